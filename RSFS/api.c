@@ -3,96 +3,199 @@
 */
 
 #include "def.h"
+#include <sched.h>
+#include <unistd.h>
 
-pthread_mutex_t mutex_for_fs_stat;
+rsfs_t rsfs_default; //the instance behind the RSFS_* calls
 
-//initialize file system - should be called as the first thing before accessing this file system 
-int RSFS_init(){
+//initialize the file system instance fs - should be called as the first thing before accessing it
+int rsfs_init(rsfs_t *fs){
 
-    //initialize data blocks
-    for(int i=0; i<NUM_DBLOCKS; i++){
-      void *block = malloc(BLOCK_SIZE); //a data block is allocated from memory
-      if(block==NULL){
+    //initialize data blocks: one cache-aligned pool, carved into blocks
+    void *block_pool = rsfs_alloc(fs, NUM_DBLOCKS*BLOCK_SIZE);
+    if(block_pool==NULL){
         printf("[init] fails to init data_blocks\n");
         return -1;
-      }
-      data_blocks[i] = block;  
-    } 
+    }
+    memset(block_pool, 0, NUM_DBLOCKS*BLOCK_SIZE);
+    fs->block_pool = to_off(fs, block_pool);
 
     //initialize bitmaps
-    for(int i=0; i<NUM_DBLOCKS; i++) data_bitmap[i]=0;
-    pthread_mutex_init(&data_bitmap_mutex,NULL);
-    for(int i=0; i<NUM_INODES; i++) inode_bitmap[i]=0;
-    pthread_mutex_init(&inode_bitmap_mutex,NULL);    
+    for(int i=0; i<NUM_DBLOCKS; i++) fs->data_bitmap[i]=0;
+    memset(fs->class_used, 0, sizeof(fs->class_used));
+    //no block is shared or indexed yet (dedup keeps its setting)
+    memset(fs->block_refs, 0, sizeof(fs->block_refs));
+    memset(fs->block_indexed, 0, sizeof(fs->block_indexed));
+    memset(fs->dedup_index, 0, sizeof(fs->dedup_index));
+    //the log starts empty, with no head segment yet (the mode keeps its setting)
+    fs->log_head = -1;
+    fs->log_segment = -1;
+    fs->log_seq = 0;
+    memset(fs->segment_live, 0, sizeof(fs->segment_live));
+    memset(fs->segment_written, 0, sizeof(fs->segment_written));
+    for(int i=0; i<NUM_DBLOCKS; i++) fs->block_owner[i]=-1;
+    rsfs_mutex_init(fs, &fs->data_bitmap_mutex, 1);
+    rsfs_mutex_init(fs, &fs->cleaner_mutex, 1);
+    for(int i=0; i<NUM_INODES; i++) fs->inode_bitmap[i]=0;
+    rsfs_mutex_init(fs, &fs->inode_bitmap_mutex, 1);    
 
     //initialize inodes
     for(int i=0; i<NUM_INODES; i++){
-        inodes[i].length=0;
+        struct inode *inode = &fs->inodes[i];
+        inode->length=0;
+        inode->reserved=0;
+        inode->compressed=0;
+        inode->compress_policy=RSFS_COMPRESS_OFF;
+        inode->hot=0;
+        inode->snap_seen=0;
         for(int j=0; j<NUM_POINTER; j++) 
-            inodes[i].block[j]=-1; //pointer value -1 means the pointer is not used
-        inodes[i].num_current_reader=0;
-        pthread_mutex_init(&inodes[i].rw_mutex,NULL);
-        pthread_mutex_init(&inodes[i].read_mutex,NULL);
+            inode->block[j]=-1; //pointer value -1 means the pointer is not used
+        inode->num_current_reader=0;
+        inode->rw_owner=0;
+        //rw_mutex is released by the last reader, who may not be the one that took it: it cannot be robust
+        rsfs_mutex_init(fs, &inode->rw_mutex, 0);
+        rsfs_mutex_init(fs, &inode->read_mutex, 1);
     }
-    pthread_mutex_init(&inodes_mutex,NULL); 
+    rsfs_mutex_init(fs, &fs->inodes_mutex, 1); 
 
     //initialize open file table
-    for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry entry=open_file_table[i];
-        entry.used=0; //each entry is not used initially
-        pthread_mutex_init(&entry.entry_mutex,NULL);
-        entry.position=0;
-        entry.access_flag=-1;
+    if(init_open_file_table(fs)!=0){
+        printf("[init] fails to init open_file_table\n");
+        rsfs_release(fs, block_pool);
+        return -1;
     }
-    pthread_mutex_init(&open_file_table_mutex,NULL); 
 
     //initialize root directory
-    root_dir.head = root_dir.tail = NULL;
+    init_root_dir(fs);
+
+    //initialize snapshots: none is taken yet
+    init_snapshots(fs);
+
+    //initialize the statistics counters
+    init_stats(fs);
 
     //initialize mutex_for_fs_stat
-    pthread_mutex_init(&mutex_for_fs_stat,NULL);
+    rsfs_mutex_init(fs, &fs->mutex_for_fs_stat, 1);
 
     //return 0 means success
     return 0;
 }
 
+//allocate an instance on its own cache lines and initialize it: return it, or NULL on failure
+rsfs_t *rsfs_new(){
+    rsfs_t *fs = (rsfs_t *)aligned_alloc(64, sizeof(rsfs_t));
+    if(fs==NULL){
+        printf("[new] fail to allocate an instance.\n");
+        return NULL;
+    }
+    memset(fs, 0, sizeof(rsfs_t));
+    if(rsfs_init(fs)!=0){
+        free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+//release an instance allocated by rsfs_new(), with every file and directory still in it:
+//return 0 if succeed, or -1 if a file of it is still open
+int rsfs_free(rsfs_t *fs){
+    if(fs==&rsfs_default || fs->shared){
+        printf("[free] only instances from rsfs_new() can be freed.\n");
+        return -1;
+    }
+    if(__atomic_load_n(&fs->counters.open_files.value, __ATOMIC_ACQUIRE)!=0){
+        printf("[free] the instance still has open files.\n");
+        return -1;
+    }
+
+    //entries deleted from it may still wait for their grace period on any thread
+    epoch_barrier(fs);
+
+    slab_destroy(&fs->dir_entry_slab);
+    slab_destroy(&fs->directory_slab);
+    for(int i=0; i<NAME_CLASSES; i++) slab_destroy(&fs->name_slabs[i]);
+    slab_destroy(&fs->snapshot_slab);
+    destroy_open_file_table(fs);
+    rsfs_release(fs, to_ptr(fs, fs->block_pool));
+    free(fs);
+    return 0;
+}
+
 
 //create file
 //if file does not exist, create the file and return 0;
 //if file_name already exists, return -1; 
 //otherwise, return -2.
-int RSFS_create(char *file_name){
-
-    //search root_dir for dir_entry matching provided file_name
-    struct dir_entry *dir_entry = search_dir(file_name);
+//The entry is inserted with its inode under one acquisition of the directory mutex,
+//so two creators of the same name cannot both succeed
+int rsfs_create(rsfs_t *fs, char *file_name){
+    PROF_OP(PROF_CREATE, file_name, -1, 0);
+
+    //access inode-bitmap to get a free inode; it goes back if the file exists
+    int inode_number = allocate_inode(fs);
+
+    //construct and insert a new dir_entry with given file_name, unless it exists
+    int result;
+    if (insert_file_entries(fs, &file_name, 1, &inode_number, inode_number >= 0, &result, NULL) == 0 && inode_number >= 0) {
+        free_inode(fs, inode_number);
+    }
 
-    if(dir_entry){//already exists
+    if (result == -1) {//already exists
         printf("[create] file (%s) already exists.\n", file_name);
         return -1;
-    }else{
+    }
+    if (result < 0) {
+        if (inode_number < 0) printf("[create] fail to allocate an inode.\n");
+        else printf("[create] fail to insert a dir_entry for %s.\n", file_name);
+        return -2;
+    }
+    if(DEBUG) printf("[create] insert a dir_entry with file_name:%s and inode number:%d.\n", file_name, inode_number);
+    PROF_FILE(inode_number, -1, 0);
+    return 0;
+}
 
-        if(DEBUG) printf("[create] file (%s) does not exist.\n", file_name);
 
-        //construct and insert a new dir_entry with given file_name
-        dir_entry = insert_dir(file_name);
-        if(DEBUG) printf("[create] insert a dir_entry with file_name:%s.\n", dir_entry->name);
-        
-        //access inode-bitmap to get a free inode 
-        int inode_number = allocate_inode();
-        if(inode_number<0){
-            printf("[create] fail to allocate an inode.\n");
-            return -2;
-        } 
-        if(DEBUG) printf("[create] allocate inode with number:%d.\n", inode_number);
 
-        //save inode-number to dir-entry
-        dir_entry->inode_number = inode_number;
-        
-        return 0;
+//helper for opening with RSFS_RDAPPEND: appenders write into the blocks in place, so a compressed file
+//is stored plain first, with the file held like a writer (wait=0: only if that needs no waiting);
+//return 0, -1 if it cannot be decompressed, or -2 if the file is held and wait is 0
+static int decompress_for_append(rsfs_t *fs, struct inode *inode, int wait){
+    while (__atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) {
+        if (wait) {
+            PROF_LOCK(&inode->rw_mutex, LOCK_INODE_RW);
+        } else if (PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW) != 0) {
+            return -2;
+        }
+        inode->rw_owner = getpid();
+        int ret = decompress_file(fs, inode);
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+        if (ret != 0) {
+            return -1;
+        }
     }
+    return 0;
 }
 
-
+//helper: take the reader/writer hold on inode for opening it with access_flag, waiting for it if needed:
+//appenders share the file like readers; only RSFS_RDWR needs it exclusively
+static void take_open_lock(struct inode *inode, int access_flag){
+    if (access_flag != RSFS_RDWR) {
+        //Increment the num readers and lock the rw_mutex if this is the first reader
+        PROF_LOCK(&inode->read_mutex, LOCK_INODE_READ);
+        inode->num_current_reader++;
+        if (inode->num_current_reader == 1) {
+            PROF_LOCK(&inode->rw_mutex, LOCK_INODE_RW);
+            //No writer can change the length now, so appenders start reserving from it
+            inode->reserved = inode->length;
+        }
+        PROF_UNLOCK(&inode->read_mutex, LOCK_INODE_READ);
+    } else {
+        //Writer must have the rw_mutex to open the file
+        PROF_LOCK(&inode->rw_mutex, LOCK_INODE_RW);
+        inode->rw_owner = getpid();
+    }
+}
 
 //open a file with RSFS_RDONLY or RSFS_RDWR flags
 //When flag=RSFS_RDONLY: 
@@ -102,37 +205,73 @@ int RSFS_create(char *file_name){
 //  if the file is currently opened with RSFS_RDWR (by a process/thread) or RSFS_RDONLY (by one or multiple processes/threads) 
 //      => the caller should be blocked (i.e. wait);
 //  otherwise, the file is opened and the desrcriptor is returned
-int RSFS_open(char *file_name, int access_flag){
+int rsfs_open(rsfs_t *fs, char *file_name, int access_flag){
+    PROF_OP(PROF_OPEN, file_name, -1, access_flag);
 
-    //Check to make sure access_flag is either RSFS_RDONLY or RSFS_RDWR
-    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR) {
-        printf("[open] access_flag is not RSFS_RDONLY or RSFS_RDWR.\n");
+    //Check to make sure access_flag is RSFS_RDONLY, RSFS_RDWR or RSFS_RDAPPEND
+    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR && access_flag != RSFS_RDAPPEND) {
+        printf("[open] access_flag is not RSFS_RDONLY, RSFS_RDWR or RSFS_RDAPPEND.\n");
         return -1;
     }
     
     //Find dir_entry matching file_name
-    struct dir_entry *dir = search_dir(file_name);
+    //Directory lookups take no lock: stay in an epoch section until the file is held,
+    //so that a concurrent RSFS_delete cannot free the dir_entry under us
+    epoch_enter(fs);
+    struct dir_entry *dir = search_dir(fs, file_name);
+    if (dir == NULL || dir->inode_number < 0) {
+        printf("[open] file (%s) does not exist or is a directory.\n", file_name);
+        epoch_exit(fs);
+        return -1;
+    }
 
     //Find the corresponding inode 
-    struct inode *inode = &inodes[dir->inode_number];
+    struct inode *inode = &fs->inodes[dir->inode_number];
+    PROF_FILE(dir->inode_number, -1, 0);
+
+retry:
+    if (access_flag == RSFS_RDAPPEND && decompress_for_append(fs, inode, 1) != 0) {
+        printf("[open] fail to decompress file (%s) for appending.\n", file_name);
+        epoch_exit(fs);
+        return -1;
+    }
     
     //Based on the requested access_flag and the current "open" status of this file to block the caller if needed
     //(refer to solution to reader/writer problem) 
-    if (access_flag == RSFS_RDONLY) {
-        //Increment the num readers and lock the rw_mutex if this is the first reader
-        pthread_mutex_lock(&inode->read_mutex);
-        inode->num_current_reader++;
-        if (inode->num_current_reader == 1) {
-            pthread_mutex_lock(&inode->rw_mutex);
-        }
-        pthread_mutex_unlock(&inode->read_mutex);
-    } else {
-        //Writer must have the rw_mutex to open the file
-        pthread_mutex_lock(&inode->rw_mutex);
+    take_open_lock(inode, access_flag);
+
+    //The file may have been deleted while we waited
+    if (__atomic_load_n(&dir->deleted, __ATOMIC_ACQUIRE)) {
+        printf("[open] file (%s) has been deleted.\n", file_name);
+        release_open_lock(fs, inode, access_flag);
+        epoch_exit(fs);
+        return -1;
+    }
+
+    //Writers and appenders work on plain blocks: a compressed file is decompressed now (or again,
+    //for an appender that lost a race with RSFS_compress_cold), and the file counts as hot
+    if (access_flag == RSFS_RDAPPEND && __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) {
+        release_open_lock(fs, inode, access_flag);
+        goto retry;
+    }
+    if (access_flag == RSFS_RDWR && inode->compressed && decompress_file(fs, inode) != 0) {
+        printf("[open] fail to decompress file (%s) for writing.\n", file_name);
+        release_open_lock(fs, inode, access_flag);
+        epoch_exit(fs);
+        return -1;
+    }
+    if (access_flag != RSFS_RDONLY) {
+        __atomic_store_n(&inode->hot, 1, __ATOMIC_RELAXED);
     }
 
     //Find an unused open-file-entry in open-file-table and fill the fields of the entry properly
-    int fd = allocate_open_file_entry(access_flag, dir);
+    int fd = allocate_open_file_entry(fs, access_flag, dir);
+    PROF_FILE(dir->inode_number, fd, 0);
+    if (fd < 0) {
+        printf("[open] no free entry in the open file table.\n");
+        release_open_lock(fs, inode, access_flag);
+    }
+    epoch_exit(fs);
     
     //Return the index of the open-file-entry in open-file-table as file descriptor
     return fd; 
@@ -140,27 +279,232 @@ int RSFS_open(char *file_name, int access_flag){
 
 
 
+//open a file like RSFS_open, but never block on the file's rw_mutex:
+//return the descriptor on success, -1 on error, or -2 if the caller would have to wait
+int rsfs_try_open(rsfs_t *fs, char *file_name, int access_flag){
+    PROF_OP(PROF_TRY_OPEN, file_name, -1, access_flag);
+
+    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR && access_flag != RSFS_RDAPPEND) {
+        printf("[try_open] access_flag is not RSFS_RDONLY, RSFS_RDWR or RSFS_RDAPPEND.\n");
+        return -1;
+    }
+
+    //Directory lookups take no lock: stay in an epoch section until the file is held,
+    //so that a concurrent RSFS_delete cannot free the dir_entry under us
+    epoch_enter(fs);
+    struct dir_entry *dir = search_dir(fs, file_name);
+    if (dir == NULL || dir->inode_number < 0) {
+        printf("[try_open] file (%s) does not exist or is a directory.\n", file_name);
+        epoch_exit(fs);
+        return -1;
+    }
+    struct inode *inode = &fs->inodes[dir->inode_number];
+    PROF_FILE(dir->inode_number, -1, 0);
+
+retry:
+    if (access_flag == RSFS_RDAPPEND) {
+        int ret = decompress_for_append(fs, inode, 0);
+        if (ret != 0) {
+            if (ret == -1) printf("[try_open] fail to decompress file (%s) for appending.\n", file_name);
+            epoch_exit(fs);
+            return ret;
+        }
+    }
+
+    if (access_flag != RSFS_RDWR) {
+        //Only the first reader has to take the rw_mutex; read_mutex is never held for long
+        PROF_LOCK(&inode->read_mutex, LOCK_INODE_READ);
+        if (inode->num_current_reader == 0) {
+            if (PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW) != 0) {
+                PROF_UNLOCK(&inode->read_mutex, LOCK_INODE_READ);
+                epoch_exit(fs);
+                return -2;
+            }
+            inode->reserved = inode->length;
+        }
+        inode->num_current_reader++;
+        PROF_UNLOCK(&inode->read_mutex, LOCK_INODE_READ);
+    } else {
+        if (PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW) != 0) {
+            epoch_exit(fs);
+            return -2;
+        }
+        inode->rw_owner = getpid();
+    }
+
+    if (__atomic_load_n(&dir->deleted, __ATOMIC_ACQUIRE)) {
+        printf("[try_open] file (%s) has been deleted.\n", file_name);
+        release_open_lock(fs, inode, access_flag);
+        epoch_exit(fs);
+        return -1;
+    }
+
+    if (access_flag == RSFS_RDAPPEND && __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) {
+        release_open_lock(fs, inode, access_flag);
+        goto retry;
+    }
+    if (access_flag == RSFS_RDWR && inode->compressed && decompress_file(fs, inode) != 0) {
+        printf("[try_open] fail to decompress file (%s) for writing.\n", file_name);
+        release_open_lock(fs, inode, access_flag);
+        epoch_exit(fs);
+        return -1;
+    }
+    if (access_flag != RSFS_RDONLY) {
+        __atomic_store_n(&inode->hot, 1, __ATOMIC_RELAXED);
+    }
+
+    int fd = allocate_open_file_entry(fs, access_flag, dir);
+    PROF_FILE(dir->inode_number, fd, 0);
+    if (fd < 0) {
+        printf("[try_open] no free entry in the open file table.\n");
+        release_open_lock(fs, inode, access_flag);
+    }
+    epoch_exit(fs);
+    return fd;
+}
+
+
+
+//release the rw_mutex of inode, whoever took it (a writer, the last reader, a delete, the defragmenter, the cleaner
+//or a compressor): opens parked by the workers of a ring may go ahead now
+void release_rw_mutex(rsfs_t *fs, struct inode *inode){
+    PROF_UNLOCK(&inode->rw_mutex, LOCK_INODE_RW);
+    ring_notify_release(fs);
+}
+
+//give up the hold on the inode taken by RSFS_open/RSFS_try_open with the given access_flag
+void release_open_lock(rsfs_t *fs, struct inode *inode, int access_flag){
+    if (access_flag == RSFS_RDWR) {
+        //Writer must release the rw_mutex when closing the file
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+
+    } else {
+        //Check if this is the last reader and release the rw_mutex if it is
+        PROF_LOCK(&inode->read_mutex, LOCK_INODE_READ);
+        inode->num_current_reader--;
+        if (inode->num_current_reader == 0) {
+            release_rw_mutex(fs, inode);
+        }
+        PROF_UNLOCK(&inode->read_mutex, LOCK_INODE_READ);
+    }
+}
+
+
+
+//helper for append_reserved: make sure every block of [start,end) of inode has a data block, installing the missing
+//ones (a block may be shared with the neighbouring reservations: the first appender to install one wins).
+//Return the end of the backed part of the range, which is short of end if the pool ran dry
+static int back_range(rsfs_t *fs, struct inode *inode, int start, int end){
+    for (int block_position = start / BLOCK_SIZE; block_position * BLOCK_SIZE < end; block_position++) {
+        int block = __atomic_load_n(&inode->block[block_position], __ATOMIC_ACQUIRE);
+        if (block != -1) {
+            continue;
+        }
+        int new_block = allocate_data_block(fs, &inode->block[block_position]);
+        if (new_block < 0) {
+            return block_position * BLOCK_SIZE > start ? block_position * BLOCK_SIZE : start;
+        }
+        if (!__atomic_compare_exchange_n(&inode->block[block_position], &block, new_block, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free_data_block(fs, new_block);
+        }
+    }
+    return end;
+}
+
+//helper for RSFS_append on a file opened with RSFS_RDAPPEND:
+//atomically reserve [start,start+size) at the end of the file, copy into the reserved bytes
+//concurrently with the other appenders, then publish the new length in reservation order
+//so that readers never see a range whose bytes are still being copied
+static int append_reserved(rsfs_t *fs, struct open_file_entry *entry, struct inode *inode, void *buf, int size){
+
+    //Reserve the range; the reservation is capped at the maximum file size.
+    //Its blocks are installed before it is taken and cut back to what the pool could back, so that a
+    //reservation is always copied and published whole: a range left short would put a hole inside the
+    //length, and the appenders behind it would wait forever for a length that never reaches their start
+    int start = __atomic_load_n(&inode->reserved, __ATOMIC_RELAXED);
+    int end;
+    do {
+        end = start + size;
+        if (end > NUM_POINTER*BLOCK_SIZE) {
+            end = NUM_POINTER*BLOCK_SIZE;
+        }
+        if (end == start) {
+            if(DEBUG) printf("[append] file has reached its maximum size.\n");
+            return 0;
+        }
+        int backed = back_range(fs, inode, start, end);
+        if (backed < end) {
+            printf("[append] fail to allocate a data block.\n");
+            if (backed == start) {
+                return 0;
+            }
+            end = backed;
+        }
+    } while (!__atomic_compare_exchange_n(&inode->reserved, &start, end, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    //Copy into the reserved range, block by block
+    int current_position = start;
+    int bytes_written = 0;
+    while (current_position < end) {
+        int block = __atomic_load_n(&inode->block[current_position / BLOCK_SIZE], __ATOMIC_ACQUIRE);
+        int offset = current_position % BLOCK_SIZE;
+        int bytes_to_write = BLOCK_SIZE - offset;
+        if (bytes_to_write > end - current_position) {
+            bytes_to_write = end - current_position;
+        }
+        memcpy(block_data(fs, block) + offset, buf + bytes_written, bytes_to_write);
+        bytes_written += bytes_to_write;
+        current_position += bytes_to_write;
+    }
+
+    //Publish in reservation order: wait for the appenders ahead of us, then extend the length
+    while (__atomic_load_n(&inode->length, __ATOMIC_ACQUIRE) != start) {
+        sched_yield();
+    }
+    __atomic_store_n(&inode->length, end, __ATOMIC_RELEASE);
+
+    entry->position = end;
+    return bytes_written;
+}
+
+
 //append the content in buf to the end of the file of descriptor fd
-int RSFS_append(int fd, void *buf, int size){
-    //Sanity check
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
-        printf("[write] fd is not in [0,NUM_OPEN_FILE] or size <= 0.\n");
+int rsfs_append(rsfs_t *fs, int fd, void *buf, int size){
+    PROF_OP(PROF_APPEND, NULL, fd, size);
+    //Get the corresponding open file entry; invalid and stale descriptors are rejected
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if (entry == NULL || size <= 0) {
+        printf("[write] fd is not an open file descriptor or size <= 0.\n");
         return -1;
     }
-    
-    //Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
-    struct dir_entry *dir_entry = entry->dir_entry;
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    if (entry->snapshot_file) {
+        printf("[write] file is a snapshot file, which cannot be changed.\n");
+        return -1;
+    }
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    PROF_FILE(dir_entry->inode_number, fd, entry->position);
 
-    //Check if the file is opened with RSFS_RDWR mode
-    if (entry->access_flag != RSFS_RDWR) {
-        printf("[write] file is not opened with RSFS_RDWR mode.\n");
+    //Check if the file is opened with RSFS_RDWR or RSFS_RDAPPEND mode
+    if (entry->access_flag != RSFS_RDWR && entry->access_flag != RSFS_RDAPPEND) {
+        printf("[write] file is not opened with RSFS_RDWR or RSFS_RDAPPEND mode.\n");
         return -1;
     }
 
-    //Get the current position along with the block position and offset
-    int current_position = entry->position;
+    //The snapshots taken since the file last changed keep its content as it is now
+    if (snapshot_preserve(fs, dir_entry) != 0) {
+        printf("[write] fail to preserve the file for a snapshot.\n");
+        return -1;
+    }
+
+    //Shared appenders reserve their range instead of holding the file exclusively
+    if (entry->access_flag == RSFS_RDAPPEND) {
+        return PROF_BYTES(append_reserved(fs, entry, inode, buf, size));
+    }
+
+    //Get the end of the file along with the block position and offset
+    int current_position = inode->length;
     int block_position = current_position / BLOCK_SIZE;
     int offset = current_position % BLOCK_SIZE;
     int bytes_written = 0;
@@ -171,18 +515,31 @@ int RSFS_append(int fd, void *buf, int size){
         block_position = current_position / BLOCK_SIZE;
         offset = current_position % BLOCK_SIZE;
 
+        //Stop at the maximum file size
+        if (block_position >= NUM_POINTER) {
+            if(DEBUG) printf("[append] file has reached its maximum size.\n");
+            break;
+        }
+
         //Check if the block is allocated, if not allocate a new block
         int block = inode->block[block_position];
         if (block == -1) {
-            block = allocate_data_block();
+            block = allocate_data_block(fs, &inode->block[block_position]);
+            if (block < 0) {
+                printf("[append] fail to allocate a data block.\n");
+                break;
+            }
             inode->block[block_position] = block;
+        } else if ((block = writable_data_block(fs, &inode->block[block_position])) < 0) {
+            printf("[append] fail to allocate a data block.\n");
+            break;
         }
 
         //Check how much space is available in the block
         int space_available = BLOCK_SIZE - offset;
 
         //Check how many bytes we have left to write
-        int bytes_to_write = size;
+        int bytes_to_write = size - bytes_written;
 
         //If we have more space available than bytes left to write, only write the bytes left
         if (space_available > size - bytes_written) {
@@ -194,8 +551,11 @@ int RSFS_append(int fd, void *buf, int size){
             bytes_to_write = space_available;
         }
 
-        //Copy the data from the buffer to the data block
-        memcpy(data_blocks[block] + offset, buf + bytes_written, bytes_to_write);
+        //Copy the data from the buffer to the data block; a block just filled may be shared with an identical one
+        memcpy(block_data(fs, block) + offset, buf + bytes_written, bytes_to_write);
+        if (offset + bytes_to_write == BLOCK_SIZE) {
+            dedup_data_block(fs, &inode->block[block_position]);
+        }
         bytes_written += bytes_to_write;
         current_position += bytes_to_write;
 
@@ -209,7 +569,7 @@ int RSFS_append(int fd, void *buf, int size){
     entry->position = current_position;
     
     //Return the number of bytes written
-    return bytes_written;
+    return PROF_BYTES(bytes_written);
 }
 
 
@@ -219,28 +579,32 @@ int RSFS_append(int fd, void *buf, int size){
 
 
 //update current position of the file (which is in the open_file_entry) to offset
-int RSFS_fseek(int fd, int offset){
+int rsfs_fseek(rsfs_t *fs, int fd, int offset){
+    PROF_OP(PROF_FSEEK, NULL, fd, offset);
 
-    //Sanity Check  
-    if (fd < 0 || fd >= NUM_OPEN_FILE) {
-        printf("[fseek] fd is not in [0,NUM_OPEN_FILE].\n");
+    //Get the corresponding open file entry; invalid and stale descriptors are rejected
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if (entry == NULL) {
+        printf("[fseek] fd is not an open file descriptor.\n");
         return -1;
     }
-
-    //Get the correspondng open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
     
     //Get the current position
     int current_position = entry->position;
     
-    //Get the corresponding dir entry
-    struct dir_entry *dir_entry = entry->dir_entry;
-    
-    //Get the corresponding inode and file length
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    //Get the file length: a snapshot file has its own, otherwise it is the length of the inode
+    int length;
+    if (entry->snapshot_file) {
+        length = snapshot_length(fs, entry);
+    } else {
+        struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
+        struct inode *inode = &fs->inodes[dir_entry->inode_number];
+        PROF_FILE(dir_entry->inode_number, fd, entry->position);
+        length = inode->length;
+    }
     
     //Check if argument offset is not within 0...length
-    if (offset < 0 || offset > inode->length) {
+    if (offset < 0 || offset > length) {
         printf("[fseek] offset is not within 0...length.\n");
         return current_position;
     }
@@ -258,105 +622,141 @@ int RSFS_fseek(int fd, int offset){
 
 
 //Read from file from the current position for up to size bytes
-int RSFS_read(int fd, void *buf, int size){
-    //Sanity check
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
-        printf("[read] fd is not in [0,NUM_OPEN_FILE] or size <= 0.\n");
+int rsfs_read(rsfs_t *fs, int fd, void *buf, int size){
+    PROF_OP(PROF_READ, NULL, fd, size);
+    //Get the corresponding open file entry; invalid and stale descriptors are rejected
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if (entry == NULL || size <= 0) {
+        printf("[read] fd is not an open file descriptor or size <= 0.\n");
         return -1;
     }
-    
-    //Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+
+    //A snapshot file is read from the blocks preserved for it
+    if (entry->snapshot_file) {
+        return PROF_BYTES(snapshot_read(fs, entry, buf, size));
+    }
 
     //Get the current position
     int current_position = entry->position;
 
     //Get the corresponding directory entry
-    struct dir_entry *dir_entry = entry->dir_entry;
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
     
     //Get the corresponding inode 
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    PROF_FILE(dir_entry->inode_number, fd, entry->position);
+
+    //Take the length once: RSFS_RDAPPEND appenders may extend it while we read
+    int length = __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE);
+
+    //A compressed file (it has no appender) is decompressed into a buffer of the whole extent and copied from there
+    if (__atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) {
+        char plain[NUM_POINTER*BLOCK_SIZE];
+        if (read_compressed(fs, inode->block, inode->compressed, length, plain) < 0) {
+            return -1;
+        }
+        int bytes_read = length - current_position < size ? length - current_position : size;
+        if (bytes_read < 0) {
+            bytes_read = 0;
+        }
+        memcpy(buf, plain + current_position, bytes_read);
+        entry->position = current_position + bytes_read;
+        return PROF_BYTES(bytes_read);
+    }
     
     //Read the content of the file from current position for up to size bytes and copy it to the buffer buf
     //Get the current block position and offset based on the current position
     int block_position = current_position / BLOCK_SIZE;
     int offset = current_position % BLOCK_SIZE;
     int bytes_read = 0;
+
+    //The defragmenter may move a block while we copy from it: it frees the old one after a grace period
+    epoch_enter(fs);
     
     //While we have not read all the bytes in the buffer
-    while (bytes_read < size && bytes_read < inode->length) {
+    while (bytes_read < size && current_position < length) {
         //Update the block position and offset
         block_position = current_position / BLOCK_SIZE;
         offset = current_position % BLOCK_SIZE;
 
         //Get the block and check if it is allocated
-        int block = inode->block[block_position];
+        int block = __atomic_load_n(&inode->block[block_position], __ATOMIC_ACQUIRE);
         if (block == -1) {
             break;
         }
         
-        //Make sure we dont try to read past the end of the block
+        //Blocks that follow each other in the pool (a run, see data_block.c) are copied in one go
+        int run = 1;
+        while (block_position + run < NUM_POINTER && run * BLOCK_SIZE - offset < size - bytes_read
+                && run * BLOCK_SIZE - offset < length - current_position
+                && __atomic_load_n(&inode->block[block_position + run], __ATOMIC_ACQUIRE) == block + run) {
+            run++;
+        }
+
+        //Make sure we dont try to read past the end of the run
         int bytes_to_read = size - bytes_read;
-        if (bytes_to_read > BLOCK_SIZE - offset) {
-            bytes_to_read = BLOCK_SIZE - offset;
+        if (bytes_to_read > run * BLOCK_SIZE - offset) {
+            bytes_to_read = run * BLOCK_SIZE - offset;
         }
 
         //Make sure we only read to the length of the file
-        if (bytes_to_read > inode->length - current_position) {
-            bytes_to_read = inode->length - current_position;
+        if (bytes_to_read > length - current_position) {
+            bytes_to_read = length - current_position;
         }
 
         //Copy the data from the block to the buffer
-        memcpy(buf + bytes_read, data_blocks[block] + offset, bytes_to_read);
+        memcpy(buf + bytes_read, block_data(fs, block) + offset, bytes_to_read);
         bytes_read += bytes_to_read;
         current_position += bytes_to_read;
     }
+    epoch_exit(fs);
     
     
     //Update the current position in open file entry
     entry->position = current_position;
     
     //Return the actual number of bytes read
-    return bytes_read; //placeholder 
+    return PROF_BYTES(bytes_read); 
 }
 
 
 //close file: return 0 if succeed
-int RSFS_close(int fd){
-
-    //Sanity Check  
-    if (fd < 0 || fd >= NUM_OPEN_FILE) {
-        printf("[close] fd is not in [0,NUM_OPEN_FILE].\n");
+int rsfs_close(rsfs_t *fs, int fd){
+    PROF_OP(PROF_CLOSE, NULL, fd, 0);
+
+    //Claim the corresponding open file entry; invalid and stale descriptors are rejected,
+    //and of two closes of the same descriptor only the first gets past here
+    struct open_file_entry *entry = claim_open_file_entry(fs, fd);
+    if (entry == NULL) {
+        printf("[close] fd is not an open file descriptor.\n");
         return -1;
     }
 
-    //Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    //A snapshot file holds no lock on a live file
+    if (entry->snapshot_file) {
+        snapshot_close_file(fs, entry);
+        free_open_file_entry(fs, fd);
+        return 0;
+    }
 
     //Get the corresponding dir entry
-    struct dir_entry *dir_entry = entry->dir_entry;
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
     
     //Get the corresponding inode 
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    PROF_FILE(dir_entry->inode_number, fd, entry->position);
+
+    //A file whose policy says so is compressed while its writer still holds it
+    if (entry->access_flag == RSFS_RDWR && inode->compress_policy == RSFS_COMPRESS_ON_CLOSE) {
+        compress_file(fs, inode);
+    }
 
     //Depending on the way that the file was open (RSFS_RDONLY or RSFS_RDWR), update the corresponding mutex and/or count 
     //(refer to the solution to the readers/writers problem)
-    if (entry->access_flag == RSFS_RDWR) {
-        //Writer must release the rw_mutex when closing the file
-        pthread_mutex_unlock(&inode->rw_mutex);
-
-    } else {
-        //Check if this is the last reader and release the rw_mutex if it is
-        pthread_mutex_lock(&inode->read_mutex);
-        inode->num_current_reader--;
-        if (inode->num_current_reader == 0) {
-            pthread_mutex_unlock(&inode->rw_mutex);
-        }
-        pthread_mutex_unlock(&inode->read_mutex);
-    }
+    release_open_lock(fs, inode, entry->access_flag);
     
     //Release this open file entry in the open file table
-    free_open_file_entry(fd);
+    free_open_file_entry(fs, fd);
     return 0;
 }
 
@@ -369,91 +769,462 @@ int RSFS_close(int fd){
 
 
 //delete file
-int RSFS_delete(char *file_name){
+int rsfs_delete(rsfs_t *fs, char *file_name){
+    PROF_OP(PROF_DELETE, file_name, -1, 0);
+
+    //Stay in an epoch section so that the dir_entry stays valid while we wait for the file
+    epoch_enter(fs);
 
     //Find the corresponding dir_entry
-    struct dir_entry *dir_entry = search_dir(file_name);
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
+    if (dir_entry == NULL || dir_entry->inode_number < 0) {
+        printf("[delete] file (%s) does not exist or is a directory.\n", file_name);
+        epoch_exit(fs);
+        return -1;
+    }
 
     //Find the corresponding inode
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    int inode_number = dir_entry->inode_number;
+    struct inode *inode = &fs->inodes[inode_number];
+    PROF_FILE(inode_number, -1, 0);
+
+    //Take the file like a writer: wait until every descriptor of it is closed
+    PROF_LOCK(&inode->rw_mutex, LOCK_INODE_RW);
+    inode->rw_owner = getpid();
+    if (__atomic_load_n(&dir_entry->deleted, __ATOMIC_ACQUIRE)) {
+        printf("[delete] file (%s) has been deleted already.\n", file_name);
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+        epoch_exit(fs);
+        return -1;
+    }
 
-    //Free the data-blocks
-    int file_length = inode->length;
+    //The snapshots taken since the file last changed keep it, under its path
+    if (snapshot_preserve(fs, dir_entry) != 0) {
+        printf("[delete] fail to preserve file (%s) for a snapshot.\n", file_name);
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+        epoch_exit(fs);
+        return -1;
+    }
 
-    for (int i = 0; i <= file_length / BLOCK_SIZE; i++){
-        //Wipe the data that is currently in the block
-        memset(data_blocks[inode->block[i]], 0, BLOCK_SIZE);
-        //Free the data block in the data bitmap
-        free_data_block(inode->block[i]);
+    //Free the directory entry; openers waiting on rw_mutex see it deleted
+    delete_dir(fs, file_name);
+
+    //Free the data-blocks, whether they hold plain or compressed data
+    forget_compressed(fs, inode);
+    for (int i = 0; i < NUM_POINTER; i++){
+        if (inode->block[i] < 0) {
+            continue;
+        }
+        //Drop the reference; the block is wiped and freed in the data bitmap unless another file shares it
+        free_data_block(fs, inode->block[i]);
+        inode->block[i] = -1;
     }
+    inode->length = 0;
+
+    inode->rw_owner = 0;
+    release_rw_mutex(fs, inode);
 
     //Free the inode
-    free_inode(dir_entry->inode_number);
+    free_inode(fs, inode_number);
 
-    //Free the directory entry
-    delete_dir(file_name);
-    
+    epoch_exit(fs);
     return 0;
 }
 
 
-//Print status of the file system
-void RSFS_stat(){
+//create an empty directory at path:
+//return 0 if succeed, -1 if path already exists, or -2 if the parent directory does not exist
+int rsfs_mkdir(rsfs_t *fs, char *path){
+    PROF_OP(PROF_MKDIR, path, -1, 0);
 
-    pthread_mutex_lock(&mutex_for_fs_stat);
+    //the name is checked and inserted under the mutex of the parent, so that of two mkdirs of one name
+    //(or a mkdir and a create) only one gets it
+    int existed;
+    if(insert_dir_entry(fs, path, 1, &existed)==NULL){
+        printf("[mkdir] fail to create directory %s.\n", path);
+        return -2;
+    }
+    if(existed){
+        printf("[mkdir] %s already exists.\n", path);
+        return -1;
+    }
 
-    printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
+    return 0;
+}
 
-    //list files
-    struct dir_entry *dir_entry = root_dir.head;
+
+//delete the empty directory at path:
+//return 0 if succeed, -1 if it does not exist or is not a directory, or -2 if it is not empty
+int rsfs_rmdir(rsfs_t *fs, char *path){
+    PROF_OP(PROF_RMDIR, path, -1, 0);
+
+    epoch_enter(fs);
+    struct dir_entry *dir_entry = search_dir(fs, path);
+    int is_dir = dir_entry && dir_entry->dir;
+    epoch_exit(fs);
+    if(!is_dir){
+        printf("[rmdir] directory (%s) does not exist.\n", path);
+        return -1;
+    }
+
+    int ret = delete_dir(fs, path);
+    if(ret==-2){
+        printf("[rmdir] directory (%s) is not empty.\n", path);
+    }
+    return ret;
+}
+
+
+
+//create the file file_name, which must not exist yet, and open it with access_flag, as one step:
+//return the descriptor, -1 if the file exists already, or -2 on error (the file is not created then).
+//The file is held before its entry is published, so nobody else can open or delete it in between
+int rsfs_create_open(rsfs_t *fs, char *file_name, int access_flag){
+    PROF_OP(PROF_CREATE_OPEN, file_name, -1, access_flag);
+
+    if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR && access_flag != RSFS_RDAPPEND) {
+        printf("[create_open] access_flag is not RSFS_RDONLY, RSFS_RDWR or RSFS_RDAPPEND.\n");
+        return -2;
+    }
+
+    //The new inode cannot be reached before its entry is published: holding it waits for nobody
+    //(but an opener that raced with the deletion of its previous file, briefly)
+    int inode_number = allocate_inode(fs);
+    struct inode *inode = inode_number >= 0 ? &fs->inodes[inode_number] : NULL;
+    if (inode) {
+        take_open_lock(inode, access_flag);
+        if (access_flag != RSFS_RDONLY) {
+            __atomic_store_n(&inode->hot, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    //Insert the entry naming the held inode, unless the file exists; stay in an epoch section while using it
+    epoch_enter(fs);
+    int result;
+    struct dir_entry *dir_entry;
+    insert_file_entries(fs, &file_name, 1, &inode_number, inode != NULL, &result, &dir_entry);
+    if (result < 0) {
+        if (result == -1) printf("[create_open] file (%s) already exists.\n", file_name);
+        else if (inode == NULL) printf("[create_open] fail to allocate an inode.\n");
+        else printf("[create_open] fail to insert a dir_entry for %s.\n", file_name);
+        if (inode) {
+            release_open_lock(fs, inode, access_flag);
+            free_inode(fs, inode_number);
+        }
+        epoch_exit(fs);
+        return result;
+    }
+
+    int fd = allocate_open_file_entry(fs, access_flag, dir_entry);
+    PROF_FILE(inode_number, fd, 0);
+    if (fd < 0) {
+        //Take the file back out: whoever found it meanwhile is waiting for our hold and sees it deleted
+        printf("[create_open] no free entry in the open file table.\n");
+        delete_file_entries(fs, &dir_entry, 1);
+        release_open_lock(fs, inode, access_flag);
+        free_inode(fs, inode_number);
+        fd = -2;
+    }
+    epoch_exit(fs);
+    return fd;
+}
+
+//create the num files of file_names, BATCH_CHUNK at a time, each chunk taking the inode-bitmap mutex once
+//and the mutex of each directory once per run of names in it: results[i] is 0 if file_names[i] was created,
+//-1 if it exists already, or -2 on error; return the number of files created
+int rsfs_create_many(rsfs_t *fs, char **file_names, int num, int *results){
+    PROF_OP(PROF_CREATE_MANY, NULL, -1, num);
+    PROF_NAMES(file_names, num, NULL);
+    int created = 0;
+    for (int base = 0; base < num; base += BATCH_CHUNK) {
+        int n = num - base < BATCH_CHUNK ? num - base : BATCH_CHUNK;
+
+        //Inodes are taken for every name, and the ones of existing files go back
+        int inodes[BATCH_CHUNK];
+        int allocated = allocate_inodes(fs, inodes, n);
+        int used = insert_file_entries(fs, file_names + base, n, inodes, allocated, results + base, NULL);
+        if (used < allocated) {
+            free_inodes(fs, inodes + used, allocated - used);
+        }
+
+        for (int i = base; i < base + n; i++) {
+            if (results[i] == -1) {
+                printf("[create_many] file (%s) already exists.\n", file_names[i]);
+            } else if (results[i] < 0) {
+                printf("[create_many] fail to create file (%s).\n", file_names[i]);
+            } else {
+                results[i] = 0;
+                created++;
+            }
+        }
+    }
+    return created;
+}
+
+//open the num files of file_names with access_flag, in order, each like RSFS_open (waiting for it if needed):
+//fds[i] is the descriptor of file_names[i], or -1; return the number of files opened.
+//Lookups take no lock; the open file table grows once for the whole batch
+int rsfs_open_many(rsfs_t *fs, char **file_names, int num, int access_flag, int *fds){
+    PROF_OP(PROF_OPEN_MANY, NULL, -1, access_flag);
+    PROF_NAMES(file_names, num, fds);
+    reserve_open_file_entries(fs, num);
+
+    int opened = 0;
+    for (int i = 0; i < num; i++) {
+        fds[i] = rsfs_open(fs, file_names[i], access_flag);
+        if (fds[i] >= 0) {
+            opened++;
+        }
+    }
+    return opened;
+}
+
+//delete the num files of file_names, BATCH_CHUNK at a time: the files nobody uses are held at once, then unlinked
+//taking the mutex of each directory once per run of names in it, and their blocks and inodes are freed under
+//one acquisition of each bitmap mutex; a file in use is then waited for and deleted on its own, like RSFS_delete.
+//results[i] is 0 if file_names[i] was deleted, or -1; return the number of files deleted
+int rsfs_delete_many(rsfs_t *fs, char **file_names, int num, int *results){
+    PROF_OP(PROF_DELETE_MANY, NULL, -1, num);
+    PROF_NAMES(file_names, num, NULL);
+    int deleted = 0;
+    for (int base = 0; base < num; base += BATCH_CHUNK) {
+        int n = num - base < BATCH_CHUNK ? num - base : BATCH_CHUNK;
+        struct dir_entry *entries[BATCH_CHUNK];
+        int inode_numbers[BATCH_CHUNK];
+        int blocks[BATCH_CHUNK*NUM_POINTER];
+        int held = 0;
+
+        //Stay in an epoch section so that the entries stay valid while we take the files
+        epoch_enter(fs);
+
+        for (int i = base; i < base + n; i++) {
+            results[i] = -1;
+            struct dir_entry *dir_entry = search_dir(fs, file_names[i]);
+            if (dir_entry == NULL || dir_entry->inode_number < 0) {
+                printf("[delete_many] file (%s) does not exist or is a directory.\n", file_names[i]);
+                continue;
+            }
+
+            //Take the file like a writer if nobody uses it (nor holds it already for this batch)
+            struct inode *inode = &fs->inodes[dir_entry->inode_number];
+            if (PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW) != 0) {
+                results[i] = -2; //waited for below
+                continue;
+            }
+            inode->rw_owner = getpid();
+            if (__atomic_load_n(&dir_entry->deleted, __ATOMIC_ACQUIRE)) {
+                printf("[delete_many] file (%s) has been deleted already.\n", file_names[i]);
+                inode->rw_owner = 0;
+                release_rw_mutex(fs, inode);
+                continue;
+            }
+
+            //The snapshots taken since the file last changed keep it, under its path
+            if (snapshot_preserve(fs, dir_entry) != 0) {
+                printf("[delete_many] fail to preserve file (%s) for a snapshot.\n", file_names[i]);
+                inode->rw_owner = 0;
+                release_rw_mutex(fs, inode);
+                continue;
+            }
+            entries[held] = dir_entry;
+            inode_numbers[held++] = dir_entry->inode_number;
+            results[i] = 0;
+        }
+
+        //Free the directory entries; openers waiting on rw_mutex see them deleted
+        delete_file_entries(fs, entries, held);
+
+        //Free the data-blocks of all the files, whether they hold plain or compressed data, then the inodes
+        int num_blocks = 0;
+        for (int k = 0; k < held; k++) {
+            struct inode *inode = &fs->inodes[inode_numbers[k]];
+            forget_compressed(fs, inode);
+            for (int j = 0; j < NUM_POINTER; j++) {
+                blocks[num_blocks++] = inode->block[j];
+                inode->block[j] = -1;
+            }
+            inode->length = 0;
+        }
+        free_data_blocks(fs, blocks, num_blocks);
+        for (int k = 0; k < held; k++) {
+            struct inode *inode = &fs->inodes[inode_numbers[k]];
+            inode->rw_owner = 0;
+            release_rw_mutex(fs, inode);
+        }
+        free_inodes(fs, inode_numbers, held);
+
+        epoch_exit(fs);
+
+        //The files in use are waited for one at a time, holding nothing else
+        for (int i = base; i < base + n; i++) {
+            if (results[i] == -2) {
+                results[i] = rsfs_delete(fs, file_names[i]);
+            }
+            if (results[i] == 0) {
+                deleted++;
+            }
+        }
+    }
+    return deleted;
+}
+
+//helper for RSFS_stat: list the entries of dir, with their paths prefixed by prefix
+static void stat_dir(rsfs_t *fs, struct directory *dir, char *prefix){
+
+    PROF_LOCK(&dir->mutex, LOCK_DIR);
+
+    struct dir_entry *dir_entry = to_ptr(fs, dir->head);
     while(dir_entry!=NULL){
 
-        int inode_number = dir_entry->inode_number;
-        struct inode *inode = &inodes[inode_number];
-        
-        printf("%16s%10d%10d\n", dir_entry->name, inode->length, inode_number);
-        dir_entry = dir_entry->next;
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", prefix, (char *)to_ptr(fs, dir_entry->name));
+
+        if(dir_entry->dir){
+            printf("%15s/%10s%10s\n", path, "-", "-");
+            strcat(path, "/");
+            stat_dir(fs, to_ptr(fs, dir_entry->dir), path);
+        }else{
+            int inode_number = dir_entry->inode_number;
+            struct inode *inode = &fs->inodes[inode_number];
+
+            printf("%16s%10d%10d\n", path, inode->length, inode_number);
+        }
+        dir_entry = to_ptr(fs, dir_entry->next);
     }
+
+    PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+}
+
+//Print status of the file system
+void rsfs_stat(rsfs_t *fs){
+    PROF_OP(PROF_STAT, NULL, -1, 0);
+
+    PROF_LOCK(&fs->mutex_for_fs_stat, LOCK_FS_STAT);
+
+    printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
+
+    //list files
+    stat_dir(fs, &fs->root_dir, "");
     
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+
     //data blocks
-    int db_used=0;
-    for(int i=0; i<NUM_DBLOCKS; i++) db_used+=data_bitmap[i];
-    printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", NUM_DBLOCKS, db_used, NUM_DBLOCKS-db_used);
+    printf("\nTotal Data Blocks: %4ld,  Used: %ld,  Unused: %ld\n", stats.total_blocks, stats.used_blocks, stats.total_blocks-stats.used_blocks);
 
     //inodes
-    int inodes_used=0;
-    for(int i=0; i<NUM_INODES; i++) inodes_used+=inode_bitmap[i];
-    printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", NUM_INODES, inodes_used, NUM_INODES-inodes_used);
+    printf("Total iNode Blocks: %3ld,  Used: %ld,  Unused: %ld\n", stats.total_inodes, stats.used_inodes, stats.total_inodes-stats.used_inodes);
 
     //open files
-    int of_num=0;
-    for(int i=0; i<NUM_OPEN_FILE; i++) of_num+=open_file_table[i].used;
-    printf("Total Opened Files: %3d\n\n", of_num);
+    printf("Total Opened Files: %3ld\n\n", stats.open_files);
+
+    PROF_UNLOCK(&fs->mutex_for_fs_stat, LOCK_FS_STAT);
+}
+
+
+
+//take a listing of the directory at path into iter: return 0 if succeed or -1 if path is not a directory
+int rsfs_opendir(rsfs_t *fs, char *path, struct rsfs_dir_iter *iter){
+    PROF_OP(PROF_OPENDIR, path, -1, 0);
+
+    int num = snapshot_dir(fs, path, &iter->entries);
+    if(num<0){
+        printf("[opendir] directory (%s) does not exist.\n", path);
+        return -1;
+    }
+    iter->num_entries = num;
+    iter->position = 0;
+
+    return 0;
+}
+
+
+//copy the next entry of the listing to dirent: return 0 if succeed or -1 at the end of the listing
+int RSFS_readdir(struct rsfs_dir_iter *iter, struct rsfs_dirent *dirent){
+
+    if(iter->position>=iter->num_entries) return -1;
+
+    *dirent = iter->entries[iter->position++];
+    return 0;
+}
+
+
+//release a listing taken by RSFS_opendir
+void RSFS_closedir(struct rsfs_dir_iter *iter){
+    free(iter->entries);
+    iter->entries = NULL;
+    iter->num_entries = iter->position = 0;
+}
+
+
+//set cursor to the start of the directory path ("" is the root), which must stay valid while the cursor is used
+void RSFS_readdir_start(struct rsfs_readdir_cursor *cursor, char *path){
+    cursor->path = path;
+    cursor->last[0] = '\0';
+    cursor->started = 0;
+}
+
+//copy to out the next (up to max) entries of the directory of cursor whose names start with prefix, in name order,
+//with their inode numbers and lengths, and move the cursor past them: return the number of entries (0 at the end),
+//or -1 if the directory does not exist. Entries created or deleted meanwhile are seen if they come after the cursor
+int rsfs_readdir_plus(rsfs_t *fs, struct rsfs_readdir_cursor *cursor, char *prefix, struct rsfs_dirent *out, int max){
+    //the recorder keeps the directory, the prefix and the name the cursor was after on entry
+    char after[MAX_NAME_LEN+1];
+    strcpy(after, cursor->started ? cursor->last : "");
+    char *listing[3] = {cursor->path, prefix, after};
+    PROF_OP(PROF_READDIR_PLUS, NULL, -1, max);
+    PROF_NAMES(listing, 3, NULL);
+
+    if(max<=0){
+        printf("[readdir_plus] max must be positive.\n");
+        return -1;
+    }
 
-    pthread_mutex_unlock(&mutex_for_fs_stat);
+    int num = list_dir_sorted(fs, cursor->path, cursor->started ? cursor->last : NULL, prefix, out, max);
+    if(num<0){
+        printf("[readdir_plus] directory (%s) does not exist.\n", cursor->path);
+        return -1;
+    }
+    if(num>0){
+        strcpy(cursor->last, out[num-1].name);
+        cursor->started = 1;
+    }
+    return num;
 }
 
 
 
 //Write the content of size (bytes) in buf to the file (of descripter fd) from current position for up to size bytes 
-int RSFS_write(int fd, void *buf, int size){
+int rsfs_write(rsfs_t *fs, int fd, void *buf, int size){
+    PROF_OP(PROF_WRITE, NULL, fd, size);
 
-    //Sanity check
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
-        printf("[write] fd is not in [0,NUM_OPEN_FILE] or size <= 0.\n");
+    //Get the corresponding open file entry; invalid and stale descriptors are rejected
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if (entry == NULL || size <= 0) {
+        printf("[write] fd is not an open file descriptor or size <= 0.\n");
         return -1;
     }
-    
-    //Get the corresponding information from the given file descriptor
-    struct open_file_entry *entry = &open_file_table[fd];
-    struct dir_entry *dir_entry = entry->dir_entry;
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    if (entry->snapshot_file) {
+        printf("[write] file is a snapshot file, which cannot be changed.\n");
+        return -1;
+    }
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    PROF_FILE(dir_entry->inode_number, fd, entry->position);
     //Ensure that the file is opened with RSFS_RDWR mode
     if (entry->access_flag != RSFS_RDWR) {
         printf("[write] file is not opened with RSFS_RDWR mode.\n");
         return -1;
     }
 
+    //The snapshots taken since the file last changed keep its content as it is now
+    if (snapshot_preserve(fs, dir_entry) != 0) {
+        printf("[write] fail to preserve the file for a snapshot.\n");
+        return -1;
+    }
+
     //Get the current position and the block position and offset
     int current_position = entry->position;
     int block_position = current_position / BLOCK_SIZE;
@@ -470,13 +1241,33 @@ int RSFS_write(int fd, void *buf, int size){
             int block = inode->block[remove_from / BLOCK_SIZE];
             int offset = remove_from % BLOCK_SIZE;
 
-            memset(data_blocks[block] + offset, 0, BLOCK_SIZE - offset);
+            //A whole block is dropped (and wiped with its last reference); a shared one is copied before it is cleared
             if (offset == 0){
-                free_data_block(block);
+                if (block >= 0) {
+                    free_data_block(fs, block);
+                }
+                inode->block[remove_from / BLOCK_SIZE] = -1;
+            } else if (block >= 0 && (block = writable_data_block(fs, &inode->block[remove_from / BLOCK_SIZE])) >= 0) {
+                memset(block_data(fs, block) + offset, 0, BLOCK_SIZE - offset);
             }
             remove_from += BLOCK_SIZE - offset;
         }
 
+        //The file now ends where the new content ends
+        inode->length = current_position + size;
+    }
+
+    //The blocks the write needs that the file does not have yet are allocated together, in runs (see data_block.c)
+    int last_position = (current_position + size - 1) / BLOCK_SIZE;
+    if (last_position >= NUM_POINTER) {
+        last_position = NUM_POINTER - 1;
+    }
+    int fresh[NUM_POINTER] = {0};
+    for (int j = block_position; j <= last_position; j++) {
+        fresh[j] = inode->block[j] == -1;
+    }
+    if (block_position <= last_position) {
+        allocate_data_blocks(fs, &inode->block[block_position], last_position - block_position + 1);
     }
 
     //Write the content of size (bytes) in buf to the file (of descripter fd) from current position for up to size bytes
@@ -485,15 +1276,29 @@ int RSFS_write(int fd, void *buf, int size){
         //Get the block and allocate a new block if it is not allocated
         block_position = current_position / BLOCK_SIZE;
         offset = current_position % BLOCK_SIZE;
+
+        //Stop at the maximum file size
+        if (block_position >= NUM_POINTER) {
+            if(DEBUG) printf("[write] file has reached its maximum size.\n");
+            break;
+        }
+
         int block = inode->block[block_position];
         if (block == -1) {
-            block = allocate_data_block();
+            block = allocate_data_block(fs, &inode->block[block_position]);
+            if (block < 0) {
+                printf("[write] fail to allocate a data block.\n");
+                break;
+            }
             inode->block[block_position] = block;
+        } else if (!fresh[block_position] && (block = writable_data_block(fs, &inode->block[block_position])) < 0) {
+            printf("[write] fail to allocate a data block.\n");
+            break;
         }
 
         //Check how much space is available in the block
         int space_available = BLOCK_SIZE - offset;
-        int bytes_to_write = size;
+        int bytes_to_write = size - bytes_written;
 
         //If we have more space available than bytes left to write, only write the bytes left
         if (space_available > size - bytes_written) {
@@ -505,8 +1310,11 @@ int RSFS_write(int fd, void *buf, int size){
             bytes_to_write = space_available;
         }
 
-        //Copy the data from the buffer to the data block
-        memcpy(data_blocks[block] + offset, buf + bytes_written, bytes_to_write);
+        //Copy the data from the buffer to the data block; a block just filled may be shared with an identical one
+        memcpy(block_data(fs, block) + offset, buf + bytes_written, bytes_to_write);
+        if (offset + bytes_to_write == BLOCK_SIZE) {
+            dedup_data_block(fs, &inode->block[block_position]);
+        }
         bytes_written += bytes_to_write;
         current_position += bytes_to_write;
 
@@ -515,40 +1323,63 @@ int RSFS_write(int fd, void *buf, int size){
             inode->length = current_position;
         }
     }
+
+    //Blocks allocated for bytes that could not be written are given back
+    for (int j = (inode->length + BLOCK_SIZE - 1) / BLOCK_SIZE; j <= last_position; j++) {
+        if (fresh[j] && inode->block[j] >= 0) {
+            free_data_block(fs, inode->block[j]);
+            inode->block[j] = -1;
+        }
+    }
     
     //Update the current position in the open file entry
     entry->position = current_position;
     
     //Return the number of bytes written
-    return bytes_written;
+    return PROF_BYTES(bytes_written);
 }
 
 
 
 
 //cut the content from the current position for up to size (bytes) from the file of descriptor fd
-int RSFS_cut(int fd, int size){
-    //Sanity check
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
-        printf("[cut] fd is not in [0,NUM_OPEN_FILE] or size <= 0.\n");
+int rsfs_cut(rsfs_t *fs, int fd, int size){
+    PROF_OP(PROF_CUT, NULL, fd, size);
+    //Get the corresponding open file entry; invalid and stale descriptors are rejected
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if (entry == NULL || size <= 0) {
+        printf("[cut] fd is not an open file descriptor or size <= 0.\n");
+        return -1;
+    }
+    if (entry->snapshot_file) {
+        printf("[cut] file is a snapshot file, which cannot be changed.\n");
         return -1;
     }
-
-    //Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
 
     //Get the current position
     int current_position = entry->position;
     
     //Get the corresponding directory entry
-    struct dir_entry *dir_entry = entry->dir_entry;
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
 
     //Get the corresponding inode
-    struct inode *inode = &inodes[dir_entry->inode_number];
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    PROF_FILE(dir_entry->inode_number, fd, entry->position);
+
+    //The snapshots taken since the file last changed keep its content as it is now
+    if (snapshot_preserve(fs, dir_entry) != 0) {
+        printf("[cut] fail to preserve the file for a snapshot.\n");
+        return -1;
+    }
 
     //Need to memcpy all the information from current_position + size to the end of the file over the
     // current memory starting at current_position. If there are multiple data_blocks, need to account for that.
     
+    //Nothing past the end of the file can be cut
+    if (size > inode->length - current_position) {
+        size = inode->length - current_position;
+    }
+
     //Get the position to start cutting the file and stop cutting the file
     int cut_start = current_position + size;
     int cut_end = inode->length;
@@ -568,8 +1399,10 @@ int RSFS_cut(int fd, int size){
             bytes_to_read = BLOCK_SIZE - offset;
         }
 
-        //copy the data from the block to the buffer
-        memcpy(buf + bytes_copied, data_blocks[block] + offset, bytes_to_read);
+        //copy the data from the block to the buffer; a missing block reads as zeros
+        if (block >= 0) {
+            memcpy(buf + bytes_copied, block_data(fs, block) + offset, bytes_to_read);
+        }
 
         cut_start += bytes_to_read;
         bytes_to_copy -= bytes_to_read;
@@ -589,11 +1422,18 @@ int RSFS_cut(int fd, int size){
 
         int block = inode->block[block_position];
         if (block == -1) {
-            block = allocate_data_block();
+            block = allocate_data_block(fs, &inode->block[block_position]);
+            if (block < 0) {
+                printf("[cut] fail to allocate a data block.\n");
+                break;
+            }
             inode->block[block_position] = block;
+        } else if ((block = writable_data_block(fs, &inode->block[block_position])) < 0) {
+            printf("[cut] fail to allocate a data block.\n");
+            break;
         }
         int space_available = BLOCK_SIZE - offset;
-        int bytes_to_write = bytes_copied;
+        int bytes_to_write = bytes_copied - bytes_written;
 
         if (space_available > bytes_copied - bytes_written) {
             bytes_to_write = bytes_copied - bytes_written;
@@ -603,7 +1443,10 @@ int RSFS_cut(int fd, int size){
             bytes_to_write = space_available;
         }
 
-        memcpy(data_blocks[block] + offset, buf + bytes_written, bytes_to_write);
+        memcpy(block_data(fs, block) + offset, buf + bytes_written, bytes_to_write);
+        if (offset + bytes_to_write == BLOCK_SIZE) {
+            dedup_data_block(fs, &inode->block[block_position]);
+        }
         bytes_written += bytes_to_write;
         current_position += bytes_to_write;
 
@@ -616,9 +1459,13 @@ int RSFS_cut(int fd, int size){
     while (current_position < cut_end) {
         int block = inode->block[current_position / BLOCK_SIZE];
         int offset = current_position % BLOCK_SIZE;
-        memset(data_blocks[block] + offset, 0, BLOCK_SIZE - offset);
         if (offset == 0){
-            free_data_block(block);
+            if (block >= 0) {
+                free_data_block(fs, block);
+            }
+            inode->block[current_position / BLOCK_SIZE] = -1;
+        } else if (block >= 0 && (block = writable_data_block(fs, &inode->block[current_position / BLOCK_SIZE])) >= 0) {
+            memset(block_data(fs, block) + offset, 0, BLOCK_SIZE - offset);
         }
         current_position += BLOCK_SIZE - offset;
     }
@@ -629,8 +1476,29 @@ int RSFS_cut(int fd, int size){
     entry->position = current_position;
 
     //Return the number of bytes cut
-    return size; 
+    return PROF_BYTES(size); 
 }
 
 
 
+//api over the default instance
+int RSFS_init(){ return rsfs_init(&rsfs_default); }
+void RSFS_stat(){ rsfs_stat(&rsfs_default); }
+int RSFS_create(char *file_name){ return rsfs_create(&rsfs_default, file_name); }
+int RSFS_open(char *file_name, int access_flag){ return rsfs_open(&rsfs_default, file_name, access_flag); }
+int RSFS_try_open(char *file_name, int access_flag){ return rsfs_try_open(&rsfs_default, file_name, access_flag); }
+int RSFS_append(int fd, void *buf, int size){ return rsfs_append(&rsfs_default, fd, buf, size); }
+int RSFS_fseek(int fd, int offset){ return rsfs_fseek(&rsfs_default, fd, offset); }
+int RSFS_read(int fd, void *buf, int size){ return rsfs_read(&rsfs_default, fd, buf, size); }
+int RSFS_close(int fd){ return rsfs_close(&rsfs_default, fd); }
+int RSFS_write(int fd, void *buf, int size){ return rsfs_write(&rsfs_default, fd, buf, size); }
+int RSFS_cut(int fd, int size){ return rsfs_cut(&rsfs_default, fd, size); }
+int RSFS_delete(char *file_name){ return rsfs_delete(&rsfs_default, file_name); }
+int RSFS_mkdir(char *path){ return rsfs_mkdir(&rsfs_default, path); }
+int RSFS_rmdir(char *path){ return rsfs_rmdir(&rsfs_default, path); }
+int RSFS_create_open(char *file_name, int access_flag){ return rsfs_create_open(&rsfs_default, file_name, access_flag); }
+int RSFS_create_many(char **file_names, int num, int *results){ return rsfs_create_many(&rsfs_default, file_names, num, results); }
+int RSFS_open_many(char **file_names, int num, int access_flag, int *fds){ return rsfs_open_many(&rsfs_default, file_names, num, access_flag, fds); }
+int RSFS_delete_many(char **file_names, int num, int *results){ return rsfs_delete_many(&rsfs_default, file_names, num, results); }
+int RSFS_readdir_plus(struct rsfs_readdir_cursor *cursor, char *prefix, struct rsfs_dirent *out, int max){ return rsfs_readdir_plus(&rsfs_default, cursor, prefix, out, max); }
+int RSFS_opendir(char *path, struct rsfs_dir_iter *iter){ return rsfs_opendir(&rsfs_default, path, iter); }
@@ -4,6 +4,8 @@
 
 #include "def.h"
 #include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 struct thread_arg{
     int id;
@@ -282,6 +284,1439 @@ void test_isolated(){
 }
 
 
+//helper for test_ring: reap one completion, waiting up to timeout_ms for each post to the eventfd;
+//return 0, or -1 if none came in time (an open left parked)
+int wait_cqe_timeout(struct rsfs_ring *ring, struct rsfs_cqe *cqe, int timeout_ms){
+    struct pollfd pfd = {RSFS_ring_eventfd(ring), POLLIN, 0};
+    while(RSFS_ring_peek_cqe(ring, cqe)!=0){
+        if(poll(&pfd, 1, timeout_ms)<=0) return -1;
+        long long count;
+        if(read(pfd.fd, &count, sizeof(count))!=sizeof(count)) return -1;
+    }
+    return 0;
+}
+
+//thread body for test_ring: defragment and clean the log until *arg is set, taking the files like writers
+void *file_mover(void *arg){
+    int *stop = (int *)arg;
+    while(!__atomic_load_n(stop, __ATOMIC_ACQUIRE)){
+        RSFS_defrag(4);
+        RSFS_log_clean(1);
+    }
+    return NULL;
+}
+
+void test_ring(){
+
+    //a single worker keeps the appends to the shared fd in submission order
+    struct rsfs_ring ring;
+    int ret = RSFS_ring_init(&ring, 16, 1);
+    printf("[test_ring] result of RSFS_ring_init: %d\n", ret);
+    if(ret!=0) return;
+
+    RSFS_create("ring");
+
+    //open the file for writing through the ring
+    struct rsfs_cqe cqe;
+    struct rsfs_sqe *sqe = RSFS_ring_get_sqe(&ring);
+    sqe->opcode = RSFS_OP_OPEN;
+    sqe->file_name = "ring";
+    sqe->access_flag = RSFS_RDWR;
+    sqe->user_data = 1;
+    RSFS_ring_submit(&ring);
+    RSFS_ring_wait_cqe(&ring, &cqe);
+    int fd = cqe.result;
+    printf("[test_ring] open (user_data=%lu) returned fd=%d\n", cqe.user_data, fd);
+
+    //a batch of appends submitted with a single call
+    char *parts[3] = {"ring 1, ", "ring 2, ", "ring 3."};
+    for(int i=0; i<3; i++){
+        sqe = RSFS_ring_get_sqe(&ring);
+        sqe->opcode = RSFS_OP_APPEND;
+        sqe->fd = fd;
+        sqe->buf = parts[i];
+        sqe->size = strlen(parts[i]);
+        sqe->user_data = 10+i;
+    }
+    printf("[test_ring] submitted %d appends\n", RSFS_ring_submit(&ring));
+    int appended = 0;
+    for(int i=0; i<3; i++){
+        RSFS_ring_wait_cqe(&ring, &cqe);
+        appended += cqe.result;
+    }
+    printf("[test_ring] appended %d bytes in total\n", appended);
+
+    //a reader open submitted while the writer still holds the file completes only after the close
+    sqe = RSFS_ring_get_sqe(&ring);
+    sqe->opcode = RSFS_OP_OPEN;
+    sqe->file_name = "ring";
+    sqe->access_flag = RSFS_RDONLY;
+    sqe->user_data = 20;
+    RSFS_ring_submit(&ring);
+    usleep(10000);
+    printf("[test_ring] reader open completed before close: %s\n", 
+        RSFS_ring_peek_cqe(&ring, &cqe)==0 ? "yes" : "no");
+
+    sqe = RSFS_ring_get_sqe(&ring);
+    sqe->opcode = RSFS_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = 21;
+    RSFS_ring_submit(&ring);
+
+    int read_fd = -1;
+    for(int i=0; i<2 && wait_cqe_timeout(&ring, &cqe, 1000)==0; i++){
+        if(cqe.user_data==20) read_fd = cqe.result;
+    }
+
+    //read everything back
+    char buf[64];
+    memset(buf,0,64);
+    sqe = RSFS_ring_get_sqe(&ring);
+    sqe->opcode = RSFS_OP_READ;
+    sqe->fd = read_fd;
+    sqe->buf = buf;
+    sqe->size = 63;
+    sqe->offset = 0;
+    RSFS_ring_submit(&ring);
+    RSFS_ring_wait_cqe(&ring, &cqe);
+    printf("[test_ring] read %d bytes of string: %s\n", cqe.result, buf);
+
+    RSFS_close(read_fd);
+    RSFS_delete("ring");
+    RSFS_ring_exit(&ring);
+
+    //with several workers, the writes at offsets on one fd still run in submission order: each one drops
+    //what follows it, so one run out of order would leave the file short
+    ret = RSFS_ring_init(&ring, 16, 4);
+    RSFS_create("ring");
+    fd = RSFS_open("ring", RSFS_RDWR);
+    char *words[8] = {"w0..", "w1..", "w2..", "w3..", "w4..", "w5..", "w6..", "w7.."};
+    for(int i=0; i<8; i++){
+        sqe = RSFS_ring_get_sqe(&ring);
+        sqe->opcode = RSFS_OP_WRITE;
+        sqe->fd = fd;
+        sqe->buf = words[i];
+        sqe->size = 4;
+        sqe->offset = 4*i;
+        sqe->user_data = 30+i;
+    }
+    RSFS_ring_submit(&ring);
+    int in_order = 1;
+    for(int i=0; i<8; i++){
+        RSFS_ring_wait_cqe(&ring, &cqe);
+        in_order &= cqe.user_data==(unsigned long)(30+i);
+    }
+
+    //an open parked behind the writer completes when the writer closes the file outside the ring
+    sqe = RSFS_ring_get_sqe(&ring);
+    sqe->opcode = RSFS_OP_OPEN;
+    sqe->file_name = "ring";
+    sqe->access_flag = RSFS_RDONLY;
+    sqe->user_data = 40;
+    RSFS_ring_submit(&ring);
+    usleep(10000);
+    RSFS_close(fd);
+    read_fd = wait_cqe_timeout(&ring, &cqe, 1000)==0 ? cqe.result : -1;
+    memset(buf,0,64);
+    int n = RSFS_read(read_fd, buf, 63);
+    printf("[test_ring] 4 workers: completions in submission order: %s, read %d bytes: %s\n", in_order ? "yes" : "no", n, buf);
+    RSFS_close(read_fd);
+
+    //an open and the close of the writer it waits for, in one batch: they run on two workers at once, and the
+    //close may land between the failed try of the open and its parking
+    enum { RING_ROUNDS = 200 };
+    int opened = 0;
+    for(int round=0; round<RING_ROUNDS; round++){
+        fd = RSFS_open("ring", RSFS_RDWR);
+        sqe = RSFS_ring_get_sqe(&ring);
+        sqe->opcode = RSFS_OP_OPEN;
+        sqe->file_name = "ring";
+        sqe->access_flag = RSFS_RDONLY;
+        sqe->user_data = 50;
+        sqe = RSFS_ring_get_sqe(&ring);
+        sqe->opcode = RSFS_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = 51;
+        RSFS_ring_submit(&ring);
+        int reaped = 0;
+        for(; reaped<2 && wait_cqe_timeout(&ring, &cqe, 1000)==0; reaped++){
+            if(cqe.user_data==50 && cqe.result>=0){
+                opened++;
+                RSFS_close(cqe.result);
+            }
+        }
+        if(reaped<2) break;
+    }
+    printf("[test_ring] open and close in one batch: opens completed %d of %d\n", opened, RING_ROUNDS);
+
+    //opens that lose their try to the defragmenter or the cleaner (which take the file like writers) complete
+    //when they let it go, with no close to wake them
+    int stop = 0;
+    pthread_t mover;
+    pthread_create(&mover, NULL, file_mover, &stop);
+    opened = 0;
+    for(int round=0; round<RING_ROUNDS; round++){
+        sqe = RSFS_ring_get_sqe(&ring);
+        sqe->opcode = RSFS_OP_OPEN;
+        sqe->file_name = "ring";
+        sqe->access_flag = RSFS_RDWR;
+        sqe->user_data = 60;
+        RSFS_ring_submit(&ring);
+        if(wait_cqe_timeout(&ring, &cqe, 1000)!=0) break;
+        if(cqe.result>=0){
+            opened++;
+            RSFS_close(cqe.result);
+        }
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(mover, NULL);
+    printf("[test_ring] opens beside the defragmenter and the cleaner: completed %d of %d\n", opened, RING_ROUNDS);
+
+    RSFS_delete("ring");
+    RSFS_ring_exit(&ring);
+}
+
+
+//argument of double_closer: the descriptor both closers close in each round, the number of the round let go
+//(the closers spin on it, so that they close at the same moment), and the number of closes made and of those
+//that succeeded in each round
+struct double_close_arg{
+    int *fd;
+    int *round;
+    int *done;
+    int *closed;
+    int rounds;
+};
+
+//thread body for test_open_file_table: close the descriptor of each round alongside another closer
+void *double_closer(void *arg){
+    struct double_close_arg *a = (struct double_close_arg *)arg;
+    for(int r=0; r<a->rounds; r++){
+        while(__atomic_load_n(a->round, __ATOMIC_ACQUIRE)<=r) sched_yield();
+        if(RSFS_close(__atomic_load_n(a->fd, __ATOMIC_RELAXED))==0) __atomic_add_fetch(&a->closed[r], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a->done[r], 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void test_open_file_table(){
+
+    RSFS_create("shared");
+
+    //open the same file more times than the first chunk of the table holds
+    int fd[3*NUM_OPEN_FILE];
+    int opened = 0;
+    for(int i=0; i<3*NUM_OPEN_FILE; i++){
+        fd[i] = RSFS_open("shared", RSFS_RDONLY);
+        if(fd[i]>=0) opened++;
+    }
+    printf("[test_open_file_table] opened the file %d times\n", opened);
+
+    //a closed descriptor is stale even after its entry is reused
+    int stale = fd[0];
+    RSFS_close(stale);
+    fd[0] = RSFS_open("shared", RSFS_RDONLY);
+    printf("[test_open_file_table] reopen gets a new descriptor: %s\n", fd[0]!=stale ? "yes" : "no");
+    printf("[test_open_file_table] result of closing the stale descriptor: %d\n", RSFS_close(stale));
+
+    for(int i=0; i<3*NUM_OPEN_FILE; i++){
+        RSFS_close(fd[i]);
+    }
+
+    //two threads closing the same descriptor at once: one close succeeds, and the reader hold
+    //and the entry are released once
+    enum { ROUNDS = 64 };
+    int shared_fd, round = 0, done[ROUNDS] = {0}, closed[ROUNDS] = {0};
+    struct double_close_arg arg = {&shared_fd, &round, done, closed, ROUNDS};
+    pthread_t closers[2];
+    for(int t=0; t<2; t++) pthread_create(&closers[t], NULL, double_closer, &arg);
+    for(int r=0; r<ROUNDS; r++){
+        __atomic_store_n(&shared_fd, RSFS_open("shared", RSFS_RDONLY), __ATOMIC_RELAXED);
+        __atomic_store_n(&round, r+1, __ATOMIC_RELEASE);
+        while(__atomic_load_n(&done[r], __ATOMIC_ACQUIRE)<2) sched_yield();
+    }
+    for(int t=0; t<2; t++) pthread_join(closers[t], NULL);
+    int once = 1;
+    for(int r=0; r<ROUNDS; r++) once = once && closed[r]==1;
+    int first = RSFS_open("shared", RSFS_RDONLY);
+    int second = RSFS_open("shared", RSFS_RDONLY);
+    int distinct = (first & FD_INDEX_MASK)!=(second & FD_INDEX_MASK);
+    RSFS_close(first);
+    RSFS_close(second);
+    int writer = RSFS_try_open("shared", RSFS_RDWR);
+    printf("[test_open_file_table] double close: one close per round: %s, entries distinct: %s, writer can open: %s\n",
+        once ? "yes" : "no", distinct ? "yes" : "no", writer>=0 ? "yes" : "no");
+    RSFS_close(writer);
+    RSFS_delete("shared");
+    RSFS_stat();
+}
+
+
+//argument of name_racer: an instance, the number of the round let go (the racers spin on it, so that they
+//start at the same moment), whether this racer makes a directory or a file, and the number of racers that got the name
+struct name_race_arg{
+    rsfs_t *fs;
+    int *go;
+    int is_dir;
+    int *won;
+};
+
+//thread body for test_directories: make a directory, or create a file, named race
+void *name_racer(void *arg){
+    struct name_race_arg *a = (struct name_race_arg *)arg;
+    while(!__atomic_load_n(a->go, __ATOMIC_ACQUIRE)) sched_yield();
+    int ret = a->is_dir ? rsfs_mkdir(a->fs, "race") : rsfs_create(a->fs, "race");
+    if(ret==0) __atomic_add_fetch(a->won, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void test_directories(){
+
+    printf("[test_directories] mkdir docs: %d\n", RSFS_mkdir("docs"));
+    printf("[test_directories] mkdir docs/2024: %d\n", RSFS_mkdir("docs/2024"));
+    printf("[test_directories] mkdir missing/dir: %d\n", RSFS_mkdir("missing/dir"));
+    printf("[test_directories] create docs/2024/report: %d\n", RSFS_create("docs/2024/report"));
+    printf("[test_directories] create report: %d\n", RSFS_create("report"));
+
+    //the same name in two directories names two files
+    int fd = RSFS_open("docs/2024/report", RSFS_RDWR);
+    RSFS_write(fd, "nested", 6);
+    RSFS_close(fd);
+    fd = RSFS_open("/docs//2024/report", RSFS_RDONLY);
+    char buf[16];
+    memset(buf,0,16);
+    RSFS_read(fd, buf, 15);
+    RSFS_close(fd);
+    printf("[test_directories] read back: %s\n", buf);
+
+    //repeated misses are answered by the dentry cache
+    for(int i=0; i<3; i++){
+        printf("[test_directories] open docs/2024/missing: %d\n", RSFS_open("docs/2024/missing", RSFS_RDONLY));
+    }
+    RSFS_stat();
+
+    printf("[test_directories] rmdir non-empty docs: %d\n", RSFS_rmdir("docs"));
+    RSFS_delete("docs/2024/report");
+    RSFS_delete("report");
+    printf("[test_directories] rmdir docs/2024: %d\n", RSFS_rmdir("docs/2024"));
+    printf("[test_directories] rmdir docs: %d\n", RSFS_rmdir("docs"));
+    RSFS_stat();
+
+    //a directory object handed out again does not answer lookups cached in its previous life
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_directories] fail to create an instance.\n");
+        return;
+    }
+    rsfs_mkdir(fs, "old");
+    rsfs_create(fs, "old/cached");
+    rsfs_close(fs, rsfs_open(fs, "old/cached", RSFS_RDONLY));
+    rsfs_delete(fs, "old/cached");
+    rsfs_rmdir(fs, "old");
+    epoch_barrier(fs);
+    rsfs_create(fs, "other");
+    rsfs_mkdir(fs, "new");
+    rsfs_create(fs, "new/other");
+    printf("[test_directories] open new/cached after old/cached was cached: %d\n", rsfs_open(fs, "new/cached", RSFS_RDONLY));
+
+    //of directories and files made at once under one name, one gets it
+    int go = 0, won = 0;
+    pthread_t racers[4];
+    struct name_race_arg args[4];
+    for(int t=0; t<4; t++){
+        args[t] = (struct name_race_arg){fs, &go, t%2==0, &won};
+        pthread_create(&racers[t], NULL, name_racer, &args[t]);
+    }
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for(int t=0; t<4; t++) pthread_join(racers[t], NULL);
+    printf("[test_directories] racers that made race: %d\n", won);
+    rsfs_free(fs);
+}
+
+
+//test: counters and directory listings
+void test_stats(){
+
+    RSFS_mkdir("logs");
+    RSFS_create("logs/a");
+    RSFS_create("logs/b");
+    int fd = RSFS_open("logs/a", RSFS_RDWR);
+    RSFS_append(fd, "counted", 7);
+
+    struct rsfs_stats stats;
+    RSFS_get_stats(&stats);
+    printf("[test_stats] blocks %ld/%ld, inodes %ld/%ld, open %ld, files %ld, dirs %ld\n",
+        stats.used_blocks, stats.total_blocks, stats.used_inodes, stats.total_inodes,
+        stats.open_files, stats.num_files, stats.num_dirs);
+
+    //the listing keeps what it saw even if the directory changes while iterating
+    struct rsfs_dir_iter iter;
+    struct rsfs_dirent dirent;
+    RSFS_opendir("logs", &iter);
+    RSFS_delete("logs/b");
+    while(RSFS_readdir(&iter, &dirent)==0){
+        printf("[test_stats] logs/%s: length %d, inode %d\n", dirent.name, dirent.length, dirent.inode_number);
+    }
+    RSFS_closedir(&iter);
+    printf("[test_stats] opendir logs/a: %d\n", RSFS_opendir("logs/a", &iter));
+
+    RSFS_close(fd);
+    RSFS_delete("logs/a");
+    RSFS_rmdir("logs");
+    RSFS_get_stats(&stats);
+    printf("[test_stats] blocks %ld, inodes %ld, open %ld, files %ld, dirs %ld\n",
+        stats.used_blocks, stats.used_inodes, stats.open_files, stats.num_files, stats.num_dirs);
+}
+
+
+//test: latency histograms and lock counters
+void test_profile(){
+
+    RSFS_reset_profile();
+
+    RSFS_create("profiled");
+    int fd = RSFS_open("profiled", RSFS_RDWR);
+    for(int i=0; i<4; i++) RSFS_append(fd, "0123456789", 10);
+    RSFS_fseek(fd, 0);
+    char buf[40];
+    RSFS_read(fd, buf, 40);
+    RSFS_close(fd);
+    RSFS_delete("profiled");
+
+    struct rsfs_profile profile;
+    if(RSFS_get_profile(&profile)!=0){
+        printf("[test_profile] profiling is compiled out.\n");
+        return;
+    }
+    printf("[test_profile] append: %lu calls, %lu bytes; read: %lu calls, %lu bytes\n",
+        profile.op_latency[PROF_APPEND].count, profile.op_bytes[PROF_APPEND],
+        profile.op_latency[PROF_READ].count, profile.op_bytes[PROF_READ]);
+    printf("[test_profile] inode rw_mutex taken %lu times\n", profile.lock_wait[LOCK_INODE_RW].count);
+
+    RSFS_dump_profile(stdout, 0);
+    RSFS_dump_profile(stdout, 1);
+}
+
+
+//test: event tracing; the dump can be converted with ./trace2json trace.bin trace.json
+void test_trace(){
+
+    RSFS_trace_start();
+
+    RSFS_create("traced");
+    int fd = RSFS_open("traced", RSFS_RDWR);
+    RSFS_append(fd, "0123456789", 10);
+    RSFS_close(fd);
+    RSFS_delete("traced");
+
+    RSFS_trace_stop();
+    printf("[test_trace] records dumped: %d\n", RSFS_trace_dump("trace.bin"));
+}
+
+
+//callback for test_record: read the bytes at a match through the descriptor arg points at;
+//the calls it makes are recorded on their own, not as part of the scan
+int read_match(int offset, void *arg){
+    int fd = *(int *)arg;
+    char buf[4];
+    RSFS_fseek(fd, offset);
+    RSFS_read(fd, buf, 4);
+    return 0;
+}
+
+//test: call recording; replay it with ./replay calls.rec
+void test_record(){
+
+    RSFS_record_start("calls.rec");
+
+    RSFS_mkdir("rec");
+    RSFS_create("rec/file");
+    int fd = RSFS_open("rec/file", RSFS_RDWR);
+    RSFS_append(fd, "recorded", 8);
+    RSFS_fseek(fd, 0);
+    char buf[8];
+    RSFS_read(fd, buf, 8);
+    RSFS_close(fd);
+
+    //snapshot ids and the descriptors of snapshot files are mapped by the replay like those of open
+    int snapshot = RSFS_snapshot_create();
+    RSFS_delete("rec/file");
+    fd = RSFS_snapshot_open_file(snapshot, "rec/file");
+    RSFS_read(fd, buf, 8);
+    RSFS_close(fd);
+    RSFS_snapshot_drop(snapshot);
+
+    //a batch call is recorded with its paths, and the calls it makes are replayed with it
+    char *names[] = {"rec/a", "rec/b", "rec/c"};
+    int results[3], fds[3];
+    RSFS_create_many(names, 3, results);
+    RSFS_open_many(names, 3, RSFS_RDWR, fds);
+    for(int i=0; i<3; i++) RSFS_append(fds[i], "batched", 7);
+    for(int i=0; i<3; i++) RSFS_close(fds[i]);
+    RSFS_delete_many(names, 3, results);
+    fd = RSFS_create_open("rec/single", RSFS_RDWR);
+
+    //a find or scan is recorded with its pattern; the scan stops at as many matches in the replay
+    RSFS_append(fd, "recorded\0record", 15);
+    RSFS_close(fd);
+    fd = RSFS_open("rec/single", RSFS_RDONLY);
+    int reader = RSFS_open("rec/single", RSFS_RDONLY);
+    RSFS_find(fd, "d\0r", 3, 0);
+    RSFS_scan(fd, "rec", 3, 0, read_match, &reader);
+    RSFS_close(reader);
+    RSFS_close(fd);
+
+    //a copy is recorded with both descriptors, and the replay maps both
+    fd = RSFS_open("rec/single", RSFS_RDONLY);
+    int copy = RSFS_create_open("rec/copy", RSFS_RDWR);
+    RSFS_copy_range(fd, 0, copy, 0, 15);
+
+    //the host data of an import or export is not recorded, only how much of it moved
+    int pipe_fds[2];
+    pipe(pipe_fds);
+    write(pipe_fds[1], "imported", 8);
+    close(pipe_fds[1]);
+    RSFS_import_fd(pipe_fds[0], copy, 64);
+    close(pipe_fds[0]);
+    pipe(pipe_fds);
+    RSFS_fseek(copy, 0);
+    RSFS_export_fd(copy, pipe_fds[1], 64);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    RSFS_close(copy);
+    RSFS_close(fd);
+    RSFS_delete("rec/copy");
+
+    //a listing by pages is recorded with where each page starts
+    struct rsfs_readdir_cursor cursor;
+    struct rsfs_dirent page[1];
+    RSFS_readdir_start(&cursor, "rec");
+    while(RSFS_readdir_plus(&cursor, "", page, 1)>0);
+    RSFS_delete("rec/single");
+    RSFS_rmdir("rec");
+
+    printf("[test_record] calls recorded: %d\n", RSFS_record_stop());
+}
+
+
+//argument of instance_worker: an instance and the byte its file is filled with
+struct instance_arg{
+    rsfs_t *fs;
+    char content;
+};
+
+//thread body for test_instances: fill a file of the same name in its own instance
+void *instance_worker(void *arg){
+    struct instance_arg *a = (struct instance_arg *)arg;
+
+    rsfs_create(a->fs, "same_name");
+    int fd = rsfs_open(a->fs, "same_name", RSFS_RDWR);
+    for(int i=0; i<100; i++) rsfs_append(a->fs, fd, &a->content, 1);
+    rsfs_close(a->fs, fd);
+    return NULL;
+}
+
+//test: independent instances with files of the same name, and the default instance beside them
+void test_instances(){
+
+    rsfs_t *fs[2] = {rsfs_new(), rsfs_new()};
+    if(fs[0]==NULL || fs[1]==NULL){
+        printf("[test_instances] fail to create the instances.\n");
+        return;
+    }
+    printf("[test_instances] instances are cache-line aligned: %s\n",
+        ((unsigned long)fs[0]|(unsigned long)fs[1])%64==0 ? "yes" : "no");
+
+    pthread_t threads[2];
+    struct instance_arg args[2] = {{fs[0], 'x'}, {fs[1], 'y'}};
+    for(int i=0; i<2; i++) pthread_create(&threads[i], NULL, instance_worker, &args[i]);
+    for(int i=0; i<2; i++) pthread_join(threads[i], NULL);
+
+    for(int i=0; i<2; i++){
+        char buf[128];
+        int fd = rsfs_open(fs[i], "same_name", RSFS_RDONLY);
+        int n = rsfs_read(fs[i], fd, buf, sizeof(buf));
+        int uniform = 1;
+        for(int j=0; j<n; j++) if(buf[j]!=args[i].content) uniform = 0;
+        struct rsfs_stats stats;
+        rsfs_get_stats(fs[i], &stats);
+        printf("[test_instances] instance %d: read %d bytes, all from its own writer: %s; blocks %ld, files %ld, open %ld\n",
+            i, n, uniform ? "yes" : "no", stats.used_blocks, stats.num_files, stats.open_files);
+        printf("[test_instances] instance %d freed with a file open: %d\n", i, rsfs_free(fs[i]));
+        rsfs_close(fs[i], fd);
+    }
+
+    printf("[test_instances] default instance has same_name: %s\n", RSFS_open("same_name", RSFS_RDONLY)<0 ? "no" : "yes");
+
+    //deleted entries may still wait for their grace period when the instance goes away
+    rsfs_delete(fs[0], "same_name");
+    for(int i=0; i<2; i++) printf("[test_instances] instance %d freed: %d\n", i, rsfs_free(fs[i]));
+}
+
+
+//test: an instance in shared memory used by a parent and its children, and recovery after a child dies
+void test_shm(){
+
+    char name[64];
+    sprintf(name, "/rsfs_test_%d", (int)getpid());
+    rsfs_t *fs = rsfs_shm_create(name, 0);
+    if(fs==NULL){
+        printf("[test_shm] fail to create the segment.\n");
+        return;
+    }
+    rsfs_create(fs, "from_parent");
+    fflush(stdout); //the children must not inherit buffered output
+
+    //a child attaches the segment by name (at its own address) and writes a file the parent reads
+    pid_t pid = fork();
+    if(pid==0){
+        rsfs_t *child = rsfs_shm_attach(name);
+        int ok = child!=NULL && rsfs_create(child, "from_child")==0;
+        int fd = ok ? rsfs_open(child, "from_child", RSFS_RDWR) : -1;
+        ok = ok && rsfs_append(child, fd, "written by the child", 20)==20 && rsfs_close(child, fd)==0;
+        if(child) rsfs_shm_detach(child);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    char buf[64] = {0};
+    int fd = rsfs_open(fs, "from_child", RSFS_RDONLY);
+    int n = rsfs_read(fs, fd, buf, sizeof(buf)-1);
+    rsfs_close(fs, fd);
+    printf("[test_shm] child exited with %d; parent read %d bytes: %s\n", WEXITSTATUS(status), n, buf);
+
+    //a child dies holding from_parent open for writing: recovery releases its descriptor and the file
+    pid = fork();
+    if(pid==0){
+        rsfs_t *child = rsfs_shm_attach(name);
+        if(child) rsfs_open(child, "from_parent", RSFS_RDWR);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    printf("[test_shm] open files after the child died: %ld; try_open for writing: %d\n",
+        stats.open_files, rsfs_try_open(fs, "from_parent", RSFS_RDWR));
+    printf("[test_shm] resources recovered: %d\n", rsfs_shm_recover(fs));
+    rsfs_get_stats(fs, &stats);
+    fd = rsfs_try_open(fs, "from_parent", RSFS_RDWR);
+    printf("[test_shm] open files after recovery: %ld; try_open for writing: %s\n", stats.open_files, fd>=0 ? "ok" : "failed");
+    rsfs_close(fs, fd);
+
+    printf("[test_shm] detach: %d, unlink: %d\n", rsfs_shm_detach(fs), rsfs_shm_unlink(name));
+}
+
+
+//test: the RSFS calls served over a socket, with pipelined requests and a client waiting to open a file
+void test_server(){
+
+    char socket_path[64];
+    sprintf(socket_path, "/tmp/rsfsd_test_%d.sock", (int)getpid());
+    struct rsfsd_server *server = rsfsd_start(&rsfs_default, socket_path, 2);
+    struct rsfsd_client *a = server ? rsfsd_connect(socket_path, 0) : NULL;
+    struct rsfsd_client *b = a ? rsfsd_connect(socket_path, 0) : NULL;
+    struct rsfsd_client *c = b ? rsfsd_connect(socket_path, 0) : NULL;
+    if(c==NULL){
+        printf("[test_server] fail to start the server or connect to it.\n");
+        return;
+    }
+
+    //the data goes through the shared buffer, the socket only carries the requests
+    rsfsd_call(a, RSFSD_CREATE, "served", -1, 0, 0);
+    int fd = rsfsd_call(a, RSFSD_OPEN, "served", -1, RSFS_RDWR, 0);
+    strcpy(a->buffer, "written through the server");
+    int written = rsfsd_call(a, RSFSD_WRITE, NULL, fd, 26, 0);
+    rsfsd_call(a, RSFSD_FSEEK, NULL, fd, 0, 0);
+    int n = rsfsd_call(a, RSFSD_READ, NULL, fd, 26, 64);
+    printf("[test_server] wrote %d bytes, read back %d: %.*s\n", written, n, n>0 ? n : 0, a->buffer+64);
+
+    //pipelined: every request is sent before the first response is read; responses come in order
+    int ids[8], in_order = 1, sum = 0;
+    for(int i=0; i<8; i++){
+        ids[i] = i%2==0 ? rsfsd_send(a, RSFSD_FSEEK, NULL, fd, i, 0) : rsfsd_send(a, RSFSD_READ, NULL, fd, 1, 128+i);
+    }
+    for(int i=0; i<8; i++){
+        struct rsfsd_response response;
+        if(rsfsd_recv(a, &response)!=0 || (int)response.id!=ids[i]) in_order = 0;
+        else if(i%2==1) sum += response.result;
+    }
+    printf("[test_server] 8 pipelined requests answered in order: %s; bytes read: %d\n", in_order ? "yes" : "no", sum);
+
+    //b waits to open the file a holds; c is served meanwhile
+    int id = rsfsd_send(b, RSFSD_OPEN, "served", -1, RSFS_RDWR, 0);
+    printf("[test_server] another client is served while one waits: mkdir %d\n", rsfsd_call(c, RSFSD_MKDIR, "served_dir", -1, 0, 0));
+    printf("[test_server] a client cannot use a descriptor of another: %d\n", rsfsd_call(c, RSFSD_READ, NULL, fd, 1, 0));
+    rsfsd_call(a, RSFSD_CLOSE, NULL, fd, 0, 0);
+    struct rsfsd_response response;
+    rsfsd_recv(b, &response);
+    printf("[test_server] waiting open completes after the close: %s\n", (int)response.id==id && response.result>=0 ? "yes" : "no");
+
+    //b goes away with the file open: the server closes it
+    rsfsd_disconnect(b);
+    fd = -1;
+    for(int i=0; i<1000 && fd<0; i++){
+        fd = rsfsd_call(a, RSFSD_TRY_OPEN, "served", -1, RSFS_RDWR, 0);
+        if(fd<0) usleep(1000);
+    }
+    rsfsd_call(c, RSFSD_GET_STATS, NULL, -1, 0, 0);
+    struct rsfs_stats stats;
+    memcpy(&stats, c->buffer, sizeof(stats));
+    printf("[test_server] file reopened after its holder disconnected: %s; open files: %ld\n", fd>=0 ? "yes" : "no", stats.open_files);
+
+    rsfsd_disconnect(a);
+    rsfsd_disconnect(c);
+    rsfsd_stop(server);
+}
+
+
+//test: identical blocks shared by deduplication, and the sharing broken by a later write
+void test_dedup(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_dedup] fail to create an instance.\n");
+        return;
+    }
+    rsfs_set_dedup(fs, 1);
+
+    //two files of 4 blocks each, every block holding the same pattern
+    char pattern[BLOCK_SIZE*4];
+    for(int i=0; i<(int)sizeof(pattern); i++) pattern[i] = 'a' + i%BLOCK_SIZE%26;
+    char *names[2] = {"dedup_a", "dedup_b"};
+    int fds[2];
+    for(int i=0; i<2; i++){
+        rsfs_create(fs, names[i]);
+        fds[i] = rsfs_open(fs, names[i], RSFS_RDWR);
+        rsfs_append(fs, fds[i], pattern, sizeof(pattern));
+    }
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    printf("[test_dedup] 8 identical blocks written: used blocks %ld, shared references %ld, dedup ratio %.2f\n",
+        stats.used_blocks, stats.shared_refs, stats.dedup_ratio);
+
+    //overwriting the middle of dedup_a gives it private copies; dedup_b keeps its content
+    rsfs_fseek(fs, fds[0], BLOCK_SIZE+4);
+    rsfs_write(fs, fds[0], "XYZ", 3);
+    rsfs_get_stats(fs, &stats);
+    printf("[test_dedup] after a write into dedup_a: used blocks %ld, shared references %ld, dedup ratio %.2f\n",
+        stats.used_blocks, stats.shared_refs, stats.dedup_ratio);
+    char buf[BLOCK_SIZE*4];
+    rsfs_fseek(fs, fds[1], 0);
+    int n = rsfs_read(fs, fds[1], buf, sizeof(buf));
+    printf("[test_dedup] dedup_b unchanged: %s\n", n==(int)sizeof(pattern) && memcmp(buf, pattern, n)==0 ? "yes" : "no");
+    rsfs_fseek(fs, fds[0], 0);
+    n = rsfs_read(fs, fds[0], buf, sizeof(buf));
+    printf("[test_dedup] dedup_a now holds %d bytes: %.*s\n", n, n>0 ? n : 0, buf);
+
+    for(int i=0; i<2; i++){
+        rsfs_close(fs, fds[i]);
+        rsfs_delete(fs, names[i]);
+    }
+    rsfs_get_stats(fs, &stats);
+    printf("[test_dedup] after deleting both: used blocks %ld, shared references %ld\n", stats.used_blocks, stats.shared_refs);
+    rsfs_free(fs);
+}
+
+
+//test: files compressed on close and when cold, read while compressed, and decompressed for writing
+void test_compression(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_compression] fail to create an instance.\n");
+        return;
+    }
+
+    //the codec on its own: a repetitive and a random buffer survive the round trip
+    char plain[NUM_POINTER*BLOCK_SIZE], packed[NUM_POINTER*BLOCK_SIZE*2], back[NUM_POINTER*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(plain); i++) plain[i] = "log line: ok\n"[i%13];
+    int packed_len = lz_compress(plain, sizeof(plain), packed, sizeof(packed));
+    int ok = lz_decompress(packed, packed_len, back, sizeof(back))==(int)sizeof(plain) && memcmp(plain, back, sizeof(plain))==0;
+    srand(7);
+    for(int i=0; i<(int)sizeof(plain); i++) plain[i] = rand();
+    int random_len = lz_compress(plain, sizeof(plain), packed, sizeof(packed));
+    ok = ok && lz_decompress(packed, random_len, back, sizeof(back))==(int)sizeof(plain) && memcmp(plain, back, sizeof(plain))==0;
+    printf("[test_compression] round trips: %s; repetitive %d -> %d bytes, random %d -> %d bytes\n",
+        ok ? "ok" : "failed", (int)sizeof(plain), packed_len, (int)sizeof(plain), random_len);
+
+    //compressed when its writer closes it
+    char text[200];
+    for(int i=0; i<(int)sizeof(text); i++) text[i] = "log line: ok\n"[i%13];
+    rsfs_create(fs, "on_close");
+    rsfs_set_compression(fs, "on_close", RSFS_COMPRESS_ON_CLOSE);
+    int fd = rsfs_open(fs, "on_close", RSFS_RDWR);
+    rsfs_append(fs, fd, text, sizeof(text));
+    rsfs_close(fs, fd);
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    printf("[test_compression] after close: %ld file compressed, %ld bytes stored in %ld, ratio %.2f, used blocks %ld\n",
+        stats.compressed_files, stats.compressed_bytes, stats.compressed_stored, stats.compression_ratio, stats.used_blocks);
+
+    //read while compressed, from the middle
+    char buf[256];
+    fd = rsfs_open(fs, "on_close", RSFS_RDONLY);
+    rsfs_fseek(fs, fd, 13);
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_compression] read %d bytes from a compressed file, content intact: %s\n",
+        n, n==(int)sizeof(text)-13 && memcmp(buf, text+13, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+
+    //a file of the cold policy is compressed once a sweep finds it unused since the previous one
+    rsfs_create(fs, "cold");
+    rsfs_set_compression(fs, "cold", RSFS_COMPRESS_COLD);
+    fd = rsfs_open(fs, "cold", RSFS_RDWR);
+    rsfs_append(fs, fd, text, 150);
+    rsfs_close(fs, fd);
+    int first = rsfs_compress_cold(fs);
+    int second = rsfs_compress_cold(fs);
+    printf("[test_compression] cold sweeps compressed %d then %d file\n", first, second);
+
+    //appending decompresses it; the file is compressed again only when it goes cold again
+    fd = rsfs_open(fs, "cold", RSFS_RDAPPEND);
+    rsfs_append(fs, fd, text+150, 50);
+    rsfs_close(fs, fd);
+    rsfs_get_stats(fs, &stats);
+    printf("[test_compression] after appending to the cold file: %ld file compressed\n", stats.compressed_files);
+    fd = rsfs_open(fs, "cold", RSFS_RDONLY);
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_compression] cold file holds %d bytes, content intact: %s\n", n, n==(int)sizeof(text) && memcmp(buf, text, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+
+    rsfs_delete(fs, "on_close");
+    rsfs_delete(fs, "cold");
+    rsfs_get_stats(fs, &stats);
+    printf("[test_compression] after deleting both: used blocks %ld, compressed files %ld\n", stats.used_blocks, stats.compressed_files);
+    rsfs_free(fs);
+}
+
+
+//test: snapshots are taken in constant time, keep files as they were and copy blocks only when they are written
+void test_snapshot(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_snapshot] fail to create an instance.\n");
+        return;
+    }
+
+    char one[80], two[80], buf[256];
+    for(int i=0; i<(int)sizeof(one); i++){
+        one[i] = 'a'+i%26;
+        two[i] = 'A'+i%26;
+    }
+    rsfs_create(fs, "file");
+    rsfs_mkdir(fs, "dir");
+    rsfs_create(fs, "dir/kept");
+    int fd = rsfs_open(fs, "file", RSFS_RDWR);
+    rsfs_append(fs, fd, one, sizeof(one));
+    rsfs_close(fs, fd);
+    fd = rsfs_open(fs, "dir/kept", RSFS_RDWR);
+    rsfs_append(fs, fd, two, 40);
+    rsfs_close(fs, fd);
+
+    //taking a snapshot copies nothing
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    long before = stats.used_blocks;
+    int first = rsfs_snapshot_create(fs);
+    rsfs_get_stats(fs, &stats);
+    printf("[test_snapshot] snapshot %d taken, used blocks %ld -> %ld\n", first, before, stats.used_blocks);
+
+    //overwrite the first block of file: only that block is copied; delete dir/kept and create a new file
+    fd = rsfs_open(fs, "file", RSFS_RDWR);
+    rsfs_write(fs, fd, two, BLOCK_SIZE);
+    rsfs_append(fs, fd, two, sizeof(one)-BLOCK_SIZE);
+    rsfs_close(fs, fd);
+    rsfs_delete(fs, "dir/kept");
+    rsfs_create(fs, "new");
+    rsfs_get_stats(fs, &stats);
+    printf("[test_snapshot] after changing the files: used blocks %ld\n", stats.used_blocks);
+
+    int second = rsfs_snapshot_create(fs);
+    fd = rsfs_open(fs, "file", RSFS_RDWR);
+    rsfs_cut(fs, fd, 10);
+    rsfs_close(fs, fd);
+
+    //each snapshot reads the files as they were when it was taken
+    fd = rsfs_snapshot_open_file(fs, first, "file");
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_snapshot] snapshot %d: file has %d bytes, as before the write: %s\n", first, n, n==(int)sizeof(one) && memcmp(buf, one, n)==0 ? "yes" : "no");
+    printf("[test_snapshot] writing to a snapshot file returns %d\n", rsfs_write(fs, fd, two, 1));
+    printf("[test_snapshot] dropping snapshot %d with a file open returns %d\n", first, rsfs_snapshot_drop(fs, first));
+    rsfs_close(fs, fd);
+    fd = rsfs_snapshot_open_file(fs, first, "/dir//kept");
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_snapshot] snapshot %d: deleted dir/kept has %d bytes, intact: %s\n", first, n, n==40 && memcmp(buf, two, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+    printf("[test_snapshot] snapshot %d: opening the file created later returns %d\n", first, rsfs_snapshot_open_file(fs, first, "new"));
+
+    fd = rsfs_snapshot_open_file(fs, second, "file");
+    rsfs_fseek(fs, fd, BLOCK_SIZE);
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_snapshot] snapshot %d: file read from offset %d gives %d bytes, as before the cut: %s\n",
+        second, BLOCK_SIZE, n, n==(int)sizeof(one)-BLOCK_SIZE && memcmp(buf, two, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+    fd = rsfs_open(fs, "file", RSFS_RDONLY);
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_snapshot] live file has %d bytes\n", n);
+    rsfs_close(fs, fd);
+
+    //dropping the snapshots gives their blocks back
+    int dropped = rsfs_snapshot_drop(fs, first) + rsfs_snapshot_drop(fs, second);
+    rsfs_get_stats(fs, &stats);
+    printf("[test_snapshot] snapshots dropped (%d): used blocks %ld, shared references %ld\n", dropped, stats.used_blocks, stats.shared_refs);
+    rsfs_free(fs);
+}
+
+
+//helper for test_defrag: print the fragmentation of fs
+static void print_frag(rsfs_t *fs, const char *when){
+    struct rsfs_frag_report report;
+    rsfs_frag_report(fs, &report);
+    printf("[test_defrag] %s: extents per file", when);
+    for(int i=0; i<NUM_INODES; i++) if(report.file_extents[i]) printf(" %d", report.file_extents[i]);
+    printf(" (max %d), free blocks %ld in %ld runs, largest %ld, slack %ld bytes\n",
+        report.max_extents, report.free_blocks, report.free_runs, report.largest_free_run, report.slack_bytes);
+}
+
+//test: defragmentation moves the blocks of files into contiguous runs, also while they are being read
+void test_defrag(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_defrag] fail to create an instance.\n");
+        return;
+    }
+
+    //interleaved appends scatter the blocks of the files, and deleting one leaves holes
+    char data[4*BLOCK_SIZE], buf[8*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'a'+i%23;
+    char *names[3] = {"first", "second", "third"};
+    int fds[3];
+    for(int f=0; f<3; f++){
+        rsfs_create(fs, names[f]);
+        fds[f] = rsfs_open(fs, names[f], RSFS_RDWR);
+    }
+    for(int b=0; b<3; b++){
+        for(int f=0; f<3; f++) rsfs_append(fs, fds[f], data+b*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    rsfs_append(fs, fds[0], data+3*BLOCK_SIZE, 10);
+    for(int f=0; f<3; f++) rsfs_close(fs, fds[f]);
+    rsfs_delete(fs, "second");
+    print_frag(fs, "before");
+
+    //a file open for reading keeps being read while its full blocks move
+    int fd = rsfs_open(fs, "first", RSFS_RDONLY);
+    int moved = rsfs_defrag(fs, 100);
+    print_frag(fs, "first open");
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_defrag] moved %d blocks; the open file reads %d bytes, intact: %s\n",
+        moved, n, n==3*BLOCK_SIZE+10 && memcmp(buf, data, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+
+    //closed, the whole file moves; the budget caps each call
+    int rounds = 0;
+    moved = 0;
+    for(int m; (m=rsfs_defrag(fs, 2))>0; rounds++) moved += m;
+    print_frag(fs, "closed");
+    printf("[test_defrag] moved %d more blocks in %d calls of at most 2\n", moved, rounds);
+    fd = rsfs_open(fs, "third", RSFS_RDONLY);
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_defrag] third reads %d bytes, intact: %s\n", n, n==3*BLOCK_SIZE && memcmp(buf, data, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+
+    //the background defragmenter has nothing left to do
+    struct rsfs_defragger *defragger = rsfs_defrag_start(fs, 50);
+    usleep(250000);
+    RSFS_defrag_stop(defragger);
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    printf("[test_defrag] background defragmenter stopped; %ld blocks moved in all, used blocks %ld\n", stats.defrag_moves, stats.used_blocks);
+    rsfs_free(fs);
+}
+
+
+//helper for test_log: print the live blocks of each segment and the log counters of fs
+static void print_log(rsfs_t *fs, const char *when){
+    struct rsfs_log_stats stats;
+    rsfs_log_stats(fs, &stats);
+    printf("[test_log] %s: live blocks per segment", when);
+    for(int s=0; s<NUM_SEGMENTS; s++) printf(" %d", stats.segment_live[s]);
+    printf(" (head %d), clean %d, utilization %.2f, log writes %ld, cleaned %ld segments moving %ld blocks\n",
+        stats.head_segment, stats.clean_segments, stats.utilization, stats.log_writes, stats.cleaned_segments, stats.cleaner_moves);
+}
+
+//test: in log-structured mode, writes go to the head of the log and the cleaner keeps segments clean for it
+void test_log(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_log] fail to create an instance.\n");
+        return;
+    }
+    printf("[test_log] log mode was %d\n", rsfs_set_log_mode(fs, 1));
+
+    //cold files are written once; the hot file is overwritten over and over, many times the size of the pool
+    char data[2*BLOCK_SIZE], hot[2*BLOCK_SIZE], buf[8*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'a'+i%23;
+    char *names[3] = {"cold1", "hot", "cold2"};
+    for(int f=0; f<3; f++){
+        rsfs_create(fs, names[f]);
+        int fd = rsfs_open(fs, names[f], RSFS_RDWR);
+        rsfs_append(fs, fd, data, sizeof(data));
+        rsfs_close(fs, fd);
+    }
+    print_log(fs, "written");
+
+    int fd = rsfs_open(fs, "hot", RSFS_RDWR);
+    int failed = 0;
+    for(int round=0; round<4*NUM_DBLOCKS; round++){
+        memset(hot, 'A'+round%26, sizeof(hot));
+        rsfs_fseek(fs, fd, 0);
+        if(rsfs_write(fs, fd, hot, sizeof(hot))!=(int)sizeof(hot)) failed++;
+    }
+    rsfs_close(fs, fd);
+    print_log(fs, "overwritten");
+
+    int intact = 1;
+    for(int f=0; f<3; f++){
+        fd = rsfs_open(fs, names[f], RSFS_RDONLY);
+        int n = rsfs_read(fs, fd, buf, sizeof(buf));
+        intact &= n==(int)sizeof(data) && memcmp(buf, f==1 ? hot : data, n)==0;
+        rsfs_close(fs, fd);
+    }
+    printf("[test_log] %d failed writes; files intact: %s\n", failed, intact ? "yes" : "no");
+
+    //deleting a cold file leaves half-full segments for an explicit clean
+    rsfs_delete(fs, "cold1");
+    print_log(fs, "cold1 deleted");
+    printf("[test_log] cleaned %d segments\n", rsfs_log_clean(fs, NUM_SEGMENTS));
+    print_log(fs, "cleaned");
+    fd = rsfs_open(fs, "cold2", RSFS_RDONLY);
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    printf("[test_log] cold2 reads %d bytes, intact: %s\n", n, n==(int)sizeof(data) && memcmp(buf, data, n)==0 ? "yes" : "no");
+    rsfs_close(fs, fd);
+    rsfs_free(fs);
+}
+
+
+//argument of create_open_worker: an instance, and the descriptor the thread got for the contended name
+struct create_open_arg{
+    rsfs_t *fs;
+    int fd;
+};
+
+//thread body for test_batch: race the other threads to create and open the same file
+void *create_open_worker(void *arg){
+    struct create_open_arg *a = (struct create_open_arg *)arg;
+    a->fd = rsfs_create_open(a->fs, "contended", RSFS_RDWR);
+    if(a->fd>=0){
+        rsfs_append(a->fs, a->fd, "won", 3);
+        rsfs_close(a->fs, a->fd);
+    }
+    return NULL;
+}
+
+//test: atomic create-and-open, and creating, opening and deleting files in batches
+void test_batch(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_batch] fail to create an instance.\n");
+        return;
+    }
+
+    //exactly one of the racing creators gets the file
+    pthread_t threads[4];
+    struct create_open_arg args[4];
+    for(int i=0; i<4; i++){
+        args[i].fs = fs;
+        pthread_create(&threads[i], NULL, create_open_worker, &args[i]);
+    }
+    int winners = 0, existed = 0;
+    for(int i=0; i<4; i++){
+        pthread_join(threads[i], NULL);
+        if(args[i].fd>=0) winners++;
+        else if(args[i].fd==-1) existed++;
+    }
+    char buf[16];
+    int fd = rsfs_open(fs, "contended", RSFS_RDONLY);
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    rsfs_close(fs, fd);
+    printf("[test_batch] racing create_open: %d created, %d found it existing; it reads %d bytes\n", winners, existed, n);
+
+    //a batch with a name that exists, a name twice and a missing parent
+    char *names[6] = {"b1", "b2", "contended", "b3", "b1", "nodir/b4"};
+    int results[6];
+    int created = rsfs_create_many(fs, names, 6, results);
+    printf("[test_batch] create_many created %d:", created);
+    for(int i=0; i<6; i++) printf(" %d", results[i]);
+    struct rsfs_stats stats;
+    rsfs_get_stats(fs, &stats);
+    printf("; files %ld, inodes %ld\n", stats.num_files, stats.used_inodes);
+
+    int fds[4];
+    int opened = rsfs_open_many(fs, names, 4, RSFS_RDONLY, fds);
+    for(int i=0; i<4; i++) if(fds[i]>=0) rsfs_close(fs, fds[i]);
+    printf("[test_batch] open_many opened %d of 4\n", opened);
+
+    char *doomed[5] = {"b1", "b2", "b3", "missing", "contended"};
+    int deleted = rsfs_delete_many(fs, doomed, 5, results);
+    printf("[test_batch] delete_many deleted %d:", deleted);
+    for(int i=0; i<5; i++) printf(" %d", results[i]);
+    rsfs_get_stats(fs, &stats);
+    printf("; files %ld, inodes %ld, blocks %ld\n", stats.num_files, stats.used_inodes, stats.used_blocks);
+    rsfs_free(fs);
+}
+
+
+//helper for test_readdir_plus: print a batch of entries
+static void print_batch(const char *what, struct rsfs_dirent *out, int num){
+    printf("[test_readdir_plus] %s (%d):", what, num);
+    for(int i=0; i<num; i++) printf(" %s%s(inode %d, %d bytes)", out[i].name, out[i].is_dir ? "/" : "", out[i].inode_number, out[i].length);
+    printf("\n");
+}
+
+//test: listing a directory in name order, by prefix and in batches, while entries come and go
+void test_readdir_plus(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_readdir_plus] fail to create an instance.\n");
+        return;
+    }
+
+    //created out of order, each file as long as its number
+    rsfs_mkdir(fs, "logs");
+    rsfs_mkdir(fs, "logs/archive");
+    char *names[5] = {"logs/app_3", "logs/db_1", "logs/app_1", "logs/app_4", "logs/app_2"};
+    for(int i=0; i<5; i++){
+        int fd = rsfs_create_open(fs, names[i], RSFS_RDWR);
+        rsfs_append(fs, fd, "0123456789", names[i][strlen(names[i])-1]-'0');
+        rsfs_close(fs, fd);
+    }
+
+    struct rsfs_readdir_cursor cursor;
+    struct rsfs_dirent out[8];
+    RSFS_readdir_start(&cursor, "logs");
+    print_batch("all", out, rsfs_readdir_plus(fs, &cursor, "", out, 8));
+
+    //batches of two; names before the cursor are not seen, names after it are, and deleted ones are gone
+    RSFS_readdir_start(&cursor, "logs");
+    print_batch("app_ first", out, rsfs_readdir_plus(fs, &cursor, "app_", out, 2));
+    rsfs_create(fs, "logs/app_0");
+    rsfs_delete(fs, "logs/app_3");
+    rsfs_create(fs, "logs/app_5");
+    print_batch("app_ next", out, rsfs_readdir_plus(fs, &cursor, "app_", out, 2));
+    print_batch("app_ last", out, rsfs_readdir_plus(fs, &cursor, "app_", out, 2));
+
+    RSFS_readdir_start(&cursor, "");
+    print_batch("root", out, rsfs_readdir_plus(fs, &cursor, "", out, 8));
+    RSFS_readdir_start(&cursor, "nowhere");
+    printf("[test_readdir_plus] missing directory: %d\n", rsfs_readdir_plus(fs, &cursor, "", out, 8));
+    rsfs_free(fs);
+}
+
+
+//argument of collect_match: the offsets found so far
+struct match_list{
+    int offsets[64];
+    int num;
+};
+
+//callback for test_scan: collect the offset of each match
+int collect_match(int offset, void *arg){
+    struct match_list *list = (struct match_list *)arg;
+    if(list->num<64) list->offsets[list->num++] = offset;
+    return 0;
+}
+
+//test: finding a pattern in the blocks of a file, across block boundaries, with each kernel the CPU has
+void test_scan(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_scan] fail to create an instance.\n");
+        return;
+    }
+
+    //"needle" at the start, across the first block boundary, inside a block and at the very end
+    char data[NUM_POINTER*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'a'+i%7;
+    int planted[4] = {0, BLOCK_SIZE-3, 2*BLOCK_SIZE+10, (int)sizeof(data)-6};
+    for(int i=0; i<4; i++) memcpy(data+planted[i], "needle", 6);
+    int fd = rsfs_create_open(fs, "haystack", RSFS_RDWR);
+    rsfs_append(fs, fd, data, sizeof(data));
+    rsfs_close(fs, fd);
+
+    //two readers scan at once, each under its own shared hold
+    int fds[2] = {rsfs_open(fs, "haystack", RSFS_RDONLY), rsfs_open(fs, "haystack", RSFS_RDONLY)};
+    int agree = 1;
+    for(int kernel=RSFS_KERNEL_SCALAR; kernel<=RSFS_KERNEL_AVX2; kernel++){
+        if(RSFS_scan_use_kernel(kernel)!=0) continue;
+        struct match_list list = {{0}, 0};
+        int calls = rsfs_scan(fs, fds[kernel%2], "needle", 6, 0, collect_match, &list);
+        int same = calls==4;
+        for(int i=0; i<list.num && same; i++) same = list.offsets[i]==planted[i];
+        printf("[test_scan] %s: %d matches, at the planted offsets: %s\n", RSFS_scan_kernel_name(), calls, same ? "yes" : "no");
+        agree &= same;
+    }
+    RSFS_scan_use_kernel(RSFS_KERNEL_AUTO);
+
+    printf("[test_scan] find from 1: %d, from %d: %d, \"needles\": %d, \"a\" from 40: %d\n",
+        rsfs_find(fs, fds[0], "needle", 6, 1), planted[3]+1, rsfs_find(fs, fds[0], "needle", 6, planted[3]+1),
+        rsfs_find(fs, fds[1], "needles", 7, 0), rsfs_find(fs, fds[1], "a", 1, 40));
+    printf("[test_scan] kernels agree: %s\n", agree ? "yes" : "no");
+    for(int i=0; i<2; i++) rsfs_close(fs, fds[i]);
+    rsfs_free(fs);
+}
+
+
+//test: copies between files, block-aligned (shared by reference) and not (copied block to block)
+void test_copy_range(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_copy_range] fail to create an instance.\n");
+        return;
+    }
+
+    char data[4*BLOCK_SIZE], buf[NUM_POINTER*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'a'+i%26;
+    int in = rsfs_create_open(fs, "src", RSFS_RDWR);
+    rsfs_append(fs, in, data, sizeof(data));
+    rsfs_close(fs, in);
+
+    //the whole source at the start of the copy: its blocks are shared, nothing is copied
+    struct rsfs_stats before, after;
+    in = rsfs_open(fs, "src", RSFS_RDONLY);
+    int out = rsfs_create_open(fs, "dst", RSFS_RDWR);
+    rsfs_get_stats(fs, &before);
+    int copied = rsfs_copy_range(fs, in, 0, out, 0, sizeof(data));
+    rsfs_get_stats(fs, &after);
+    printf("[test_copy_range] aligned: %d bytes, %ld blocks used and %ld shared more\n", copied,
+        after.used_blocks-before.used_blocks, after.shared_refs-before.shared_refs);
+
+    //half a block in, past the end of the file: copied block to block, the file grows
+    rsfs_get_stats(fs, &before);
+    copied = rsfs_copy_range(fs, in, 0, out, sizeof(data)-BLOCK_SIZE/2, 2*BLOCK_SIZE);
+    rsfs_get_stats(fs, &after);
+    printf("[test_copy_range] unaligned: %d bytes, %ld blocks used more\n", copied, after.used_blocks-before.used_blocks);
+
+    //writing to the source (RSFS_write drops what follows) leaves the copy alone
+    rsfs_close(fs, out);
+    rsfs_close(fs, in);
+    in = rsfs_open(fs, "src", RSFS_RDWR);
+    rsfs_write(fs, in, "XY", 2);
+    rsfs_close(fs, in);
+    out = rsfs_open(fs, "dst", RSFS_RDONLY);
+    int length = rsfs_read(fs, out, buf, sizeof(buf));
+    int same = length==(int)sizeof(data)+3*BLOCK_SIZE/2 && memcmp(buf, data, sizeof(data)-BLOCK_SIZE/2)==0
+        && memcmp(buf+sizeof(data)-BLOCK_SIZE/2, data, 2*BLOCK_SIZE)==0;
+    printf("[test_copy_range] copy has its %d bytes: %s\n", length, same ? "yes" : "no");
+    rsfs_close(fs, out);
+
+    //within one file: overlapping ranges are refused, disjoint ones are fine; a reader cannot be copied to
+    in = rsfs_open(fs, "src", RSFS_RDONLY);
+    out = rsfs_open(fs, "dst", RSFS_RDWR);
+    int overlap = rsfs_copy_range(fs, out, 0, out, BLOCK_SIZE/2, BLOCK_SIZE);
+    int disjoint = rsfs_copy_range(fs, out, 0, out, 3*BLOCK_SIZE, BLOCK_SIZE);
+    int to_reader = rsfs_copy_range(fs, out, 0, in, 0, 8);
+    int past_source = rsfs_copy_range(fs, in, 2, out, 0, 8);
+    printf("[test_copy_range] overlap: %d, disjoint: %d, to a reader: %d, past the source: %d\n", overlap, disjoint, to_reader, past_source);
+    rsfs_close(fs, out);
+    rsfs_close(fs, in);
+    rsfs_free(fs);
+}
+
+
+//test: import from and export to host file descriptors, through a pipe and a host file
+void test_host_fd(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_host_fd] fail to create an instance.\n");
+        return;
+    }
+
+    char data[NUM_POINTER*BLOCK_SIZE], buf[NUM_POINTER*BLOCK_SIZE];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'A'+i%26;
+    int fd = rsfs_create_open(fs, "imported", RSFS_RDWR);
+
+    //a pipe holding fewer bytes than asked for: the import ends with its data, across block boundaries
+    int pipe_fds[2];
+    pipe(pipe_fds);
+    write(pipe_fds[1], data, 100);
+    close(pipe_fds[1]);
+    int from_pipe = rsfs_import_fd(fs, pipe_fds[0], fd, 4*BLOCK_SIZE);
+    int rest = rsfs_import_fd(fs, pipe_fds[0], fd, 4*BLOCK_SIZE);
+    close(pipe_fds[0]);
+
+    //a host file: more than fits in the file, from the host offset on
+    FILE *host = tmpfile();
+    write(fileno(host), data, sizeof(data));
+    lseek(fileno(host), 100, SEEK_SET);
+    int from_file = rsfs_import_fd(fs, fileno(host), fd, sizeof(data));
+    printf("[test_host_fd] imported %d bytes from the pipe (then %d), %d from the host file\n", from_pipe, rest, from_file);
+    rsfs_close(fs, fd);
+
+    //the whole file back out, after the first 8 bytes
+    fd = rsfs_open(fs, "imported", RSFS_RDONLY);
+    rsfs_fseek(fs, fd, 8);
+    lseek(fileno(host), 0, SEEK_SET);
+    int exported = rsfs_export_fd(fs, fd, fileno(host), sizeof(data));
+    lseek(fileno(host), 0, SEEK_SET);
+    int length = read(fileno(host), buf, sizeof(buf));
+    int same = exported==(int)sizeof(data)-8 && memcmp(buf, data+8, exported)==0 && memcmp(buf+exported, data+sizeof(data)-8, 8)==0;
+    printf("[test_host_fd] exported %d bytes, host file of %d bytes as expected: %s, at the end: %d\n", exported, length,
+        same ? "yes" : "no", rsfs_export_fd(fs, fd, fileno(host), 8));
+    fclose(host);
+
+    //a reader cannot import, and a bad host descriptor fails
+    rsfs_fseek(fs, fd, 0);
+    int to_reader = rsfs_import_fd(fs, 0, fd, 8);
+    int bad_host = rsfs_export_fd(fs, fd, -1, 8);
+    printf("[test_host_fd] import to a reader: %d, export to a bad host fd: %d\n", to_reader, bad_host);
+    rsfs_close(fs, fd);
+    rsfs_free(fs);
+}
+
+
+//test: size classes keep a growing file in a few runs while small files are written in between
+void test_block_classes(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_block_classes] fail to create an instance.\n");
+        return;
+    }
+
+    char data[NUM_POINTER*BLOCK_SIZE], buf[NUM_POINTER*BLOCK_SIZE], name[16];
+    for(int i=0; i<(int)sizeof(data); i++) data[i] = 'a'+i%17;
+    int big = rsfs_create_open(fs, "big", RSFS_RDWR);
+    for(int b=0; b<NUM_POINTER; b++){
+        if(b<NUM_INODES-1){ //as many small files as there are inodes left
+            sprintf(name, "small%d", b);
+            int fd = rsfs_create_open(fs, name, RSFS_RDWR);
+            rsfs_append(fs, fd, data, BLOCK_SIZE/2);
+            rsfs_close(fs, fd);
+        }
+        rsfs_append(fs, big, data+b*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    rsfs_close(fs, big);
+
+    struct rsfs_frag_report report;
+    rsfs_frag_report(fs, &report);
+    printf("[test_block_classes] extents per file");
+    for(int i=0; i<NUM_INODES; i++) if(report.file_extents[i]) printf(" %d", report.file_extents[i]);
+    printf(", free slots per class");
+    for(int c=0; c<NUM_BLOCK_CLASSES; c++) printf(" %ld", report.free_slots[c]);
+    printf("\n");
+
+    //the runs are read in one go each, and a write across them reads back
+    big = rsfs_open(fs, "big", RSFS_RDWR);
+    rsfs_fseek(fs, big, BLOCK_SIZE+5);
+    rsfs_write(fs, big, data, 3*BLOCK_SIZE);
+    rsfs_close(fs, big);
+    big = rsfs_open(fs, "big", RSFS_RDONLY);
+    int n = rsfs_read(fs, big, buf, sizeof(buf));
+    printf("[test_block_classes] big file reads %d bytes, intact: %s\n", n,
+        n==4*BLOCK_SIZE+5 && memcmp(buf, data, BLOCK_SIZE+5)==0 && memcmp(buf+BLOCK_SIZE+5, data, 3*BLOCK_SIZE)==0 ? "yes" : "no");
+    rsfs_close(fs, big);
+    rsfs_free(fs);
+}
+
+
+//argument of dry_appender: an instance, the byte appended and the number of bytes the appends took
+struct dry_arg{
+    rsfs_t *fs;
+    char content;
+    int appended;
+};
+
+//thread body for test_append_pool_dry: append runs of its byte to a shared file until the pool runs dry
+void *dry_appender(void *arg){
+    struct dry_arg *a = (struct dry_arg *)arg;
+    char run[10];
+    memset(run, a->content, sizeof(run));
+
+    int fd = rsfs_open(a->fs, "log", RSFS_RDAPPEND);
+    for(int i=0; i<4; i++) a->appended += rsfs_append(a->fs, fd, run, sizeof(run));
+    rsfs_close(a->fs, fd);
+    return NULL;
+}
+
+//test: concurrent RSFS_RDAPPEND appenders running the pool dry publish only what they wrote,
+//and a cut and a write over the file afterwards stay within its blocks
+void test_append_pool_dry(){
+
+    rsfs_t *fs = rsfs_new();
+    if(fs==NULL){
+        printf("[test_append_pool_dry] fail to create an instance.\n");
+        return;
+    }
+
+    //fill the pool with distinct blocks, then give two of them back
+    char block[BLOCK_SIZE], name[16];
+    rsfs_create(fs, "log");
+    int spare = rsfs_create_open(fs, "spare", RSFS_RDWR);
+    for(int k=0; k<2; k++){
+        memset(block, 's', BLOCK_SIZE);
+        block[0] = '0'+k;
+        rsfs_append(fs, spare, block, BLOCK_SIZE);
+    }
+    rsfs_close(fs, spare);
+    int k = 0, full = 0;
+    for(int f=0; f<NUM_INODES-2 && !full; f++){
+        sprintf(name, "fill%d", f);
+        int fd = rsfs_create_open(fs, name, RSFS_RDWR);
+        for(int b=0; b<NUM_POINTER && !full; b++, k++){
+            memset(block, 'f', BLOCK_SIZE);
+            sprintf(block, "%d", k);
+            full = rsfs_append(fs, fd, block, BLOCK_SIZE) < BLOCK_SIZE;
+        }
+        rsfs_close(fs, fd);
+    }
+    rsfs_delete(fs, "spare");
+
+    //four appenders ask for 160 bytes between them; the pool has room for 2 blocks
+    pthread_t threads[4];
+    struct dry_arg args[4];
+    for(int t=0; t<4; t++){
+        args[t] = (struct dry_arg){fs, 'a'+t, 0};
+        pthread_create(&threads[t], NULL, dry_appender, &args[t]);
+    }
+    int appended = 0;
+    for(int t=0; t<4; t++){
+        pthread_join(threads[t], NULL);
+        appended += args[t].appended;
+    }
+
+    char buf[NUM_POINTER*BLOCK_SIZE];
+    int fd = rsfs_open(fs, "log", RSFS_RDONLY);
+    int n = rsfs_read(fs, fd, buf, sizeof(buf));
+    rsfs_close(fs, fd);
+    int whole = n==appended;
+    for(int i=0; i<n; i++) whole = whole && buf[i]>='a' && buf[i]<'a'+4;
+    printf("[test_append_pool_dry] appended %d bytes, file reads %d bytes, every byte written: %s\n",
+        appended, n, whole ? "yes" : "no");
+
+    //cut out of the middle, then overwrite past the cut
+    fd = rsfs_open(fs, "log", RSFS_RDWR);
+    rsfs_fseek(fs, fd, 5);
+    int cut = rsfs_cut(fs, fd, 10);
+    rsfs_fseek(fs, fd, 20);
+    int written = rsfs_write(fs, fd, "overwritten", 11);
+    rsfs_close(fs, fd);
+    fd = rsfs_open(fs, "log", RSFS_RDONLY);
+    n = rsfs_read(fs, fd, buf, sizeof(buf));
+    rsfs_close(fs, fd);
+    printf("[test_append_pool_dry] cut %d bytes, wrote %d bytes, file reads %d bytes ending with %.11s\n",
+        cut, written, n, n>=11 ? buf+n-11 : "");
+    rsfs_free(fs);
+}
+
 
 //test: reader-writer problem
 void main(){
@@ -300,6 +1735,70 @@ void main(){
     printf("\n\n--------Test for Concurrent Readers/Writers-----------\n\n");
     test_concurrency();
 
-    
+    printf("\n\n--------------Test for the Asynchronous Ring-----------------\n\n");
+    test_ring();
+
+    printf("\n\n--------------Test for the Open File Table-----------------\n\n");
+    test_open_file_table();
+
+    printf("\n\n----------------Test for Directories-------------------\n\n");
+    test_directories();
+
+    printf("\n\n------------------Test for Statistics---------------------\n\n");
+    test_stats();
+
+    printf("\n\n-------------------Test for Profiling---------------------\n\n");
+    test_profile();
+
+    printf("\n\n---------------------Test for Tracing---------------------\n\n");
+    test_trace();
+
+    printf("\n\n--------------------Test for Recording--------------------\n\n");
+    test_record();
+
+    printf("\n\n--------------------Test for Instances--------------------\n\n");
+    test_instances();
+
+    printf("\n\n------------------Test for Shared Memory------------------\n\n");
+    test_shm();
+
+    printf("\n\n---------------------Test for the Server---------------------\n\n");
+    test_server();
+
+    printf("\n\n-------------------Test for Deduplication-------------------\n\n");
+    test_dedup();
+
+    printf("\n\n-------------------Test for Compression--------------------\n\n");
+    test_compression();
+
+    printf("\n\n---------------------Test for Snapshots---------------------\n\n");
+    test_snapshot();
+
+    printf("\n\n-------------------Test for Defragmentation-------------------\n\n");
+    test_defrag();
+
+    printf("\n\n------------------Test for the Log-Structured Mode------------------\n\n");
+    test_log();
+
+    printf("\n\n----------------Test for Batched Metadata Calls----------------\n\n");
+    test_batch();
+
+    printf("\n\n-------------------Test for Sorted Listing--------------------\n\n");
+    test_readdir_plus();
+
+    printf("\n\n--------------------Test for Content Scans---------------------\n\n");
+    test_scan();
+
+    printf("\n\n---------------------Test for Range Copies----------------------\n\n");
+    test_copy_range();
+
+    printf("\n\n------------------Test for Host File Descriptors------------------\n\n");
+    test_host_fd();
+
+    printf("\n\n--------------------Test for Block Size Classes--------------------\n\n");
+    test_block_classes();
+
+    printf("\n\n---------------Test for Appends Running the Pool Dry---------------\n\n");
+    test_append_pool_dry();
 
 }
@@ -0,0 +1,514 @@
+/*
+    benchmarks of the API
+
+    usage: bench [-w workload] [-t max_threads] [-n ops] [-j]
+        -w  run only the workloads whose name starts with workload (default: all)
+        -t  sweep the thread count up to max_threads (default: the number of cores, at most BENCH_MAX_THREADS)
+        -n  operations per thread (default: BENCH_OPS)
+        -j  print JSON instead of CSV
+*/
+
+#include "def.h"
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OPS 20000 //default number of operations per thread
+#define BENCH_RECORD 8 //size of one appended record (unit: byte)
+#define BENCH_MAX_THREADS 8 //largest number of threads (every thread may need its own inode)
+#define BENCH_LOOKUP_FACTOR 10 //lookups are cheap: run this many times more of them
+
+//state of one benchmark thread
+struct bench_thread{
+    int id;
+    int num_threads;
+    long ops; //operations completed
+    unsigned int *latency; //latency of each operation (unit: ns)
+    long max_ops; //room in latency
+    unsigned int seed; //for rand_r()
+    pthread_barrier_t *barrier; //shared by the threads of one run
+};
+
+//parameters of the running workload
+struct bench_params{
+    int size; //bytes per read/write/cut
+    int read_percent; //share of reads in the mixed workload
+    int access_flag; //mode of the append workload
+    int copy_offset; //where the copy workloads copy to in the destination file
+    int file_len; //length of the per-thread files
+};
+
+static struct bench_params params;
+static long ops_per_thread = BENCH_OPS;
+static int json; //1: JSON output, 0: CSV output
+static int first_result = 1;
+
+//current time in ns
+static inline unsigned long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+//record one operation of thread t that started at start
+static inline void bench_done(struct bench_thread *t, unsigned long start){
+    if(t->ops<t->max_ops) t->latency[t->ops] = (unsigned int)(now_ns()-start);
+    t->ops++;
+}
+
+//length of the files each of num_threads threads may own: the data blocks are shared by all of them
+static int bench_file_len(int num_threads){
+    int blocks = NUM_DBLOCKS/num_threads;
+    if(blocks>NUM_POINTER) blocks = NUM_POINTER;
+    return blocks*BLOCK_SIZE;
+}
+
+//create file name and fill it with len bytes
+static void bench_fill(char *name, int len){
+    char buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'f', sizeof(buf));
+    RSFS_create(name);
+    int fd = RSFS_open(name, RSFS_RDWR);
+    RSFS_append(fd, buf, len);
+    RSFS_close(fd);
+}
+
+static int compare_latency(const void *a, const void *b){
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x<y ? -1 : x>y;
+}
+
+
+//workload: threads appending fixed-size records to one shared file, refilled in rounds
+static void append_worker(struct bench_thread *t){
+    char record[BENCH_RECORD];
+    memset(record, 'r', BENCH_RECORD);
+    long rounds = ops_per_thread/(NUM_POINTER*BLOCK_SIZE/BENCH_RECORD);
+    if(rounds<1) rounds = 1;
+
+    for(long round=0; round<rounds; round++){
+        if(t->id==0) RSFS_create("log");
+        pthread_barrier_wait(t->barrier);
+
+        if(params.access_flag==RSFS_RDAPPEND){
+            int fd = RSFS_open("log", RSFS_RDAPPEND);
+            while(1){
+                unsigned long start = now_ns();
+                if(RSFS_append(fd, record, BENCH_RECORD)!=BENCH_RECORD) break;
+                bench_done(t, start);
+            }
+            RSFS_close(fd);
+        }else{
+            while(1){
+                unsigned long start = now_ns();
+                int fd = RSFS_open("log", RSFS_RDWR);
+                int ret = RSFS_append(fd, record, BENCH_RECORD);
+                RSFS_close(fd);
+                if(ret!=BENCH_RECORD) break;
+                bench_done(t, start);
+            }
+        }
+
+        pthread_barrier_wait(t->barrier);
+        if(t->id==0) RSFS_delete("log");
+        pthread_barrier_wait(t->barrier);
+    }
+}
+
+//workload: every thread creates and deletes its own file
+static void create_delete_worker(struct bench_thread *t){
+    char name[16];
+    sprintf(name, "cd%d", t->id);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i+=2){
+        unsigned long start = now_ns();
+        RSFS_create(name);
+        bench_done(t, start);
+        start = now_ns();
+        RSFS_delete(name);
+        bench_done(t, start);
+    }
+}
+
+//workload: every thread opens and closes its own file read-only, holding a few descriptors at a time
+static void open_close_worker(struct bench_thread *t){
+    char name[16];
+    sprintf(name, "oc%d", t->id);
+    RSFS_create(name);
+    int fd[4];
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i+=8){
+        for(int j=0; j<4; j++){
+            unsigned long start = now_ns();
+            fd[j] = RSFS_open(name, RSFS_RDONLY);
+            bench_done(t, start);
+        }
+        for(int j=0; j<4; j++){
+            unsigned long start = now_ns();
+            RSFS_close(fd[j]);
+            bench_done(t, start);
+        }
+    }
+
+    pthread_barrier_wait(t->barrier);
+    RSFS_delete(name);
+}
+
+//workload: threads resolving paths (and one missing path); lookups take no lock
+static void lookup_worker(struct bench_thread *t){
+    char *paths[4] = {"lookup/a", "lookup/b", "lookup/c", "lookup/missing"};
+    if(t->id==0){
+        RSFS_mkdir("lookup");
+        RSFS_create("lookup/a");
+        RSFS_create("lookup/b");
+        RSFS_create("lookup/c");
+    }
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread*BENCH_LOOKUP_FACTOR; i++){
+        unsigned long start = now_ns();
+        search_dir(&rsfs_default, paths[i&3]);
+        bench_done(t, start);
+    }
+
+    pthread_barrier_wait(t->barrier);
+    if(t->id==0){
+        RSFS_delete("lookup/a");
+        RSFS_delete("lookup/b");
+        RSFS_delete("lookup/c");
+        RSFS_rmdir("lookup");
+    }
+}
+
+//workload: every thread reads its own file front to back, size bytes at a time, starting over at the end
+static void seq_read_worker(struct bench_thread *t){
+    char name[16], buf[NUM_POINTER*BLOCK_SIZE];
+    sprintf(name, "sr%d", t->id);
+    bench_fill(name, params.file_len);
+    int fd = RSFS_open(name, RSFS_RDONLY);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        unsigned long start = now_ns();
+        if(RSFS_read(fd, buf, params.size)<params.size) RSFS_fseek(fd, 0);
+        bench_done(t, start);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete(name);
+}
+
+//workload: every thread writes its own file front to back, starting over at the maximum length
+static void seq_write_worker(struct bench_thread *t){
+    char name[16], buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'w', sizeof(buf));
+    sprintf(name, "sw%d", t->id);
+    RSFS_create(name);
+    int fd = RSFS_open(name, RSFS_RDWR);
+    int position = 0;
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        unsigned long start = now_ns();
+        if(position+params.size>params.file_len){
+            RSFS_fseek(fd, 0);
+            position = 0;
+        }
+        position += RSFS_write(fd, buf, params.size);
+        bench_done(t, start);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete(name);
+}
+
+//workload: every thread reads size bytes at random offsets of its own file
+static void rand_read_worker(struct bench_thread *t){
+    char name[16], buf[NUM_POINTER*BLOCK_SIZE];
+    sprintf(name, "rr%d", t->id);
+    bench_fill(name, params.file_len);
+    int fd = RSFS_open(name, RSFS_RDONLY);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        int offset = rand_r(&t->seed) % (params.file_len-params.size+1);
+        unsigned long start = now_ns();
+        RSFS_fseek(fd, offset);
+        RSFS_read(fd, buf, params.size);
+        bench_done(t, start);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete(name);
+}
+
+//workload: every thread writes size bytes at random offsets of its own file
+//(RSFS_write drops what follows the written bytes, so the file ends right after them)
+static void rand_write_worker(struct bench_thread *t){
+    char name[16], buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'w', sizeof(buf));
+    sprintf(name, "rw%d", t->id);
+    bench_fill(name, params.file_len);
+    int length = params.file_len;
+    int fd = RSFS_open(name, RSFS_RDWR);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        int limit = length < params.file_len-params.size ? length : params.file_len-params.size;
+        int offset = rand_r(&t->seed) % (limit+1);
+        unsigned long start = now_ns();
+        RSFS_fseek(fd, offset);
+        length = offset + RSFS_write(fd, buf, params.size);
+        bench_done(t, start);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete(name);
+}
+
+//workload: all threads share one file; each operation opens it, reads or rewrites size bytes, and closes it
+static void mixed_worker(struct bench_thread *t){
+    char buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'm', sizeof(buf));
+    if(t->id==0) bench_fill("shared", params.size);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        int read = rand_r(&t->seed)%100 < params.read_percent;
+        unsigned long start = now_ns();
+        int fd = RSFS_open("shared", read ? RSFS_RDONLY : RSFS_RDWR);
+        if(read) RSFS_read(fd, buf, params.size);
+        else RSFS_write(fd, buf, params.size);
+        RSFS_close(fd);
+        bench_done(t, start);
+    }
+
+    pthread_barrier_wait(t->barrier);
+    if(t->id==0) RSFS_delete("shared");
+}
+
+//workload: every thread edits its own file: cut size bytes at a random offset, then append size bytes
+static void cut_worker(struct bench_thread *t){
+    char name[16], buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'c', sizeof(buf));
+    sprintf(name, "ct%d", t->id);
+    bench_fill(name, params.file_len);
+    int fd = RSFS_open(name, RSFS_RDWR);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        int offset = rand_r(&t->seed) % (params.file_len-params.size+1);
+        unsigned long start = now_ns();
+        RSFS_fseek(fd, offset);
+        RSFS_cut(fd, params.size);
+        RSFS_append(fd, buf, params.size);
+        bench_done(t, start);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete(name);
+}
+
+
+//helper for the copy workloads: every thread copies its own file into another one at copy_offset, over and over,
+//through RSFS_copy_range or through a buffer with RSFS_read and RSFS_write
+static void copy_worker(struct bench_thread *t, int copy_range){
+    char src[16], dst[16], buf[NUM_POINTER*BLOCK_SIZE];
+    memset(buf, 'c', sizeof(buf));
+    sprintf(src, "cps%d", t->id);
+    sprintf(dst, "cpd%d", t->id);
+    int len = params.file_len/2-BLOCK_SIZE; //the copy and the source fit in the share of the blocks of a thread
+    bench_fill(src, len);
+    RSFS_create(dst);
+    int in = RSFS_open(src, RSFS_RDONLY);
+    int out = RSFS_open(dst, RSFS_RDWR);
+    if(params.copy_offset>0) RSFS_append(out, buf, params.copy_offset);
+    pthread_barrier_wait(t->barrier);
+
+    for(long i=0; i<ops_per_thread; i++){
+        unsigned long start = now_ns();
+        if(copy_range){
+            RSFS_copy_range(in, 0, out, params.copy_offset, len);
+        }else{
+            RSFS_fseek(in, 0);
+            RSFS_read(in, buf, len);
+            RSFS_fseek(out, params.copy_offset);
+            RSFS_write(out, buf, len);
+        }
+        bench_done(t, start);
+    }
+
+    RSFS_close(out);
+    RSFS_close(in);
+    RSFS_delete(dst);
+    RSFS_delete(src);
+}
+
+static void copy_read_write_worker(struct bench_thread *t){ copy_worker(t, 0); }
+static void copy_range_worker(struct bench_thread *t){ copy_worker(t, 1); }
+
+
+//helper: thread body; runs the workload function
+struct bench_start{
+    struct bench_thread *thread;
+    void (*worker)(struct bench_thread *);
+};
+
+static void *bench_thread_main(void *ptr){
+    struct bench_start *start = (struct bench_start *)ptr;
+    start->worker(start->thread);
+    return NULL;
+}
+
+//run worker on num_threads threads and print one result line
+static void bench_run(char *name, char *mode, int num_threads, void (*worker)(struct bench_thread *)){
+
+    pthread_t threads[BENCH_MAX_THREADS];
+    struct bench_thread t[BENCH_MAX_THREADS];
+    struct bench_start starts[BENCH_MAX_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, num_threads);
+
+    params.file_len = bench_file_len(num_threads);
+    long max_ops = ops_per_thread*BENCH_LOOKUP_FACTOR;
+
+    for(int i=0; i<num_threads; i++){
+        t[i].id = i;
+        t[i].num_threads = num_threads;
+        t[i].ops = 0;
+        t[i].max_ops = max_ops;
+        t[i].latency = (unsigned int *)malloc(sizeof(unsigned int)*max_ops);
+        t[i].seed = 12345+i;
+        t[i].barrier = &barrier;
+        if(t[i].latency==NULL){
+            printf("[bench] fail to allocate the latency samples.\n");
+            exit(1);
+        }
+    }
+
+    //the clock starts once every thread has been created; workers line up on the barrier
+    unsigned long start = now_ns();
+    for(int i=0; i<num_threads; i++){
+        starts[i].thread = &t[i];
+        starts[i].worker = worker;
+        pthread_create(&threads[i], NULL, bench_thread_main, &starts[i]);
+    }
+    for(int i=0; i<num_threads; i++) pthread_join(threads[i], NULL);
+    double seconds = (now_ns()-start)/1e9;
+    pthread_barrier_destroy(&barrier);
+
+    //merge the samples of all threads
+    long ops = 0, samples = 0;
+    for(int i=0; i<num_threads; i++){
+        ops += t[i].ops;
+        samples += t[i].ops<t[i].max_ops ? t[i].ops : t[i].max_ops;
+    }
+    unsigned int *latency = (unsigned int *)malloc(sizeof(unsigned int)*(samples+1));
+    long n = 0;
+    for(int i=0; i<num_threads; i++){
+        long k = t[i].ops<t[i].max_ops ? t[i].ops : t[i].max_ops;
+        memcpy(latency+n, t[i].latency, sizeof(unsigned int)*k);
+        n += k;
+        free(t[i].latency);
+    }
+    qsort(latency, n, sizeof(unsigned int), compare_latency);
+    unsigned int p50 = n ? latency[(long)(n*0.5)] : 0;
+    unsigned int p99 = n ? latency[(long)(n*0.99)] : 0;
+    unsigned int p999 = n ? latency[(long)(n*0.999)] : 0;
+    free(latency);
+
+    if(json){
+        printf("%s  {\"benchmark\": \"%s\", \"mode\": \"%s\", \"threads\": %d, \"ops\": %ld, \"seconds\": %.6f, \"ops_per_second\": %.0f, \"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u}",
+            first_result ? "" : ",\n", name, mode, num_threads, ops, seconds, ops/seconds, p50, p99, p999);
+    }else{
+        printf("%s,%s,%d,%ld,%.6f,%.0f,%u,%u,%u\n", name, mode, num_threads, ops, seconds, ops/seconds, p50, p99, p999);
+    }
+    first_result = 0;
+    fflush(stdout);
+}
+
+
+//workloads with their modes
+struct bench_workload{
+    char *name;
+    char *mode;
+    void (*worker)(struct bench_thread *);
+    struct bench_params params;
+};
+
+static struct bench_workload workloads[] = {
+    {"append", "rdwr", append_worker, {.access_flag = RSFS_RDWR}},
+    {"append", "rdappend", append_worker, {.access_flag = RSFS_RDAPPEND}},
+    {"create_delete", "churn", create_delete_worker, {0}},
+    {"open_close", "rdonly", open_close_worker, {0}},
+    {"lookup", "path", lookup_worker, {0}},
+    {"seq_read", "8B", seq_read_worker, {.size = 8}},
+    {"seq_read", "32B", seq_read_worker, {.size = 32}},
+    {"seq_read", "128B", seq_read_worker, {.size = 128}},
+    {"seq_write", "8B", seq_write_worker, {.size = 8}},
+    {"seq_write", "32B", seq_write_worker, {.size = 32}},
+    {"seq_write", "128B", seq_write_worker, {.size = 128}},
+    {"rand_read", "8B", rand_read_worker, {.size = 8}},
+    {"rand_read", "32B", rand_read_worker, {.size = 32}},
+    {"rand_write", "8B", rand_write_worker, {.size = 8}},
+    {"rand_write", "32B", rand_write_worker, {.size = 32}},
+    {"mixed", "read90_32B", mixed_worker, {.size = 32, .read_percent = 90}},
+    {"mixed", "read50_32B", mixed_worker, {.size = 32, .read_percent = 50}},
+    {"cut", "8B", cut_worker, {.size = 8}},
+    {"cut", "32B", cut_worker, {.size = 32}},
+    {"copy", "read_write", copy_read_write_worker, {0}},
+    {"copy", "copy_range", copy_range_worker, {0}},
+    {"copy", "read_write_unaligned", copy_read_write_worker, {.copy_offset = 1}},
+    {"copy", "copy_range_unaligned", copy_range_worker, {.copy_offset = 1}},
+};
+
+
+int main(int argc, char **argv){
+
+    char *filter = "";
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores<1 ? 1 : cores>BENCH_MAX_THREADS ? BENCH_MAX_THREADS : (int)cores;
+
+    int opt;
+    while((opt=getopt(argc, argv, "w:t:n:j"))!=-1){
+        switch(opt){
+            case 'w': filter = optarg; break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'n': ops_per_thread = atol(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                printf("usage: %s [-w workload] [-t max_threads] [-n ops] [-j]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(max_threads<1 || max_threads>BENCH_MAX_THREADS || ops_per_thread<8){
+        printf("[bench] max_threads must be within 1...%d and ops at least 8.\n", BENCH_MAX_THREADS);
+        return 1;
+    }
+
+    if(RSFS_init()!=0){
+        printf("[bench] fail to initialize the system.\n");
+        return 1;
+    }
+
+    if(json) printf("[\n");
+    else printf("benchmark,mode,threads,ops,seconds,ops_per_second,p50_ns,p99_ns,p999_ns\n");
+
+    for(int w=0; w<(int)(sizeof(workloads)/sizeof(workloads[0])); w++){
+        if(strncmp(workloads[w].name, filter, strlen(filter))!=0) continue;
+        params = workloads[w].params;
+
+        //1, 2, 4, ... threads, and max_threads itself
+        for(int n=1; ; n*=2){
+            if(n>max_threads) n = max_threads;
+            if(params.size > bench_file_len(n)) break;
+            bench_run(workloads[w].name, workloads[w].mode, n, workloads[w].worker);
+            if(n==max_threads) break;
+        }
+    }
+
+    if(json) printf("\n]\n");
+
+    return 0;
+}
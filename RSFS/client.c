@@ -0,0 +1,150 @@
+/*
+    client of the local server (see server.c): requests go over the socket,
+    the data of reads and writes through a buffer shared with the server
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int client_count; //makes the names of the buffers of this process unique
+
+
+//helper: send all of data on sock
+static int send_all(int sock, void *data, size_t len){
+    while(len>0){
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if(n<0){
+            if(errno==EINTR) continue;
+            return -1;
+        }
+        data = (char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+//helper: send the RSFSD_HELLO request with the descriptor of the buffer attached
+static int send_hello(struct rsfsd_client *client, int buffer_fd){
+    struct rsfsd_request request = {client->next_id++, RSFSD_HELLO, 0, -1, (int)client->buffer_size, 0};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &buffer_fd, sizeof(int));
+
+    return sendmsg(client->sock, &msg, MSG_NOSIGNAL)==sizeof(request) ? 0 : -1;
+}
+
+
+//connect to the server at socket_path and share a buffer of buffer_size bytes (0 for RSFSD_BUFFER_SIZE) with it:
+//return the client, or NULL on error
+struct rsfsd_client *rsfsd_connect(const char *socket_path, size_t buffer_size){
+    if(buffer_size==0) buffer_size = RSFSD_BUFFER_SIZE;
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)){
+        printf("[rsfsd_connect] socket path %s is too long.\n", socket_path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct rsfsd_client *client = (struct rsfsd_client *)calloc(1, sizeof(struct rsfsd_client));
+    if(client==NULL){
+        printf("[rsfsd_connect] fail to allocate the client.\n");
+        return NULL;
+    }
+    client->buffer_size = buffer_size;
+    client->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(client->sock<0 || connect(client->sock, (struct sockaddr *)&addr, sizeof(addr))!=0){
+        printf("[rsfsd_connect] fail to connect to %s.\n", socket_path);
+        if(client->sock>=0) close(client->sock);
+        free(client);
+        return NULL;
+    }
+
+    //the buffer is a shared-memory object whose name is removed at once: only the descriptor is passed on
+    char name[64];
+    sprintf(name, "/rsfsd_client_%d_%d", (int)getpid(), __atomic_fetch_add(&client_count, 1, __ATOMIC_RELAXED));
+    int buffer_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(buffer_fd>=0) shm_unlink(name);
+    if(buffer_fd>=0 && ftruncate(buffer_fd, buffer_size)==0){
+        client->buffer = (char *)mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer_fd, 0);
+    }
+    if(client->buffer==NULL || client->buffer==MAP_FAILED){
+        printf("[rsfsd_connect] fail to create the shared buffer.\n");
+        if(buffer_fd>=0) close(buffer_fd);
+        close(client->sock);
+        free(client);
+        return NULL;
+    }
+
+    struct rsfsd_response response;
+    int ret = send_hello(client, buffer_fd);
+    close(buffer_fd);
+    if(ret!=0 || rsfsd_recv(client, &response)!=0 || response.result!=0){
+        printf("[rsfsd_connect] the server refused the shared buffer.\n");
+        rsfsd_disconnect(client);
+        return NULL;
+    }
+    return client;
+}
+
+//send a request (see enum rsfsd_op for the use of fd, arg and offset) without waiting for its response:
+//return its id, or -1 on error
+int rsfsd_send(struct rsfsd_client *client, int op, char *path, int fd, int arg, unsigned int offset){
+    int path_len = path ? strlen(path) : 0;
+    if(path_len>RSFSD_MAX_PATH){
+        printf("[rsfsd_send] path is longer than %d bytes.\n", RSFSD_MAX_PATH);
+        return -1;
+    }
+
+    char message[sizeof(struct rsfsd_request)+RSFSD_MAX_PATH];
+    struct rsfsd_request request = {client->next_id, op, path_len, fd, arg, offset};
+    memcpy(message, &request, sizeof(request));
+    if(path_len) memcpy(message+sizeof(request), path, path_len);
+    if(send_all(client->sock, message, sizeof(request)+path_len)!=0){
+        printf("[rsfsd_send] the server is gone.\n");
+        return -1;
+    }
+    return (int)(client->next_id++ & 0x7fffffff);
+}
+
+//wait for the response to the oldest request still unanswered: return 0, or -1 if the server is gone
+int rsfsd_recv(struct rsfsd_client *client, struct rsfsd_response *response){
+    size_t got = 0;
+    while(got<sizeof(*response)){
+        ssize_t n = recv(client->sock, (char *)response+got, sizeof(*response)-got, 0);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+//send a request and wait for its response: return the result of the call, or -1 on error
+int rsfsd_call(struct rsfsd_client *client, int op, char *path, int fd, int arg, unsigned int offset){
+    struct rsfsd_response response;
+    if(rsfsd_send(client, op, path, fd, arg, offset)<0 || rsfsd_recv(client, &response)!=0) return -1;
+    return response.result;
+}
+
+//close the connection and the shared buffer; the server closes the files the client left open
+void rsfsd_disconnect(struct rsfsd_client *client){
+    close(client->sock);
+    munmap(client->buffer, client->buffer_size);
+    free(client);
+}
@@ -0,0 +1,285 @@
+/*
+    transparent compression of whole files (the extent of a file is its NUM_POINTER blocks):
+    a compressed file keeps its logical length, and its first blocks hold the compressed bytes.
+    The codec is an LZ4-style byte-oriented LZ77 (no entropy coding), chosen for speed.
+    A file only changes form while it is held exclusively: it is decompressed when it is opened
+    for writing or appending and compressed when its writer closes it or when it goes cold (see rsfs_compress_cold())
+*/
+
+#include "def.h"
+#include <unistd.h>
+
+#define LZ_MIN_MATCH 4 //shortest match encoded
+#define LZ_LAST_LITERALS 5 //the last bytes are always literals, as in LZ4
+#define LZ_HASH_BITS 10
+
+
+//helper: hash of the 4 bytes at p, for the match finder
+static inline int lz_hash(const unsigned char *p){
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return (v*2654435761U) >> (32-LZ_HASH_BITS);
+}
+
+//helper: write a length continuation (bytes of 255, then the rest); return the new end or NULL if past limit
+static unsigned char *lz_put_length(unsigned char *out, unsigned char *limit, int len){
+    while(len>=255){
+        if(out>=limit) return NULL;
+        *out++ = 255;
+        len -= 255;
+    }
+    if(out>=limit) return NULL;
+    *out++ = len;
+    return out;
+}
+
+//compress len bytes of src into at most max bytes of dst (LZ4 block format):
+//return the compressed length, or -1 if it does not fit in max
+int lz_compress(const char *src, int len, char *dst, int max){
+    const unsigned char *in = (const unsigned char *)src, *end = in+len, *anchor = in;
+    unsigned char *out = (unsigned char *)dst, *limit = out+max;
+    unsigned short table[1<<LZ_HASH_BITS]; //position+1 of the last occurrence of each hash (0: none)
+    memset(table, 0, sizeof(table));
+
+    const unsigned char *p = in;
+    const unsigned char *match_limit = len>LZ_LAST_LITERALS+LZ_MIN_MATCH ? end-LZ_LAST_LITERALS-LZ_MIN_MATCH : in;
+    while(p<match_limit){
+        int h = lz_hash(p);
+        const unsigned char *candidate = table[h] ? in+table[h]-1 : NULL;
+        table[h] = p-in+1;
+        if(candidate==NULL || p-candidate>0xffff || memcmp(candidate, p, LZ_MIN_MATCH)!=0){
+            p++;
+            continue;
+        }
+
+        //extend the match, keeping the last literals out of it
+        int match_len = LZ_MIN_MATCH;
+        while(p+match_len<end-LZ_LAST_LITERALS && candidate[match_len]==p[match_len]) match_len++;
+
+        //sequence: token, literal length, literals, offset, match length
+        int literals = p-anchor;
+        if(out>=limit) return -1;
+        unsigned char *token = out++;
+        *token = (literals<15 ? literals : 15)<<4;
+        if(literals>=15 && (out=lz_put_length(out, limit, literals-15))==NULL) return -1;
+        if(out+literals+2>limit) return -1;
+        memcpy(out, anchor, literals);
+        out += literals;
+        int offset = p-candidate;
+        *out++ = offset & 0xff;
+        *out++ = offset>>8;
+        int extra = match_len-LZ_MIN_MATCH;
+        *token |= extra<15 ? extra : 15;
+        if(extra>=15 && (out=lz_put_length(out, limit, extra-15))==NULL) return -1;
+
+        p += match_len;
+        anchor = p;
+    }
+
+    //last sequence: literals only
+    int literals = end-anchor;
+    if(out>=limit) return -1;
+    unsigned char *token = out++;
+    *token = (literals<15 ? literals : 15)<<4;
+    if(literals>=15 && (out=lz_put_length(out, limit, literals-15))==NULL) return -1;
+    if(out+literals>limit) return -1;
+    memcpy(out, anchor, literals);
+    out += literals;
+    return out-(unsigned char *)dst;
+}
+
+//decompress len bytes of src into at most max bytes of dst:
+//return the decompressed length, or -1 if src is malformed or does not fit in max
+int lz_decompress(const char *src, int len, char *dst, int max){
+    const unsigned char *in = (const unsigned char *)src, *end = in+len;
+    unsigned char *out = (unsigned char *)dst, *limit = out+max;
+
+    while(in<end){
+        int token = *in++;
+        int literals = token>>4;
+        if(literals==15){
+            int b;
+            do{
+                if(in>=end) return -1;
+                b = *in++;
+                literals += b;
+            }while(b==255);
+        }
+        if(in+literals>end || out+literals>limit) return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in==end) break; //the last sequence has no match
+
+        if(in+2>end) return -1;
+        int offset = in[0] | in[1]<<8;
+        in += 2;
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15)==15){
+            int b;
+            do{
+                if(in>=end) return -1;
+                b = *in++;
+                match_len += b;
+            }while(b==255);
+        }
+        if(offset==0 || offset>out-(unsigned char *)dst || out+match_len>limit) return -1;
+        //byte by byte: the match may overlap the bytes it produces
+        for(int i=0; i<match_len; i++, out++) *out = *(out-offset);
+    }
+    return out-(unsigned char *)dst;
+}
+
+
+//decompress a file of the given length, whose first blocks block[] hold stored bytes of compressed data,
+//into plain (NUM_POINTER*BLOCK_SIZE bytes); the caller holds the file (shared or exclusively), or reads
+//a snapshot of it: return its length, or -1 if the data is corrupt
+int read_compressed(rsfs_t *fs, int *block, int stored, int length, char *plain){
+    char packed[NUM_POINTER*BLOCK_SIZE];
+    for(int i=0; i*BLOCK_SIZE<stored; i++){
+        int n = stored-i*BLOCK_SIZE < BLOCK_SIZE ? stored-i*BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(packed+i*BLOCK_SIZE, block_data(fs, block[i]), n);
+    }
+    if(lz_decompress(packed, stored, plain, NUM_POINTER*BLOCK_SIZE)!=length){
+        printf("[compress] compressed data of a file is corrupt.\n");
+        return -1;
+    }
+    return length;
+}
+
+//compress the file of inode, held exclusively by the caller, if that saves at least one block:
+//return 0 if it was compressed, 1 if it was left as it is, or -1 on error
+int compress_file(rsfs_t *fs, struct inode *inode){
+    if(inode->compressed || inode->length==0) return 1;
+
+    //gather the content; files with a missing block (the pool ran dry) are left alone
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    int num_blocks = (inode->length+BLOCK_SIZE-1)/BLOCK_SIZE;
+    for(int i=0; i<num_blocks; i++){
+        if(inode->block[i]<0) return 1;
+        memcpy(plain+i*BLOCK_SIZE, block_data(fs, inode->block[i]), BLOCK_SIZE);
+    }
+
+    char packed[NUM_POINTER*BLOCK_SIZE];
+    int stored = lz_compress(plain, inode->length, packed, (num_blocks-1)*BLOCK_SIZE);
+    if(stored<0) return 1;
+    int packed_blocks = (stored+BLOCK_SIZE-1)/BLOCK_SIZE;
+
+    //the blocks kept must be private (dedup may share them) before anything is overwritten
+    for(int i=0; i<packed_blocks; i++){
+        if(writable_data_block(fs, &inode->block[i])<0) return -1;
+    }
+    for(int i=0; i<packed_blocks; i++){
+        int n = stored-i*BLOCK_SIZE < BLOCK_SIZE ? stored-i*BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(block_data(fs, inode->block[i]), packed+i*BLOCK_SIZE, n);
+    }
+    for(int i=packed_blocks; i<num_blocks; i++){
+        free_data_block(fs, inode->block[i]);
+        inode->block[i] = -1;
+    }
+
+    __atomic_store_n(&inode->compressed, stored, __ATOMIC_RELEASE);
+    STAT_ADD(fs, compressed_files, 1);
+    STAT_ADD(fs, compressed_bytes, inode->length);
+    STAT_ADD(fs, compressed_stored, stored);
+    return 0;
+}
+
+//decompress the file of inode, held exclusively by the caller, back into plain blocks:
+//return 0 if succeed, or -1 if there are not enough free blocks (the file stays compressed)
+int decompress_file(rsfs_t *fs, struct inode *inode){
+    int stored = inode->compressed;
+    if(stored==0) return 0;
+
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    if(read_compressed(fs, inode->block, stored, inode->length, plain)<0) return -1;
+    int num_blocks = (inode->length+BLOCK_SIZE-1)/BLOCK_SIZE;
+    int packed_blocks = (stored+BLOCK_SIZE-1)/BLOCK_SIZE;
+
+    //the blocks holding the compressed bytes may be shared with a snapshot: they are overwritten below
+    for(int i=0; i<packed_blocks; i++){
+        if(writable_data_block(fs, &inode->block[i])<0){
+            printf("[compress] no free block to decompress a file into.\n");
+            return -1;
+        }
+    }
+
+    //take the extra blocks first, so that a failure leaves the compressed file intact
+    for(int i=packed_blocks; i<num_blocks; i++){
+        inode->block[i] = allocate_data_block(fs, &inode->block[i]);
+        if(inode->block[i]<0){
+            for(int j=packed_blocks; j<i; j++){
+                free_data_block(fs, inode->block[j]);
+                inode->block[j] = -1;
+            }
+            printf("[compress] no free block to decompress a file into.\n");
+            return -1;
+        }
+    }
+    for(int i=0; i<num_blocks; i++){
+        int n = inode->length-i*BLOCK_SIZE < BLOCK_SIZE ? inode->length-i*BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(block_data(fs, inode->block[i]), plain+i*BLOCK_SIZE, n);
+        memset(block_data(fs, inode->block[i])+n, 0, BLOCK_SIZE-n);
+    }
+
+    __atomic_store_n(&inode->compressed, 0, __ATOMIC_RELEASE);
+    STAT_ADD(fs, compressed_files, -1);
+    STAT_ADD(fs, compressed_bytes, -inode->length);
+    STAT_ADD(fs, compressed_stored, -stored);
+    return 0;
+}
+
+//the file of inode is deleted: forget its compressed form; the caller holds it exclusively and frees the blocks
+void forget_compressed(rsfs_t *fs, struct inode *inode){
+    int stored = inode->compressed;
+    if(stored==0) return;
+    __atomic_store_n(&inode->compressed, 0, __ATOMIC_RELEASE);
+    STAT_ADD(fs, compressed_files, -1);
+    STAT_ADD(fs, compressed_bytes, -inode->length);
+    STAT_ADD(fs, compressed_stored, -stored);
+}
+
+
+//set the compression policy of file_name to one of RSFS_COMPRESS_*: return 0, or -1 if the file does not exist
+int rsfs_set_compression(rsfs_t *fs, char *file_name, int policy){
+    if(policy!=RSFS_COMPRESS_OFF && policy!=RSFS_COMPRESS_ON_CLOSE && policy!=RSFS_COMPRESS_COLD){
+        printf("[set_compression] unknown policy %d.\n", policy);
+        return -1;
+    }
+    epoch_enter(fs);
+    struct dir_entry *dir = search_dir(fs, file_name);
+    if(dir==NULL || dir->inode_number<0){
+        printf("[set_compression] file (%s) does not exist or is a directory.\n", file_name);
+        epoch_exit(fs);
+        return -1;
+    }
+    __atomic_store_n(&fs->inodes[dir->inode_number].compress_policy, policy, __ATOMIC_RELAXED);
+    epoch_exit(fs);
+    return 0;
+}
+
+//compress the files of policy RSFS_COMPRESS_COLD that nobody has opened for writing since the previous call
+//and that nobody has open now; return the number of files compressed
+int rsfs_compress_cold(rsfs_t *fs){
+    int compressed = 0;
+    for(int i=0; i<NUM_INODES; i++){
+        struct inode *inode = &fs->inodes[i];
+        if(__atomic_load_n(&inode->compress_policy, __ATOMIC_RELAXED)!=RSFS_COMPRESS_COLD) continue;
+        if(__atomic_exchange_n(&inode->hot, 0, __ATOMIC_RELAXED)) continue; //written lately: cold next time if left alone
+        if(__atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) continue;
+
+        //never wait for a file in use: it is not cold
+        if(PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW)!=0) continue;
+        inode->rw_owner = getpid();
+        PROF_LOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+        int in_use = fs->inode_bitmap[i];
+        PROF_UNLOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+        if(in_use && inode->compress_policy==RSFS_COMPRESS_COLD && compress_file(fs, inode)==0) compressed++;
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+    }
+    return compressed;
+}
+
+int RSFS_set_compression(char *file_name, int policy){ return rsfs_set_compression(&rsfs_default, file_name, policy); }
+int RSFS_compress_cold(){ return rsfs_compress_cold(&rsfs_default); }
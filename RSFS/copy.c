@@ -0,0 +1,263 @@
+/*
+    copies between files: RSFS_copy_range copies a range of an open file into a file open for writing (or elsewhere
+    in the same file) without a bounce buffer. Where the two ranges sit at the same place within their blocks,
+    the whole blocks of the destination are pointed at the blocks of the source and shared by reference, as dedup
+    and snapshots share them (the first write to either side copies the block, see writable_data_block()).
+    The other blocks are copied block to block, into blocks allocated in one batch up front.
+    The copy works under the holds of the two descriptors, and the source blocks are read inside epoch sections,
+    like RSFS_read, so the defragmenter can move them meanwhile.
+    RSFS_import_fd and RSFS_export_fd move data between an open file and a host file descriptor the same way:
+    one readv() straight into the data blocks of the file, or one writev() straight out of them
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <sys/uio.h>
+
+
+//helper: copy n bytes of source from position pos to dst, across the source blocks they span:
+//return the number copied (fewer if a block is missing). The caller is in an epoch section
+static int copy_from(rsfs_t *fs, struct scan_file *source, int pos, char *dst, int n){
+    int done = 0;
+    while(done<n){
+        int avail;
+        const char *p = file_bytes(fs, source, pos+done, &avail);
+        if(avail==0) break;
+        int m = avail<n-done ? avail : n-done;
+        memcpy(dst+done, p, m);
+        done += m;
+    }
+    return done;
+}
+
+//helper: allocate the missing blocks from first to last of the file of inode (held by its writer) in one batch,
+//marking them in fresh; the pointers left at -1 are those the pool had no block for
+static void allocate_range(rsfs_t *fs, struct inode *inode, int first, int last, int *fresh){
+    for(int k=first; k<=last; k++) fresh[k] = inode->block[k]<0;
+    allocate_data_blocks(fs, &inode->block[first], last-first+1);
+}
+
+//helper: give back the blocks from first to last of the file of inode marked in fresh or shared (NULL: none)
+//that lie past its length, where a transfer that fell short left them
+static void release_range(rsfs_t *fs, struct inode *inode, int first, int last, const int *fresh, const int *shared){
+    int unused[NUM_POINTER];
+    int num_unused = 0;
+    for(int k=first; k<=last; k++){
+        if((fresh[k] || (shared && shared[k])) && inode->block[k]>=0 && k*BLOCK_SIZE>=inode->length){
+            unused[num_unused++] = inode->block[k];
+            inode->block[k] = -1;
+        }
+    }
+    free_data_blocks(fs, unused, num_unused);
+}
+
+//copy up to len bytes of the file of fd_in from off_in to the file of fd_out (opened with RSFS_RDWR) at off_out,
+//overwriting what is there and extending the file if needed; the positions of the descriptors do not move.
+//The copy stops at the end of the source and at the maximum file size, and the two ranges must not overlap
+//if both are in one file: return the number of bytes copied (if the pool runs dry, whole blocks of the range past
+//them may have been shared already), or -1 on error
+int rsfs_copy_range(rsfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len){
+    PROF_OP(PROF_COPY_RANGE, NULL, fd_in, len);
+    PROF_ARGS(3, off_in, fd_out, off_out);
+    if(len<=0 || off_in<0 || off_out<0){
+        printf("[copy_range] len must be positive and the offsets not negative.\n");
+        return -1;
+    }
+    struct open_file_entry *out = get_open_file_entry(fs, fd_out);
+    if(out==NULL || out->snapshot_file || out->access_flag!=RSFS_RDWR){
+        printf("[copy_range] fd_out is not a file descriptor opened with RSFS_RDWR.\n");
+        return -1;
+    }
+    struct dir_entry *dir_entry = to_ptr(fs, out->dir_entry);
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    if(off_out>inode->length){
+        printf("[copy_range] off_out is past the end of the destination file.\n");
+        return -1;
+    }
+
+    struct scan_file source;
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    if(scan_source(fs, fd_in, &source, plain, "copy_range")!=0) return -1;
+
+    if(len>source.length-off_in) len = source.length-off_in;
+    if(len>NUM_POINTER*BLOCK_SIZE-off_out) len = NUM_POINTER*BLOCK_SIZE-off_out;
+    if(len<=0) return 0;
+    if(source.block==inode->block && off_in<off_out+len && off_out<off_in+len){
+        printf("[copy_range] the source and destination ranges overlap.\n");
+        return -1;
+    }
+
+    //The snapshots taken since the file last changed keep its content as it is now
+    if(snapshot_preserve(fs, dir_entry)!=0){
+        printf("[copy_range] fail to preserve the file for a snapshot.\n");
+        return -1;
+    }
+
+    int first = off_out/BLOCK_SIZE, last = (off_out+len-1)/BLOCK_SIZE;
+    int shared[NUM_POINTER] = {0};
+    int fresh[NUM_POINTER] = {0};
+
+    //whole destination blocks over source blocks at the same place share them
+    if(source.plain==NULL && (off_in-off_out)%BLOCK_SIZE==0){
+        int lo = (off_out+BLOCK_SIZE-1)/BLOCK_SIZE, hi = (off_out+len)/BLOCK_SIZE;
+        int shift = (off_in-off_out)/BLOCK_SIZE;
+        int linked = hi>lo ? link_data_blocks(fs, &source.block[lo+shift], &inode->block[lo], hi-lo) : 0;
+        for(int k=lo; k<lo+linked; k++) shared[k] = 1;
+    }
+
+    //the blocks the rest of the copy lands in are allocated together; a block already there is written in place
+    allocate_range(fs, inode, first, last, fresh);
+
+    int copied = 0;
+    for(int k=first; k<=last; k++){
+        int start = k==first ? off_out%BLOCK_SIZE : 0;
+        int n = BLOCK_SIZE-start<len-copied ? BLOCK_SIZE-start : len-copied;
+        if(shared[k]){
+            copied += n;
+            continue;
+        }
+
+        int block = fresh[k] ? inode->block[k] : writable_data_block(fs, &inode->block[k]);
+        if(block<0){
+            printf("[copy_range] fail to allocate a data block.\n");
+            break;
+        }
+        epoch_enter(fs);
+        int done = copy_from(fs, &source, off_in+copied, block_data(fs, block)+start, n);
+        epoch_exit(fs);
+
+        //a block just filled may be shared with an identical one
+        if(done==n && start+n==BLOCK_SIZE) dedup_data_block(fs, &inode->block[k]);
+        copied += done;
+        if(done<n) break;
+    }
+
+    if(off_out+copied>inode->length) inode->length = off_out+copied;
+    release_range(fs, inode, first, last, fresh, shared);
+    return PROF_BYTES(copied);
+}
+
+//read up to len bytes from the host file descriptor host_fd (from its offset, which moves on) into the file of rsfs_fd
+//(opened with RSFS_RDWR) at its position, overwriting what is there and extending the file if needed, with readv()
+//into the data blocks; the position of rsfs_fd moves past them. The import stops at the end of the host data and at
+//the maximum file size: return the number of bytes imported, or -1 on error
+int rsfs_import_fd(rsfs_t *fs, int host_fd, int rsfs_fd, int len){
+    PROF_OP(PROF_IMPORT_FD, NULL, rsfs_fd, len);
+    struct open_file_entry *entry = get_open_file_entry(fs, rsfs_fd);
+    if(entry==NULL || entry->snapshot_file || entry->access_flag!=RSFS_RDWR || len<=0){
+        printf("[import_fd] rsfs_fd is not a file descriptor opened with RSFS_RDWR or len <= 0.\n");
+        return -1;
+    }
+    struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    int position = entry->position;
+    if(len>NUM_POINTER*BLOCK_SIZE-position) len = NUM_POINTER*BLOCK_SIZE-position;
+    if(len<=0) return 0;
+
+    //The snapshots taken since the file last changed keep its content as it is now
+    if(snapshot_preserve(fs, dir_entry)!=0){
+        printf("[import_fd] fail to preserve the file for a snapshot.\n");
+        return -1;
+    }
+
+    //the blocks are allocated (or made private) first, then filled by one readv()
+    int first = position/BLOCK_SIZE, last = (position+len-1)/BLOCK_SIZE;
+    int fresh[NUM_POINTER] = {0};
+    struct iovec iov[NUM_POINTER];
+    int num_iov = 0, room = 0; //room: bytes the blocks prepared can take
+    allocate_range(fs, inode, first, last, fresh);
+    for(int k=first; k<=last; k++){
+        int block = fresh[k] ? inode->block[k] : writable_data_block(fs, &inode->block[k]);
+        if(block<0){
+            printf("[import_fd] fail to allocate a data block.\n");
+            break;
+        }
+        int start = k==first ? position%BLOCK_SIZE : 0;
+        int n = BLOCK_SIZE-start<len-room ? BLOCK_SIZE-start : len-room;
+        iov[num_iov].iov_base = block_data(fs, block)+start;
+        iov[num_iov++].iov_len = n;
+        room += n;
+    }
+
+    //a pipe or socket may hand over less than asked for at a time: read on until the blocks are full or the data ends
+    int imported = 0, failed = num_iov==0;
+    for(int i=0; i<num_iov; ){
+        ssize_t ret = readv(host_fd, iov+i, num_iov-i);
+        if(ret<0 && errno==EINTR) continue;
+        if(ret<0){
+            printf("[import_fd] fail to read from host_fd: %s.\n", strerror(errno));
+            failed = imported==0;
+            break;
+        }
+        if(ret==0) break;
+        imported += ret;
+        while(i<num_iov && ret>=(ssize_t)iov[i].iov_len) ret -= iov[i++].iov_len;
+        if(i<num_iov){
+            iov[i].iov_base = (char *)iov[i].iov_base+ret;
+            iov[i].iov_len -= ret;
+        }
+    }
+
+    //blocks just filled may be shared with identical ones
+    for(int k=first; k<first+num_iov && (k+1)*BLOCK_SIZE<=position+imported; k++) dedup_data_block(fs, &inode->block[k]);
+
+    if(position+imported>inode->length) inode->length = position+imported;
+    release_range(fs, inode, first, last, fresh, NULL);
+    entry->position = position+imported;
+
+    //the host data is not recorded: the replay imports as many bytes from elsewhere
+    PROF_ARGS(1, imported, 0, 0);
+    return failed ? -1 : PROF_BYTES(imported);
+}
+
+//write up to len bytes of the file of rsfs_fd from its position to the host file descriptor host_fd (at its offset,
+//which moves on) with writev() straight out of the data blocks; the position of rsfs_fd moves past them.
+//The blocks are read inside an epoch section, which a writev() blocked on a full pipe prolongs (the defragmenter
+//waits for it): return the number of bytes exported, or -1 on error
+int rsfs_export_fd(rsfs_t *fs, int rsfs_fd, int host_fd, int len){
+    PROF_OP(PROF_EXPORT_FD, NULL, rsfs_fd, len);
+    if(len<=0){
+        printf("[export_fd] len must be positive.\n");
+        return -1;
+    }
+    struct scan_file file;
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    if(scan_source(fs, rsfs_fd, &file, plain, "export_fd")!=0) return -1;
+    struct open_file_entry *entry = get_open_file_entry(fs, rsfs_fd);
+    int position = entry->position;
+    if(len>file.length-position) len = file.length-position;
+
+    //the bytes left go out in one writev() a round; a pipe or socket may take fewer
+    int exported = 0, failed = 0;
+    while(exported<len){
+        struct iovec iov[NUM_POINTER];
+        int num_iov = 0;
+        epoch_enter(fs);
+        for(int done=exported; done<len && num_iov<NUM_POINTER; ){
+            int avail;
+            const char *p = file_bytes(fs, &file, position+done, &avail);
+            if(avail==0) break;
+            int n = avail<len-done ? avail : len-done;
+            iov[num_iov].iov_base = (void *)p;
+            iov[num_iov++].iov_len = n;
+            done += n;
+        }
+        ssize_t ret = num_iov>0 ? writev(host_fd, iov, num_iov) : 0;
+        epoch_exit(fs);
+        if(ret<0 && errno==EINTR) continue;
+        if(ret<0){
+            printf("[export_fd] fail to write to host_fd: %s.\n", strerror(errno));
+            failed = exported==0;
+            break;
+        }
+        if(ret==0) break;
+        exported += ret;
+    }
+
+    entry->position = position+exported;
+    return failed ? -1 : PROF_BYTES(exported);
+}
+
+int RSFS_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len){ return rsfs_copy_range(&rsfs_default, fd_in, off_in, fd_out, off_out, len); }
+int RSFS_import_fd(int host_fd, int rsfs_fd, int len){ return rsfs_import_fd(&rsfs_default, host_fd, rsfs_fd, len); }
+int RSFS_export_fd(int rsfs_fd, int host_fd, int len){ return rsfs_export_fd(&rsfs_default, rsfs_fd, host_fd, len); }
@@ -1,45 +1,432 @@
 /*
-    Allocation of data block, data block bitmaps and mutex to guard M.E. access; 
-    routines for managing them
+    routines for managing the data blocks and the data block bitmap of an instance
+    (they live in struct rsfs, guarded by its data_bitmap_mutex).
+    With deduplication on, a block that has been filled is looked up by the hash of its content
+    and shared with an identical block through reference counts; writing to a shared block copies it first.
+    In log-structured mode (see log.c), blocks are taken in order from the head segment of the log,
+    and writers copy a block to the head instead of modifying it in place.
+    Otherwise blocks are placed by size class: the pool is also seen as aligned slots of 2, 4... blocks, with a map
+    of the blocks used in each slot, and a file gets its blocks in runs that double as it grows (1, 1, 2, 4...),
+    each run starting a free slot of its size, so that a large file lies in a few runs that RSFS_read and
+    the in-place readers copy in one go, while small files fill the holes of slots already split
 */
 
 #include "def.h"
 
+#define HASH_PRIME1 0x9E3779B185EBCA87UL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FUL
+#define HASH_PRIME3 0x165667B19E3779F9UL
 
-//allocation of data block and data block bitmaps
-void *data_blocks[BLOCK_SIZE];
-int data_bitmap[NUM_DBLOCKS];
-pthread_mutex_t data_bitmap_mutex;
 
+//helper: mix one 8-byte word into a lane of the hash
+static inline unsigned long hash_round(unsigned long acc, unsigned long word){
+    acc += word*HASH_PRIME2;
+    acc = (acc<<31) | (acc>>33);
+    return acc*HASH_PRIME1;
+}
 
-//to allocate an empty data block and return the block-number;
-//if no free data block is available, return -1
-int allocate_data_block(){
+//helper: 64-bit hash of the content of a block (xxh64-style): four independent lanes over 32-byte stripes,
+//so the compiler can keep them in vector registers; words are loaded with memcpy (blocks need no alignment)
+static unsigned long block_content_hash(const char *data){
+    unsigned long lane[4] = {HASH_PRIME1+HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1};
+    int i = 0;
+    for(; i+32<=BLOCK_SIZE; i+=32){
+        unsigned long word[4];
+        memcpy(word, data+i, 32);
+        for(int j=0; j<4; j++) lane[j] = hash_round(lane[j], word[j]);
+    }
+    unsigned long hash = ((lane[0]<<1)|(lane[0]>>63)) + ((lane[1]<<7)|(lane[1]>>57))
+        + ((lane[2]<<12)|(lane[2]>>52)) + ((lane[3]<<18)|(lane[3]>>46));
+    for(; i+8<=BLOCK_SIZE; i+=8){
+        unsigned long word;
+        memcpy(&word, data+i, 8);
+        hash ^= hash_round(0, word);
+        hash = ((hash<<27)|(hash>>37))*HASH_PRIME1 + HASH_PRIME3;
+    }
+    for(; i<BLOCK_SIZE; i++){
+        hash ^= (unsigned char)data[i]*HASH_PRIME3;
+        hash = ((hash<<11)|(hash>>53))*HASH_PRIME1;
+    }
+    hash ^= hash>>33;
+    hash *= HASH_PRIME2;
+    hash ^= hash>>29;
+    return hash;
+}
 
-    int block_number=-1; //init
+//helper: take block_number out of the index; the caller holds data_bitmap_mutex
+static void unindex_block(rsfs_t *fs, int block_number){
+    int *link = &fs->dedup_index[fs->block_hash[block_number] % DEDUP_BUCKETS];
+    while(*link && *link-1!=block_number) link = &fs->block_hash_next[*link-1];
+    if(*link) *link = fs->block_hash_next[block_number];
+    __atomic_store_n(&fs->block_indexed[block_number], 0, __ATOMIC_RELEASE);
+}
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+//helper: drop a reference to block_number, freeing it with the last one; the caller holds data_bitmap_mutex
+static void put_block(rsfs_t *fs, int block_number){
+    if(fs->block_refs[block_number]>1){
+        __atomic_store_n(&fs->block_refs[block_number], fs->block_refs[block_number]-1, __ATOMIC_RELEASE);
+        STAT_ADD(fs, shared_refs, -1);
+        return;
+    }
+    if(fs->data_bitmap[block_number]){
+        if(fs->block_indexed[block_number]) unindex_block(fs, block_number);
+        memset(block_data(fs, block_number), 0, BLOCK_SIZE); //wipe the data of the last owner
+        fs->block_refs[block_number]=0;
+        fs->block_owner[block_number]=-1;
+        fs->data_bitmap[block_number]=0; //reset it to available
+        fs->segment_live[block_number/SEGMENT_BLOCKS]--;
+        for(int c=0; c<NUM_BLOCK_CLASSES; c++) fs->class_used[c][block_number>>c]--;
+        STAT_ADD(fs, used_blocks, -1);
+    }
+}
+
+//helper: the entry of the inode map for the inode pointer *pointer: inode_number*NUM_POINTER+pointer,
+//or -1 if it is NULL or not a pointer of an inode (a shared instance maps its inodes at different addresses,
+//so the map records positions, not addresses)
+static int pointer_owner(rsfs_t *fs, int *pointer){
+    if(pointer==NULL) return -1;
+    long offset = (char *)pointer - (char *)fs->inodes;
+    if(offset<0 || offset>=(long)sizeof(fs->inodes)) return -1;
+    int inode_number = offset/sizeof(struct inode);
+    long j = pointer - fs->inodes[inode_number].block;
+    if(j<0 || j>=NUM_POINTER) return -1;
+    return inode_number*NUM_POINTER+j;
+}
+
+//helper: mark the free block block_number allocated to the inode pointer *pointer (NULL: none);
+//the caller holds data_bitmap_mutex
+static void mark_block(rsfs_t *fs, int block_number, int *pointer){
+    fs->data_bitmap[block_number]=1; //mark it as allocated
+    __atomic_store_n(&fs->block_refs[block_number], 1, __ATOMIC_RELEASE);
+    fs->block_owner[block_number] = pointer_owner(fs, pointer);
+    fs->segment_live[block_number/SEGMENT_BLOCKS]++;
+    for(int c=0; c<NUM_BLOCK_CLASSES; c++) fs->class_used[c][block_number>>c]++;
+    STAT_ADD(fs, used_blocks, 1);
+}
 
-    for(int i=0; i<NUM_DBLOCKS; i++){
-        if(data_bitmap[i]==0){//find an available data block
-            block_number=i;
-            data_bitmap[i]=1; //mark it as allocated
-            break;
+//helper: take the next block of the head segment of the log, opening a clean segment (the first one after
+//the previous head segment) when the head one is used up; return -1 if no segment is clean.
+//The caller holds data_bitmap_mutex
+static int take_log_block(rsfs_t *fs, int *pointer){
+    for(;;){
+        if(fs->log_head<0){
+            int segment = -1;
+            for(int i=1; i<=NUM_SEGMENTS && segment<0; i++){
+                int s = (fs->log_segment+i+NUM_SEGMENTS)%NUM_SEGMENTS;
+                if(fs->segment_live[s]==0) segment = s;
+            }
+            if(segment<0) return -1;
+            fs->log_segment = segment;
+            fs->log_head = segment*SEGMENT_BLOCKS;
         }
+        int block_number = fs->log_head;
+        fs->log_head = (block_number+1)%SEGMENT_BLOCKS ? block_number+1 : -1;
+        if(fs->data_bitmap[block_number]==0){ //a first-fit allocation may have taken it meanwhile
+            mark_block(fs, block_number, pointer);
+            fs->segment_written[fs->log_segment] = ++fs->log_seq;
+            STAT_ADD(fs, log_writes, 1);
+            return block_number;
+        }
+    }
+}
+
+//helper: the size class of the run that starts at pointer j of a file: runs double as the file grows
+static int run_class(int j){
+    int c = 0;
+    while(c+1<NUM_BLOCK_CLASSES && (2<<c)<=j) c++;
+    return c;
+}
+
+//helper: the first block of a free slot of class c, preferring one whose enclosing slot is split already;
+//-1 if no slot of class c is free. The caller holds data_bitmap_mutex
+static int find_free_slot(rsfs_t *fs, int c){
+    int found = -1;
+    for(int slot=0; slot<(NUM_DBLOCKS>>c); slot++){
+        if(fs->class_used[c][slot]) continue;
+        if(c+1==NUM_BLOCK_CLASSES || fs->class_used[c+1][slot>>1]) return slot<<c;
+        if(found<0) found = slot<<c;
+    }
+    return found;
+}
+
+//helper: the block for the inode pointer *pointer (NULL: none) outside the log: right after the block of the pointer
+//before it, which extends its run, or else the start of a free slot of the class of the run starting there
+//(or of a smaller class if none is free); -1 if the pool is full. The caller holds data_bitmap_mutex
+static int place_block(rsfs_t *fs, int *pointer){
+    int owner = pointer_owner(fs, pointer);
+    int j = owner<0 ? 0 : owner%NUM_POINTER;
+    if(j>0){
+        int previous = __atomic_load_n(pointer-1, __ATOMIC_ACQUIRE);
+        if(previous>=0 && previous+1<NUM_DBLOCKS && fs->data_bitmap[previous+1]==0) return previous+1;
+    }
+    for(int c=run_class(j); c>=0; c--){
+        int block_number = find_free_slot(fs, c);
+        if(block_number>=0) return block_number;
+    }
+    return -1;
+}
+
+//helper: find a free block and mark it allocated to the inode pointer *pointer (NULL: none): at the head of the log
+//in log-structured mode, else (or when no segment is clean) by size class; the caller holds data_bitmap_mutex
+static int take_free_block(rsfs_t *fs, int *pointer){
+    if(fs->log_mode){
+        int block_number = take_log_block(fs, pointer);
+        if(block_number>=0) return block_number;
+    }
+    int block_number = place_block(fs, pointer);
+    if(block_number>=0) mark_block(fs, block_number, pointer);
+    return block_number;
+}
+
+//helper: copy the private block of the inode pointer *pointer to the block copy, taken already, and free it,
+//in one step, so that whoever reads the pointer under data_bitmap_mutex never finds a freed block;
+//return copy. The caller holds data_bitmap_mutex
+static int move_block(rsfs_t *fs, int *pointer, int copy){
+    int block_number = *pointer;
+    memcpy(block_data(fs, copy), block_data(fs, block_number), BLOCK_SIZE);
+    __atomic_store_n(pointer, copy, __ATOMIC_RELEASE);
+    put_block(fs, block_number);
+    TRACE_EVENT(TRACE_BLOCK_ALLOC, -1, -1, copy, 0);
+    TRACE_EVENT(TRACE_BLOCK_FREE, -1, -1, block_number, 0);
+    return copy;
+}
+
+
+//to allocate an empty data block for the inode pointer *pointer (recorded for the log cleaner; NULL if none)
+//and return the block-number; if no free data block is available, return -1
+int allocate_data_block(rsfs_t *fs, int *pointer){
+
+    log_clean_if_needed(fs);
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    int block_number = take_free_block(fs, pointer);
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    TRACE_EVENT(TRACE_BLOCK_ALLOC, -1, -1, block_number, 0);
+    return block_number;
+}
+
+//to allocate an empty data block for each of the num inode pointers in pointer (held by a writer) that is -1,
+//under one acquisition of the mutex; return the number allocated, which falls short if the pool runs dry
+int allocate_data_blocks(rsfs_t *fs, int *pointer, int num){
+
+    log_clean_if_needed(fs);
+
+    int allocated = 0;
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int j=0; j<num; j++){
+        if(pointer[j]>=0) continue;
+        int block_number = take_free_block(fs, &pointer[j]);
+        if(block_number<0) break;
+        __atomic_store_n(&pointer[j], block_number, __ATOMIC_RELEASE);
+        allocated++;
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int j=0; j<num; j++) if(pointer[j]>=0) TRACE_EVENT(TRACE_BLOCK_ALLOC, -1, -1, pointer[j], 0);
+    return allocated;
+}
+
+//to drop a reference to the data block with the provided block_number;
+//the block is wiped and freed when no inode points to it any more
+void free_data_block(rsfs_t *fs, int block_number){
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    put_block(fs, block_number);
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    TRACE_EVENT(TRACE_BLOCK_FREE, -1, -1, block_number, 0);
+}
+
+//to drop a reference to each of the num data blocks in blocks (skipping values<0) under one acquisition of the mutex
+void free_data_blocks(rsfs_t *fs, int *blocks, int num){
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int i=0; i<num; i++) if(blocks[i]>=0) put_block(fs, blocks[i]);
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int i=0; i<num; i++) if(blocks[i]>=0) TRACE_EVENT(TRACE_BLOCK_FREE, -1, -1, blocks[i], 0);
+}
+
+//copy the first num pointers of block to copy, taking one more reference to each block (for a snapshot,
+//see snapshot.c): the blocks are copied before any writer modifies them in place. The pointers are read under
+//data_bitmap_mutex, so a block a writer or the log cleaner is moving is taken either before or after it moved
+void share_data_blocks(rsfs_t *fs, int *block, int *copy, int num){
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int j=0; j<num; j++){
+        copy[j] = __atomic_load_n(&block[j], __ATOMIC_ACQUIRE);
+        if(copy[j]<0) continue;
+        __atomic_store_n(&fs->block_refs[copy[j]], fs->block_refs[copy[j]]+1, __ATOMIC_RELEASE);
+        STAT_ADD(fs, shared_refs, 1);
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+}
+
+//point each of the num inode pointers in to (held by a writer) at the block of the matching pointer in from,
+//taking one more reference to it and dropping the block to pointed to before (see RSFS_copy_range);
+//stop at the first pointer of from that is -1 and return the number of pointers linked.
+//As in share_data_blocks(), the pointers of from are read under data_bitmap_mutex
+int link_data_blocks(rsfs_t *fs, int *from, int *to, int num){
+    int old[NUM_POINTER];
+    int linked = 0;
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(; linked<num; linked++){
+        int block_number = __atomic_load_n(&from[linked], __ATOMIC_ACQUIRE);
+        if(block_number<0) break;
+        old[linked] = to[linked];
+        if(block_number==old[linked]) continue;
+        __atomic_store_n(&fs->block_refs[block_number], fs->block_refs[block_number]+1, __ATOMIC_RELEASE);
+        STAT_ADD(fs, shared_refs, 1);
+        __atomic_store_n(&to[linked], block_number, __ATOMIC_RELEASE);
+        if(old[linked]>=0) put_block(fs, old[linked]);
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int j=0; j<linked; j++) if(old[j]>=0 && old[j]!=to[j]) TRACE_EVENT(TRACE_BLOCK_FREE, -1, -1, old[j], 0);
+    return linked;
+}
+
+//move the content of the block of the inode pointer *pointer to the free block target and point *pointer to it
+//(see defrag.c): return the old block, which the caller frees once no reader can still be using it,
+//or -1 if target is taken or the block is shared or indexed (it stays where it is)
+int relocate_data_block(rsfs_t *fs, int *pointer, int target){
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    int block_number = *pointer;
+    if(fs->data_bitmap[target] || fs->block_refs[block_number]!=1 || fs->block_indexed[block_number]){
+        PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+        return -1;
+    }
+    mark_block(fs, target, pointer);
+    memcpy(block_data(fs, target), block_data(fs, block_number), BLOCK_SIZE);
+    __atomic_store_n(pointer, target, __ATOMIC_RELEASE);
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    TRACE_EVENT(TRACE_BLOCK_ALLOC, -1, -1, target, 0);
+    return block_number;
+}
+
+//prepare the block of the inode pointer *pointer (held by a writer) to be modified in place:
+//a block shared with other pointers is replaced by a private copy, and an indexed block leaves the index;
+//return the block to write to, or -1 if no block is free for the copy
+int writable_data_block(rsfs_t *fs, int *pointer){
+    int block_number = *pointer;
+
+    //common case, and the only one without dedup or the log: a private block nobody can start sharing
+    if(__atomic_load_n(&fs->block_refs[block_number], __ATOMIC_ACQUIRE)==1 && !__atomic_load_n(&fs->block_indexed[block_number], __ATOMIC_ACQUIRE)
+            && !__atomic_load_n(&fs->log_mode, __ATOMIC_RELAXED)){
+        return block_number;
     }
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    log_clean_if_needed(fs);
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
 
+    if(fs->log_mode && fs->block_refs[block_number]==1){
+        //written at the head of the log instead of in place (in place if no segment is clean)
+        if(fs->block_indexed[block_number]) unindex_block(fs, block_number);
+        int copy = take_log_block(fs, pointer);
+        if(copy>=0) block_number = move_block(fs, pointer, copy);
+    }else if(fs->block_refs[block_number]>1){
+        //the others keep the block (and its index entry); this pointer gets a copy
+        int copy = take_free_block(fs, pointer);
+        if(copy>=0){
+            memcpy(block_data(fs, copy), block_data(fs, block_number), BLOCK_SIZE);
+            put_block(fs, block_number);
+            __atomic_store_n(pointer, copy, __ATOMIC_RELEASE);
+            TRACE_EVENT(TRACE_BLOCK_ALLOC, -1, -1, copy, 0);
+        }
+        block_number = copy;
+    }else if(fs->block_indexed[block_number]){
+        unindex_block(fs, block_number); //its content is about to change
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
     return block_number;
 }
 
-//to free a data block with the provided block_number
-void free_data_block(int block_number){
+//the block of the inode pointer *pointer (held by a writer) has just been filled: if deduplication is on,
+//point *pointer to an identical block instead and free this one, or index it for the blocks written later
+void dedup_data_block(rsfs_t *fs, int *pointer){
+    if(!__atomic_load_n(&fs->dedup, __ATOMIC_RELAXED)) return;
+
+    int block_number = *pointer;
+    unsigned long hash = block_content_hash(block_data(fs, block_number)); //the block is ours: no lock needed
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    if(fs->block_indexed[block_number] || fs->block_refs[block_number]!=1){
+        PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+        return;
+    }
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    //equal hashes are confirmed byte by byte; indexed blocks cannot change while we hold the mutex
+    int bucket = hash % DEDUP_BUCKETS;
+    for(int b=fs->dedup_index[bucket]; b; b=fs->block_hash_next[b-1]){
+        if(fs->block_hash[b-1]==hash && memcmp(block_data(fs, b-1), block_data(fs, block_number), BLOCK_SIZE)==0){
+            __atomic_store_n(&fs->block_refs[b-1], fs->block_refs[b-1]+1, __ATOMIC_RELEASE);
+            STAT_ADD(fs, shared_refs, 1);
+            __atomic_store_n(pointer, b-1, __ATOMIC_RELEASE);
+            put_block(fs, block_number);
+            PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            TRACE_EVENT(TRACE_BLOCK_FREE, -1, -1, block_number, 0);
+            return;
+        }
+    }
 
-    data_bitmap[block_number]=0; //reset it to available
+    fs->block_hash[block_number] = hash;
+    fs->block_hash_next[block_number] = fs->dedup_index[bucket];
+    fs->dedup_index[bucket] = block_number+1;
+    __atomic_store_n(&fs->block_indexed[block_number], 1, __ATOMIC_RELEASE);
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
 }
 
+//turn deduplication of fs on (1) or off (0): blocks filled from now on are shared with identical ones or not
+//(blocks shared already stay shared until written); return the previous setting
+int rsfs_set_dedup(rsfs_t *fs, int enable){
+    return __atomic_exchange_n(&fs->dedup, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+int RSFS_set_dedup(int enable){ return rsfs_set_dedup(&rsfs_default, enable); }
+
+
+//move the block block_number of the inode pointer *pointer, held exclusively by the caller, out of its segment
+//(see log.c): to the head of the log, or, with no clean segment left, to the first free block of another segment.
+//Return the new block, or -1 if the pointer moved on, the block is shared or indexed, or no block is free
+int log_move_block(rsfs_t *fs, int *pointer, int block_number){
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    int copy = -1;
+    if(*pointer==block_number && fs->block_refs[block_number]==1 && !fs->block_indexed[block_number]){
+        copy = take_log_block(fs, pointer);
+        for(int i=0; i<NUM_DBLOCKS && copy<0; i++){
+            if(fs->data_bitmap[i]==0 && i/SEGMENT_BLOCKS!=block_number/SEGMENT_BLOCKS){
+                mark_block(fs, i, pointer);
+                copy = i;
+            }
+        }
+        if(copy>=0) move_block(fs, pointer, copy);
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    return copy;
+}
@@ -14,10 +14,41 @@
 #define NUM_DBLOCKS 32 //total number of data blocks
 #define NUM_POINTER 8 //total number of (direct) pointers for each inode; i.e., each file can have at most this number of data blocks
 #define BLOCK_SIZE 32 //size of each data block (unit: byte)
-#define NUM_OPEN_FILE 8 //maximum number of files that can be open at a time in the whole system
+#define MAX_NAME_LEN 63 //maximum length of a file or directory name (one component of a path)
+#define DIR_HASH_BUCKETS 16 //number of buckets in the name index of each directory
+#define DIR_SKIP_LEVELS 12 //levels of the sorted index of each directory (a skip list: O(log n) up to 4^12 entries)
+#define DCACHE_SIZE 256 //number of slots in the (direct-mapped) dentry cache
+#define DCACHE_NAME_LEN 31 //names longer than this are not kept in the dentry cache
+#define DEDUP_BUCKETS 64 //number of buckets in the block-hash index used by deduplication
+#define DIR_SLAB_OBJECTS 64 //number of dir_entry (and directory) objects allocated at a time
+#define MAX_SNAPSHOTS 8 //number of snapshots that can be kept at once
+#define SNAPSHOT_PATH_LEN 256 //longest path (with its terminating 0) of a file kept in a snapshot
+#define SNAPSHOT_SLAB_OBJECTS 16 //number of preserved files (struct snapshot_file) allocated at a time
+#define DEFRAG_TICK_NS 100000000L //the background defragmenter spends its budget in rounds this far apart
+#define SEGMENT_BLOCKS 4 //data blocks in each segment of the log (log-structured mode)
+#define NUM_SEGMENTS (NUM_DBLOCKS/SEGMENT_BLOCKS) //segments of the log
+#define NUM_BLOCK_CLASSES 3 //size classes of the data pool: aligned slots of 1, 2 and 4 blocks
+#define BATCH_CHUNK 64 //names a batch call (RSFS_create_many...) handles per acquisition of each lock
+#define NAME_CLASSES 4 //number of size classes in the name arena
+#define NAME_SLAB_OBJECTS 128 //number of names of one size class allocated at a time
+#define NAME_TABLE_BUCKETS 1024 //number of buckets of the table of interned names
+#define NAME_LOCKS 16 //number of locks striped over the buckets of the name table
+#define NUM_OPEN_FILE 8 //number of entries the open file table grows by at a time
+#define OPEN_FILE_CHUNKS 256 //maximum number of chunks of NUM_OPEN_FILE entries in the open file table
+#define FD_INDEX_BITS 16 //a descriptor is (generation<<FD_INDEX_BITS)|index of the open file entry
+#define FD_INDEX_MASK ((1<<FD_INDEX_BITS)-1)
+#define FD_GENERATION_MASK 0x7fff //generations wrap around within 15 bits so descriptors stay positive
+#define EPOCH_SLOTS 64 //threads, over all attached processes, that can use a shared instance at once
+#define RSFS_SHM_SIZE (1<<20) //default size of a shared-memory segment (unit: byte)
+#define RSFS_SHM_MAGIC 0x3153464853525346UL //"RSFSHFS1": set once a shared instance is initialized
 
 #define RSFS_RDONLY 0 //a value for access_flag in RSFS_open(): file is open for read only
 #define RSFS_RDWR 1 //a value for access_flag in RSFS_open(): file is open for read and write  
+#define RSFS_RDAPPEND 2 //a value for access_flag in RSFS_open(): file is open for appending, shared with readers and other appenders
+
+#define RSFS_COMPRESS_OFF 0 //a value for policy in RSFS_set_compression(): the file stays uncompressed (default)
+#define RSFS_COMPRESS_ON_CLOSE 1 //a value for policy in RSFS_set_compression(): compressed whenever its writer closes it
+#define RSFS_COMPRESS_COLD 2 //a value for policy in RSFS_set_compression(): compressed by RSFS_compress_cold() once unused
 
 #define RSFS_SEEK_SET 0 //a value for whence in RSFS_fseek()
 #define RSFS_SEEK_CUR 1 //a value for whence in RSFS_fseek()
@@ -25,26 +56,75 @@
 
 #define DEBUG 0 //1-enable debug, 0-disable debug prints
 
+#ifndef RSFS_PROFILE
+#define RSFS_PROFILE 1 //1-collect latency histograms and lock counters, 0-compile them out (make PROFILE=0)
+#endif
+#ifndef RSFS_TRACE
+#define RSFS_TRACE 1 //1-build the event tracepoints (off until RSFS_trace_start()), 0-compile them out (make TRACE=0)
+#endif
+#ifndef RSFS_RECORD
+#define RSFS_RECORD 1 //1-build the call recorder (off until RSFS_record_start()), 0-compile it out (make RECORD=0)
+#endif
+
+typedef struct rsfs rsfs_t; //one file system instance (defined below, after the structures it holds)
+
+//links between the objects of an instance are offsets from a base (the instance, unless noted) rather than
+//pointers, so that an instance in shared memory works at whatever address each process maps it; 0 is NULL
+typedef long rsfs_off_t;
+static inline rsfs_off_t to_off(void *base, void *ptr){ return ptr ? (char *)ptr - (char *)base : 0; }
+static inline void *to_ptr(void *base, rsfs_off_t off){ return off ? (char *)base + off : NULL; }
+
 //directory entry
+//(all links are offsets in the instance: see to_ptr())
 struct dir_entry{
-    char *name; //file name
-    int inode_number; //inode_number identifying the inode of the file
-    struct dir_entry *next; //pointers to form a doubly-linked list of directory entries
-    struct dir_entry *prev;
+    rsfs_off_t name; //file name (the last component of its path), interned in the name arena
+    unsigned int name_hash; //cached name_hash() of name
+    int name_len; //cached length of name
+    int inode_number; //inode_number identifying the inode of the file; -1 for a directory
+    int deleted; //set once the entry is unlinked; it is freed after an epoch grace period
+    rsfs_off_t dir; //the subdirectory (struct directory) this entry names; 0 for a regular file
+    rsfs_off_t parent; //the directory containing this entry
+    rsfs_off_t self; //offset of this entry, to find its instance when it is freed after its grace period
+    rsfs_off_t next; //links of the doubly-linked list of directory entries
+    rsfs_off_t prev;
+    rsfs_off_t hash_next; //next entry in the same bucket of the parent's index
+    rsfs_off_t sorted_next[DIR_SKIP_LEVELS]; //next entry by name at each level of the parent's sorted index (0: none)
 };
 
-//root directory: a linked list of dir_entry (directory entries) 
-struct root_dir{
-    struct dir_entry *head; //pointer to the first entry of the list
-    struct dir_entry *tail; //pointer to the last entry of the list
-    pthread_mutex_t mutex; //mutex to guard mutually-exclusive access of the list
+//directory: a linked list of dir_entry (directory entries) indexed by a hash of their names
+struct directory{
+    rsfs_off_t head; //the first entry of the list
+    rsfs_off_t tail; //the last entry of the list
+    rsfs_off_t index[DIR_HASH_BUCKETS]; //hash index of the entries by name
+    rsfs_off_t sorted[DIR_SKIP_LEVELS]; //sorted index of the entries by name: the first entry of each level
+    unsigned int version; //bumped whenever an entry is inserted or deleted; validates the dentry cache
+    int removed; //set when the directory itself is deleted, so that nothing is inserted into it any more
+    rsfs_off_t entry; //the dir_entry naming this directory; 0 for the root
+    pthread_mutex_t mutex; //mutex to guard writers of the list and the index; lookups take no lock
+};
+
+//slot of the dentry cache: remembers the result of looking up name in parent,
+//including negative results (entry==NULL); only valid while parent->version is unchanged.
+//Slots are read without a lock under a sequence counter that is odd while a writer fills the slot.
+struct dcache_slot{
+    unsigned int seq;
+    rsfs_off_t parent;
+    unsigned int hash;
+    unsigned int version; //version of parent when the slot was filled
+    rsfs_off_t entry;
+    char name[DCACHE_NAME_LEN+1]; //the last byte stays 0, so a racing reader never runs off the end
 };
-extern struct root_dir root_dir; //global variable of the root directory
 
 //inode data structure: inodes implemented in inode.c
 struct inode {
     int block[NUM_POINTER]; //(direct) pointers to data blocks; note: value<0 means the block is not used
     int length; //length of the file of the inode
+    int reserved; //end of the byte range reserved by RSFS_RDAPPEND appenders; length catches up as they publish
+    int rw_owner; //pid of the process holding rw_mutex exclusively (writer or delete), for recovery; 0 if none
+    int compressed; //bytes of compressed data held in the first blocks; 0 if the file is stored plain
+    int compress_policy; //RSFS_COMPRESS_OFF, RSFS_COMPRESS_ON_CLOSE or RSFS_COMPRESS_COLD
+    int hot; //set when the file is opened for writing or appending, cleared by RSFS_compress_cold()
+    unsigned int snap_seen; //latest snapshot the current content is accounted for in: preserved for it, or created after it
 
     //following are used to regulate concurrent reading and exclusive writing;
     //recall the solution of reader/writer's problem discussed in class
@@ -52,62 +132,174 @@ struct inode {
     pthread_mutex_t rw_mutex;
     pthread_mutex_t read_mutex;
 };
-extern struct inode inodes[NUM_INODES]; //global array of inodes
-extern pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
-
-//inode bitmap: implemented in inode.c
-extern int inode_bitmap[NUM_INODES]; //global inode bitmap
-extern pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data bitmap: implemented in data_block.c
-extern int data_bitmap[NUM_DBLOCKS]; //global data-block bitmap
-extern pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data blocks: implemented in data_block.c
-extern void *data_blocks[BLOCK_SIZE]; //global array of pointers to the data blocks
 
 //open file entry: open_file_table implemented in open_file_table.c 
 struct open_file_entry{
     int used; //0-the entry is not in use, or 1- it is in use (already allocated)
     pthread_mutex_t entry_mutex; //mutex to guard M.E. access to this entry
-    struct dir_entry *dir_entry; //pointer to the directory entry of the opened file
+    rsfs_off_t dir_entry; //the directory entry of the opened file
+    int owner; //pid of the process that opened the file, for recovery
     int position; //current position of the file
-    int access_flag; //RSFS_RDONLY or RSFS_RDWR - how the file can be accessed by the process/thread openning this file
+    int access_flag; //RSFS_RDONLY, RSFS_RDWR or RSFS_RDAPPEND - how the file can be accessed by the process/thread openning this file
+    int generation; //bumped when the entry is freed, so that descriptors of earlier opens are rejected
+    rsfs_off_t snapshot_file; //the preserved file read through this entry (struct snapshot_file); 0 for a live file
+    int next_free; //index+1 of the next entry on the free list (0: end of the list)
 };
-extern struct open_file_entry open_file_table[NUM_OPEN_FILE]; //global table (array) of open_file_entries 
-extern pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
 
 
 //routines for directory management: implemented in dir.c
-struct dir_entry *search_dir(char *file_name); //get the dir_entry for file_name
-struct dir_entry *insert_dir(char *file_name); //create a dir_entry for file_name and insert it to the root directory; the dir_entry is returned
-int delete_dir(char *file_name); //delete the dir_entry for the given file name from the global directory
+//paths are names separated by '/', relative to the root directory
+void init_dir(rsfs_t *fs, struct directory *dir); //initialize an empty directory
+void init_root_dir(rsfs_t *fs); //initialize the root directory and the dentry cache
+struct dir_entry *search_dir(rsfs_t *fs, char *file_name); //get the dir_entry for the path file_name
+struct dir_entry *insert_dir_entry(rsfs_t *fs, char *file_name, int is_dir, int *existed); //create a dir_entry (and a subdirectory if is_dir) for the path and insert it to its parent directory; *existed is set if it was there already
+struct dir_entry *insert_dir(rsfs_t *fs, char *file_name); //create a dir_entry for file_name and insert it to its parent directory; the dir_entry is returned
+int delete_dir(rsfs_t *fs, char *file_name); //delete the dir_entry for the given path from its parent directory
+int insert_file_entries(rsfs_t *fs, char **file_names, int num, int *inodes, int num_inodes, int *results, struct dir_entry **entries);
+        //insert_file_entries: create the file entries that do not exist yet, naming the given inodes; the number of inodes used
+void delete_file_entries(rsfs_t *fs, struct dir_entry **entries, int num); //delete file entries whose files the caller holds
+int dir_entry_path(rsfs_t *fs, struct dir_entry *dir_entry, char *path, int size); //the path of an entry; its length or -1 if longer than size-1
+
+
+//slab allocator of fixed-size objects: implemented in slab.c
+//(links are offsets from the cache itself, so a cache in shared memory works in every process)
+struct slab_cache{
+    size_t object_size; //size of each object (rounded up to 16 bytes)
+    int objects_per_slab; //number of objects carved out of each slab
+    rsfs_off_t free_list; //free objects, linked through their first word
+    rsfs_off_t slabs; //all slabs of the cache
+    rsfs_off_t fs; //instance the slabs are allocated from (see rsfs_alloc()); 0 for the heap
+    int num_slabs; //number of slabs allocated so far
+    int num_free; //number of objects on the free list
+    pthread_mutex_t mutex; //mutex to guard M.E. access to the cache
+};
+void slab_init(rsfs_t *fs, struct slab_cache *cache, size_t object_size, int objects_per_slab); //initialize an empty cache (fs NULL: heap)
+void *slab_alloc(struct slab_cache *cache); //allocate an object; NULL if no memory is left
+void slab_free(struct slab_cache *cache, void *object); //return an object to its cache
+void slab_destroy(struct slab_cache *cache); //release every slab of the cache at once
+
+
+//name arena of interned names: implemented in names.c
+void init_names(rsfs_t *fs); //initialize the arena and the intern table
+unsigned int name_hash(const char *str, int len); //hash of the len bytes at str
+char *name_intern(rsfs_t *fs, const char *str, int len, unsigned int hash); //get the shared copy of a name and take a reference on it
+void name_release(rsfs_t *fs, char *str); //drop a reference taken by name_intern()
+
+
+//routines for epoch-based reclamation: implemented in epoch.c
+//the readers of an instance in this process are tracked per thread; those of a shared instance,
+//in every attached process, in the slots of its epoch_domain
+struct epoch_slot{
+    int pid; //process and thread owning the slot; pid 0: free
+    int tid;
+    unsigned long epoch; //epoch observed when the thread entered its critical section
+    int active; //1 while the thread is inside a critical section
+    int nesting; //depth of nested epoch_enter() calls (owned by the thread)
+} __attribute__((aligned(64)));
+
+struct epoch_domain{
+    unsigned long global_epoch;
+    struct epoch_slot slots[EPOCH_SLOTS];
+};
+
+void epoch_domain_init(struct epoch_domain *domain); //initialize the domain of a shared instance
+void epoch_enter(rsfs_t *fs); //enter a read-side critical section on fs (may nest)
+void epoch_exit(rsfs_t *fs); //leave a read-side critical section
+void epoch_retire(rsfs_t *fs, void *ptr, void (*free_fn)(void *)); //free an unlinked object of fs after a grace period
+void epoch_barrier(rsfs_t *fs); //wait for a grace period and free every object retired so far (on fs if shared)
+int epoch_recover(struct epoch_domain *domain); //free the slots of dead processes; return how many
+void epoch_detach(struct epoch_domain *domain); //free the slots of this process before unmapping the domain
 
 
 //routines for inode management: implemented in inode.c
-int allocate_inode(); //allocate an unused inode, and the inode_number is returned
-void free_inode(int inode_number); //free (release) an inode
+int allocate_inode(rsfs_t *fs); //allocate an unused inode, and the inode_number is returned
+void free_inode(rsfs_t *fs, int inode_number); //free (release) an inode
+int allocate_inodes(rsfs_t *fs, int *inode_numbers, int num); //allocate up to num inodes under one lock; return how many
+void free_inodes(rsfs_t *fs, int *inode_numbers, int num); //free num inodes under one lock
 
 
 //routines for data block management: implemented in data_block.c
-int allocate_data_block(); //allocate an unused data block, and the block_number is returned
-void free_data_block(int block_number); //free (release) a data block
+int allocate_data_block(rsfs_t *fs, int *pointer); //allocate an unused data block for an inode pointer, and the block_number is returned
+int allocate_data_blocks(rsfs_t *fs, int *pointer, int num); //allocate a block for each inode pointer that is -1, under one lock; return how many
+void free_data_block(rsfs_t *fs, int block_number); //drop a reference to a data block; it is freed with the last one
+void free_data_blocks(rsfs_t *fs, int *blocks, int num); //free_data_block() for each block>=0, under one lock
+int writable_data_block(rsfs_t *fs, int *pointer); //unshare the block of an inode pointer before it is modified; -1 if no free block
+void dedup_data_block(rsfs_t *fs, int *pointer); //share the (full) block of an inode pointer with an identical one, if dedup is on
+void share_data_blocks(rsfs_t *fs, int *block, int *copy, int num); //copy block pointers, taking one more reference to each block
+int link_data_blocks(rsfs_t *fs, int *from, int *to, int num); //point inode pointers at shared blocks, dropping their old ones; how many were linked
+int relocate_data_block(rsfs_t *fs, int *pointer, int target); //copy the block of an inode pointer to a free block; the old block or -1
+int log_move_block(rsfs_t *fs, int *pointer, int block_number); //copy the block of an inode pointer to the head of the log; the new block or -1
+
+
+//routines for compression: implemented in compress.c
+int lz_compress(const char *src, int len, char *dst, int max); //LZ4-style compression; the compressed length or -1
+int lz_decompress(const char *src, int len, char *dst, int max); //the decompressed length or -1
+int read_compressed(rsfs_t *fs, int *block, int stored, int length, char *plain); //decompress the stored bytes of a file into plain; its length or -1
+int compress_file(rsfs_t *fs, struct inode *inode); //compress a file held exclusively: 0, 1 if not worth it, or -1
+int decompress_file(rsfs_t *fs, struct inode *inode); //store a file held exclusively plain again: 0 or -1
+void forget_compressed(rsfs_t *fs, struct inode *inode); //drop the compressed state of a file being deleted
+
+
+//routines for reading the data of an open file in place: implemented in scan.c
+//the data read: the block pointers of the file (or of its preserved copy), or a decompressed copy
+struct scan_file{
+    int *block;
+    int length;
+    const char *plain; //the whole content of a compressed file; NULL if the blocks are plain
+};
+int scan_source(rsfs_t *fs, int fd, struct scan_file *file, char *plain, const char *caller); //set up file for fd; 0 or -1
+const char *file_bytes(rsfs_t *fs, struct scan_file *file, int pos, int *avail); //the bytes at pos, *avail of them contiguous
+
+
+//point-in-time snapshots: implemented in snapshot.c
+//a file keeps its content in place; the first change to it after a snapshot preserves the content it had
+//for that snapshot (its length and block pointers, the blocks referenced once more and copied on write)
+struct snapshot_file{
+    rsfs_off_t next; //next file preserved for the same snapshot
+    int slot; //index of the snapshot in the snapshots of the instance
+    int length; //length of the file when the snapshot was taken
+    int compressed; //bytes of compressed data in the first blocks; 0 if plain
+    int block[NUM_POINTER]; //the blocks, each holding a reference (-1: not used)
+    char path[SNAPSHOT_PATH_LEN];
+};
+
+struct snapshot{
+    unsigned int id; //id of the snapshot in this slot; 0 if the slot is free
+    int open_files; //descriptors reading files of the snapshot
+    rsfs_off_t files; //files preserved for it (struct snapshot_file)
+};
+
+void init_snapshots(rsfs_t *fs); //start without snapshots
+int snapshot_preserve(rsfs_t *fs, struct dir_entry *dir_entry); //preserve a file about to change for the snapshots that need it; 0 or -1
+int snapshot_length(rsfs_t *fs, struct open_file_entry *entry); //length of the file read through a snapshot descriptor
+int snapshot_read(rsfs_t *fs, struct open_file_entry *entry, void *buf, int size); //RSFS_read() on a snapshot descriptor
+void snapshot_close_file(rsfs_t *fs, struct open_file_entry *entry); //the snapshot descriptor is being freed
 
 
 //routines for open file entry management: implemented in open_file_table.c
-int allocate_open_file_entry(int access_flag, struct dir_entry *dir_entry); 
+int init_open_file_table(rsfs_t *fs); //set up the table with its first chunk of entries
+int allocate_open_file_entry(rsfs_t *fs, int access_flag, struct dir_entry *dir_entry); 
         //allocate_open_file_entry: allocate an open file entry and initialize it with provided parameters
-void free_open_file_entry(int fd); //free (release) an open file entry
+struct open_file_entry *get_open_file_entry(rsfs_t *fs, int fd); //get the entry of fd; NULL if fd is invalid or stale
+struct open_file_entry *claim_open_file_entry(rsfs_t *fs, int fd); //claim the entry of fd for closing it; NULL if fd is invalid, stale or claimed already
+void free_open_file_entry(rsfs_t *fs, int fd); //free (release) an open file entry claimed for closing
+void destroy_open_file_table(rsfs_t *fs); //release the chunks of the table
+int recover_open_file_entries(rsfs_t *fs); //release the entries of dead processes; return how many
+void reserve_open_file_entries(rsfs_t *fs, int num); //grow the table at once until about num entries are free
 
 
 
 //api - basic: already implemented in api.c
+//every RSFS_* call works on the default instance rsfs_default; the rsfs_* calls of the same name take an instance
 int RSFS_init(); //initialize thesystem (provided)
 void RSFS_stat(); //print the file's stat (provided)
 
 //api - basic: required to be implemented in api.c
 int RSFS_create(char *file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
 int RSFS_open(char *file_name, int access_flag); //open an existing file and return the file handler
+int RSFS_try_open(char *file_name, int access_flag); //like RSFS_open, but return -2 instead of blocking
+void release_open_lock(rsfs_t *fs, struct inode *inode, int access_flag); //undo the reader/writer hold taken when opening
+void release_rw_mutex(rsfs_t *fs, struct inode *inode); //unlock the rw_mutex of inode and wake the opens parked by rings
 int RSFS_append(int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
 int RSFS_fseek(int fd, int offset); //change the current location of the file
 int RSFS_read(int fd, void *buf, int size); //read from file, and return the actual number of bytes read
@@ -117,7 +309,631 @@ int RSFS_close(int fd); //close the file
 int RSFS_write(int fd, void *buf, int size);
 int RSFS_cut(int fd, int size); 
 int RSFS_delete(char *file_name); //delete the file with the provided file_name
+int RSFS_mkdir(char *path); //create an empty directory
+int RSFS_rmdir(char *path); //delete an empty directory
+
+//api - batched metadata: implemented in api.c
+int RSFS_create_open(char *file_name, int access_flag); //create a file that must not exist and open it: the descriptor, -1 if it exists, -2 on error
+int RSFS_create_many(char **file_names, int num, int *results); //create files (results[i]: 0, -1 if it exists, -2); return how many were created
+int RSFS_open_many(char **file_names, int num, int access_flag, int *fds); //open files like RSFS_open (fds[i]: descriptor or -1); return how many
+int RSFS_delete_many(char **file_names, int num, int *results); //delete files (results[i]: 0 or -1); return how many were deleted
+
+
+//statistics: implemented in stats.c
+struct rsfs_counter{
+    long value;
+} __attribute__((aligned(64))); //one cache line per counter, so updaters of different counters do not collide
+
+//counters updated by the allocation and free routines
+struct rsfs_counters{
+    struct rsfs_counter used_blocks;
+    struct rsfs_counter used_inodes;
+    struct rsfs_counter open_files;
+    struct rsfs_counter num_files;
+    struct rsfs_counter num_dirs;
+    struct rsfs_counter shared_refs; //references to data blocks beyond the first, saved by deduplication
+    struct rsfs_counter compressed_files;
+    struct rsfs_counter compressed_bytes; //length of the compressed files
+    struct rsfs_counter compressed_stored; //bytes the compressed files take in their blocks
+    struct rsfs_counter defrag_moves; //blocks relocated by the defragmenter
+    struct rsfs_counter log_writes; //blocks taken at the head of the log
+    struct rsfs_counter cleaned_segments; //segments emptied by the log cleaner
+    struct rsfs_counter cleaner_moves; //live blocks it copied to the head of the log
+};
+#define STAT_ADD(fs, counter, n) __atomic_add_fetch(&(fs)->counters.counter.value, (n), __ATOMIC_RELAXED)
+
+//snapshot of the counters returned by RSFS_get_stats()
+struct rsfs_stats{
+    long total_blocks;
+    long used_blocks;
+    long total_inodes;
+    long used_inodes;
+    long open_files;
+    long num_files; //regular files in all directories
+    long num_dirs; //directories, not counting the root
+    long shared_refs; //block references served by a block that is already used (blocks saved by dedup)
+    double dedup_ratio; //blocks referenced by files per used block (1.0 without sharing)
+    long compressed_files; //files stored compressed
+    long compressed_bytes; //their length
+    long compressed_stored; //bytes they take in their blocks
+    double compression_ratio; //compressed_bytes per stored byte (1.0 if no file is compressed)
+    long defrag_moves; //blocks relocated by the defragmenter
+};
+
+void init_stats(rsfs_t *fs); //reset the counters
+
+//entry of a directory listing
+struct rsfs_dirent{
+    char name[MAX_NAME_LEN+1];
+    int inode_number; //-1 for a directory
+    int length; //length of the file (0 for a directory)
+    int is_dir;
+};
+
+//iterator over a directory listing taken at one instant
+struct rsfs_dir_iter{
+    struct rsfs_dirent *entries;
+    int num_entries;
+    int position;
+};
+
+//cursor of RSFS_readdir_plus(): it remembers a name, not an entry, so it stays valid whatever is created or deleted
+struct rsfs_readdir_cursor{
+    char *path; //the directory listed ("" is the root)
+    char last[MAX_NAME_LEN+1]; //name of the last entry returned; the next batch resumes after it
+    int started; //0 until an entry has been returned
+};
+
+int snapshot_dir(rsfs_t *fs, char *path, struct rsfs_dirent **entries); //dir.c: copy the listing of a directory; return the number of entries or -1
+int list_dir_sorted(rsfs_t *fs, char *path, const char *after, const char *prefix, struct rsfs_dirent *out, int max);
+        //list_dir_sorted: dir.c: copy up to max entries of a directory named prefix*, in name order, from after on; how many or -1
+
+//api - statistics and listing: implemented in stats.c and api.c
+void RSFS_get_stats(struct rsfs_stats *stats); //read the counters; takes no lock and scans nothing
+int RSFS_set_dedup(int enable); //share identical full blocks from now on (1) or stop (0); return the previous setting
+int RSFS_set_compression(char *file_name, int policy); //set the RSFS_COMPRESS_* policy of a file; 0 or -1
+int RSFS_compress_cold(); //compress the RSFS_COMPRESS_COLD files unused since the last call; return how many
+int RSFS_snapshot_create(); //freeze every file as it is now, in constant time; return the snapshot id, or -1 if all are kept
+int RSFS_snapshot_open_file(int snapshot, char *file_name); //open the file as it was in the snapshot, read-only; the descriptor or -1
+int RSFS_snapshot_drop(int snapshot); //release a snapshot and its blocks; 0, or -1 if unknown or a file of it is open
+int RSFS_opendir(char *path, struct rsfs_dir_iter *iter); //take a consistent listing of a directory ("" is the root)
+int RSFS_readdir(struct rsfs_dir_iter *iter, struct rsfs_dirent *dirent); //next entry of the listing; -1 at the end
+void RSFS_closedir(struct rsfs_dir_iter *iter); //release the listing
+void RSFS_readdir_start(struct rsfs_readdir_cursor *cursor, char *path); //set a cursor to the start of the directory path
+int RSFS_readdir_plus(struct rsfs_readdir_cursor *cursor, char *prefix, struct rsfs_dirent *out, int max);
+        //RSFS_readdir_plus: the next (up to max) entries named prefix*, in name order, with their attributes; 0 at the end, -1 on error
+
+
+//content scans: implemented in scan.c
+//kernels that look for the first byte of a pattern (process-wide)
+enum rsfs_scan_kernel{
+    RSFS_KERNEL_AUTO, RSFS_KERNEL_SCALAR, RSFS_KERNEL_SSE2, RSFS_KERNEL_AVX2
+};
+typedef int (*rsfs_scan_fn)(int offset, void *arg); //called by RSFS_scan() for each match; nonzero stops the scan
+
+int RSFS_find(int fd, const void *pattern, int len, int start_offset); //offset of the first match at or after start_offset; -1 if none, -2 on error
+int RSFS_scan(int fd, const void *pattern, int len, int start_offset, rsfs_scan_fn fn, void *arg); //call fn for each match; the number of calls or -1
+int RSFS_scan_use_kernel(int kernel); //force an RSFS_KERNEL_* kernel (AUTO: the best one); -1 if the CPU lacks it
+const char *RSFS_scan_kernel_name(); //name of the kernel in use
+
+
+//copies between files, and between files and host file descriptors: implemented in copy.c
+int RSFS_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len); //copy len bytes without a bounce buffer; the bytes copied or -1
+int RSFS_import_fd(int host_fd, int rsfs_fd, int len); //readv() up to len bytes from a host fd into the blocks; the bytes imported or -1
+int RSFS_export_fd(int rsfs_fd, int host_fd, int len); //writev() up to len bytes from the blocks to a host fd; the bytes exported or -1
+
+
+//defragmentation: implemented in defrag.c
+//fragmentation of the data blocks, as scanned by RSFS_frag_report()
+struct rsfs_frag_report{
+    int file_extents[NUM_INODES]; //runs of consecutive blocks holding the file of each inode (0: no file or empty)
+    long files; //files with at least one block
+    long extents; //their extents in all
+    int max_extents; //extents of the most fragmented file
+    long free_blocks;
+    long free_runs; //runs of consecutive free blocks
+    long largest_free_run; //blocks in the longest one
+    long slack_bytes; //bytes of the files' last blocks past their content
+    long free_slots[NUM_BLOCK_CLASSES]; //free slots of each size class (of 1, 2, 4... blocks)
+};
 
+//background defragmenter started by RSFS_defrag_start()
+struct rsfs_defragger{
+    rsfs_t *fs;
+    int moves_per_tick; //budget of each round (DEFRAG_TICK_NS apart)
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t mutex; //guards stop
+    pthread_cond_t cond; //signalled to stop
+};
 
+int RSFS_defrag(int max_moves); //move up to max_moves blocks so that files are contiguous and packed; return how many moved
+void RSFS_frag_report(struct rsfs_frag_report *report); //scan the files and the free blocks
+struct rsfs_defragger *RSFS_defrag_start(int moves_per_second); //defragment in the background at this rate; NULL on error
+void RSFS_defrag_stop(struct rsfs_defragger *defragger); //stop and free a background defragmenter
+
+
+//log-structured mode: implemented in log.c and data_block.c
+//the data blocks form a log of NUM_SEGMENTS segments; blocks are taken in order at the head of the log,
+//and a block being written is copied there and its old copy freed, so writes never wait on a search for space.
+//The cleaner empties the segments that are cheapest to clean for the benefit, to keep clean ones for the head
+struct rsfs_log_stats{
+    int log_mode; //1 if the mode is on
+    int head_segment; //segment the head of the log is in (-1: none yet)
+    int clean_segments; //segments without a live block
+    int segment_live[NUM_SEGMENTS]; //live blocks of each segment
+    unsigned long segment_age[NUM_SEGMENTS]; //blocks written to the log since each segment was last written
+    double utilization; //live blocks per block of the segments in use (0 if none)
+    long log_writes; //blocks taken at the head of the log
+    long cleaned_segments; //segments emptied by the cleaner
+    long cleaner_moves; //live blocks it copied
+};
 
+void log_clean_if_needed(rsfs_t *fs); //clean a segment if the log is out of clean ones (and the cleaner is idle)
+int RSFS_set_log_mode(int enable); //write blocks at the head of the log (1) or in place (0); return the previous setting
+int RSFS_log_clean(int max_segments); //empty up to max_segments segments, best first; return how many were emptied
+void RSFS_log_stats(struct rsfs_log_stats *stats); //read the state of the log and its segments
+
+
+//file system instance: every piece of state of one file system, so that instances share nothing;
+//it is aligned to a cache line, and so is everything it allocates, so instances never share one.
+//A shared instance is the head (the superblock) of a shared-memory segment; everything it allocates
+//comes from the rest of the segment, and every link in it is an offset
+struct name;
+struct rsfs{
+    //superblock: implemented in shm.c
+    unsigned long magic; //RSFS_SHM_MAGIC once a shared instance is initialized
+    int shared; //1 if the instance lives in a shared-memory segment
+    size_t size; //size of the segment
+    size_t arena_used; //bytes of the segment handed out by rsfs_alloc()
+    pthread_mutex_t arena_mutex;
+    struct epoch_domain epoch; //readers of a shared instance
+
+    //directories: implemented in dir.c and names.c
+    struct directory root_dir; //root directory
+    struct dcache_slot dcache[DCACHE_SIZE]; //dentry cache (direct-mapped)
+    struct slab_cache dir_entry_slab; //dir_entry objects
+    struct slab_cache directory_slab; //subdirectories
+    struct slab_cache name_slabs[NAME_CLASSES]; //name arena, by size class
+    rsfs_off_t name_table[NAME_TABLE_BUCKETS]; //intern table
+    pthread_mutex_t name_locks[NAME_LOCKS]; //each lock guards every NAME_LOCKS-th bucket
+
+    //inodes and inode bitmap: implemented in inode.c
+    struct inode inodes[NUM_INODES];
+    pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
+    int inode_bitmap[NUM_INODES];
+    pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+
+    //data blocks and data bitmap: implemented in data_block.c
+    rsfs_off_t block_pool; //one cache-aligned allocation holding every data block (see block_data())
+    int data_bitmap[NUM_DBLOCKS];
+    int class_used[NUM_BLOCK_CLASSES][NUM_DBLOCKS]; //blocks used in each slot of 1<<class blocks (0: the slot is free)
+    pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap and of the fields below
+
+    //deduplication: implemented in data_block.c
+    int dedup; //1 if full blocks are shared with identical ones as they are written
+    int block_refs[NUM_DBLOCKS]; //inode pointers to each block (1 unless shared)
+    int block_indexed[NUM_DBLOCKS]; //1 if the block is in the index (its content must not change in place)
+    unsigned long block_hash[NUM_DBLOCKS]; //hash of an indexed block
+    int block_hash_next[NUM_DBLOCKS]; //next block+1 in the same bucket (0: end)
+    int dedup_index[DEDUP_BUCKETS]; //first block+1 of each bucket, by hash
+
+    //log-structured mode: implemented in log.c and data_block.c
+    int log_mode; //1 if blocks are written at the head of the log
+    int log_head; //next block of the head segment (-1: the head segment is used up)
+    int log_segment; //head segment (-1: none yet)
+    unsigned long log_seq; //blocks written to the log so far
+    int segment_live[NUM_SEGMENTS]; //live blocks of each segment
+    unsigned long segment_written[NUM_SEGMENTS]; //log_seq when each segment was last written
+    int block_owner[NUM_DBLOCKS]; //inode map: inode_number*NUM_POINTER+pointer the block was allocated to (-1: none)
+    pthread_mutex_t cleaner_mutex; //serializes the cleaner
+
+    //snapshots: implemented in snapshot.c
+    unsigned int snapshot_id; //id of the latest snapshot taken (ids only grow; 0: none yet)
+    struct snapshot snapshots[MAX_SNAPSHOTS];
+    struct slab_cache snapshot_slab; //struct snapshot_file objects
+    pthread_mutex_t snapshot_mutex; //mutex to guard the slots, their lists and the preserving of files
+
+    //open file table: implemented in open_file_table.c
+    rsfs_off_t open_file_table[OPEN_FILE_CHUNKS]; //chunks of NUM_OPEN_FILE entries; 0 if not allocated yet
+    int open_file_chunks; //number of allocated chunks
+    unsigned long open_file_free; //head of the free list: ABA tag in the high 32 bits, index+1 in the low 32 bits (0: empty)
+    pthread_mutex_t open_file_table_mutex; //serializes growing the table; allocation itself is lock-free
+
+    pthread_mutex_t mutex_for_fs_stat;
+    struct rsfs_counters counters; //statistics: implemented in stats.c
+} __attribute__((aligned(64)));
+
+extern rsfs_t rsfs_default; //the instance behind the RSFS_* calls
+
+//the data of block block_number of fs
+static inline char *block_data(rsfs_t *fs, int block_number){
+    return (char *)to_ptr(fs, fs->block_pool) + (long)block_number*BLOCK_SIZE;
+}
+
+//shared-memory instances: implemented in shm.c
+void *rsfs_alloc(rsfs_t *fs, size_t size); //cache-aligned memory for fs: from its segment if shared, else the heap
+void rsfs_release(rsfs_t *fs, void *ptr); //give back memory of rsfs_alloc() (segment memory goes with the segment)
+void rsfs_mutex_init(rsfs_t *fs, pthread_mutex_t *mutex, int robust); //process-shared (and robust) if fs is shared
+int rsfs_mutex_lock(pthread_mutex_t *mutex); //lock, taking over a robust mutex whose owner died
+int rsfs_mutex_trylock(pthread_mutex_t *mutex);
+int rsfs_process_alive(int pid); //1 if process pid still exists
+
+//api - shared memory: the instance is used with the rsfs_* calls
+rsfs_t *rsfs_shm_create(const char *name, size_t size); //create and initialize a segment (size 0: RSFS_SHM_SIZE)
+rsfs_t *rsfs_shm_attach(const char *name); //map an existing segment and recover what dead processes left
+int rsfs_shm_detach(rsfs_t *fs); //unmap a segment; files opened by this process have to be closed first
+int rsfs_shm_unlink(const char *name); //remove the segment name (attached processes keep their mapping)
+int rsfs_shm_recover(rsfs_t *fs); //release the files, locks and epoch slots of dead processes; return how many
+
+//api - instances: implemented in api.c
+int rsfs_init(rsfs_t *fs); //initialize an instance in place (RSFS_init() does it for rsfs_default)
+rsfs_t *rsfs_new(); //allocate and initialize an instance; NULL on failure
+int rsfs_free(rsfs_t *fs); //release an instance from rsfs_new(); it must have no open file and no call in progress
+
+//api - per instance: the same contracts as the RSFS_* calls
+void rsfs_stat(rsfs_t *fs);
+int rsfs_create(rsfs_t *fs, char *file_name);
+int rsfs_open(rsfs_t *fs, char *file_name, int access_flag);
+int rsfs_try_open(rsfs_t *fs, char *file_name, int access_flag);
+int rsfs_append(rsfs_t *fs, int fd, void *buf, int size);
+int rsfs_fseek(rsfs_t *fs, int fd, int offset);
+int rsfs_read(rsfs_t *fs, int fd, void *buf, int size);
+int rsfs_close(rsfs_t *fs, int fd);
+int rsfs_write(rsfs_t *fs, int fd, void *buf, int size);
+int rsfs_cut(rsfs_t *fs, int fd, int size);
+int rsfs_delete(rsfs_t *fs, char *file_name);
+int rsfs_mkdir(rsfs_t *fs, char *path);
+int rsfs_rmdir(rsfs_t *fs, char *path);
+int rsfs_create_open(rsfs_t *fs, char *file_name, int access_flag);
+int rsfs_create_many(rsfs_t *fs, char **file_names, int num, int *results);
+int rsfs_open_many(rsfs_t *fs, char **file_names, int num, int access_flag, int *fds);
+int rsfs_delete_many(rsfs_t *fs, char **file_names, int num, int *results);
+void rsfs_get_stats(rsfs_t *fs, struct rsfs_stats *stats);
+int rsfs_set_dedup(rsfs_t *fs, int enable);
+int rsfs_set_compression(rsfs_t *fs, char *file_name, int policy);
+int rsfs_compress_cold(rsfs_t *fs);
+int rsfs_snapshot_create(rsfs_t *fs);
+int rsfs_snapshot_open_file(rsfs_t *fs, int snapshot, char *file_name);
+int rsfs_snapshot_drop(rsfs_t *fs, int snapshot);
+int rsfs_set_log_mode(rsfs_t *fs, int enable);
+int rsfs_log_clean(rsfs_t *fs, int max_segments);
+void rsfs_log_stats(rsfs_t *fs, struct rsfs_log_stats *stats);
+int rsfs_find(rsfs_t *fs, int fd, const void *pattern, int len, int start_offset);
+int rsfs_scan(rsfs_t *fs, int fd, const void *pattern, int len, int start_offset, rsfs_scan_fn fn, void *arg);
+int rsfs_copy_range(rsfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len);
+int rsfs_import_fd(rsfs_t *fs, int host_fd, int rsfs_fd, int len);
+int rsfs_export_fd(rsfs_t *fs, int rsfs_fd, int host_fd, int len);
+int rsfs_defrag(rsfs_t *fs, int max_moves);
+void rsfs_frag_report(rsfs_t *fs, struct rsfs_frag_report *report);
+struct rsfs_defragger *rsfs_defrag_start(rsfs_t *fs, int moves_per_second); //RSFS_defrag_stop() needs no instance
+int rsfs_opendir(rsfs_t *fs, char *path, struct rsfs_dir_iter *iter); //readdir and closedir need no instance
+int rsfs_readdir_plus(rsfs_t *fs, struct rsfs_readdir_cursor *cursor, char *prefix, struct rsfs_dirent *out, int max);
+
+
+//profiling: implemented in profile.c
+//operations timed at the RSFS_* entry points
+enum prof_op{
+    PROF_CREATE, PROF_OPEN, PROF_TRY_OPEN, PROF_APPEND, PROF_FSEEK, PROF_READ, PROF_WRITE,
+    PROF_CUT, PROF_CLOSE, PROF_DELETE, PROF_MKDIR, PROF_RMDIR, PROF_STAT, PROF_OPENDIR,
+    PROF_SNAPSHOT_CREATE, PROF_SNAPSHOT_OPEN_FILE, PROF_SNAPSHOT_DROP,
+    PROF_CREATE_OPEN, PROF_CREATE_MANY, PROF_OPEN_MANY, PROF_DELETE_MANY, PROF_READDIR_PLUS,
+    PROF_FIND, PROF_SCAN, PROF_COPY_RANGE, PROF_IMPORT_FD, PROF_EXPORT_FD,
+    PROF_OPS
+};
+//classes of the mutexes whose acquisitions are counted
+enum prof_lock{
+    LOCK_INODE_RW, LOCK_INODE_READ, LOCK_DIR, LOCK_OPEN_FILE_TABLE, LOCK_DATA_BITMAP,
+    LOCK_INODE_BITMAP, LOCK_NAMES, LOCK_SLAB, LOCK_FS_STAT, LOCK_SNAPSHOT,
+    PROF_LOCKS
+};
+
+//summary of a latency histogram
+struct rsfs_latency{
+    unsigned long count;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned long p50_ns; //percentiles are upper bounds of histogram buckets (within 12.5%)
+    unsigned long p99_ns;
+    unsigned long p999_ns;
+};
+
+//profile merged from every thread by RSFS_get_profile()
+struct rsfs_profile{
+    struct rsfs_latency op_latency[PROF_OPS];
+    unsigned long op_bytes[PROF_OPS]; //bytes moved by read, write, append and cut
+    struct rsfs_latency lock_wait[PROF_LOCKS]; //time to acquire, 0 when uncontended
+    unsigned long lock_contended[PROF_LOCKS]; //acquisitions that had to wait
+    unsigned long lock_hold_ns[PROF_LOCKS]; //total time held, counted by the thread that took the lock
+};
+
+//timer of one RSFS_* call, recorded (and traced) when it goes out of scope
+struct prof_scope{
+    int op;
+    unsigned long start;
+    long bytes;
+    int inode_number; //file the call worked on, for the trace (-1 if none)
+    int fd;
+    int offset;
+    unsigned long wait_ns; //time spent waiting for contended locks during the call
+    struct prof_scope *parent; //scope of the enclosing call on this thread
+    char *path; //path argument of the call, for the recorder (NULL if none)
+    int path_len; //bytes of path if it is not a string (the pattern of a find), 0 if it is
+    int arg; //access flag, size or offset argument of the call, for the recorder
+    int args[3]; //further arguments of the call (the offsets of a copy), for the recorder
+    int num_args;
+    char **names; //paths of a batch call (or the strings of a readdir_plus), for the recorder (NULL if none)
+    int num_names;
+    int *results; //descriptors a batch open returns (one per name), for the recorder (NULL if none)
+};
+
+unsigned long prof_now(); //monotonic time in ns
+void prof_op_end(struct prof_scope *scope);
+void prof_lock(pthread_mutex_t *mutex, int lock);
+int prof_trylock(pthread_mutex_t *mutex, int lock);
+void prof_unlock(pthread_mutex_t *mutex, int lock);
+
+void prof_op_begin(struct prof_scope *scope);
+void prof_op_suspend(struct prof_scope *scope);
+void prof_op_resume(struct prof_scope *scope);
+
+#if RSFS_PROFILE || RSFS_TRACE || RSFS_RECORD
+//open the scope of an RSFS_* call with its arguments (path or NULL, fd or -1, flag/size/offset)
+#define PROF_OP(o, p, f, a) struct prof_scope prof_scope __attribute__((cleanup(prof_op_end))) = \
+    {.op = (o), .start = prof_now(), .inode_number = -1, .fd = (f), .path = (p), .arg = (a)}; prof_op_begin(&prof_scope)
+#define PROF_BYTES(n) (prof_scope.bytes = (n)) //record the bytes moved; evaluates to n
+#define PROF_FILE(i, f, o) (prof_scope.inode_number = (i), prof_scope.fd = (f), prof_scope.offset = (o)) //file the call works on
+#define PROF_ARG(a) (prof_scope.arg = (a)) //record an argument the call decides (the id of a new snapshot); evaluates to a
+#define PROF_NAMES(n, num, r) (prof_scope.names = (n), prof_scope.num_names = (num), prof_scope.results = (r)) //paths of a batch call
+#define PROF_DATA(p, n) (prof_scope.path = (char *)(p), prof_scope.path_len = (n)) //bytes recorded in place of a path
+#define PROF_ARGS(num, a, b, c) (prof_scope.args[0] = (a), prof_scope.args[1] = (b), prof_scope.args[2] = (c), prof_scope.num_args = (num))
+#define PROF_SUSPEND() prof_op_suspend(&prof_scope) //run code of the caller (a callback): the calls it makes are not nested
+#define PROF_RESUME() prof_op_resume(&prof_scope)
+#define PROF_LOCK(mutex, lock) prof_lock((mutex), (lock))
+#define PROF_TRYLOCK(mutex, lock) prof_trylock((mutex), (lock))
+#define PROF_UNLOCK(mutex, lock) prof_unlock((mutex), (lock))
+#else
+#define PROF_OP(o, p, f, a) ((void)0)
+#define PROF_BYTES(n) (n)
+#define PROF_FILE(i, f, o) ((void)0)
+#define PROF_ARG(a) (a)
+#define PROF_NAMES(n, num, r) ((void)(n))
+#define PROF_DATA(p, n) ((void)0)
+#define PROF_ARGS(num, a, b, c) ((void)0)
+#define PROF_SUSPEND() ((void)0)
+#define PROF_RESUME() ((void)0)
+#define PROF_LOCK(mutex, lock) rsfs_mutex_lock(mutex)
+#define PROF_TRYLOCK(mutex, lock) rsfs_mutex_trylock(mutex)
+#define PROF_UNLOCK(mutex, lock) pthread_mutex_unlock(mutex)
+#endif
+
+//api - profiling
+int RSFS_get_profile(struct rsfs_profile *profile); //merge the per-thread data; -1 if profiling is compiled out
+void RSFS_reset_profile(); //start counting from zero
+void RSFS_dump_profile(FILE *out, int json); //print the profile as a text table or as JSON
+
+
+//event tracing: implemented in trace.c
+//events besides the RSFS_* calls (which use their enum prof_op value)
+enum trace_event{
+    TRACE_DIR_INSERT = PROF_OPS, TRACE_DIR_DELETE, TRACE_INODE_ALLOC, TRACE_INODE_FREE,
+    TRACE_BLOCK_ALLOC, TRACE_BLOCK_FREE, TRACE_FD_ALLOC, TRACE_FD_FREE,
+    TRACE_LOCK_WAIT, //a contended lock; the lock class is in size
+    TRACE_EVENTS
+};
+#define TRACE_RING_RECORDS 4096 //records kept per thread (a power of 2); older ones are overwritten
+#define TRACE_MAGIC "RSFSTRC1" //first bytes of a trace dump
+
+//fixed-size binary trace record
+struct rsfs_trace_record{
+    unsigned long timestamp; //ns, CLOCK_MONOTONIC; start of the event
+    unsigned long duration; //ns; 0 for an instant event
+    unsigned long wait_ns; //time waited on contended locks
+    int thread; //small id of the thread, in order of first trace
+    int op; //enum prof_op or enum trace_event
+    int inode_number; //-1 if none
+    int fd; //-1 if none
+    int offset; //file position, or the block number of a block event
+    int size; //bytes moved, or the lock class of a lock wait
+};
+
+//header of a trace dump, followed by num_records records
+struct rsfs_trace_header{
+    char magic[8];
+    int record_size;
+    int num_records;
+};
+
+extern int rsfs_tracing; //1 while tracing is on
+void trace_record(int op, unsigned long timestamp, unsigned long duration, unsigned long wait_ns, int inode_number, int fd, int offset, int size);
+
+#if RSFS_TRACE
+#define TRACE_EVENT(op, inode, fd, offset, size) \
+    do{ if(__builtin_expect(__atomic_load_n(&rsfs_tracing, __ATOMIC_RELAXED), 0)) trace_record((op), prof_now(), 0, 0, (inode), (fd), (offset), (size)); }while(0)
+#else
+#define TRACE_EVENT(op, inode, fd, offset, size) ((void)0)
+#endif
+
+//api - tracing
+void RSFS_trace_start(); //start recording events into the per-thread rings
+void RSFS_trace_stop(); //stop recording; the rings keep their records
+int RSFS_trace_dump(char *path); //write every thread's records to a file; return the number of records or -1
+
+
+//call recorder: implemented in record.c
+#define RECORD_MAGIC "RSFSREC2" //first bytes of a recording
+#define RECORD_BUFFER 4096 //bytes buffered per thread before they are written out
+
+//one recorded RSFS_* call, followed by path_len bytes of its path
+//A record is followed by path_len bytes of path (the paths of a batch call, each ended by a 0, or the pattern of
+//a find), then num_args ints (the further arguments of the call, then the descriptors a batch open returned)
+struct rsfs_call_record{
+    unsigned long time; //ns from RSFS_record_start() to the call
+    unsigned short thread; //small id of the calling thread
+    unsigned char op; //enum prof_op
+    unsigned short path_len;
+    unsigned short num_args;
+    int fd; //fd argument, or the descriptor returned by open/try_open/create_open
+    int arg; //access flag, size or offset argument, or the snapshot id of a snapshot call
+};
+
+extern int rsfs_recording; //1 while calls are recorded
+void record_call(struct prof_scope *scope); //called when a recorded RSFS_* call returns
+
+//api - recording
+int RSFS_record_start(char *path); //record every RSFS_* call into the file at path; 0 or -1
+int RSFS_record_stop(); //flush and close the recording; return the number of calls recorded or -1
+
+
+//asynchronous ring api: implemented in ring.c
+#define RSFS_OP_OPEN 0 //opcodes of a submission queue entry
+#define RSFS_OP_READ 1
+#define RSFS_OP_WRITE 2
+#define RSFS_OP_APPEND 3
+#define RSFS_OP_CLOSE 4
+#define RSFS_OP_DELETE 5
+
+#define RING_DEFAULT_WORKERS 4 //number of workers used when RSFS_ring_init() is given num_workers<=0
+#define RING_WORKER_BATCH 8 //maximum number of submissions a worker takes per acquisition of the submission lock
+#define RING_PARK_POLL_NS 10000000L //a worker with parked opens on a shared instance also retries them this often
+                                    //(files let go by other processes wake no worker here)
+
+//submission queue entry: one operation for the worker pool
+struct rsfs_sqe{
+    int opcode; //one of RSFS_OP_*
+    char *file_name; //OPEN, DELETE
+    int access_flag; //OPEN
+    int fd; //READ, WRITE, APPEND, CLOSE
+    void *buf; //READ, WRITE, APPEND
+    int size; //READ, WRITE, APPEND
+    int offset; //READ, WRITE: position to seek to first; <0 means the current position
+    unsigned long user_data; //passed back untouched in the completion
+};
+
+//completion queue entry: the result of one submitted operation
+struct rsfs_cqe{
+    unsigned long user_data; //user_data of the submission
+    int result; //return value of the corresponding RSFS_* call
+};
+
+//one worker of a ring, with the queue of the submissions routed to it
+struct rsfs_ring_worker{
+    struct rsfs_ring *ring;
+    pthread_t thread;
+    struct rsfs_sqe *sq; //its submissions, in submission order (capacity: the entries of the ring)
+    unsigned int sq_head; //next entry the worker takes (guarded by sq_mutex of the ring)
+    unsigned int sq_tail; //end of the entries routed to it (guarded by sq_mutex of the ring)
+    pthread_cond_t cond; //signalled when submissions are routed to it, a file is closed or the ring stops
+};
+
+//submission/completion ring pair serviced by a pool of worker threads.
+//The submissions on one fd all go to the same worker, which runs them in submission order
+struct rsfs_ring{
+    unsigned int entries; //capacity of each queue (power of two)
+    int inflight; //submissions handed out by RSFS_ring_get_sqe() whose completions are not reaped yet
+
+    struct rsfs_sqe *sq; //submission queue, from which RSFS_ring_submit() routes the entries to the workers
+    unsigned int sq_tail; //end of the published submissions (guarded by sq_mutex)
+    unsigned int sq_local_tail; //end of the prepared submissions (owned by the caller)
+    unsigned int next_worker; //worker the next OPEN or DELETE goes to (they have no fd; guarded by sq_mutex)
+    unsigned int release_seq; //holds of files on fs released so far, for the workers with parked opens (guarded by sq_mutex)
+    pthread_mutex_t sq_mutex;
+
+    struct rsfs_cqe *cq; //completion queue
+    unsigned int cq_head; //next completion to reap (owned by the caller)
+    unsigned int cq_tail; //end of the posted completions (workers post under cq_mutex)
+    pthread_mutex_t cq_mutex;
+    int event_fd; //eventfd signalled whenever completions are posted
+
+    rsfs_t *fs; //instance the submissions run against
+    int num_workers;
+    struct rsfs_ring_worker *workers;
+    int stop; //set by RSFS_ring_exit() to shut the workers down
+    struct rsfs_ring *next_ring; //next ring of this process (see ring_notify_release())
+};
+
+int RSFS_ring_init(struct rsfs_ring *ring, int entries, int num_workers); //set up a ring on rsfs_default and start its workers
+int rsfs_ring_init(rsfs_t *fs, struct rsfs_ring *ring, int entries, int num_workers); //set up a ring on the instance fs
+struct rsfs_sqe *RSFS_ring_get_sqe(struct rsfs_ring *ring); //get a free submission entry to fill; NULL if the ring is full
+int RSFS_ring_submit(struct rsfs_ring *ring); //publish all prepared entries to the workers; return the number submitted
+int RSFS_ring_peek_cqe(struct rsfs_ring *ring, struct rsfs_cqe *cqe); //reap one completion without blocking; -1 if none
+int RSFS_ring_wait_cqe(struct rsfs_ring *ring, struct rsfs_cqe *cqe); //reap one completion, waiting on the eventfd if needed
+int RSFS_ring_eventfd(struct rsfs_ring *ring); //the eventfd to poll for completions
+void RSFS_ring_exit(struct rsfs_ring *ring); //stop the workers and release the ring
+void ring_notify_release(rsfs_t *fs); //a file of fs was let go: wake the workers of rings on fs that have parked opens
+
+
+//local server: implemented in server.c (the rsfsd daemon is rsfsd.c) and client.c
+//a client sends requests over a Unix-domain socket and may send more before the answers come back;
+//each request is a struct rsfsd_request followed by path_len bytes of path, each answer a struct rsfsd_response,
+//in request order. The data of reads and writes never crosses the socket: it is placed in a buffer of
+//shared memory that the client hands to the server (as a file descriptor) in its RSFSD_HELLO request
+#define RSFSD_DEFAULT_WORKERS 4 //number of workers used when rsfsd_start() is given num_workers<=0
+#define RSFSD_MAX_PATH 4096 //longest path a request may carry
+#define RSFSD_BUFFER_SIZE (1<<16) //size of the shared buffer of a client when rsfsd_connect() is given 0
+#define RSFSD_RETRY_NS 1000000 //how long a client waiting to open a file waits before the open is retried
+
+//operations of a request; fd, arg and offset are used as noted
+enum rsfsd_op{
+    RSFSD_HELLO, //arg: size of the buffer whose descriptor comes with the request
+    RSFSD_CREATE, RSFSD_DELETE, RSFSD_MKDIR, RSFSD_RMDIR, //path
+    RSFSD_OPEN, RSFSD_TRY_OPEN, //path, arg: access flag
+    RSFSD_READ, RSFSD_WRITE, RSFSD_APPEND, //fd, arg: size, offset: where the data is in the buffer
+    RSFSD_FSEEK, RSFSD_CUT, //fd, arg: position or size
+    RSFSD_CLOSE, //fd
+    RSFSD_GET_STATS, //offset: where a struct rsfs_stats is put in the buffer
+    RSFSD_OPS
+};
+
+struct rsfsd_request{
+    unsigned int id; //echoed in the response
+    unsigned short op; //one of rsfsd_op
+    unsigned short path_len; //bytes of path following the request
+    int fd;
+    int arg;
+    unsigned int offset;
+};
+
+struct rsfsd_response{
+    unsigned int id; //id of the request
+    int result; //return value of the corresponding RSFS_* call (-1 for a malformed request)
+};
+
+//server: an epoll loop hands clients with pending requests to a pool of workers;
+//a worker runs the requests of one client in order, so a client waiting to open a file
+//only holds up itself (its open is retried every RSFSD_RETRY_NS while the others are served)
+struct rsfsd_server{
+    rsfs_t *fs; //instance served
+    char socket_path[108]; //removed by rsfsd_stop()
+    int listen_fd;
+    int epoll_fd;
+    int event_fd; //wakes the epoll loop to retry parked clients or to stop
+    pthread_t loop;
+
+    struct rsfsd_conn *ready_head, *ready_tail; //clients waiting for a worker
+    struct rsfsd_conn *parked; //clients whose next request is an open that would block
+    struct rsfsd_conn *conns; //every connected client
+    pthread_mutex_t mutex; //guards the lists above
+    pthread_cond_t ready_cond;
+
+    int num_workers;
+    pthread_t *workers;
+    int stop; //set by rsfsd_stop()
+};
+
+struct rsfsd_server *rsfsd_start(rsfs_t *fs, const char *socket_path, int num_workers); //serve fs at socket_path; NULL on error
+void rsfsd_stop(struct rsfsd_server *server); //disconnect every client (closing its files), stop and free the server
+
+//client: the calls may be pipelined by sending several requests before receiving their responses
+struct rsfsd_client{
+    int sock;
+    char *buffer; //shared with the server: data of reads and writes
+    size_t buffer_size;
+    unsigned int next_id;
+};
 
+struct rsfsd_client *rsfsd_connect(const char *socket_path, size_t buffer_size); //connect and share a buffer; NULL on error
+int rsfsd_send(struct rsfsd_client *client, int op, char *path, int fd, int arg, unsigned int offset); //send a request; its id or -1
+int rsfsd_recv(struct rsfsd_client *client, struct rsfsd_response *response); //wait for the next response; 0 or -1
+int rsfsd_call(struct rsfsd_client *client, int op, char *path, int fd, int arg, unsigned int offset); //send, wait: the result
+void rsfsd_disconnect(struct rsfsd_client *client); //the server closes the files the client left open
@@ -0,0 +1,212 @@
+/*
+    online defragmentation: the blocks of each file are moved, in order, to the lowest run of blocks that can hold them,
+    so that files become contiguous and the free blocks gather at the end of the pool.
+    A file nobody has open is held like a writer and all of its blocks move. A file that is open is joined like
+    a reader: no writer can change it meanwhile, and appenders only write past its length, so its full blocks
+    move while it is being read. Readers copy from the blocks inside an epoch section (see RSFS_read),
+    so a block moved away is freed only after a grace period, once the file is let go.
+    Each call moves at most the blocks it is allowed to, and the background defragmenter
+    spends such a budget every DEFRAG_TICK_NS
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+//helper: number of blocks the content of the file of inode takes (its compressed bytes if compressed)
+static int content_blocks(struct inode *inode){
+    int compressed = __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE);
+    int bytes = compressed ? compressed : __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE);
+    return (bytes+BLOCK_SIZE-1)/BLOCK_SIZE;
+}
+
+//helper: number of runs of consecutive blocks among the first num_blocks blocks of inode
+static int count_extents(struct inode *inode, int num_blocks){
+    int extents = 0;
+    for(int j=0; j<num_blocks; j++){
+        int block = __atomic_load_n(&inode->block[j], __ATOMIC_ACQUIRE);
+        if(block>=0 && (j==0 || block!=__atomic_load_n(&inode->block[j-1], __ATOMIC_ACQUIRE)+1)) extents++;
+    }
+    return extents;
+}
+
+//helper: the lowest block where the first movable blocks of inode can lie one after the other, each position
+//being free or holding that very block already; -1 if there is none. The bitmap is only a hint here:
+//relocate_data_block() checks again
+static int find_target(rsfs_t *fs, struct inode *inode, int movable){
+    for(int base=0; base+movable<=NUM_DBLOCKS; base++){
+        int j = 0;
+        while(j<movable && (inode->block[j]==base+j || __atomic_load_n(&fs->data_bitmap[base+j], __ATOMIC_RELAXED)==0)) j++;
+        if(j==movable) return base;
+    }
+    return -1;
+}
+
+//helper: move up to budget blocks of the file of inode_number toward their target, never waiting for the file:
+//return the number of blocks moved
+static int defrag_file(rsfs_t *fs, int inode_number, int budget){
+    struct inode *inode = &fs->inodes[inode_number];
+    if(__atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE)) return 0; //its blocks change with its form
+
+    //hold the file like a writer if nobody has it, else join its readers; a writer holding it is not waited for
+    int exclusive = PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW)==0;
+    if(exclusive){
+        inode->rw_owner = getpid();
+    }else{
+        PROF_LOCK(&inode->read_mutex, LOCK_INODE_READ);
+        int shared = inode->num_current_reader>0;
+        if(shared) inode->num_current_reader++;
+        PROF_UNLOCK(&inode->read_mutex, LOCK_INODE_READ);
+        if(!shared) return 0;
+    }
+
+    PROF_LOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+    int in_use = fs->inode_bitmap[inode_number];
+    PROF_UNLOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    //with readers (and maybe appenders) around, only the full blocks below the length are left alone by everyone
+    int movable = 0;
+    if(in_use && !inode->compressed){
+        movable = exclusive ? content_blocks(inode) : __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE)/BLOCK_SIZE;
+    }
+    int base = movable>0 ? find_target(fs, inode, movable) : -1;
+
+    int old[NUM_POINTER];
+    int moved = 0;
+    for(int j=0; base>=0 && j<movable && moved<budget; j++){
+        if(inode->block[j]<0 || inode->block[j]==base+j) continue;
+        int block = relocate_data_block(fs, &inode->block[j], base+j);
+        if(block>=0) old[moved++] = block;
+    }
+
+    if(exclusive){
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+    }else{
+        release_open_lock(fs, inode, RSFS_RDONLY);
+    }
+
+    //readers (and snapshots preserving the file) that took a block before it moved may still be copying from it.
+    //The file is let go first: openers wait for it inside their epoch sections
+    if(moved>0) epoch_barrier(fs);
+    for(int i=0; i<moved; i++) free_data_block(fs, old[i]);
+    STAT_ADD(fs, defrag_moves, moved);
+    return moved;
+}
+
+
+//defragment the files of fs, in inode order, moving at most max_moves blocks; files in use by a writer are skipped.
+//It waits for grace periods, so the caller must not have a file open that other threads may be waiting to open:
+//return the number of blocks moved (0 once every file is contiguous and as low as it can be)
+int rsfs_defrag(rsfs_t *fs, int max_moves){
+    int moved = 0;
+    for(int i=0; i<NUM_INODES && moved<max_moves; i++){
+        moved += defrag_file(fs, i, max_moves-moved);
+    }
+    return moved;
+}
+
+//scan the files and the free blocks of fs into report; it takes no lock, so files changing meanwhile
+//are counted as they are seen
+void rsfs_frag_report(rsfs_t *fs, struct rsfs_frag_report *report){
+    memset(report, 0, sizeof(*report));
+
+    for(int i=0; i<NUM_INODES; i++){
+        if(!__atomic_load_n(&fs->inode_bitmap[i], __ATOMIC_RELAXED)) continue;
+        struct inode *inode = &fs->inodes[i];
+        int num_blocks = content_blocks(inode);
+        int extents = count_extents(inode, num_blocks);
+        report->file_extents[i] = extents;
+        if(extents==0) continue;
+        report->files++;
+        report->extents += extents;
+        if(extents>report->max_extents) report->max_extents = extents;
+        int compressed = __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE);
+        report->slack_bytes += (long)num_blocks*BLOCK_SIZE - (compressed ? compressed : __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE));
+    }
+
+    long run = 0;
+    for(int b=0; b<=NUM_DBLOCKS; b++){
+        if(b<NUM_DBLOCKS && __atomic_load_n(&fs->data_bitmap[b], __ATOMIC_RELAXED)==0){
+            report->free_blocks++;
+            if(run++==0) report->free_runs++;
+            continue;
+        }
+        if(run>report->largest_free_run) report->largest_free_run = run;
+        run = 0;
+    }
+
+    for(int c=0; c<NUM_BLOCK_CLASSES; c++){
+        for(int slot=0; slot<(NUM_DBLOCKS>>c); slot++){
+            if(__atomic_load_n(&fs->class_used[c][slot], __ATOMIC_RELAXED)==0) report->free_slots[c]++;
+        }
+    }
+}
+
+
+//helper: body of the background defragmenter
+static void *defrag_loop(void *arg){
+    struct rsfs_defragger *defragger = (struct rsfs_defragger *)arg;
+
+    pthread_mutex_lock(&defragger->mutex);
+    while(!defragger->stop){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DEFRAG_TICK_NS;
+        deadline.tv_sec += deadline.tv_nsec/1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while(!defragger->stop && pthread_cond_timedwait(&defragger->cond, &defragger->mutex, &deadline)!=ETIMEDOUT);
+        if(defragger->stop) break;
+
+        pthread_mutex_unlock(&defragger->mutex);
+        rsfs_defrag(defragger->fs, defragger->moves_per_tick);
+        pthread_mutex_lock(&defragger->mutex);
+    }
+    pthread_mutex_unlock(&defragger->mutex);
+    return NULL;
+}
+
+//defragment fs in the background, moving about moves_per_second blocks a second (at least one per round):
+//return the defragmenter, or NULL on error
+struct rsfs_defragger *rsfs_defrag_start(rsfs_t *fs, int moves_per_second){
+    if(moves_per_second<=0){
+        printf("[defrag_start] moves_per_second must be positive.\n");
+        return NULL;
+    }
+    struct rsfs_defragger *defragger = (struct rsfs_defragger *)calloc(1, sizeof(struct rsfs_defragger));
+    if(defragger==NULL){
+        printf("[defrag_start] fail to allocate the defragmenter.\n");
+        return NULL;
+    }
+    defragger->fs = fs;
+    defragger->moves_per_tick = (int)((long)moves_per_second*DEFRAG_TICK_NS/1000000000L);
+    if(defragger->moves_per_tick<1) defragger->moves_per_tick = 1;
+    pthread_mutex_init(&defragger->mutex, NULL);
+    pthread_cond_init(&defragger->cond, NULL);
+    if(pthread_create(&defragger->thread, NULL, defrag_loop, defragger)!=0){
+        printf("[defrag_start] fail to start the defragmenter thread.\n");
+        pthread_mutex_destroy(&defragger->mutex);
+        pthread_cond_destroy(&defragger->cond);
+        free(defragger);
+        return NULL;
+    }
+    return defragger;
+}
+
+//stop a background defragmenter (waiting for its current round) and free it
+void RSFS_defrag_stop(struct rsfs_defragger *defragger){
+    pthread_mutex_lock(&defragger->mutex);
+    defragger->stop = 1;
+    pthread_cond_signal(&defragger->cond);
+    pthread_mutex_unlock(&defragger->mutex);
+    pthread_join(defragger->thread, NULL);
+    pthread_mutex_destroy(&defragger->mutex);
+    pthread_cond_destroy(&defragger->cond);
+    free(defragger);
+}
+
+int RSFS_defrag(int max_moves){ return rsfs_defrag(&rsfs_default, max_moves); }
+void RSFS_frag_report(struct rsfs_frag_report *report){ rsfs_frag_report(&rsfs_default, report); }
+struct rsfs_defragger *RSFS_defrag_start(int moves_per_second){ return rsfs_defrag_start(&rsfs_default, moves_per_second); }
@@ -1,113 +1,580 @@
 /*
-    allocation of global variable root_dir (root directory); 
-    routines for directory management
+    routines for directory management; the root directory, the dentry cache and the
+    allocators of directory objects of each instance live in struct rsfs
 */
 
 
 #include "def.h"
+#include <stdint.h>
 
-struct root_dir root_dir; //global root directory
 
-//helper: search for dir entry matching provided file_name
-struct dir_entry *search_dir_internal(char *file_name){
-    //start from head entry
-    struct dir_entry *dir_entry = root_dir.head;
-    
-    //loop through all entries
+//helper: the dentry-cache slot of (parent, name)
+static struct dcache_slot *dcache_slot(rsfs_t *fs, struct directory *parent, unsigned int hash){
+    uintptr_t key = hash ^ ((uintptr_t)to_off(fs, parent)>>4);
+    return &fs->dcache[key % DCACHE_SIZE];
+}
+
+//helper: look (parent, name) up in the dentry cache; the caller is inside an epoch section;
+//return 1 and set *entry (NULL for a cached miss) on a hit, or 0 if the cache does not know
+static int dcache_lookup(rsfs_t *fs, struct directory *parent, const char *name, unsigned int hash, struct dir_entry **entry){
+    struct dcache_slot *slot = dcache_slot(fs, parent, hash);
+    unsigned int seq, hit;
+    rsfs_off_t found;
+
+    do{
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) return 0; //being filled: just miss
+        hit = __atomic_load_n(&slot->parent, __ATOMIC_RELAXED)==to_off(fs, parent)
+            && __atomic_load_n(&slot->hash, __ATOMIC_RELAXED)==hash
+            && __atomic_load_n(&slot->version, __ATOMIC_RELAXED)==__atomic_load_n(&parent->version, __ATOMIC_ACQUIRE)
+            && strncmp(slot->name, name, DCACHE_NAME_LEN+1)==0;
+        found = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)!=seq);
+
+    if(hit) *entry = to_ptr(fs, found);
+    return hit;
+}
+
+//helper: remember the lookup result of (parent, name) taken at the given version of parent;
+//a slot that another thread is filling right now is left alone
+static void dcache_insert(rsfs_t *fs, struct directory *parent, const char *name, unsigned int hash, struct dir_entry *entry, unsigned int version){
+    if(strlen(name)>DCACHE_NAME_LEN) return; //long names are not cached
+
+    struct dcache_slot *slot = dcache_slot(fs, parent, hash);
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&slot->parent, to_off(fs, parent), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->version, version, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->entry, to_off(fs, entry), __ATOMIC_RELAXED);
+    strcpy(slot->name, name);
+
+    __atomic_store_n(&slot->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+
+//helper: search dir for the entry matching name (of length len) without taking dir->mutex;
+//the caller is inside an epoch section (or holds dir->mutex)
+static struct dir_entry *search_dir_internal(rsfs_t *fs, struct directory *dir, const char *name, int len, unsigned int hash){
+    //start from the head of the bucket
+    struct dir_entry *dir_entry = to_ptr(fs, __atomic_load_n(&dir->index[hash % DIR_HASH_BUCKETS], __ATOMIC_ACQUIRE));
+
+    //loop through the entries of the bucket; the cached hash and length rule out most entries
     while(dir_entry){
-        if(strcmp(dir_entry->name,file_name)==0){
+        if(dir_entry->name_hash==hash && dir_entry->name_len==len && memcmp(to_ptr(fs, dir_entry->name),name,len)==0){
             break; //break when finding a match
-        } 
-        dir_entry = dir_entry->next;
+        }
+        dir_entry = to_ptr(fs, __atomic_load_n(&dir_entry->hash_next, __ATOMIC_ACQUIRE));
     }
-    
+
     //return the found match; NULL is not found
     return dir_entry;
 }
 
-//search for the dir_entry for provided file_name
-struct dir_entry *search_dir(char *file_name){    
+//helper: look name up in dir, through the dentry cache; the caller is inside an epoch section
+static struct dir_entry *lookup_dir(rsfs_t *fs, struct directory *dir, const char *name){
+    int len = strlen(name);
+    unsigned int hash = name_hash(name, len);
 
-    pthread_mutex_lock(&root_dir.mutex);
+    struct dir_entry *dir_entry;
+    if(dcache_lookup(fs, dir, name, hash, &dir_entry)) return dir_entry;
 
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    pthread_mutex_unlock(&root_dir.mutex);
+    //the version is taken before the walk: if a writer changes the directory meanwhile,
+    //the slot we fill is already stale and is never used
+    unsigned int version = __atomic_load_n(&dir->version, __ATOMIC_ACQUIRE);
+    dir_entry = search_dir_internal(fs, dir, name, len, hash);
+    dcache_insert(fs, dir, name, hash, dir_entry, version);
 
     return dir_entry;
 }
 
-//insert an entry with provided file_name and return it;
-//if such entry exists already, return it directly
-struct dir_entry *insert_dir(char *file_name){
-    
-    pthread_mutex_lock(&root_dir.mutex);
-
-    //search for the entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    if(!dir_entry){//if not found
-        
-        //construct a new dir_entry
-        dir_entry = (struct dir_entry *)malloc(sizeof(struct dir_entry));
-        if(dir_entry==NULL){
-            printf("[insert_dir] fail to allocate a space for dir_entry.\n");
-            pthread_mutex_unlock(&root_dir.mutex);
-            return NULL;
+//helper: resolve every component of path but the last one and copy the last one to leaf;
+//return the directory that should contain leaf, or NULL if path is invalid or a parent does not exist
+static struct directory *resolve_parent(rsfs_t *fs, const char *path, char *leaf){
+    struct directory *dir = &fs->root_dir;
+    char component[MAX_NAME_LEN+1];
+    int len = 0;
+
+    leaf[0] = '\0';
+    for(const char *p=path; ; p++){
+        if(*p!='/' && *p!='\0'){
+            if(len==MAX_NAME_LEN) return NULL; //component too long
+            component[len++] = *p;
+            continue;
+        }
+        if(len>0){
+            component[len] = '\0';
+            //a component followed by more components has to be a directory
+            const char *rest = p;
+            while(*rest=='/') rest++;
+            if(*rest=='\0'){
+                strcpy(leaf, component);
+                return dir;
+            }
+            struct dir_entry *dir_entry = lookup_dir(fs, dir, component);
+            if(dir_entry==NULL || dir_entry->dir==0) return NULL;
+            dir = to_ptr(fs, dir_entry->dir);
+            len = 0;
+        }
+        if(*p=='\0') break;
+    }
+
+    return NULL; //empty path
+}
+
+//helper: order of the names a and b (of lengths alen and blen), bytewise: <0, 0 or >0
+static int compare_names(const char *a, int alen, const char *b, int blen){
+    int ret = memcmp(a, b, alen<blen ? alen : blen);
+    return ret ? ret : alen-blen;
+}
+
+//helper: find, at each level of the sorted index of dir, the link to the first entry not below name (of length len);
+//the caller holds dir->mutex. The search goes down the levels, each skipping about four times as many entries as the next
+static void find_sorted(rsfs_t *fs, struct directory *dir, const char *name, int len, rsfs_off_t **links){
+    rsfs_off_t *level_links = dir->sorted;
+    for(int i=DIR_SKIP_LEVELS-1; i>=0; i--){
+        struct dir_entry *next;
+        while((next=to_ptr(fs, level_links[i])) && compare_names(to_ptr(fs, next->name), next->name_len, name, len)<0){
+            level_links = next->sorted_next;
         }
+        links[i] = &level_links[i];
+    }
+}
+
+//helper: number of levels of the sorted index an entry with name hash hash is linked into: each one more with
+//probability 1/4, drawn from the hash (mixed, so its low bits, which pick the bucket, do not matter)
+static int sorted_levels(unsigned int hash){
+    unsigned long bits = hash*0x9E3779B97F4A7C15UL;
+    int levels = 1;
+    while(levels<DIR_SKIP_LEVELS && (bits>>(64-2*levels) & 3)==0) levels++;
+    return levels;
+}
+
+//helper: construct an entry named leaf (of length len and hash hash) with a subdirectory if is_dir, or naming
+//inode_number, and insert it to dir, which has no such entry: return it, or NULL if memory runs out.
+//The caller holds dir->mutex, and the entry is complete before lock-free readers can reach it
+static struct dir_entry *link_new_entry(rsfs_t *fs, struct directory *dir, const char *leaf, int len, unsigned int hash, int is_dir, int inode_number){
+
+    //construct a new dir_entry
+    struct dir_entry *dir_entry = (struct dir_entry *)slab_alloc(&fs->dir_entry_slab);
+    char *name = name_intern(fs, leaf, len, hash);
+    struct directory *subdir = is_dir ? (struct directory *)slab_alloc(&fs->directory_slab) : NULL;
+    if(dir_entry==NULL || name==NULL || (is_dir && subdir==NULL)){
+        printf("[insert_dir] fail to allocate a space for dir_entry.\n");
+        if(dir_entry) slab_free(&fs->dir_entry_slab, dir_entry);
+        if(name) name_release(fs, name);
+        if(subdir) slab_free(&fs->directory_slab, subdir);
+        return NULL;
+    }
+    if(subdir) init_dir(fs, subdir);
 
-        dir_entry->name = file_name;
-        dir_entry->inode_number = -1; //mark that inode_number is not assigned 
-        dir_entry->next = dir_entry->prev = NULL; //initialize the links
-
-        //append the dir_entry to root_dir
-        if(root_dir.tail){//the root_dir is non-empty
-            root_dir.tail->next = dir_entry;
-            dir_entry->prev = root_dir.tail;
-            root_dir.tail = dir_entry;
-        }else{//the root_dir is empty
-            root_dir.head = root_dir.tail = dir_entry;
+    dir_entry->name = to_off(fs, name);
+    dir_entry->name_hash = hash;
+    dir_entry->name_len = len;
+    dir_entry->inode_number = inode_number; //-1: not assigned yet, or a directory
+    dir_entry->deleted = 0;
+    dir_entry->dir = to_off(fs, subdir);
+    dir_entry->parent = to_off(fs, dir);
+    dir_entry->self = to_off(fs, dir_entry);
+    if(subdir) subdir->entry = dir_entry->self;
+    dir_entry->next = dir_entry->prev = 0; //initialize the links
+
+    //append the dir_entry to the directory
+    if(dir->tail){//the directory is non-empty
+        ((struct dir_entry *)to_ptr(fs, dir->tail))->next = dir_entry->self;
+        dir_entry->prev = dir->tail;
+        dir->tail = dir_entry->self;
+    }else{//the directory is empty
+        dir->head = dir->tail = dir_entry->self;
+    }
+
+    //link it into the sorted index, which only holders of the mutex use
+    rsfs_off_t *links[DIR_SKIP_LEVELS];
+    find_sorted(fs, dir, leaf, len, links);
+    int levels = sorted_levels(hash);
+    for(int i=0; i<DIR_SKIP_LEVELS; i++){
+        dir_entry->sorted_next[i] = i<levels ? *links[i] : 0;
+        if(i<levels) *links[i] = dir_entry->self;
+    }
+
+    //publish it in the index: the entry is complete before readers can reach it
+    dir_entry->hash_next = dir->index[hash % DIR_HASH_BUCKETS];
+    __atomic_store_n(&dir->index[hash % DIR_HASH_BUCKETS], dir_entry->self, __ATOMIC_RELEASE);
+
+    //cached lookups in this directory (including misses of this name) are stale now
+    __atomic_add_fetch(&dir->version, 1, __ATOMIC_RELEASE);
+
+    if(is_dir) STAT_ADD(fs, num_dirs, 1);
+    else STAT_ADD(fs, num_files, 1);
+    TRACE_EVENT(TRACE_DIR_INSERT, dir_entry->inode_number, -1, 0, dir_entry->name_len);
+    return dir_entry;
+}
+
+//helper: unlink dir_entry from dir; the caller holds dir->mutex
+static void unlink_dir_internal(rsfs_t *fs, struct directory *dir, struct dir_entry *dir_entry){
+    struct dir_entry *prev = to_ptr(fs, dir_entry->prev);
+    struct dir_entry *next = to_ptr(fs, dir_entry->next);
+    if(prev){//not the head entry
+        prev->next = dir_entry->next;
+        if(next){//it is not the tail entry
+            next->prev = dir_entry->prev;
+        }else{//it is the tail entry
+            dir->tail = dir_entry->prev;
         }
-    } 
+    }else{//it is the head entry
+        dir->head = dir_entry->next;
+        if(next){//it is not the tail entry
+            next->prev = 0;
+        }else{//it is the tail entry
+            dir->tail = 0;
+        }
+    }
+
+    //unlink it from the sorted index
+    rsfs_off_t *links[DIR_SKIP_LEVELS];
+    find_sorted(fs, dir, to_ptr(fs, dir_entry->name), dir_entry->name_len, links);
+    for(int i=0; i<DIR_SKIP_LEVELS; i++){
+        if(*links[i]==dir_entry->self) *links[i] = dir_entry->sorted_next[i];
+    }
+
+    //unlink it from its bucket of the index; its own hash_next stays intact for readers still on it
+    rsfs_off_t *link = &dir->index[dir_entry->name_hash % DIR_HASH_BUCKETS];
+    while(*link!=dir_entry->self) link = &((struct dir_entry *)to_ptr(fs, *link))->hash_next;
+    __atomic_store_n(link, dir_entry->hash_next, __ATOMIC_RELEASE);
+}
 
-    pthread_mutex_unlock(&root_dir.mutex);
+//helper: release a dir_entry (and its subdirectory) once its grace period is over
+static void free_dir_entry(void *ptr){
+    struct dir_entry *dir_entry = (struct dir_entry *)ptr;
+    rsfs_t *fs = (rsfs_t *)((char *)dir_entry - dir_entry->self);
+    if(dir_entry->dir){
+        struct directory *dir = to_ptr(fs, dir_entry->dir);
+        pthread_mutex_destroy(&dir->mutex);
+        slab_free(&fs->directory_slab, dir);
+    }
+    name_release(fs, to_ptr(fs, dir_entry->name));
+    slab_free(&fs->dir_entry_slab, dir_entry);
+}
+
+//helper: unlink dir_entry from dir, mark it deleted and free it after its grace period; the caller holds dir->mutex
+static void retire_entry(rsfs_t *fs, struct directory *dir, struct dir_entry *dir_entry){
+    unlink_dir_internal(fs, dir, dir_entry);
+    __atomic_store_n(&dir_entry->deleted, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&dir->version, 1, __ATOMIC_RELEASE);
+    if(dir_entry->dir) STAT_ADD(fs, num_dirs, -1);
+    else STAT_ADD(fs, num_files, -1);
+    TRACE_EVENT(TRACE_DIR_DELETE, dir_entry->inode_number, -1, 0, dir_entry->name_len);
+    epoch_retire(fs, dir_entry, free_dir_entry);
+}
+
+
+//initialize an empty directory of fs; a directory object handed out again by its slab keeps counting its
+//version up from where its previous life left it, so that dentry-cache slots of that life never match it
+void init_dir(rsfs_t *fs, struct directory *dir){
+    dir->head = dir->tail = 0;
+    for(int i=0; i<DIR_HASH_BUCKETS; i++) dir->index[i] = 0;
+    for(int i=0; i<DIR_SKIP_LEVELS; i++) dir->sorted[i] = 0;
+    dir->version++;
+    dir->removed = 0;
+    dir->entry = 0;
+    rsfs_mutex_init(fs, &dir->mutex, 1);
+}
+
+//initialize the root directory, the dentry cache and the allocators of directory objects of fs
+void init_root_dir(rsfs_t *fs){
+    slab_init(fs, &fs->dir_entry_slab, sizeof(struct dir_entry), DIR_SLAB_OBJECTS);
+    slab_init(fs, &fs->directory_slab, sizeof(struct directory), DIR_SLAB_OBJECTS);
+    init_names(fs);
+
+    fs->root_dir.version = 0;
+    init_dir(fs, &fs->root_dir);
+    for(int i=0; i<DCACHE_SIZE; i++){
+        fs->dcache[i].seq = 0;
+        fs->dcache[i].parent = 0;
+    }
+}
+
+//search for the dir_entry for provided path without taking any lock;
+//a caller that uses the returned entry has to stay inside its own epoch section meanwhile
+struct dir_entry *search_dir(rsfs_t *fs, char *file_name){
+
+    char leaf[MAX_NAME_LEN+1];
+    struct dir_entry *dir_entry = NULL;
+
+    epoch_enter(fs);
+    struct directory *dir = resolve_parent(fs, file_name, leaf);
+    if(dir) dir_entry = lookup_dir(fs, dir, leaf);
+    epoch_exit(fs);
 
     return dir_entry;
 }
 
-//delete the entry matching provided file_name if it exists;
-//return 0 if succeed (found and deleted) or -1 if errs
-int delete_dir(char *file_name){
+//insert an entry with provided path and return it; a subdirectory is created with it if is_dir is set;
+//if such entry exists already, return it directly and set *existed (unless existed is NULL), which is decided
+//under the mutex of the parent, so that of two concurrent inserts of one name only one creates it;
+//return NULL if the parent directory does not exist
+struct dir_entry *insert_dir_entry(rsfs_t *fs, char *file_name, int is_dir, int *existed){
 
-    pthread_mutex_lock(&root_dir.mutex);
+    epoch_enter(fs);
+
+    char leaf[MAX_NAME_LEN+1];
+    struct directory *dir = resolve_parent(fs, file_name, leaf);
+    if(dir==NULL){
+        printf("[insert_dir] invalid path or no parent directory for %s.\n", file_name);
+        epoch_exit(fs);
+        return NULL;
+    }
+    int len = strlen(leaf);
+    unsigned int hash = name_hash(leaf, len);
+
+    PROF_LOCK(&dir->mutex, LOCK_DIR);
+
+    //the parent may have been removed since we resolved it
+    if(dir->removed){
+        printf("[insert_dir] parent directory of %s has been removed.\n", file_name);
+        PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+        epoch_exit(fs);
+        return NULL;
+    }
+
+    //search for the entry, and construct it if not found
+    struct dir_entry *dir_entry = search_dir_internal(fs, dir, leaf, len, hash);
+    if(existed) *existed = dir_entry!=NULL;
+    if(!dir_entry) dir_entry = link_new_entry(fs, dir, leaf, len, hash, is_dir, -1);
+
+    PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+    epoch_exit(fs);
+
+    return dir_entry;
+}
+
+//insert a file entry with provided path and return it
+struct dir_entry *insert_dir(rsfs_t *fs, char *file_name){
+    return insert_dir_entry(fs, file_name, 0, NULL);
+}
+
+//delete the entry matching provided path if it exists; a subdirectory has to be empty;
+//the entry is freed once no lock-free reader can see it any more;
+//return 0 if succeed (found and deleted), -1 if not found, or -2 if it is a non-empty directory
+int delete_dir(rsfs_t *fs, char *file_name){
+
+    epoch_enter(fs);
+
+    char leaf[MAX_NAME_LEN+1];
+    struct directory *dir = resolve_parent(fs, file_name, leaf);
+    if(dir==NULL){
+        epoch_exit(fs);
+        return -1;
+    }
+
+    PROF_LOCK(&dir->mutex, LOCK_DIR);
 
     int ret = -1;
 
     //search for the matching dir_entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name); 
+    struct dir_entry *dir_entry = dir->removed ? NULL : search_dir_internal(fs, dir, leaf, strlen(leaf), name_hash(leaf, strlen(leaf)));
 
     //if found, delete it
     if(dir_entry){
-        if(dir_entry->prev){//not the head entry
-            dir_entry->prev->next = dir_entry->next;
-            if(dir_entry->next){//it is not the tail entry
-                dir_entry->next->prev = dir_entry->prev;
-            }else{//it is the tail entry
-                root_dir.tail = dir_entry->prev;
-            } 
-        }else{//it is the head entry
-            root_dir.head = dir_entry->next;
-            if(dir_entry->next){//it is not the tail entry
-                dir_entry->next->prev=NULL;
-            }else{//it is the tail entry
-                root_dir.tail = NULL;
+        ret = 0;
+        struct directory *subdir = to_ptr(fs, dir_entry->dir);
+        if(subdir){
+            //parent before child: the same order RSFS_stat locks them in
+            PROF_LOCK(&subdir->mutex, LOCK_DIR);
+            if(subdir->head){
+                ret = -2;
+            }else{
+                subdir->removed = 1; //inserts that resolved it concurrently must fail
             }
+            PROF_UNLOCK(&subdir->mutex, LOCK_DIR);
         }
-        ret = 0;
+        if(ret==0) retire_entry(fs, dir, dir_entry);
     }
 
-    pthread_mutex_unlock(&root_dir.mutex);
+    PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+    epoch_exit(fs);
 
     return ret;
 }
 
+//insert an entry for each of the num file paths in file_names, if it does not exist yet, giving it the next inode
+//of the num_inodes in inodes; the entry names its inode before lock-free readers can reach it. Consecutive paths
+//in the same directory are inserted under one acquisition of its mutex. results[i] is the inode_number given to
+//file_names[i], -1 if it exists already, or -2 if its parent does not exist or the inodes or memory ran out;
+//entries[i] is its new entry (NULL if none; entries may be NULL). Return the number of inodes used
+int insert_file_entries(rsfs_t *fs, char **file_names, int num, int *inodes, int num_inodes, int *results, struct dir_entry **entries){
+
+    epoch_enter(fs);
+
+    struct directory *locked = NULL;
+    int used = 0;
+    for(int i=0; i<num; i++){
+        if(entries) entries[i] = NULL;
+        results[i] = -2;
+
+        char leaf[MAX_NAME_LEN+1];
+        struct directory *dir = resolve_parent(fs, file_names[i], leaf);
+        if(dir==NULL){
+            printf("[insert_dir] invalid path or no parent directory for %s.\n", file_names[i]);
+            continue;
+        }
+        if(dir!=locked){
+            if(locked) PROF_UNLOCK(&locked->mutex, LOCK_DIR);
+            PROF_LOCK(&dir->mutex, LOCK_DIR);
+            locked = dir;
+        }
+        if(dir->removed){
+            printf("[insert_dir] parent directory of %s has been removed.\n", file_names[i]);
+            continue;
+        }
+
+        int len = strlen(leaf);
+        unsigned int hash = name_hash(leaf, len);
+        if(search_dir_internal(fs, dir, leaf, len, hash)){
+            results[i] = -1;
+        }else if(used<num_inodes){
+            struct dir_entry *dir_entry = link_new_entry(fs, dir, leaf, len, hash, 0, inodes[used]);
+            if(dir_entry){
+                results[i] = inodes[used++];
+                if(entries) entries[i] = dir_entry;
+            }
+        }
+    }
+    if(locked) PROF_UNLOCK(&locked->mutex, LOCK_DIR);
+
+    epoch_exit(fs);
+    return used;
+}
+
+//delete the num file entries in entries, whose files the caller holds like a writer (so nobody else deletes them);
+//consecutive entries of the same directory are deleted under one acquisition of its mutex
+void delete_file_entries(rsfs_t *fs, struct dir_entry **entries, int num){
+    struct directory *locked = NULL;
+    for(int i=0; i<num; i++){
+        //a directory holding an entry is not empty, so it cannot be removed meanwhile
+        struct directory *dir = to_ptr(fs, entries[i]->parent);
+        if(dir!=locked){
+            if(locked) PROF_UNLOCK(&locked->mutex, LOCK_DIR);
+            PROF_LOCK(&dir->mutex, LOCK_DIR);
+            locked = dir;
+        }
+        retire_entry(fs, dir, entries[i]);
+    }
+    if(locked) PROF_UNLOCK(&locked->mutex, LOCK_DIR);
+}
+
+//write the path of dir_entry ("dir/sub/name", as resolved from the root) to path, which holds size bytes;
+//the caller keeps dir_entry and its parents from being freed (an epoch section or a hold on the file):
+//return the length of the path, or -1 if it does not fit
+int dir_entry_path(rsfs_t *fs, struct dir_entry *dir_entry, char *path, int size){
+    //components are laid down from the end of path, then moved to its start
+    int start = size-1;
+    path[start] = '\0';
+    for(struct dir_entry *e=dir_entry; e; e=to_ptr(fs, ((struct directory *)to_ptr(fs, e->parent))->entry)){
+        int len = e->name_len + (e==dir_entry ? 0 : 1);
+        if(len>start) return -1;
+        start -= len;
+        memcpy(path+start, to_ptr(fs, e->name), e->name_len);
+        if(e!=dir_entry) path[start+e->name_len] = '/';
+    }
+    memmove(path, path+start, size-start);
+    return size-1-start;
+}
+
+//copy the listing of the directory at path ("" or "/" is the root) into a new array *entries;
+//the copy is taken under the directory's mutex, so it reflects one instant;
+//return the number of entries, or -1 if path is not a directory
+int snapshot_dir(rsfs_t *fs, char *path, struct rsfs_dirent **entries){
+
+    epoch_enter(fs);
+
+    struct directory *dir = &fs->root_dir;
+    const char *p = path;
+    while(*p=='/') p++;
+    if(*p){
+        struct dir_entry *dir_entry = search_dir(fs, path);
+        if(dir_entry==NULL || dir_entry->dir==0){
+            epoch_exit(fs);
+            return -1;
+        }
+        dir = to_ptr(fs, dir_entry->dir);
+    }
+
+    PROF_LOCK(&dir->mutex, LOCK_DIR);
+
+    int num = 0;
+    for(struct dir_entry *e=to_ptr(fs, dir->head); e; e=to_ptr(fs, e->next)) num++;
+
+    *entries = (struct rsfs_dirent *)malloc((num>0 ? num : 1)*sizeof(struct rsfs_dirent));
+    if(*entries==NULL){
+        printf("[snapshot_dir] fail to allocate the listing.\n");
+        PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+        epoch_exit(fs);
+        return -1;
+    }
+
+    int i = 0;
+    for(struct dir_entry *e=to_ptr(fs, dir->head); e; e=to_ptr(fs, e->next), i++){
+        struct rsfs_dirent *dirent = &(*entries)[i];
+        memcpy(dirent->name, to_ptr(fs, e->name), e->name_len+1);
+        dirent->inode_number = e->inode_number;
+        dirent->is_dir = e->dir!=0;
+        dirent->length = e->inode_number>=0 ? __atomic_load_n(&fs->inodes[e->inode_number].length, __ATOMIC_ACQUIRE) : 0;
+    }
+
+    PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+    epoch_exit(fs);
+
+    return num;
+}
+
+//copy to out up to max entries of the directory path ("" is the root) whose names start with prefix, in name order,
+//from the first one after the name after on (NULL: from the start); return the number of entries, or -1 if
+//the directory does not exist. The sorted index takes the search to the first one in O(log n)
+int list_dir_sorted(rsfs_t *fs, char *path, const char *after, const char *prefix, struct rsfs_dirent *out, int max){
+
+    epoch_enter(fs);
+
+    struct directory *dir = &fs->root_dir;
+    const char *p = path;
+    while(*p=='/') p++;
+    if(*p){
+        struct dir_entry *dir_entry = search_dir(fs, path);
+        if(dir_entry==NULL || dir_entry->dir==0){
+            epoch_exit(fs);
+            return -1;
+        }
+        dir = to_ptr(fs, dir_entry->dir);
+    }
+
+    PROF_LOCK(&dir->mutex, LOCK_DIR);
+
+    //start at the first name not below the prefix, or just past the name the last batch ended with
+    int prefix_len = strlen(prefix);
+    const char *start = after && strcmp(after, prefix)>0 ? after : prefix;
+    rsfs_off_t *links[DIR_SKIP_LEVELS];
+    find_sorted(fs, dir, start, strlen(start), links);
+    struct dir_entry *e = to_ptr(fs, *links[0]);
+    if(e && start==after && compare_names(to_ptr(fs, e->name), e->name_len, after, strlen(after))==0){
+        e = to_ptr(fs, e->sorted_next[0]);
+    }
+
+    //the names with the prefix follow one another
+    int num = 0;
+    for(; e && num<max; e=to_ptr(fs, e->sorted_next[0])){
+        if(e->name_len<prefix_len || memcmp(to_ptr(fs, e->name), prefix, prefix_len)!=0) break;
+        struct rsfs_dirent *dirent = &out[num++];
+        memcpy(dirent->name, to_ptr(fs, e->name), e->name_len+1);
+        dirent->inode_number = e->inode_number;
+        dirent->is_dir = e->dir!=0;
+        dirent->length = e->inode_number>=0 ? __atomic_load_n(&fs->inodes[e->inode_number].length, __ATOMIC_ACQUIRE) : 0;
+    }
+
+    PROF_UNLOCK(&dir->mutex, LOCK_DIR);
+    epoch_exit(fs);
+
+    return num;
+}
@@ -0,0 +1,393 @@
+/*
+    epoch-based reclamation: objects unlinked from lock-free structures are freed
+    only after every reader that could still see them has left its critical section.
+    Instances of this process share one domain of per-thread records; a shared instance
+    has its own domain in its segment, with a slot for each thread (of any process) using it
+*/
+
+#include "def.h"
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//retired object waiting for its grace period
+struct retired{
+    void *ptr;
+    void (*free_fn)(void *);
+    struct retired *next;
+    struct epoch_domain *domain; //shared domain it was retired in (NULL: the domain of this process)
+    unsigned long epoch; //epoch of domain when it was retired
+};
+
+//per-thread epoch record; records are never freed, so the list can be walked without a lock
+struct epoch_record{
+    unsigned long epoch; //global epoch observed when the thread entered its critical section
+    int active; //1 while the thread is inside a critical section
+    int nesting; //depth of nested epoch_enter() calls (owned by the thread)
+    unsigned long limbo_epoch[3]; //epoch in which the objects of each limbo list were retired
+    struct retired *limbo[3]; //objects retired by this thread, by epoch modulo 3
+    pthread_mutex_t limbo_mutex; //guards the limbo lists against epoch_barrier() (uncontended otherwise)
+    struct epoch_record *next;
+};
+
+#define EPOCH_CACHED 4 //shared domains whose slot a thread remembers
+#define EPOCH_DOMAINS 64 //shared domains this process can have mapped at once
+
+static unsigned long global_epoch = 1;
+static struct slab_cache retired_slab; //retired records come from a slab, so retiring does not hit malloc
+static pthread_once_t retired_slab_once = PTHREAD_ONCE_INIT;
+static struct epoch_record *epoch_records; //list of the records of all threads that ever entered
+static __thread struct epoch_record *my_record;
+
+//slot of the calling thread in a shared domain
+struct slot_cache{
+    struct epoch_domain *domain;
+    int slot;
+};
+static __thread struct slot_cache my_slots[EPOCH_CACHED];
+static __thread int my_slots_next; //entry of my_slots replaced next
+static __thread int my_pid, my_tid; //ids of the calling thread, cached (0: not yet, or forgotten in a forked child)
+static pthread_once_t ids_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key; //its destructor frees the slots of an exiting thread
+
+//shared domains mapped by this process, so that exiting threads never touch an unmapped one;
+//objects retired in them wait on one list, guarded by the same mutex
+static struct epoch_domain *mapped_domains[EPOCH_DOMAINS];
+static struct retired *shared_limbo;
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//helper: get (and register on first use) the record of the calling thread
+static struct epoch_record *epoch_record(){
+    if(my_record) return my_record;
+
+    struct epoch_record *record = (struct epoch_record *)calloc(1, sizeof(struct epoch_record));
+    if(record==NULL){
+        printf("[epoch] fail to allocate an epoch record.\n");
+        abort();
+    }
+    pthread_mutex_init(&record->limbo_mutex, NULL);
+    record->next = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&epoch_records, &record->next, record, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    my_record = record;
+    return record;
+}
+
+//helper: in the child of a fork, forget the ids cached by the thread that forked, which the child continues
+static void forget_ids(){
+    my_pid = my_tid = 0;
+}
+
+//helper: register forget_ids() to run in forked children
+static void init_ids(){
+    pthread_atfork(NULL, NULL, forget_ids);
+}
+
+//helper: the pid and tid of the calling thread, without a system call once they are cached
+static void thread_ids(int *pid, int *tid){
+    if(my_tid==0){
+        pthread_once(&ids_once, init_ids);
+        my_pid = getpid();
+        my_tid = syscall(SYS_gettid);
+    }
+    *pid = my_pid;
+    *tid = my_tid;
+}
+
+//helper: free the slots of an exiting thread in the domains that are still mapped
+static void release_slots(void *unused){
+    (void)unused;
+    int pid, tid;
+    thread_ids(&pid, &tid);
+    pthread_mutex_lock(&shared_mutex);
+    for(int i=0; i<EPOCH_CACHED; i++){
+        for(int j=0; j<EPOCH_DOMAINS; j++){
+            if(my_slots[i].domain==NULL || mapped_domains[j]!=my_slots[i].domain) continue;
+            struct epoch_slot *slot = &my_slots[i].domain->slots[my_slots[i].slot];
+            if(slot->pid==pid && slot->tid==tid){
+                __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+                __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+            }
+        }
+        my_slots[i].domain = NULL;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+}
+
+//helper: set up the slab of retired records and the key that frees slots at thread exit
+static void init_retired_slab(){
+    slab_init(NULL, &retired_slab, sizeof(struct retired), 256);
+    pthread_key_create(&slot_key, release_slots);
+}
+
+//helper: get (and claim on first use) the slot of the calling thread in a shared domain
+static struct epoch_slot *epoch_slot(struct epoch_domain *domain){
+    int pid, tid;
+    thread_ids(&pid, &tid);
+
+    //a slot remembered before a fork belongs to the parent: pid and tid tell
+    for(int i=0; i<EPOCH_CACHED; i++){
+        if(my_slots[i].domain!=domain) continue;
+        struct epoch_slot *slot = &domain->slots[my_slots[i].slot];
+        if(slot->pid==pid && slot->tid==tid) return slot;
+    }
+
+    pthread_once(&retired_slab_once, init_retired_slab);
+    pthread_mutex_lock(&shared_mutex);
+    int mapped = -1, free_entry = -1;
+    for(int j=0; j<EPOCH_DOMAINS; j++){
+        if(mapped_domains[j]==domain) mapped = j;
+        if(mapped_domains[j]==NULL && free_entry<0) free_entry = j;
+    }
+    if(mapped<0 && free_entry>=0) mapped_domains[free_entry] = domain;
+    pthread_mutex_unlock(&shared_mutex);
+
+    //take a free slot, or the slot of a process that died
+    for(int s=0; s<EPOCH_SLOTS; s++){
+        struct epoch_slot *slot = &domain->slots[s];
+        int owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if(owner!=0 && rsfs_process_alive(owner)) continue;
+        if(!__atomic_compare_exchange_n(&slot->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+
+        slot->tid = tid;
+        slot->nesting = 0;
+        __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+        my_slots[my_slots_next].domain = domain;
+        my_slots[my_slots_next].slot = s;
+        my_slots_next = (my_slots_next+1) % EPOCH_CACHED;
+        pthread_setspecific(slot_key, my_slots); //any non-NULL value runs the destructor
+        return slot;
+    }
+
+    printf("[epoch] no free slot in the shared instance.\n");
+    abort();
+}
+
+//helper: free a list of retired objects
+static void free_retired(struct retired *list){
+    while(list){
+        struct retired *next = list->next;
+        list->free_fn(list->ptr);
+        slab_free(&retired_slab, list);
+        list = next;
+    }
+}
+
+//helper: advance the global epoch if every active thread has observed the current one
+static void epoch_try_advance(){
+    //pairs with the fence in epoch_enter(): either we see the reader active or it sees our unlink
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    for(struct epoch_record *r=__atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); r; r=r->next){
+        if(__atomic_load_n(&r->active, __ATOMIC_ACQUIRE) && __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)!=epoch){
+            return; //a reader may still be looking at objects retired in the previous epoch
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+//helper: the same for a shared domain; a reader that died inside its critical section gives up its slot
+static void epoch_try_advance_shared(struct epoch_domain *domain){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_load_n(&domain->global_epoch, __ATOMIC_ACQUIRE);
+
+    for(int s=0; s<EPOCH_SLOTS; s++){
+        struct epoch_slot *slot = &domain->slots[s];
+        int owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if(owner==0 || !__atomic_load_n(&slot->active, __ATOMIC_ACQUIRE)) continue;
+        if(__atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE)==epoch) continue;
+        if(rsfs_process_alive(owner)) return;
+        if(__atomic_compare_exchange_n(&slot->pid, &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_compare_exchange_n(&domain->global_epoch, &epoch, epoch+1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+//helper: free the shared retirements of domain that are past their grace period; the caller holds shared_mutex
+static void free_shared_retired(struct epoch_domain *domain){
+    unsigned long epoch = __atomic_load_n(&domain->global_epoch, __ATOMIC_ACQUIRE);
+    struct retired **link = &shared_limbo;
+    while(*link){
+        struct retired *retired = *link;
+        if(retired->domain==domain && retired->epoch+2<=epoch){
+            *link = retired->next;
+            retired->next = NULL;
+            free_retired(retired);
+        }else{
+            link = &retired->next;
+        }
+    }
+}
+
+
+//initialize the epoch domain of a shared instance
+void epoch_domain_init(struct epoch_domain *domain){
+    memset(domain, 0, sizeof(struct epoch_domain));
+    domain->global_epoch = 1;
+}
+
+//enter a read-side critical section on fs: objects reachable now stay valid until epoch_exit()
+void epoch_enter(rsfs_t *fs){
+    if(fs && fs->shared){
+        struct epoch_slot *slot = epoch_slot(&fs->epoch);
+        if(slot->nesting++>0) return;
+
+        __atomic_store_n(&slot->active, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->epoch, __atomic_load_n(&fs->epoch.global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return;
+    }
+
+    struct epoch_record *record = epoch_record();
+    if(record->nesting++>0) return;
+
+    __atomic_store_n(&record->active, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    //the announcement has to be visible before any pointer of the structure is loaded
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+//leave a read-side critical section on fs
+void epoch_exit(rsfs_t *fs){
+    if(fs && fs->shared){
+        struct epoch_slot *slot = epoch_slot(&fs->epoch);
+        if(--slot->nesting>0) return;
+
+        __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    struct epoch_record *record = my_record;
+    if(--record->nesting>0) return;
+
+    __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+}
+
+//free ptr (an object of fs) with free_fn once no reader can reach it any more; ptr must already be unlinked
+void epoch_retire(rsfs_t *fs, void *ptr, void (*free_fn)(void *)){
+    pthread_once(&retired_slab_once, init_retired_slab);
+    struct retired *retired = (struct retired *)slab_alloc(&retired_slab);
+    if(retired==NULL){
+        printf("[epoch] fail to allocate a retired object.\n");
+        abort();
+    }
+    retired->ptr = ptr;
+    retired->free_fn = free_fn;
+    retired->domain = NULL;
+
+    if(fs && fs->shared){
+        pthread_mutex_lock(&shared_mutex);
+        epoch_try_advance_shared(&fs->epoch);
+        free_shared_retired(&fs->epoch);
+        retired->domain = &fs->epoch;
+        retired->epoch = __atomic_load_n(&fs->epoch.global_epoch, __ATOMIC_ACQUIRE);
+        retired->next = shared_limbo;
+        shared_limbo = retired;
+        pthread_mutex_unlock(&shared_mutex);
+        return;
+    }
+
+    struct epoch_record *record = epoch_record();
+
+    epoch_try_advance();
+
+    pthread_mutex_lock(&record->limbo_mutex);
+
+    //a list tagged with an epoch at least 3 behind the current one is past its grace period
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    int slot = epoch % 3;
+    if(record->limbo_epoch[slot]!=epoch){
+        free_retired(record->limbo[slot]);
+        record->limbo[slot] = NULL;
+        record->limbo_epoch[slot] = epoch;
+    }
+    for(int i=0; i<3; i++){
+        if(record->limbo[i] && record->limbo_epoch[i]+2<=epoch){
+            free_retired(record->limbo[i]);
+            record->limbo[i] = NULL;
+        }
+    }
+
+    retired->next = record->limbo[slot];
+    record->limbo[slot] = retired;
+
+    pthread_mutex_unlock(&record->limbo_mutex);
+}
+
+//wait until every object retired so far is past its grace period, then free them (and any other object past
+//its grace period), whichever thread retired them; used before the memory they point into goes away.
+//Objects retired meanwhile by other threads are left to wait for their own grace period.
+//For a shared fs only its own retirements (made by this process) are waited for.
+//The caller must not be inside a critical section (it would wait for itself)
+void epoch_barrier(rsfs_t *fs){
+    if(fs && fs->shared){
+        unsigned long target = __atomic_load_n(&fs->epoch.global_epoch, __ATOMIC_ACQUIRE)+2;
+        while(__atomic_load_n(&fs->epoch.global_epoch, __ATOMIC_ACQUIRE)<target){
+            epoch_try_advance_shared(&fs->epoch);
+            if(__atomic_load_n(&fs->epoch.global_epoch, __ATOMIC_ACQUIRE)<target) sched_yield();
+        }
+        pthread_mutex_lock(&shared_mutex);
+        free_shared_retired(&fs->epoch);
+        pthread_mutex_unlock(&shared_mutex);
+        return;
+    }
+
+    //two advances: every reader active now has left, and so has every reader of the epoch before
+    unsigned long target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE)+2;
+    while(__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE)<target){
+        epoch_try_advance();
+        if(__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE)<target) sched_yield();
+    }
+
+    //as in epoch_retire(), only the lists at least 2 epochs behind are past their grace period
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    for(struct epoch_record *r=__atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); r; r=r->next){
+        pthread_mutex_lock(&r->limbo_mutex);
+        for(int i=0; i<3; i++){
+            if(r->limbo[i] && r->limbo_epoch[i]+2<=epoch){
+                free_retired(r->limbo[i]);
+                r->limbo[i] = NULL;
+            }
+        }
+        pthread_mutex_unlock(&r->limbo_mutex);
+    }
+}
+
+//free the slots of a shared domain held by processes that died; return how many
+int epoch_recover(struct epoch_domain *domain){
+    int recovered = 0;
+    for(int s=0; s<EPOCH_SLOTS; s++){
+        struct epoch_slot *slot = &domain->slots[s];
+        int owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if(owner==0 || rsfs_process_alive(owner)) continue;
+        if(__atomic_compare_exchange_n(&slot->pid, &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+            recovered++;
+        }
+    }
+    return recovered;
+}
+
+//forget a shared domain this process is about to unmap: free the slots of all its threads in it;
+//its retirements must have been freed by epoch_barrier() already
+void epoch_detach(struct epoch_domain *domain){
+    int pid = getpid();
+    pthread_mutex_lock(&shared_mutex);
+    for(int j=0; j<EPOCH_DOMAINS; j++){
+        if(mapped_domains[j]==domain) mapped_domains[j] = NULL;
+    }
+    for(int s=0; s<EPOCH_SLOTS; s++){
+        struct epoch_slot *slot = &domain->slots[s];
+        if(__atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE)==pid){
+            __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+        }
+    }
+    for(int i=0; i<EPOCH_CACHED; i++){
+        if(my_slots[i].domain==domain) my_slots[i].domain = NULL;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+}
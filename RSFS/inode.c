@@ -1,55 +1,77 @@
 /*
-    allocation of inodes, inode bitmap, and mutexes to guard them;
-    routines for inode management
+    routines for managing the inodes and the inode bitmap of an instance
+    (they live in struct rsfs, guarded by its inode_bitmap_mutex)
 */
 
 #include "def.h"
 
 
-//allocation of inodes, inode bitmap and mutexes
-struct inode inodes[NUM_INODES];
-pthread_mutex_t inodes_mutex;
-int inode_bitmap[NUM_INODES];
-pthread_mutex_t inode_bitmap_mutex;
+//helper: initialize the inode inode_number of fs, just allocated; the caller holds inode_bitmap_mutex
+static void init_inode(rsfs_t *fs, int inode_number){
+    struct inode *inode = &fs->inodes[inode_number];
+    inode->length=0;
+    inode->reserved=0;
+    inode->compressed=0;
+    inode->compress_policy=RSFS_COMPRESS_OFF;
+    inode->hot=0;
+    //the new file is part of no snapshot taken so far
+    inode->snap_seen=__atomic_load_n(&fs->snapshot_id, __ATOMIC_ACQUIRE);
+    for(int j=0; j<NUM_POINTER; j++) inode->block[j]=-1;
+    //the mutexes and the reader count are left alone: an opener that raced with the
+    //deletion of the previous file may still hold them briefly (see RSFS_open)
+}
 
+//to allocate up to num empty inodes at once, storing their inode-numbers in inode_numbers;
+//return how many were allocated (fewer than num if the inodes run out)
+int allocate_inodes(rsfs_t *fs, int *inode_numbers, int num){
 
-//to allocate an empty inode and return the inode-number; 
-//if no free inode is available, return -1
-int allocate_inode(){
+    int allocated=0;
 
-    int inode_number=-1; //init 
+    PROF_LOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
-
-    for(int i=0; i<NUM_INODES; i++){
-        if(inode_bitmap[i]==0){//find an available inode
-            
-            inode_number=i;
-            inode_bitmap[i]=1; //mark it as allocated
-            
-            //initialize the inode
-            inodes[i].length=0;
-            for(int j=0; j<NUM_POINTER; j++) inodes[i].block[j]=-1;
-            inodes[i].num_current_reader=0;
-            pthread_mutex_init(&inodes[i].read_mutex,NULL);
-            pthread_mutex_init(&inodes[i].rw_mutex,NULL);
-
-            break;
+    for(int i=0; i<NUM_INODES && allocated<num; i++){
+        if(fs->inode_bitmap[i]==0){//find an available inode
+            fs->inode_bitmap[i]=1; //mark it as allocated
+            STAT_ADD(fs, used_inodes, 1);
+            init_inode(fs, i);
+            inode_numbers[allocated++]=i;
         }
     }
 
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    PROF_UNLOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    for(int i=0; i<allocated; i++) TRACE_EVENT(TRACE_INODE_ALLOC, inode_numbers[i], -1, 0, 0);
+    return allocated;
+}
+
+//to allocate an empty inode and return the inode-number; 
+//if no free inode is available, return -1
+int allocate_inode(rsfs_t *fs){
+
+    int inode_number=-1; //init 
+    if(allocate_inodes(fs, &inode_number, 1)==0) TRACE_EVENT(TRACE_INODE_ALLOC, -1, -1, 0, 0);
 
     return inode_number;
 }
 
 //to free an inode with provided inode_number
-void free_inode(int inode_number){
-
-    pthread_mutex_lock(&inode_bitmap_mutex);
-    
-    inode_bitmap[inode_number]=0; //mark it as available
-    
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+void free_inode(rsfs_t *fs, int inode_number){
+    free_inodes(fs, &inode_number, 1);
 }
 
+//to free the num inodes in inode_numbers at once
+void free_inodes(rsfs_t *fs, int *inode_numbers, int num){
+
+    PROF_LOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    for(int i=0; i<num; i++){
+        if(fs->inode_bitmap[inode_numbers[i]]){
+            fs->inode_bitmap[inode_numbers[i]]=0; //mark it as available
+            STAT_ADD(fs, used_inodes, -1);
+        }
+    }
+
+    PROF_UNLOCK(&fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    for(int i=0; i<num; i++) TRACE_EVENT(TRACE_INODE_FREE, inode_numbers[i], -1, 0, 0);
+}
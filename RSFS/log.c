@@ -0,0 +1,140 @@
+/*
+    log-structured mode: the data blocks form a log of NUM_SEGMENTS segments of SEGMENT_BLOCKS blocks.
+    Blocks are taken one after the other at the head of the log, and a block about to be written is copied to the head
+    and its old copy freed (see writable_data_block()), so a write takes the next block instead of searching the pool,
+    however fragmented it is. The inode map (block_owner) tells which inode pointer each block belongs to,
+    so that the cleaner can move the live blocks of a segment out of it.
+    The cleaner picks segments by cost-benefit, (1-u)*age/(1+u) for a segment with a share u of live blocks,
+    written age blocks ago: cold segments are cleaned while still fairly full, hot ones are left to empty themselves.
+    It runs when asked to, and inline when an allocation finds no clean segment left (unless it is running already)
+*/
+
+#include "def.h"
+#include <unistd.h>
+
+
+//helper: the segment the cleaner should empty next, -1 if none is worth it; tried marks the segments it gave up on.
+//The head segment, clean segments and full segments (nothing to gain) are never picked
+static int pick_victim(rsfs_t *fs, int *tried){
+    int victim = -1;
+    double best = 0;
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int s=0; s<NUM_SEGMENTS; s++){
+        if(tried[s] || (s==fs->log_segment && fs->log_head>=0)) continue;
+        if(fs->segment_live[s]==0 || fs->segment_live[s]==SEGMENT_BLOCKS) continue;
+        double u = (double)fs->segment_live[s]/SEGMENT_BLOCKS;
+        double age = (double)(fs->log_seq - fs->segment_written[s]) + 1;
+        double score = (1-u)*age/(1+u);
+        if(score>best){
+            best = score;
+            victim = s;
+        }
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    return victim;
+}
+
+//helper: move the live blocks of segment out of it, never waiting for a file: return 1 if the segment is clean then
+static int clean_segment(rsfs_t *fs, int segment){
+    int owner[SEGMENT_BLOCKS];
+    int block[SEGMENT_BLOCKS];
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    for(int i=0; i<SEGMENT_BLOCKS; i++){
+        block[i] = segment*SEGMENT_BLOCKS+i;
+        owner[i] = fs->data_bitmap[block[i]] ? fs->block_owner[block[i]] : -1;
+    }
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int i=0; i<SEGMENT_BLOCKS; i++){
+        if(owner[i]<0) continue; //free, or not movable (shared blocks stay where they are)
+        struct inode *inode = &fs->inodes[owner[i]/NUM_POINTER];
+
+        //the file is held like a writer, so nobody reads the block while it moves; a file in use is skipped
+        if(PROF_TRYLOCK(&inode->rw_mutex, LOCK_INODE_RW)!=0) continue;
+        inode->rw_owner = getpid();
+        if(log_move_block(fs, &inode->block[owner[i]%NUM_POINTER], block[i])>=0) STAT_ADD(fs, cleaner_moves, 1);
+        inode->rw_owner = 0;
+        release_rw_mutex(fs, inode);
+    }
+
+    return __atomic_load_n(&fs->segment_live[segment], __ATOMIC_RELAXED)==0;
+}
+
+//helper: rsfs_log_clean() with cleaner_mutex held
+static int clean_segments(rsfs_t *fs, int max_segments){
+    int tried[NUM_SEGMENTS] = {0};
+    int cleaned = 0;
+    while(cleaned<max_segments){
+        int victim = pick_victim(fs, tried);
+        if(victim<0) break;
+        tried[victim] = 1;
+        if(clean_segment(fs, victim)){
+            cleaned++;
+            STAT_ADD(fs, cleaned_segments, 1);
+        }
+    }
+    return cleaned;
+}
+
+
+//turn the log-structured mode of fs on (1) or off (0): blocks written from now on go to the head of the log
+//or stay in place (blocks already written stay where they are); return the previous setting
+int rsfs_set_log_mode(rsfs_t *fs, int enable){
+    return __atomic_exchange_n(&fs->log_mode, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+//empty up to max_segments segments of fs, best first, skipping the files in use; return how many were emptied
+int rsfs_log_clean(rsfs_t *fs, int max_segments){
+    rsfs_mutex_lock(&fs->cleaner_mutex);
+    int cleaned = clean_segments(fs, max_segments);
+    pthread_mutex_unlock(&fs->cleaner_mutex);
+    return cleaned;
+}
+
+//clean one segment of fs if it is in log-structured mode, its head segment is used up and no segment is clean.
+//Allocations call it, possibly holding a file: the cleaner only tries its locks, and is not waited for if busy
+void log_clean_if_needed(rsfs_t *fs){
+    if(!__atomic_load_n(&fs->log_mode, __ATOMIC_RELAXED) || __atomic_load_n(&fs->log_head, __ATOMIC_RELAXED)>=0) return;
+    for(int s=0; s<NUM_SEGMENTS; s++){
+        if(__atomic_load_n(&fs->segment_live[s], __ATOMIC_RELAXED)==0) return;
+    }
+    if(rsfs_mutex_trylock(&fs->cleaner_mutex)!=0) return;
+    clean_segments(fs, 1);
+    pthread_mutex_unlock(&fs->cleaner_mutex);
+}
+
+//read the state of the log of fs and of its segments into stats
+void rsfs_log_stats(rsfs_t *fs, struct rsfs_log_stats *stats){
+    memset(stats, 0, sizeof(*stats));
+    int live = 0, used = 0;
+
+    PROF_LOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    stats->log_mode = fs->log_mode;
+    stats->head_segment = fs->log_segment;
+    for(int s=0; s<NUM_SEGMENTS; s++){
+        stats->segment_live[s] = fs->segment_live[s];
+        stats->segment_age[s] = fs->log_seq - fs->segment_written[s];
+        if(fs->segment_live[s]==0){
+            stats->clean_segments++;
+        }else{
+            live += fs->segment_live[s];
+            used += SEGMENT_BLOCKS;
+        }
+    }
+
+    PROF_UNLOCK(&fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    stats->utilization = used ? (double)live/used : 0;
+    stats->log_writes = __atomic_load_n(&fs->counters.log_writes.value, __ATOMIC_RELAXED);
+    stats->cleaned_segments = __atomic_load_n(&fs->counters.cleaned_segments.value, __ATOMIC_RELAXED);
+    stats->cleaner_moves = __atomic_load_n(&fs->counters.cleaner_moves.value, __ATOMIC_RELAXED);
+}
+
+int RSFS_set_log_mode(int enable){ return rsfs_set_log_mode(&rsfs_default, enable); }
+int RSFS_log_clean(int max_segments){ return rsfs_log_clean(&rsfs_default, max_segments); }
+void RSFS_log_stats(struct rsfs_log_stats *stats){ rsfs_log_stats(&rsfs_default, stats); }
@@ -0,0 +1,99 @@
+/*
+    name arena: interned file and directory names, stored once with their hash and length
+    in size-classed slabs and shared by every dir_entry with the same name
+*/
+
+#include "def.h"
+#include <stddef.h>
+
+//interned name record; str is what dir_entry->name points to
+struct name{
+    rsfs_off_t next; //next record in the same bucket of the intern table (offset in the instance)
+    unsigned int hash; //cached name_hash() of str
+    unsigned short len; //cached strlen() of str
+    unsigned short size_class; //slab cache the record came from
+    int refs; //number of dir_entries using this name
+    char str[]; //the name, 0-terminated
+};
+
+static const int name_class_len[NAME_CLASSES] = {7, 23, 39, MAX_NAME_LEN}; //longest name of each size class
+//the slabs, intern table and locks of each instance live in struct rsfs
+
+
+//hash of the first len bytes of str (FNV-1a)
+unsigned int name_hash(const char *str, int len){
+    unsigned int hash = 2166136261u;
+    for(int i=0; i<len; i++){
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//initialize the name arena and the intern table of fs
+void init_names(rsfs_t *fs){
+    for(int i=0; i<NAME_CLASSES; i++){
+        slab_init(fs, &fs->name_slabs[i], sizeof(struct name)+name_class_len[i]+1, NAME_SLAB_OBJECTS);
+    }
+    for(int i=0; i<NAME_TABLE_BUCKETS; i++) fs->name_table[i] = 0;
+    for(int i=0; i<NAME_LOCKS; i++) rsfs_mutex_init(fs, &fs->name_locks[i], 1);
+}
+
+//get the interned copy of the len bytes at str (whose hash is given) and take a reference on it;
+//return NULL if the name is too long or no memory is left
+char *name_intern(rsfs_t *fs, const char *str, int len, unsigned int hash){
+    if(len>MAX_NAME_LEN) return NULL;
+
+    int bucket = hash % NAME_TABLE_BUCKETS;
+    pthread_mutex_t *lock = &fs->name_locks[bucket % NAME_LOCKS];
+    PROF_LOCK(lock, LOCK_NAMES);
+
+    //compare hash and length before the bytes
+    struct name *name = to_ptr(fs, fs->name_table[bucket]);
+    while(name && !(name->hash==hash && name->len==len && memcmp(name->str,str,len)==0)){
+        name = to_ptr(fs, name->next);
+    }
+
+    if(name==NULL){
+        int size_class = 0;
+        while(name_class_len[size_class]<len) size_class++;
+
+        name = (struct name *)slab_alloc(&fs->name_slabs[size_class]);
+        if(name==NULL){
+            PROF_UNLOCK(lock, LOCK_NAMES);
+            return NULL;
+        }
+        name->hash = hash;
+        name->len = len;
+        name->size_class = size_class;
+        name->refs = 0;
+        memcpy(name->str, str, len);
+        name->str[len] = '\0';
+
+        name->next = fs->name_table[bucket];
+        fs->name_table[bucket] = to_off(fs, name);
+    }
+    name->refs++;
+
+    PROF_UNLOCK(lock, LOCK_NAMES);
+
+    return name->str;
+}
+
+//drop a reference taken by name_intern(); the record is recycled when the last one goes
+void name_release(rsfs_t *fs, char *str){
+    struct name *name = (struct name *)(str - offsetof(struct name, str));
+
+    int bucket = name->hash % NAME_TABLE_BUCKETS;
+    pthread_mutex_t *lock = &fs->name_locks[bucket % NAME_LOCKS];
+    PROF_LOCK(lock, LOCK_NAMES);
+
+    if(--name->refs==0){
+        rsfs_off_t *link = &fs->name_table[bucket];
+        while(*link!=to_off(fs, name)) link = &((struct name *)to_ptr(fs, *link))->next;
+        *link = name->next;
+        slab_free(&fs->name_slabs[name->size_class], name);
+    }
+
+    PROF_UNLOCK(lock, LOCK_NAMES);
+}
@@ -1,44 +1,216 @@
 /*
-    allocation of global open_file_table and its guarding mutex; 
-    routines for open file entry
+    routines for the open file table of an instance
+    (its chunks, free list and guarding mutex live in struct rsfs)
 */
 
 #include "def.h"
+#include <unistd.h>
 
-struct open_file_entry open_file_table[NUM_OPEN_FILE];
-pthread_mutex_t open_file_table_mutex;
 
-//allocate an available entry in open file table and return fd (file descriptor);
-//return -1 if no entry is found
-int allocate_open_file_entry(int access_flag, struct dir_entry *dir_entry){
-    
-    int fd=-1;
-    
-    pthread_mutex_lock(&open_file_table_mutex);
+//helper: the entry with the given index; NULL if its chunk does not exist
+static struct open_file_entry *open_file_entry_at(rsfs_t *fs, int index){
+    int chunk = index / NUM_OPEN_FILE;
+    if(chunk>=OPEN_FILE_CHUNKS) return NULL;
+    struct open_file_entry *entries = to_ptr(fs, __atomic_load_n(&fs->open_file_table[chunk], __ATOMIC_ACQUIRE));
+    if(entries==NULL) return NULL;
+    return &entries[index % NUM_OPEN_FILE];
+}
+
+//helper: push the entry with the given index onto the free list
+static void push_free_entry(rsfs_t *fs, int index){
+    struct open_file_entry *entry = open_file_entry_at(fs, index);
+    unsigned long head = __atomic_load_n(&fs->open_file_free, __ATOMIC_ACQUIRE);
+    unsigned long new_head;
+    do{
+        __atomic_store_n(&entry->next_free, (int)(head & 0xffffffffUL), __ATOMIC_RELAXED);
+        new_head = (((head>>32)+1)<<32) | (unsigned long)(index+1);
+    }while(!__atomic_compare_exchange_n(&fs->open_file_free, &head, new_head, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+//helper: pop an index from the free list; return -1 if the list is empty
+static int pop_free_entry(rsfs_t *fs){
+    unsigned long head = __atomic_load_n(&fs->open_file_free, __ATOMIC_ACQUIRE);
+    unsigned long new_head;
+    int index;
+    do{
+        index = (int)(head & 0xffffffffUL) - 1;
+        if(index<0) return -1;
+        //entries are never released, so reading next_free of an entry popped meanwhile is harmless:
+        //the tag in the head makes the exchange fail in that case
+        int next = __atomic_load_n(&open_file_entry_at(fs, index)->next_free, __ATOMIC_RELAXED);
+        new_head = (((head>>32)+1)<<32) | (unsigned long)next;
+    }while(!__atomic_compare_exchange_n(&fs->open_file_free, &head, new_head, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return index;
+}
+
+//helper: add a chunk of NUM_OPEN_FILE entries to the table and put them on the free list;
+//return 0 if succeed or -1 if the table cannot grow any more. The caller holds open_file_table_mutex
+static int add_chunk(rsfs_t *fs){
+    if(fs->open_file_chunks==OPEN_FILE_CHUNKS) return -1;
+
+    //chunks are whole cache lines, so entries of different instances never share one
+    struct open_file_entry *entries = (struct open_file_entry *)rsfs_alloc(fs, NUM_OPEN_FILE*sizeof(struct open_file_entry));
+    if(entries!=NULL) memset(entries, 0, NUM_OPEN_FILE*sizeof(struct open_file_entry));
+    if(entries==NULL){
+        printf("[open_file_table] fail to allocate a chunk of entries.\n");
+        return -1;
+    }
     for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry *entry = &open_file_table[i];
-        if(entry->used==0){
-            fd=i; //find a valid fd
-            entry->used = 1; //mark it as used
+        rsfs_mutex_init(fs, &entries[i].entry_mutex, 1);
+        entries[i].access_flag = -1;
+    }
+
+    int chunk = fs->open_file_chunks;
+    __atomic_store_n(&fs->open_file_table[chunk], to_off(fs, entries), __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->open_file_chunks, chunk+1, __ATOMIC_RELEASE);
+
+    //push in reverse so that the lowest index is handed out first
+    for(int i=NUM_OPEN_FILE-1; i>=0; i--){
+        push_free_entry(fs, chunk*NUM_OPEN_FILE+i);
+    }
+    return 0;
+}
+
+//helper: add a chunk of entries to the table, unless another thread did while we waited;
+//return 0 if succeed or -1 if the table cannot grow any more
+static int grow_open_file_table(rsfs_t *fs){
+
+    PROF_LOCK(&fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
+
+    //another thread may have grown the table while we waited
+    int ret = 0;
+    if((__atomic_load_n(&fs->open_file_free, __ATOMIC_ACQUIRE) & 0xffffffffUL)==0){
+        ret = add_chunk(fs);
+    }
+
+    PROF_UNLOCK(&fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
+
+    return ret;
+}
+
+
+//initialize the open file table of fs with its first chunk of entries; return 0 if succeed
+int init_open_file_table(rsfs_t *fs){
+    rsfs_mutex_init(fs, &fs->open_file_table_mutex, 1);
+    fs->open_file_chunks = 0;
+    fs->open_file_free = 0;
+    for(int i=0; i<OPEN_FILE_CHUNKS; i++) fs->open_file_table[i] = 0;
+    return grow_open_file_table(fs);
+}
+
+//release the chunks of the open file table of fs; no descriptor of it may be in use
+void destroy_open_file_table(rsfs_t *fs){
+    for(int i=0; i<fs->open_file_chunks; i++){
+        struct open_file_entry *entries = to_ptr(fs, fs->open_file_table[i]);
+        for(int j=0; j<NUM_OPEN_FILE; j++) pthread_mutex_destroy(&entries[j].entry_mutex);
+        rsfs_release(fs, entries);
+        fs->open_file_table[i] = 0;
+    }
+    fs->open_file_chunks = 0;
+    fs->open_file_free = 0;
+    pthread_mutex_destroy(&fs->open_file_table_mutex);
+}
 
-            //set up the entry
-            entry->access_flag = access_flag;
-            entry->dir_entry = dir_entry; 
+//grow the table, under one acquisition of its mutex, until about num entries are free (the count of open files
+//is read without a lock, so it is a hint), so that a batch of opens does not grow it a chunk at a time
+void reserve_open_file_entries(rsfs_t *fs, int num){
 
-            //init position
-            entry->position = 0; 
-            
-            break;
-        }
+    PROF_LOCK(&fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
+
+    while(fs->open_file_chunks*NUM_OPEN_FILE - __atomic_load_n(&fs->counters.open_files.value, __ATOMIC_RELAXED) < num){
+        if(add_chunk(fs)!=0) break;
+    }
+
+    PROF_UNLOCK(&fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
+}
+
+//allocate an available entry in open file table and return fd (file descriptor);
+//dir_entry is NULL for a snapshot file, whose snapshot_file the caller sets (see snapshot.c);
+//the table grows when it is full; return -1 if it cannot grow any more
+int allocate_open_file_entry(rsfs_t *fs, int access_flag, struct dir_entry *dir_entry){
+
+    int index;
+    while((index=pop_free_entry(fs))<0){
+        if(grow_open_file_table(fs)!=0) return -1;
     }
-    pthread_mutex_unlock(&open_file_table_mutex);
 
-    return fd;
+    struct open_file_entry *entry = open_file_entry_at(fs, index);
+
+    //set up the entry
+    entry->access_flag = access_flag;
+    entry->dir_entry = to_off(fs, dir_entry);
+    entry->snapshot_file = 0;
+    entry->owner = getpid();
+
+    //init position
+    entry->position = 0;
+
+    __atomic_store_n(&entry->used, 1, __ATOMIC_RELEASE); //mark it as used
+    STAT_ADD(fs, open_files, 1);
+
+    //the descriptor carries the generation of the entry, so it turns stale once the entry is freed
+    int generation = __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE);
+    TRACE_EVENT(TRACE_FD_ALLOC, dir_entry ? dir_entry->inode_number : -1, (generation<<FD_INDEX_BITS) | index, 0, 0);
+    return (generation<<FD_INDEX_BITS) | index;
 }
 
+//get the open file entry of fd; return NULL if fd is invalid, closed or stale
+struct open_file_entry *get_open_file_entry(rsfs_t *fs, int fd){
+    if(fd<0) return NULL;
 
-void free_open_file_entry(int fd){
-    pthread_mutex_lock(&open_file_table_mutex);
-    open_file_table[fd].used=0;
-    pthread_mutex_unlock(&open_file_table_mutex);
-}
\ No newline at end of file
+    struct open_file_entry *entry = open_file_entry_at(fs, fd & FD_INDEX_MASK);
+    if(entry==NULL) return NULL;
+
+    if(__atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE)!=(fd>>FD_INDEX_BITS)) return NULL;
+    if(!__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE)) return NULL;
+
+    return entry;
+}
+
+//claim the open file entry of fd for closing it, by bumping its generation: the descriptor turns stale at once,
+//so that of two closes of the same fd only one gets the entry; return NULL if fd is invalid, closed or stale
+struct open_file_entry *claim_open_file_entry(rsfs_t *fs, int fd){
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if(entry==NULL) return NULL;
+
+    int generation = fd>>FD_INDEX_BITS;
+    if(!__atomic_compare_exchange_n(&entry->generation, &generation, (generation+1) & FD_GENERATION_MASK, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return NULL;
+    return entry;
+}
+
+//free (release) the open file entry of fd, claimed with claim_open_file_entry()
+void free_open_file_entry(rsfs_t *fs, int fd){
+    int index = fd & FD_INDEX_MASK;
+    struct open_file_entry *entry = open_file_entry_at(fs, index);
+
+    TRACE_EVENT(TRACE_FD_FREE, entry->dir_entry ? ((struct dir_entry *)to_ptr(fs, entry->dir_entry))->inode_number : -1, fd, entry->position, 0);
+    __atomic_store_n(&entry->used, 0, __ATOMIC_RELEASE);
+    STAT_ADD(fs, open_files, -1);
+
+    push_free_entry(fs, index);
+}
+
+//release the entries of fs opened by processes that died (and the holds they took on their files);
+//return the number of entries released
+int recover_open_file_entries(rsfs_t *fs){
+    int recovered = 0;
+    int chunks = __atomic_load_n(&fs->open_file_chunks, __ATOMIC_ACQUIRE);
+    for(int index=0; index<chunks*NUM_OPEN_FILE; index++){
+        struct open_file_entry *entry = open_file_entry_at(fs, index);
+        if(entry==NULL || !__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE)) continue;
+
+        int owner = __atomic_load_n(&entry->owner, __ATOMIC_ACQUIRE);
+        if(owner<=0 || rsfs_process_alive(owner)) continue;
+
+        //claim the entry, so that two recovering processes do not release it twice
+        int fd = (__atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE)<<FD_INDEX_BITS) | index;
+        if(claim_open_file_entry(fs, fd)==NULL) continue;
+
+        struct dir_entry *dir_entry = to_ptr(fs, entry->dir_entry);
+        if(dir_entry) release_open_lock(fs, &fs->inodes[dir_entry->inode_number], entry->access_flag);
+        else snapshot_close_file(fs, entry);
+        free_open_file_entry(fs, fd);
+        recovered++;
+    }
+    return recovered;
+}
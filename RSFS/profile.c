@@ -0,0 +1,344 @@
+/*
+    profiling: per-thread latency histograms of the RSFS_* calls, and wait/hold counters
+    of the internal mutexes; each thread only writes its own record, and the records are
+    merged when the profile is read. The same call scopes and lock waits feed the event trace (trace.c).
+*/
+
+#include "def.h"
+#include <stddef.h>
+#include <time.h>
+
+//log-linear histogram: values below 2^PROF_SUB_BITS get a bucket each, then every power of two
+//is split into 2^PROF_SUB_BITS buckets (like HDR histograms, with 3 significant bits)
+#define PROF_SUB_BITS 3
+#define PROF_SUB (1<<PROF_SUB_BITS)
+#define PROF_BUCKETS ((64-PROF_SUB_BITS+1)*PROF_SUB)
+#define PROF_HELD 16 //mutexes a thread is expected to hold at once
+
+//mutex taken by a thread and not released yet
+struct prof_held{
+    pthread_mutex_t *mutex;
+    unsigned long since;
+};
+
+struct prof_hist{
+    unsigned long count;
+    unsigned long total;
+    unsigned long max;
+    unsigned long buckets[PROF_BUCKETS];
+};
+
+//per-thread record; records are never freed, so the list can be walked without a lock
+struct prof_thread{
+    struct prof_hist op_latency[PROF_OPS];
+    unsigned long op_bytes[PROF_OPS];
+    struct prof_hist lock_wait[PROF_LOCKS];
+    unsigned long lock_contended[PROF_LOCKS];
+    unsigned long lock_hold[PROF_LOCKS];
+    struct prof_held held[PROF_HELD]; //mutexes taken by the thread, for their hold times
+    int next_held; //slot to reuse when every slot is taken
+    struct prof_thread *next;
+};
+
+static const char *prof_op_names[PROF_OPS] = {
+    "create", "open", "try_open", "append", "fseek", "read", "write",
+    "cut", "close", "delete", "mkdir", "rmdir", "stat", "opendir",
+    "snapshot_create", "snapshot_open_file", "snapshot_drop",
+    "create_open", "create_many", "open_many", "delete_many", "readdir_plus",
+    "find", "scan", "copy_range", "import_fd", "export_fd"
+};
+static const char *prof_lock_names[PROF_LOCKS] = {
+    "inode_rw", "inode_read", "dir", "open_file_table", "data_bitmap",
+    "inode_bitmap", "names", "slab", "fs_stat", "snapshot"
+};
+
+static struct prof_thread *prof_threads; //list of the records of all threads that were profiled
+static __thread struct prof_thread *my_prof;
+static __thread struct prof_scope *current_scope; //innermost RSFS_* call of the thread
+
+
+//helper: get (and register on first use) the record of the calling thread
+static struct prof_thread *prof_thread(){
+    if(my_prof) return my_prof;
+
+    struct prof_thread *record = (struct prof_thread *)calloc(1, sizeof(struct prof_thread));
+    if(record==NULL){
+        printf("[profile] fail to allocate a profile record.\n");
+        abort();
+    }
+    record->next = __atomic_load_n(&prof_threads, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&prof_threads, &record->next, record, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    my_prof = record;
+    return record;
+}
+
+//helper: add n to a counter that only the calling thread writes (no locked instruction needed)
+static inline void prof_add(unsigned long *counter, unsigned long n){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+n, __ATOMIC_RELAXED);
+}
+
+//helper: bucket of value v
+static inline int prof_bucket(unsigned long v){
+    if(v<PROF_SUB) return (int)v;
+    int msb = 63-__builtin_clzl(v);
+    return (msb-PROF_SUB_BITS+1)*PROF_SUB + (int)((v>>(msb-PROF_SUB_BITS)) & (PROF_SUB-1));
+}
+
+//helper: largest value that falls in bucket b
+static unsigned long prof_bucket_max(int b){
+    if(b<PROF_SUB) return (unsigned long)b;
+    int msb = b/PROF_SUB + PROF_SUB_BITS - 1;
+    unsigned long low = (unsigned long)(PROF_SUB + b%PROF_SUB) << (msb-PROF_SUB_BITS);
+    return low + (1UL<<(msb-PROF_SUB_BITS)) - 1;
+}
+
+//helper: record value v in a histogram of the calling thread
+static void prof_record(struct prof_hist *hist, unsigned long v){
+    prof_add(&hist->count, 1);
+    prof_add(&hist->total, v);
+    if(v>hist->max) __atomic_store_n(&hist->max, v, __ATOMIC_RELAXED);
+    prof_add(&hist->buckets[prof_bucket(v)], 1);
+}
+
+//helper: add the histogram src (read while its thread may still write it) into dst
+static void prof_merge(struct prof_hist *dst, struct prof_hist *src){
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if(max>dst->max) dst->max = max;
+    for(int b=0; b<PROF_BUCKETS; b++){
+        dst->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+//helper: summarize a merged histogram
+static void prof_summarize(struct prof_hist *hist, struct rsfs_latency *latency){
+    latency->count = hist->count;
+    latency->total_ns = hist->total;
+    latency->max_ns = hist->max;
+
+    //the buckets may hold a few more samples than count if they were read later
+    unsigned long total = 0;
+    for(int b=0; b<PROF_BUCKETS; b++) total += hist->buckets[b];
+
+    unsigned long *percentile[3] = {&latency->p50_ns, &latency->p99_ns, &latency->p999_ns};
+    double fraction[3] = {0.5, 0.99, 0.999};
+    for(int i=0; i<3; i++){
+        unsigned long rank = (unsigned long)(fraction[i]*total);
+        if(rank>=total && total>0) rank = total-1;
+        unsigned long seen = 0;
+        int b = 0;
+        while(b<PROF_BUCKETS-1 && seen+hist->buckets[b]<=rank){
+            seen += hist->buckets[b];
+            b++;
+        }
+        *percentile[i] = total ? prof_bucket_max(b) : 0;
+        if(*percentile[i]>hist->max) *percentile[i] = hist->max;
+    }
+}
+
+
+//monotonic time in ns
+unsigned long prof_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+//make scope the current call of the thread; run by PROF_OP when the call starts
+void prof_op_begin(struct prof_scope *scope){
+    scope->parent = current_scope;
+    current_scope = scope;
+}
+
+//leave the scope of an RSFS_* call while it runs code of its caller (the callback of RSFS_scan),
+//so that the calls made meanwhile are recorded on their own and their lock waits are not charged to it
+void prof_op_suspend(struct prof_scope *scope){
+    current_scope = scope->parent;
+}
+
+//enter the scope of an RSFS_* call again after prof_op_suspend()
+void prof_op_resume(struct prof_scope *scope){
+    current_scope = scope;
+}
+
+//record the latency (and bytes moved) of an RSFS_* call; run by PROF_OP when the call returns
+void prof_op_end(struct prof_scope *scope){
+    current_scope = scope->parent;
+    unsigned long duration = prof_now()-scope->start;
+
+    if(RSFS_PROFILE){
+        struct prof_thread *record = prof_thread();
+        prof_record(&record->op_latency[scope->op], duration);
+        if(scope->bytes>0) prof_add(&record->op_bytes[scope->op], scope->bytes);
+    }
+    if(RSFS_TRACE && __atomic_load_n(&rsfs_tracing, __ATOMIC_RELAXED)){
+        trace_record(scope->op, scope->start, duration, scope->wait_ns, scope->inode_number, scope->fd, scope->offset, (int)scope->bytes);
+    }
+    //a call made by another one (RSFS_open by RSFS_open_many) is replayed with it
+    if(RSFS_RECORD && scope->parent==NULL && __atomic_load_n(&rsfs_recording, __ATOMIC_RELAXED)) record_call(scope);
+}
+
+//helper: start the hold time of mutex, just taken by the calling thread
+static void prof_acquired(struct prof_thread *record, pthread_mutex_t *mutex, unsigned long now){
+    int free_slot = -1;
+    for(int i=0; i<PROF_HELD; i++){
+        if(record->held[i].mutex==mutex){
+            free_slot = i; //left behind by a release from another thread
+            break;
+        }
+        if(record->held[i].mutex==NULL && free_slot<0) free_slot = i;
+    }
+    if(free_slot<0){
+        free_slot = record->next_held;
+        record->next_held = (record->next_held+1) % PROF_HELD;
+    }
+    record->held[free_slot].mutex = mutex;
+    record->held[free_slot].since = now;
+}
+
+//lock mutex, counting the wait if it is contended
+void prof_lock(pthread_mutex_t *mutex, int lock){
+    struct prof_thread *record = prof_thread();
+
+    if(rsfs_mutex_trylock(mutex)==0){
+        if(RSFS_PROFILE) prof_record(&record->lock_wait[lock], 0);
+        prof_acquired(record, mutex, prof_now());
+        return;
+    }
+
+    unsigned long start = prof_now();
+    rsfs_mutex_lock(mutex);
+    unsigned long now = prof_now();
+
+    if(RSFS_PROFILE){
+        prof_add(&record->lock_contended[lock], 1);
+        prof_record(&record->lock_wait[lock], now-start);
+    }
+    prof_acquired(record, mutex, now);
+
+    //charge the wait to the current call, and trace what it waited for
+    if(current_scope) current_scope->wait_ns += now-start;
+    if(RSFS_TRACE && __atomic_load_n(&rsfs_tracing, __ATOMIC_RELAXED)){
+        int inode_number = current_scope ? current_scope->inode_number : -1;
+        int fd = current_scope ? current_scope->fd : -1;
+        trace_record(TRACE_LOCK_WAIT, start, now-start, now-start, inode_number, fd, 0, lock);
+    }
+}
+
+//try to lock mutex; a failed attempt counts as contention
+int prof_trylock(pthread_mutex_t *mutex, int lock){
+    struct prof_thread *record = prof_thread();
+
+    int ret = rsfs_mutex_trylock(mutex);
+    if(ret!=0){
+        if(RSFS_PROFILE) prof_add(&record->lock_contended[lock], 1);
+        return ret;
+    }
+    if(RSFS_PROFILE) prof_record(&record->lock_wait[lock], 0);
+    prof_acquired(record, mutex, prof_now());
+    return 0;
+}
+
+//unlock mutex; the hold time is counted only if the calling thread took it
+//(the last reader of a file may release an rw_mutex that another reader took)
+void prof_unlock(pthread_mutex_t *mutex, int lock){
+    struct prof_thread *record = prof_thread();
+
+    for(int i=0; i<PROF_HELD; i++){
+        if(record->held[i].mutex==mutex){
+            if(RSFS_PROFILE) prof_add(&record->lock_hold[lock], prof_now()-record->held[i].since);
+            record->held[i].mutex = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+
+//merge the records of all threads into profile: return 0, or -1 if profiling is compiled out
+int RSFS_get_profile(struct rsfs_profile *profile){
+    memset(profile, 0, sizeof(struct rsfs_profile));
+    if(!RSFS_PROFILE) return -1;
+
+    struct prof_hist *hist = (struct prof_hist *)calloc(PROF_OPS+PROF_LOCKS, sizeof(struct prof_hist));
+    if(hist==NULL){
+        printf("[profile] fail to allocate the merged histograms.\n");
+        return -1;
+    }
+
+    for(struct prof_thread *r=__atomic_load_n(&prof_threads, __ATOMIC_ACQUIRE); r; r=r->next){
+        for(int op=0; op<PROF_OPS; op++){
+            prof_merge(&hist[op], &r->op_latency[op]);
+            profile->op_bytes[op] += __atomic_load_n(&r->op_bytes[op], __ATOMIC_RELAXED);
+        }
+        for(int lock=0; lock<PROF_LOCKS; lock++){
+            prof_merge(&hist[PROF_OPS+lock], &r->lock_wait[lock]);
+            profile->lock_contended[lock] += __atomic_load_n(&r->lock_contended[lock], __ATOMIC_RELAXED);
+            profile->lock_hold_ns[lock] += __atomic_load_n(&r->lock_hold[lock], __ATOMIC_RELAXED);
+        }
+    }
+
+    for(int op=0; op<PROF_OPS; op++) prof_summarize(&hist[op], &profile->op_latency[op]);
+    for(int lock=0; lock<PROF_LOCKS; lock++) prof_summarize(&hist[PROF_OPS+lock], &profile->lock_wait[lock]);
+
+    free(hist);
+    return 0;
+}
+
+//zero the records of all threads; samples taken while this runs may be lost
+void RSFS_reset_profile(){
+    for(struct prof_thread *r=__atomic_load_n(&prof_threads, __ATOMIC_ACQUIRE); r; r=r->next){
+        //everything before held; locks held right now keep their hold timers
+        memset(r, 0, offsetof(struct prof_thread, held));
+    }
+}
+
+//print the merged profile to out, as a text table or (json!=0) as a JSON object
+void RSFS_dump_profile(FILE *out, int json){
+    struct rsfs_profile profile;
+    if(RSFS_get_profile(&profile)!=0){
+        if(json) fprintf(out, "{}\n");
+        else fprintf(out, "profiling is compiled out (RSFS_PROFILE=0)\n");
+        return;
+    }
+
+    if(json){
+        fprintf(out, "{\"operations\": {");
+        int first = 1;
+        for(int op=0; op<PROF_OPS; op++){
+            struct rsfs_latency *l = &profile.op_latency[op];
+            if(l->count==0) continue;
+            fprintf(out, "%s\n  \"%s\": {\"count\": %lu, \"bytes\": %lu, \"total_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+                first ? "" : ",", prof_op_names[op], l->count, profile.op_bytes[op], l->total_ns, l->p50_ns, l->p99_ns, l->p999_ns, l->max_ns);
+            first = 0;
+        }
+        fprintf(out, "\n},\n\"locks\": {");
+        first = 1;
+        for(int lock=0; lock<PROF_LOCKS; lock++){
+            struct rsfs_latency *l = &profile.lock_wait[lock];
+            if(l->count==0 && profile.lock_contended[lock]==0) continue;
+            fprintf(out, "%s\n  \"%s\": {\"acquired\": %lu, \"contended\": %lu, \"wait_ns\": %lu, \"hold_ns\": %lu, \"wait_p99_ns\": %lu, \"wait_max_ns\": %lu}",
+                first ? "" : ",", prof_lock_names[lock], l->count, profile.lock_contended[lock], l->total_ns, profile.lock_hold_ns[lock], l->p99_ns, l->max_ns);
+            first = 0;
+        }
+        fprintf(out, "\n}}\n");
+        return;
+    }
+
+    fprintf(out, "%-20s%10s%12s%10s%10s%10s%10s%12s\n", "operation", "count", "bytes", "mean_ns", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+    for(int op=0; op<PROF_OPS; op++){
+        struct rsfs_latency *l = &profile.op_latency[op];
+        if(l->count==0) continue;
+        fprintf(out, "%-20s%10lu%12lu%10lu%10lu%10lu%10lu%12lu\n", prof_op_names[op], l->count, profile.op_bytes[op],
+            l->total_ns/l->count, l->p50_ns, l->p99_ns, l->p999_ns, l->max_ns);
+    }
+    fprintf(out, "\n%-16s%10s%10s%14s%14s%12s\n", "lock", "acquired", "contended", "wait_ns", "hold_ns", "wait_p99_ns");
+    for(int lock=0; lock<PROF_LOCKS; lock++){
+        struct rsfs_latency *l = &profile.lock_wait[lock];
+        if(l->count==0 && profile.lock_contended[lock]==0) continue;
+        fprintf(out, "%-16s%10lu%10lu%14lu%14lu%12lu\n", prof_lock_names[lock], l->count, profile.lock_contended[lock],
+            l->total_ns, profile.lock_hold_ns[lock], l->p99_ns);
+    }
+}
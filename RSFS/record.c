@@ -0,0 +1,173 @@
+/*
+    call recorder: every RSFS_* call is logged with its arguments, its start time and its thread
+    into a per-thread buffer; full buffers are appended to the recording file (see replay.c)
+*/
+
+#include "def.h"
+
+//per-thread buffer; buffers are never freed, so the list can be walked without a lock
+struct record_buffer{
+    pthread_mutex_t mutex; //taken by the owner to append and by RSFS_record_stop() to flush
+    int used; //bytes in data
+    int thread;
+    unsigned long generation; //recording the buffer was last used for
+    struct record_buffer *next;
+    char data[RECORD_BUFFER];
+};
+
+int rsfs_recording; //1 while calls are recorded
+
+static FILE *record_file;
+static pthread_mutex_t record_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long record_start; //prof_now() when the recording started
+static unsigned long record_generation; //number of recordings started
+static long record_calls;
+static struct record_buffer *record_buffers; //list of the buffers of all threads that recorded
+static int record_threads; //number of buffers, for the thread ids
+static __thread struct record_buffer *my_buffer;
+
+
+//helper: get (and register on first use) the buffer of the calling thread
+static struct record_buffer *record_buffer(){
+    if(my_buffer) return my_buffer;
+
+    struct record_buffer *buffer = (struct record_buffer *)calloc(1, sizeof(struct record_buffer));
+    if(buffer==NULL){
+        printf("[record] fail to allocate a record buffer.\n");
+        abort();
+    }
+    pthread_mutex_init(&buffer->mutex, NULL);
+    buffer->thread = __atomic_fetch_add(&record_threads, 1, __ATOMIC_RELAXED);
+    buffer->next = __atomic_load_n(&record_buffers, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&record_buffers, &buffer->next, buffer, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    my_buffer = buffer;
+    return buffer;
+}
+
+//helper: append the content of buffer to the recording; the caller holds buffer->mutex
+static void record_flush(struct record_buffer *buffer){
+    if(buffer->used==0) return;
+    pthread_mutex_lock(&record_file_mutex);
+    if(record_file) fwrite(buffer->data, 1, buffer->used, record_file);
+    pthread_mutex_unlock(&record_file_mutex);
+    buffer->used = 0;
+}
+
+
+//log the call of scope into the buffer of the calling thread
+void record_call(struct prof_scope *scope){
+    struct record_buffer *buffer = record_buffer();
+
+    //a batch call keeps as many of its paths (and descriptors) as a buffer holds, and a pattern is cut to fit
+    int path_len = scope->path ? (scope->path_len>0 ? scope->path_len : (int)strlen(scope->path)) : 0;
+    int path_max = scope->path_len>0 ? RECORD_BUFFER-(int)sizeof(struct rsfs_call_record)-(int)sizeof(scope->args) : 255;
+    if(path_len>path_max) path_len = path_max;
+    int num_names = 0;
+    for(; scope->names && num_names<scope->num_names; num_names++){
+        int len = strlen(scope->names[num_names])+1;
+        int args = scope->num_args+(scope->results ? num_names+1 : 0);
+        if((int)sizeof(struct rsfs_call_record)+path_len+len+args*(int)sizeof(int)>RECORD_BUFFER) break;
+        path_len += len;
+    }
+    int num_results = scope->results ? num_names : 0;
+    int num_args = scope->num_args+num_results;
+    int size = sizeof(struct rsfs_call_record)+path_len+num_args*sizeof(int);
+
+    struct rsfs_call_record record;
+    memset(&record, 0, sizeof(record));
+    record.time = scope->start>record_start ? scope->start-record_start : 0;
+    record.thread = buffer->thread;
+    record.op = scope->op;
+    record.path_len = path_len;
+    record.num_args = num_args;
+    record.fd = scope->fd;
+    record.arg = scope->arg;
+
+    pthread_mutex_lock(&buffer->mutex);
+
+    //records left from an earlier recording were flushed by RSFS_record_stop()
+    unsigned long generation = __atomic_load_n(&record_generation, __ATOMIC_ACQUIRE);
+    if(buffer->generation!=generation){
+        buffer->generation = generation;
+        buffer->used = 0;
+    }
+    if(__atomic_load_n(&rsfs_recording, __ATOMIC_ACQUIRE)){
+        if(buffer->used+size>RECORD_BUFFER) record_flush(buffer);
+        char *p = buffer->data+buffer->used;
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        if(scope->names){
+            for(int i=0; i<num_names; i++){
+                int len = strlen(scope->names[i])+1;
+                memcpy(p, scope->names[i], len);
+                p += len;
+            }
+        }else if(path_len){
+            memcpy(p, scope->path, path_len);
+            p += path_len;
+        }
+        memcpy(p, scope->args, scope->num_args*sizeof(int));
+        p += scope->num_args*sizeof(int);
+        if(num_results) memcpy(p, scope->results, num_results*sizeof(int));
+        buffer->used += size;
+        __atomic_add_fetch(&record_calls, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+
+//start recording every RSFS_* call into the file at path: return 0, or -1 on error
+int RSFS_record_start(char *path){
+    if(!RSFS_RECORD){
+        printf("[record] the recorder is compiled out (RSFS_RECORD=0).\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&record_file_mutex);
+    if(record_file){
+        printf("[record] a recording is already running.\n");
+        pthread_mutex_unlock(&record_file_mutex);
+        return -1;
+    }
+    record_file = fopen(path, "wb");
+    if(record_file==NULL){
+        printf("[record] fail to open %s.\n", path);
+        pthread_mutex_unlock(&record_file_mutex);
+        return -1;
+    }
+    fwrite(RECORD_MAGIC, 1, 8, record_file);
+    record_calls = 0;
+    record_start = prof_now();
+    __atomic_add_fetch(&record_generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_file_mutex);
+
+    __atomic_store_n(&rsfs_recording, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//stop recording, flush the buffers of all threads and close the file:
+//return the number of calls recorded, or -1 if no recording is running
+int RSFS_record_stop(){
+    __atomic_store_n(&rsfs_recording, 0, __ATOMIC_RELEASE);
+
+    if(record_file==NULL){
+        printf("[record] no recording is running.\n");
+        return -1;
+    }
+
+    unsigned long generation = __atomic_load_n(&record_generation, __ATOMIC_ACQUIRE);
+    for(struct record_buffer *buffer=__atomic_load_n(&record_buffers, __ATOMIC_ACQUIRE); buffer; buffer=buffer->next){
+        pthread_mutex_lock(&buffer->mutex);
+        if(buffer->generation==generation) record_flush(buffer);
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+
+    pthread_mutex_lock(&record_file_mutex);
+    int ret = fclose(record_file)==0 ? (int)record_calls : -1;
+    record_file = NULL;
+    pthread_mutex_unlock(&record_file_mutex);
+
+    return ret;
+}
@@ -0,0 +1,396 @@
+/*
+    replay tool: re-execute a recording made with RSFS_record_start() against a fresh file system
+
+    usage: replay [-f | -s] [-p] <recording>
+        (default)  one thread per recorded thread, each call issued at its recorded time
+        -f  one thread per recorded thread, as fast as possible (each thread keeps its own order)
+        -s  every call on one thread in recorded time order, as fast as possible (deterministic)
+        -p  print the profile of the replay at the end
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_FDS 4096 //slots of the descriptor map (a power of 2)
+
+//a loaded call
+struct replay_call{
+    struct rsfs_call_record record;
+    char *path;
+    char **names; //paths of a batch call (NULL if none), pointing into path
+    int num_names;
+    int *args; //ints that followed the path (descriptors a batch open returned)
+};
+
+//calls of one recorded thread, in call order
+struct replay_thread{
+    struct replay_call **calls;
+    int num_calls;
+    long skipped; //calls on descriptors whose open failed in the recording
+};
+
+static int timed = 1; //1: issue each call at its recorded time
+static unsigned long replay_start;
+static char *replay_buf; //source and destination of reads and writes
+static int replay_buf_size;
+static int host_zero = -1, host_null = -1; //host source of imports and destination of exports
+
+//recorded descriptor -> descriptor of the replay (open addressing; recorded fds may be reused)
+static int fd_recorded[REPLAY_FDS];
+static int fd_replayed[REPLAY_FDS];
+static pthread_mutex_t fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//recorded snapshot id -> snapshot id of the replay (0: free entry); guarded by fd_mutex
+static int snapshot_recorded[MAX_SNAPSHOTS];
+static int snapshot_replayed[MAX_SNAPSHOTS];
+
+
+//helper: current time in ns
+static unsigned long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+//helper: remember that recorded descriptor recorded is fd in the replay (fd<0 forgets it);
+//forgotten slots keep their key with fd -1 so that probing still works, and are reused by later opens
+static void fd_map(int recorded, int fd){
+    pthread_mutex_lock(&fd_mutex);
+    int slot = recorded & (REPLAY_FDS-1), reuse = -1;
+    for(int i=0; i<REPLAY_FDS && fd_recorded[slot]!=-1; i++){
+        if(fd_recorded[slot]==recorded){
+            fd_replayed[slot] = fd;
+            pthread_mutex_unlock(&fd_mutex);
+            return;
+        }
+        if(fd_replayed[slot]<0 && reuse<0) reuse = slot;
+        slot = (slot+1) & (REPLAY_FDS-1);
+    }
+    if(fd>=0){
+        if(reuse>=0) slot = reuse;
+        if(fd_recorded[slot]==-1 || slot==reuse){
+            fd_recorded[slot] = recorded;
+            fd_replayed[slot] = fd;
+        }else{
+            printf("[replay] too many open descriptors.\n");
+        }
+    }
+    pthread_mutex_unlock(&fd_mutex);
+}
+
+//helper: descriptor of the replay for recorded descriptor recorded, or -1
+static int fd_lookup(int recorded){
+    pthread_mutex_lock(&fd_mutex);
+    int slot = recorded & (REPLAY_FDS-1), fd = -1;
+    for(int i=0; i<REPLAY_FDS && fd_recorded[slot]!=-1; i++){
+        if(fd_recorded[slot]==recorded){
+            fd = fd_replayed[slot];
+            break;
+        }
+        slot = (slot+1) & (REPLAY_FDS-1);
+    }
+    pthread_mutex_unlock(&fd_mutex);
+    return fd;
+}
+
+//helper: remember that recorded snapshot recorded is snapshot id in the replay (id<=0 forgets it)
+static void snapshot_map(int recorded, int id){
+    pthread_mutex_lock(&fd_mutex);
+    int slot = -1;
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+        if(snapshot_recorded[i]==recorded) slot = i;
+        else if(snapshot_recorded[i]==0 && slot<0) slot = i;
+    }
+    if(slot>=0){
+        snapshot_recorded[slot] = id>0 ? recorded : 0;
+        snapshot_replayed[slot] = id;
+    }
+    pthread_mutex_unlock(&fd_mutex);
+}
+
+//helper: snapshot id of the replay for recorded snapshot recorded, or -1
+static int snapshot_lookup(int recorded){
+    pthread_mutex_lock(&fd_mutex);
+    int id = -1;
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+        if(recorded>0 && snapshot_recorded[i]==recorded) id = snapshot_replayed[i];
+    }
+    pthread_mutex_unlock(&fd_mutex);
+    return id;
+}
+
+//helper: issue a recorded batch open: map the descriptors it returned in the recording to those it returns now
+static void replay_open_many(struct replay_call *call){
+    int *fds = (int *)malloc(sizeof(int)*(call->num_names+1));
+    if(fds==NULL){
+        printf("[replay] fail to allocate the descriptors of a batch open.\n");
+        return;
+    }
+    RSFS_open_many(call->names, call->num_names, call->record.arg, fds);
+    for(int i=0; i<call->num_names; i++){
+        int recorded = i<call->record.num_args ? call->args[i] : -1;
+        if(recorded>=0) fd_map(recorded, fds[i]);
+        else if(fds[i]>=0) RSFS_close(fds[i]); //it failed in the recording
+    }
+    free(fds);
+}
+
+//helper: callback of a replayed scan: stop after as many matches as the recorded one went through (<=0: all)
+static int replay_match(int offset, void *arg){
+    (void)offset;
+    int *left = (int *)arg;
+    return --*left==0;
+}
+
+//helper: issue one call; return 0, or -1 if it was skipped
+static int replay_call(struct replay_call *call){
+    struct rsfs_call_record *r = &call->record;
+
+    if(timed){
+        unsigned long due = replay_start + r->time;
+        unsigned long now = now_ns();
+        if(due>now){
+            struct timespec ts = {(due-now)/1000000000UL, (due-now)%1000000000UL};
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    int fd = -1, snapshot = -1;
+    switch(r->op){
+        case PROF_APPEND: case PROF_FSEEK: case PROF_READ: case PROF_WRITE: case PROF_CUT: case PROF_CLOSE:
+        case PROF_FIND: case PROF_SCAN: case PROF_COPY_RANGE: case PROF_IMPORT_FD: case PROF_EXPORT_FD:
+            fd = fd_lookup(r->fd);
+            if(fd<0) return -1;
+            break;
+        case PROF_SNAPSHOT_OPEN_FILE: case PROF_SNAPSHOT_DROP:
+            snapshot = snapshot_lookup(r->arg);
+            if(snapshot<0) return -1;
+    }
+
+    switch(r->op){
+        case PROF_CREATE: RSFS_create(call->path); break;
+        case PROF_OPEN:
+        case PROF_TRY_OPEN:
+            fd = r->op==PROF_OPEN ? RSFS_open(call->path, r->arg) : RSFS_try_open(call->path, r->arg);
+            if(r->fd>=0) fd_map(r->fd, fd);
+            else if(fd>=0) RSFS_close(fd); //it failed in the recording
+            break;
+        case PROF_APPEND: RSFS_append(fd, replay_buf, r->arg); break;
+        case PROF_FSEEK: RSFS_fseek(fd, r->arg); break;
+        case PROF_READ: RSFS_read(fd, replay_buf, r->arg); break;
+        case PROF_WRITE: RSFS_write(fd, replay_buf, r->arg); break;
+        case PROF_CUT: RSFS_cut(fd, r->arg); break;
+        case PROF_CLOSE: RSFS_close(fd); fd_map(r->fd, -1); break;
+        case PROF_DELETE: RSFS_delete(call->path); break;
+        case PROF_MKDIR: RSFS_mkdir(call->path); break;
+        case PROF_RMDIR: RSFS_rmdir(call->path); break;
+        case PROF_STAT: RSFS_stat(); break;
+        case PROF_OPENDIR:{
+            struct rsfs_dir_iter iter;
+            if(RSFS_opendir(call->path, &iter)==0) RSFS_closedir(&iter);
+            break;
+        }
+        case PROF_SNAPSHOT_CREATE:
+            snapshot = RSFS_snapshot_create();
+            if(r->arg>0) snapshot_map(r->arg, snapshot);
+            else if(snapshot>0) RSFS_snapshot_drop(snapshot); //it failed in the recording
+            break;
+        case PROF_SNAPSHOT_OPEN_FILE:
+            fd = RSFS_snapshot_open_file(snapshot, call->path);
+            if(r->fd>=0) fd_map(r->fd, fd);
+            else if(fd>=0) RSFS_close(fd);
+            break;
+        case PROF_SNAPSHOT_DROP: RSFS_snapshot_drop(snapshot); snapshot_map(r->arg, -1); break;
+        case PROF_CREATE_OPEN:
+            fd = RSFS_create_open(call->path, r->arg);
+            if(r->fd>=0) fd_map(r->fd, fd);
+            else if(fd>=0) RSFS_close(fd); //it failed in the recording
+            break;
+        case PROF_CREATE_MANY:
+        case PROF_DELETE_MANY:{
+            int *results = (int *)malloc(sizeof(int)*(call->num_names+1));
+            if(results==NULL) return -1;
+            if(r->op==PROF_CREATE_MANY) RSFS_create_many(call->names, call->num_names, results);
+            else RSFS_delete_many(call->names, call->num_names, results);
+            free(results);
+            break;
+        }
+        case PROF_OPEN_MANY: replay_open_many(call); break;
+        case PROF_READDIR_PLUS:{
+            //the cursor resumes after the name the recorded one was after
+            if(call->num_names<3) return -1;
+            struct rsfs_readdir_cursor cursor;
+            RSFS_readdir_start(&cursor, call->names[0]);
+            if(call->names[2][0]){
+                strcpy(cursor.last, call->names[2]);
+                cursor.started = 1;
+            }
+            struct rsfs_dirent *out = (struct rsfs_dirent *)malloc(sizeof(struct rsfs_dirent)*(r->arg>0 ? r->arg : 1));
+            if(out==NULL) return -1;
+            RSFS_readdir_plus(&cursor, call->names[1], out, r->arg);
+            free(out);
+            break;
+        }
+        case PROF_FIND:
+        case PROF_SCAN:{
+            //the pattern was recorded in place of a path (cut if it was long)
+            if(r->num_args<1) return -1;
+            if(r->op==PROF_FIND) RSFS_find(fd, call->path, r->path_len, call->args[0]);
+            else{
+                int left = r->num_args>1 ? call->args[1] : 0;
+                RSFS_scan(fd, call->path, r->path_len, call->args[0], replay_match, &left);
+            }
+            break;
+        }
+        case PROF_COPY_RANGE:{
+            //the destination descriptor follows the source offset
+            int fd_out = r->num_args>2 ? fd_lookup(call->args[1]) : -1;
+            if(fd_out<0) return -1;
+            RSFS_copy_range(fd, call->args[0], fd_out, call->args[2], r->arg);
+            break;
+        }
+        case PROF_IMPORT_FD:{
+            //as many bytes as the recorded import took from its host descriptor
+            int len = r->num_args>0 ? call->args[0] : r->arg;
+            if(host_zero<0) return -1;
+            if(len>0) RSFS_import_fd(host_zero, fd, len);
+            break;
+        }
+        case PROF_EXPORT_FD:
+            if(host_null<0) return -1;
+            RSFS_export_fd(fd, host_null, r->arg);
+            break;
+        default: return -1;
+    }
+    return 0;
+}
+
+//thread body: replay the calls of one recorded thread
+static void *replay_thread_main(void *ptr){
+    struct replay_thread *t = (struct replay_thread *)ptr;
+    for(int i=0; i<t->num_calls; i++){
+        if(replay_call(t->calls[i])!=0) t->skipped++;
+    }
+    return NULL;
+}
+
+static int compare_time(const void *a, const void *b){
+    const struct replay_call *x = *(struct replay_call * const *)a, *y = *(struct replay_call * const *)b;
+    return x->record.time<y->record.time ? -1 : x->record.time>y->record.time;
+}
+
+
+int main(int argc, char **argv){
+
+    int serial = 0, profile = 0;
+    int opt;
+    while((opt=getopt(argc, argv, "fsp"))!=-1){
+        switch(opt){
+            case 'f': timed = 0; break;
+            case 's': timed = 0; serial = 1; break;
+            case 'p': profile = 1; break;
+            default: optind = argc; break;
+        }
+    }
+    if(optind!=argc-1){
+        printf("usage: %s [-f | -s] [-p] <recording>\n", argv[0]);
+        return 1;
+    }
+
+    //load the recording
+    FILE *file = fopen(argv[optind], "rb");
+    char magic[8];
+    if(file==NULL || fread(magic, 1, 8, file)!=8 || memcmp(magic, RECORD_MAGIC, 8)!=0){
+        printf("[replay] %s is not a recording.\n", argv[optind]);
+        return 1;
+    }
+    int num_calls = 0, capacity = 1024, num_threads = 0;
+    replay_buf_size = NUM_POINTER*BLOCK_SIZE;
+    struct replay_call *calls = (struct replay_call *)malloc(sizeof(struct replay_call)*capacity);
+    struct rsfs_call_record record;
+    while(calls && fread(&record, sizeof(record), 1, file)==1){
+        if(num_calls==capacity){
+            capacity *= 2;
+            calls = (struct replay_call *)realloc(calls, sizeof(struct replay_call)*capacity);
+            if(calls==NULL) break;
+        }
+        struct replay_call *call = &calls[num_calls++];
+        call->record = record;
+        call->path = (char *)malloc(record.path_len+1);
+        if(call->path==NULL || fread(call->path, 1, record.path_len, file)!=record.path_len){
+            printf("[replay] %s is truncated.\n", argv[optind]);
+            return 1;
+        }
+        call->path[record.path_len] = '\0';
+        call->args = (int *)malloc(sizeof(int)*(record.num_args+1));
+        if(call->args==NULL || fread(call->args, sizeof(int), record.num_args, file)!=record.num_args){
+            printf("[replay] %s is truncated.\n", argv[optind]);
+            return 1;
+        }
+
+        //the paths of a batch call are each ended by a 0 (a single path has none)
+        call->names = NULL;
+        call->num_names = 0;
+        for(int i=0; i<record.path_len; i++) call->num_names += call->path[i]=='\0';
+        if(call->num_names>0){
+            call->names = (char **)malloc(sizeof(char *)*(call->num_names+1));
+            if(call->names==NULL){
+                printf("[replay] fail to allocate memory for the recording.\n");
+                return 1;
+            }
+            for(int i=0, at=0; i<call->num_names; i++){
+                call->names[i] = call->path+at;
+                at += strlen(call->path+at)+1;
+            }
+        }
+        if(record.thread>=num_threads) num_threads = record.thread+1;
+        int buffered = record.op==PROF_APPEND || record.op==PROF_READ || record.op==PROF_WRITE;
+        if(buffered && record.arg>replay_buf_size) replay_buf_size = record.arg;
+    }
+    fclose(file);
+    replay_buf = (char *)malloc(replay_buf_size);
+    if(calls==NULL || replay_buf==NULL){
+        printf("[replay] fail to allocate memory for the recording.\n");
+        return 1;
+    }
+    memset(replay_buf, 'x', replay_buf_size);
+    for(int i=0; i<REPLAY_FDS; i++) fd_recorded[i] = -1;
+    host_zero = open("/dev/zero", O_RDONLY);
+    host_null = open("/dev/null", O_WRONLY);
+
+    //split the calls by thread (each thread's calls are in call order in the file),
+    //or put all of them on one thread in time order
+    if(serial) num_threads = 1;
+    struct replay_thread *threads = (struct replay_thread *)calloc(num_threads>0 ? num_threads : 1, sizeof(struct replay_thread));
+    for(int i=0; i<num_threads; i++){
+        threads[i].calls = (struct replay_call **)malloc(sizeof(struct replay_call *)*(num_calls+1));
+    }
+    for(int i=0; i<num_calls; i++){
+        struct replay_thread *t = &threads[serial ? 0 : calls[i].record.thread];
+        t->calls[t->num_calls++] = &calls[i];
+    }
+    if(serial && num_threads>0) qsort(threads[0].calls, threads[0].num_calls, sizeof(struct replay_call *), compare_time);
+
+    if(RSFS_init()!=0){
+        printf("[replay] fail to initialize the system.\n");
+        return 1;
+    }
+
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t)*(num_threads+1));
+    replay_start = now_ns();
+    for(int i=0; i<num_threads; i++) pthread_create(&tids[i], NULL, replay_thread_main, &threads[i]);
+    long skipped = 0;
+    for(int i=0; i<num_threads; i++){
+        pthread_join(tids[i], NULL);
+        skipped += threads[i].skipped;
+    }
+    double seconds = (now_ns()-replay_start)/1e9;
+
+    printf("[replay] %d calls on %d threads (%ld skipped) in %.6f s: %.0f calls/s\n",
+        num_calls, num_threads, skipped, seconds, num_calls/seconds);
+    if(profile) RSFS_dump_profile(stdout, 0);
+
+    return 0;
+}
@@ -0,0 +1,362 @@
+/*
+    asynchronous submission/completion ring serviced by a pool of worker threads.
+    Each submission is routed to a worker by its fd, so the operations on one fd run one after the other,
+    in submission order (a READ or WRITE with an offset seeks and then reads or writes, and nothing on that fd
+    comes in between). Opens that would block are parked by their worker and retried whenever a file is let go
+    (closed, deleted, or released by the defragmenter, the cleaner or a compressor)
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+
+static struct rsfs_ring *rings; //the rings of this process, woken by ring_notify_release()
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int parked_opens; //opens parked (or trying) by all the workers of this process: releases skip the rings while it is 0
+
+
+//helper: run one submission against fs and return the result of the corresponding call;
+//-2 means an open would have blocked and has to be retried later
+static int ring_execute(rsfs_t *fs, struct rsfs_sqe *sqe){
+    switch(sqe->opcode){
+        case RSFS_OP_OPEN:
+            return rsfs_try_open(fs, sqe->file_name, sqe->access_flag);
+        case RSFS_OP_READ:
+            if(sqe->offset>=0) rsfs_fseek(fs, sqe->fd, sqe->offset);
+            return rsfs_read(fs, sqe->fd, sqe->buf, sqe->size);
+        case RSFS_OP_WRITE:
+            if(sqe->offset>=0) rsfs_fseek(fs, sqe->fd, sqe->offset);
+            return rsfs_write(fs, sqe->fd, sqe->buf, sqe->size);
+        case RSFS_OP_APPEND:
+            return rsfs_append(fs, sqe->fd, sqe->buf, sqe->size);
+        case RSFS_OP_CLOSE:
+            return rsfs_close(fs, sqe->fd);
+        case RSFS_OP_DELETE:
+            return rsfs_delete(fs, sqe->file_name);
+    }
+    printf("[ring] unknown opcode %d.\n", sqe->opcode);
+    return -1;
+}
+
+//helper: post a batch of completions under a single acquisition of cq_mutex and wake the caller
+static void ring_post(struct rsfs_ring *ring, struct rsfs_cqe *cqes, int num){
+    if(num==0) return;
+
+    pthread_mutex_lock(&ring->cq_mutex);
+    unsigned int tail = ring->cq_tail;
+    for(int i=0; i<num; i++){
+        ring->cq[(tail+i)&(ring->entries-1)] = cqes[i];
+    }
+    //publish the entries before the new tail; the caller reads cq_tail without the mutex
+    __atomic_store_n(&ring->cq_tail, tail+num, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring->cq_mutex);
+
+    uint64_t count = num;
+    if(write(ring->event_fd, &count, sizeof(count))!=sizeof(count)){
+        printf("[ring] fail to signal the eventfd.\n");
+    }
+}
+
+//helper: wait until the worker w has submissions, or a file has been let go since seen_release while it has parked
+//opens, or the ring stops; the caller holds sq_mutex. On a shared instance, files let go by other processes wake
+//no worker, so parked opens are retried every RING_PARK_POLL_NS too
+static void ring_wait(struct rsfs_ring_worker *w, int num_parked, unsigned int seen_release){
+    struct rsfs_ring *ring = w->ring;
+    while(w->sq_head==w->sq_tail && !ring->stop && (num_parked==0 || ring->release_seq==seen_release)){
+        if(num_parked==0 || !ring->fs->shared){
+            pthread_cond_wait(&w->cond, &ring->sq_mutex);
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += RING_PARK_POLL_NS;
+        ts.tv_sec += ts.tv_nsec/1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        if(pthread_cond_timedwait(&w->cond, &ring->sq_mutex, &ts)==ETIMEDOUT) break;
+    }
+}
+
+//worker thread: take batches of the submissions routed to it, run them and post their completions;
+//opens that would block are parked and retried after a file is let go, so that they never hold up the rest of the batch
+static void *ring_worker(void *ptr){
+    struct rsfs_ring_worker *w = (struct rsfs_ring_worker *)ptr;
+    struct rsfs_ring *ring = w->ring;
+
+    struct rsfs_sqe batch[RING_WORKER_BATCH];
+    struct rsfs_cqe done[RING_WORKER_BATCH];
+    struct rsfs_sqe *parked = (struct rsfs_sqe *)malloc(ring->entries*sizeof(struct rsfs_sqe));
+    int num_parked = 0;
+    unsigned int seen_release = 0;
+    if(parked==NULL){
+        printf("[ring] fail to allocate the parked list of a worker.\n");
+        return NULL;
+    }
+
+    while(1){
+        //take up to RING_WORKER_BATCH submissions with one lock acquisition
+        pthread_mutex_lock(&ring->sq_mutex);
+        ring_wait(w, num_parked, seen_release);
+        seen_release = ring->release_seq;
+        if(ring->stop && w->sq_head==w->sq_tail){
+            pthread_mutex_unlock(&ring->sq_mutex);
+
+            //shutting down: opens that still cannot proceed complete with -2 (would block)
+            for(int i=0; i<num_parked; i++){
+                struct rsfs_cqe cqe = {parked[i].user_data, -2};
+                ring_post(ring, &cqe, 1);
+            }
+            __atomic_sub_fetch(&parked_opens, num_parked, __ATOMIC_RELAXED);
+            break;
+        }
+        int num = 0;
+        while(num<RING_WORKER_BATCH && w->sq_head!=w->sq_tail){
+            batch[num++] = w->sq[w->sq_head&(ring->entries-1)];
+            w->sq_head++;
+        }
+        pthread_mutex_unlock(&ring->sq_mutex);
+
+        //retry the parked opens first, so earlier submissions keep their head start
+        int num_done = 0;
+        int still_parked = 0;
+        for(int i=0; i<num_parked; i++){
+            int ret = ring_execute(ring->fs, &parked[i]);
+            if(ret==-2){
+                parked[still_parked++] = parked[i];
+                continue;
+            }
+            done[num_done].user_data = parked[i].user_data;
+            done[num_done].result = ret;
+            if(++num_done==RING_WORKER_BATCH){
+                ring_post(ring, done, num_done);
+                num_done = 0;
+            }
+        }
+        __atomic_sub_fetch(&parked_opens, num_parked-still_parked, __ATOMIC_RELAXED);
+        num_parked = still_parked;
+
+        for(int i=0; i<num; i++){
+            //an open counts as parked before it tries: a file let go after its try failed then bumps release_seq
+            int open = batch[i].opcode==RSFS_OP_OPEN;
+            if(open) __atomic_add_fetch(&parked_opens, 1, __ATOMIC_SEQ_CST);
+            int ret = ring_execute(ring->fs, &batch[i]);
+            if(ret==-2){
+                parked[num_parked++] = batch[i];
+                continue;
+            }
+            if(open) __atomic_sub_fetch(&parked_opens, 1, __ATOMIC_RELAXED);
+            done[num_done].user_data = batch[i].user_data;
+            done[num_done].result = ret;
+            if(++num_done==RING_WORKER_BATCH){
+                ring_post(ring, done, num_done);
+                num_done = 0;
+            }
+        }
+        ring_post(ring, done, num_done);
+    }
+
+    free(parked);
+    return NULL;
+}
+
+//a file of fs was let go (see release_rw_mutex()): wake the workers of the rings of this process on fs, for their
+//parked opens to try again. Nothing is done while no open is parked; the fence orders the unlock before the check,
+//against the count an open makes before it tries
+void ring_notify_release(rsfs_t *fs){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&parked_opens, __ATOMIC_RELAXED)==0) return;
+
+    pthread_mutex_lock(&rings_mutex);
+    for(struct rsfs_ring *ring=rings; ring; ring=ring->next_ring){
+        if(ring->fs!=fs) continue;
+        pthread_mutex_lock(&ring->sq_mutex);
+        ring->release_seq++;
+        for(int i=0; i<ring->num_workers; i++) pthread_cond_signal(&ring->workers[i].cond);
+        pthread_mutex_unlock(&ring->sq_mutex);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+
+//set up a ring on the default instance
+int RSFS_ring_init(struct rsfs_ring *ring, int entries, int num_workers){
+    return rsfs_ring_init(&rsfs_default, ring, entries, num_workers);
+}
+
+//set up a ring on the instance fs with at least the given number of entries and start num_workers worker threads;
+//return 0 if succeed or -1 if errs
+int rsfs_ring_init(rsfs_t *fs, struct rsfs_ring *ring, int entries, int num_workers){
+
+    if(entries<=0){
+        printf("[ring_init] entries must be positive.\n");
+        return -1;
+    }
+    if(num_workers<=0) num_workers = RING_DEFAULT_WORKERS;
+
+    //round the capacity up to a power of two so that indices can be masked
+    unsigned int capacity = 1;
+    while(capacity<(unsigned int)entries) capacity <<= 1;
+
+    memset(ring, 0, sizeof(struct rsfs_ring));
+    ring->fs = fs;
+    ring->entries = capacity;
+    ring->sq = (struct rsfs_sqe *)calloc(capacity, sizeof(struct rsfs_sqe));
+    ring->cq = (struct rsfs_cqe *)calloc(capacity, sizeof(struct rsfs_cqe));
+    ring->workers = (struct rsfs_ring_worker *)calloc(num_workers, sizeof(struct rsfs_ring_worker));
+    int queues = ring->workers!=NULL;
+    for(int i=0; queues && i<num_workers; i++){
+        ring->workers[i].sq = (struct rsfs_sqe *)calloc(capacity, sizeof(struct rsfs_sqe));
+        queues = ring->workers[i].sq!=NULL;
+    }
+    if(ring->sq==NULL || ring->cq==NULL || !queues){
+        printf("[ring_init] fail to allocate the queues.\n");
+        for(int i=0; ring->workers && i<num_workers; i++) free(ring->workers[i].sq);
+        free(ring->sq); free(ring->cq); free(ring->workers);
+        return -1;
+    }
+
+    ring->event_fd = eventfd(0, EFD_CLOEXEC);
+    if(ring->event_fd<0){
+        printf("[ring_init] fail to create the eventfd.\n");
+        for(int i=0; i<num_workers; i++) free(ring->workers[i].sq);
+        free(ring->sq); free(ring->cq); free(ring->workers);
+        return -1;
+    }
+
+    pthread_mutex_init(&ring->sq_mutex,NULL);
+    pthread_mutex_init(&ring->cq_mutex,NULL);
+    for(int i=0; i<num_workers; i++){
+        ring->workers[i].ring = ring;
+        pthread_cond_init(&ring->workers[i].cond,NULL);
+    }
+
+    //files let go on fs wake the parked opens of this ring from now on
+    pthread_mutex_lock(&rings_mutex);
+    ring->next_ring = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    ring->num_workers = num_workers;
+    for(int i=0; i<num_workers; i++){
+        if(pthread_create(&ring->workers[i].thread,NULL,ring_worker,&ring->workers[i])!=0){
+            printf("[ring_init] fail to start worker %d.\n", i);
+            for(int j=i; j<num_workers; j++){
+                free(ring->workers[j].sq);
+                pthread_cond_destroy(&ring->workers[j].cond);
+            }
+            ring->num_workers = i;
+            RSFS_ring_exit(ring);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//get the next free submission entry; it is handed to the workers by the next RSFS_ring_submit();
+//return NULL if the ring is full (too many completions are not reaped yet)
+struct rsfs_sqe *RSFS_ring_get_sqe(struct rsfs_ring *ring){
+
+    if(__atomic_load_n(&ring->inflight, __ATOMIC_ACQUIRE)>=(int)ring->entries) return NULL;
+    __atomic_add_fetch(&ring->inflight, 1, __ATOMIC_ACQ_REL);
+
+    struct rsfs_sqe *sqe = &ring->sq[ring->sq_local_tail&(ring->entries-1)];
+    ring->sq_local_tail++;
+
+    memset(sqe, 0, sizeof(struct rsfs_sqe));
+    sqe->offset = -1;
+    return sqe;
+}
+
+//helper: the worker the submission sqe goes to: the one of its fd (opens and deletes, which have none, take turns);
+//the caller holds sq_mutex
+static struct rsfs_ring_worker *ring_route(struct rsfs_ring *ring, struct rsfs_sqe *sqe){
+    if(sqe->opcode==RSFS_OP_OPEN || sqe->opcode==RSFS_OP_DELETE){
+        return &ring->workers[ring->next_worker++%ring->num_workers];
+    }
+    return &ring->workers[(unsigned int)(sqe->fd&FD_INDEX_MASK)%ring->num_workers];
+}
+
+//publish all entries prepared since the last call with a single acquisition of sq_mutex, routing each one to
+//its worker; return the number of entries submitted
+int RSFS_ring_submit(struct rsfs_ring *ring){
+
+    pthread_mutex_lock(&ring->sq_mutex);
+    int num = ring->sq_local_tail - ring->sq_tail;
+    for(unsigned int i=ring->sq_tail; i!=ring->sq_local_tail; i++){
+        struct rsfs_sqe *sqe = &ring->sq[i&(ring->entries-1)];
+        struct rsfs_ring_worker *w = ring_route(ring, sqe);
+        //no queue overflows: at most entries submissions are in flight
+        w->sq[w->sq_tail&(ring->entries-1)] = *sqe;
+        if(w->sq_tail++==w->sq_head) pthread_cond_signal(&w->cond);
+    }
+    ring->sq_tail = ring->sq_local_tail;
+    pthread_mutex_unlock(&ring->sq_mutex);
+
+    return num;
+}
+
+//reap one completion into cqe without blocking;
+//return 0 if a completion was reaped or -1 if none is available
+int RSFS_ring_peek_cqe(struct rsfs_ring *ring, struct rsfs_cqe *cqe){
+
+    unsigned int tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+    if(ring->cq_head==tail) return -1;
+
+    *cqe = ring->cq[ring->cq_head&(ring->entries-1)];
+    ring->cq_head++;
+    __atomic_sub_fetch(&ring->inflight, 1, __ATOMIC_ACQ_REL);
+
+    return 0;
+}
+
+//reap one completion into cqe, sleeping on the eventfd until one is posted;
+//return 0 if succeed or -1 if errs
+int RSFS_ring_wait_cqe(struct rsfs_ring *ring, struct rsfs_cqe *cqe){
+
+    while(RSFS_ring_peek_cqe(ring, cqe)!=0){
+        uint64_t count;
+        if(read(ring->event_fd, &count, sizeof(count))!=sizeof(count)){
+            printf("[ring_wait_cqe] fail to read the eventfd.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//return the eventfd that becomes readable whenever completions are posted (for poll/epoll)
+int RSFS_ring_eventfd(struct rsfs_ring *ring){
+    return ring->event_fd;
+}
+
+//finish the submitted work, stop the workers and release the ring
+void RSFS_ring_exit(struct rsfs_ring *ring){
+
+    pthread_mutex_lock(&ring->sq_mutex);
+    ring->stop = 1;
+    for(int i=0; i<ring->num_workers; i++) pthread_cond_signal(&ring->workers[i].cond);
+    pthread_mutex_unlock(&ring->sq_mutex);
+
+    for(int i=0; i<ring->num_workers; i++){
+        pthread_join(ring->workers[i].thread,NULL);
+    }
+
+    pthread_mutex_lock(&rings_mutex);
+    struct rsfs_ring **link = &rings;
+    while(*link!=ring) link = &(*link)->next_ring;
+    *link = ring->next_ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    close(ring->event_fd);
+    for(int i=0; i<ring->num_workers; i++){
+        free(ring->workers[i].sq);
+        pthread_cond_destroy(&ring->workers[i].cond);
+    }
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->workers);
+    pthread_mutex_destroy(&ring->sq_mutex);
+    pthread_mutex_destroy(&ring->cq_mutex);
+}
@@ -0,0 +1,64 @@
+/*
+    rsfsd: serve a file system to local clients over a Unix-domain socket (see server.c)
+
+    usage: rsfsd [-w workers] [-m segment] <socket>
+        -w  number of worker threads (default RSFSD_DEFAULT_WORKERS)
+        -m  serve the shared-memory instance segment (created if it does not exist),
+            so that processes linking the library can use it too; by default a private instance
+    runs until SIGINT or SIGTERM; the files clients left open are closed on the way out
+*/
+
+#include "def.h"
+#include <signal.h>
+#include <unistd.h>
+
+
+int main(int argc, char **argv){
+
+    int num_workers = 0;
+    char *segment = NULL;
+    int opt;
+    while((opt=getopt(argc, argv, "w:m:"))!=-1){
+        switch(opt){
+            case 'w': num_workers = atoi(optarg); break;
+            case 'm': segment = optarg; break;
+            default: optind = argc; break;
+        }
+    }
+    if(optind!=argc-1){
+        printf("usage: %s [-w workers] [-m segment] <socket>\n", argv[0]);
+        return 1;
+    }
+
+    rsfs_t *fs = &rsfs_default;
+    if(segment){
+        fs = rsfs_shm_create(segment, 0);
+        if(fs==NULL) fs = rsfs_shm_attach(segment);
+    }else if(RSFS_init()!=0){
+        fs = NULL;
+    }
+    if(fs==NULL){
+        printf("[rsfsd] fail to initialize the system.\n");
+        return 1;
+    }
+
+    //the signals are taken by sigwait() below, not by whichever thread happens to run
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct rsfsd_server *server = rsfsd_start(fs, argv[optind], num_workers);
+    if(server==NULL) return 1;
+    printf("[rsfsd] serving on %s\n", argv[optind]);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&signals, &sig);
+
+    rsfsd_stop(server);
+    if(segment) rsfs_shm_detach(fs);
+    printf("[rsfsd] stopped.\n");
+    return 0;
+}
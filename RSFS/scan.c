@@ -0,0 +1,248 @@
+/*
+    content scans: RSFS_find and RSFS_scan search the data of an open file for a pattern in place, block by block,
+    without copying it out (a compressed file is decompressed once into a buffer of its size).
+    Candidates are found with a first-byte kernel picked at run time from the CPU (AVX2, SSE2, or scalar),
+    and each one is checked against the whole pattern, which may straddle blocks.
+    A scan works under the hold of its descriptor: readers of a file scan it in parallel, and the blocks are
+    read inside epoch sections, like RSFS_read, so the defragmenter can move them meanwhile
+*/
+
+#include "def.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+//kernel: index of the first byte c among the n bytes at p, or -1
+typedef int (*find_byte_fn)(const char *p, int n, char c);
+
+static int find_byte_scalar(const char *p, int n, char c){
+    for(int i=0; i<n; i++) if(p[i]==c) return i;
+    return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int find_byte_sse2(const char *p, int n, char c){
+    __m128i needle = _mm_set1_epi8(c);
+    int i = 0;
+    for(; i+16<=n; i+=16){
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+i)), needle));
+        if(mask) return i+__builtin_ctz(mask);
+    }
+    int rest = find_byte_scalar(p+i, n-i, c);
+    return rest<0 ? -1 : i+rest;
+}
+
+__attribute__((target("avx2")))
+static int find_byte_avx2(const char *p, int n, char c){
+    __m256i needle = _mm256_set1_epi8(c);
+    int i = 0;
+    for(; i+32<=n; i+=32){
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p+i)), needle));
+        if(mask) return i+__builtin_ctz(mask);
+    }
+    int rest = find_byte_sse2(p+i, n-i, c);
+    return rest<0 ? -1 : i+rest;
+}
+#endif
+
+static const char *kernel_names[] = {"auto", "scalar", "sse2", "avx2"};
+static int kernel_in_use; //enum rsfs_scan_kernel; RSFS_KERNEL_AUTO until the first scan picks one
+static find_byte_fn find_byte;
+
+//helper: the kernel the CPU supports best
+static int best_kernel(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return RSFS_KERNEL_AVX2;
+    if(__builtin_cpu_supports("sse2")) return RSFS_KERNEL_SSE2;
+#endif
+    return RSFS_KERNEL_SCALAR;
+}
+
+//helper: the function of kernel
+static find_byte_fn kernel_function(int kernel){
+#if defined(__x86_64__) || defined(__i386__)
+    if(kernel==RSFS_KERNEL_AVX2) return find_byte_avx2;
+    if(kernel==RSFS_KERNEL_SSE2) return find_byte_sse2;
+#endif
+    return find_byte_scalar;
+}
+
+//helper: the kernel to scan with, picked on first use (racing threads pick the same one)
+static find_byte_fn scan_kernel(){
+    find_byte_fn fn = __atomic_load_n(&find_byte, __ATOMIC_ACQUIRE);
+    if(fn) return fn;
+    int kernel = best_kernel();
+    __atomic_store_n(&kernel_in_use, kernel, __ATOMIC_RELAXED);
+    __atomic_store_n(&find_byte, kernel_function(kernel), __ATOMIC_RELEASE);
+    return kernel_function(kernel);
+}
+
+
+//the bytes of file from position pos on, with the number of them that are contiguous in *avail: up to the end of
+//the run of blocks that follow each other in the pool (see data_block.c), or 0 if the block is missing (the pool
+//ran dry when the file was written). The caller is in an epoch section
+const char *file_bytes(rsfs_t *fs, struct scan_file *file, int pos, int *avail){
+    if(file->plain){
+        *avail = file->length-pos;
+        return file->plain+pos;
+    }
+    int j = pos/BLOCK_SIZE;
+    int block = __atomic_load_n(&file->block[j], __ATOMIC_ACQUIRE);
+    if(block<0){
+        *avail = 0;
+        return NULL;
+    }
+    int run = 1;
+    while(j+run<NUM_POINTER && __atomic_load_n(&file->block[j+run], __ATOMIC_ACQUIRE)==block+run) run++;
+    *avail = run*BLOCK_SIZE-pos%BLOCK_SIZE;
+    return block_data(fs, block)+pos%BLOCK_SIZE;
+}
+
+//helper: 1 if the len bytes of pattern are at position pos of file, across as many blocks as they span
+static int match_at(rsfs_t *fs, struct scan_file *file, int pos, const char *pattern, int len){
+    for(int done=0; done<len; ){
+        int avail;
+        const char *p = file_bytes(fs, file, pos+done, &avail);
+        int n = avail<len-done ? avail : len-done;
+        if(n==0 || memcmp(p, pattern+done, n)!=0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+//helper: position of the first match of pattern (len bytes) in file at or after start, or -1.
+//The first byte is looked for a block at a time, and only the starts where the whole pattern fits are tried
+static int search(rsfs_t *fs, struct scan_file *file, const char *pattern, int len, int start){
+    find_byte_fn find = scan_kernel();
+    int last_start = file->length-len; //the last position a match can start at
+    for(int pos=start; pos<=last_start; ){
+        int avail;
+        const char *p = file_bytes(fs, file, pos, &avail);
+        if(avail==0) return -1;
+        int n = avail<last_start-pos+1 ? avail : last_start-pos+1;
+        int i = find(p, n, pattern[0]);
+        if(i<0){
+            pos += n;
+            continue;
+        }
+        pos += i;
+        if(len==1 || match_at(fs, file, pos, pattern, len)) return pos;
+        pos++;
+    }
+    return -1;
+}
+
+//set up file for reading the data of the descriptor fd in place (a scan, or RSFS_copy_range), decompressing into
+//plain (which holds the largest file) if needed: return 0, or -1 (with a message for caller) if fd is not open
+//or the compressed data is corrupt
+int scan_source(rsfs_t *fs, int fd, struct scan_file *file, char *plain, const char *caller){
+    struct open_file_entry *entry = get_open_file_entry(fs, fd);
+    if(entry==NULL){
+        printf("[%s] fd is not an open file descriptor.\n", caller);
+        return -1;
+    }
+
+    //a snapshot file is scanned in the blocks preserved for it; the blocks of a live file stay the file's
+    //while the descriptor holds it, and its length is taken once (appenders may extend it)
+    int compressed;
+    if(entry->snapshot_file){
+        struct snapshot_file *preserved = to_ptr(fs, entry->snapshot_file);
+        file->block = preserved->block;
+        file->length = preserved->length;
+        compressed = preserved->compressed;
+    }else{
+        struct inode *inode = &fs->inodes[((struct dir_entry *)to_ptr(fs, entry->dir_entry))->inode_number];
+        file->block = inode->block;
+        file->length = __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE);
+        compressed = __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE);
+    }
+    file->plain = NULL;
+
+    if(compressed){
+        if(read_compressed(fs, file->block, compressed, file->length, plain)<0){
+            printf("[%s] the compressed data of the file is corrupt.\n", caller);
+            return -1;
+        }
+        file->plain = plain;
+    }
+    return 0;
+}
+
+
+//find the first occurrence of the len bytes of pattern in the file of fd at or after start_offset, reading the
+//blocks in place (the position of fd does not move): return its offset, -1 if there is none, or -2 on error
+int rsfs_find(rsfs_t *fs, int fd, const void *pattern, int len, int start_offset){
+    PROF_OP(PROF_FIND, NULL, fd, len);
+    PROF_DATA(len>0 ? pattern : NULL, len);
+    PROF_ARGS(1, start_offset, 0, 0);
+    if(len<=0 || start_offset<0){
+        printf("[find] len must be positive and start_offset not negative.\n");
+        return -2;
+    }
+    struct scan_file file;
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    if(scan_source(fs, fd, &file, plain, "find")!=0) return -2;
+
+    epoch_enter(fs);
+    int offset = search(fs, &file, (const char *)pattern, len, start_offset);
+    epoch_exit(fs);
+    return offset;
+}
+
+//call fn(offset, arg) for each occurrence of the len bytes of pattern in the file of fd at or after start_offset,
+//in order and without overlaps, until fn returns nonzero: return the number of calls, or -1 on error.
+//fn runs outside the epoch section of the scan, so it may use any RSFS call (but not close fd)
+int rsfs_scan(rsfs_t *fs, int fd, const void *pattern, int len, int start_offset, rsfs_scan_fn fn, void *arg){
+    PROF_OP(PROF_SCAN, NULL, fd, len);
+    PROF_DATA(len>0 ? pattern : NULL, len);
+    PROF_ARGS(1, start_offset, 0, 0);
+    if(len<=0 || start_offset<0 || fn==NULL){
+        printf("[scan] len must be positive, start_offset not negative and fn given.\n");
+        return -1;
+    }
+    struct scan_file file;
+    char plain[NUM_POINTER*BLOCK_SIZE];
+    if(scan_source(fs, fd, &file, plain, "scan")!=0) return -1;
+
+    int matches = 0;
+    for(int pos=start_offset; ; ){
+        epoch_enter(fs);
+        int offset = search(fs, &file, (const char *)pattern, len, pos);
+        epoch_exit(fs);
+        if(offset<0) break;
+        matches++;
+        PROF_SUSPEND();
+        int stop = fn(offset, arg);
+        PROF_RESUME();
+        if(stop) break;
+        pos = offset+len;
+    }
+
+    //the replay stops after as many matches
+    PROF_ARGS(2, start_offset, matches, 0);
+    return matches;
+}
+
+//scan with kernel (one of RSFS_KERNEL_*; RSFS_KERNEL_AUTO: the best the CPU supports) from now on, in every instance:
+//return 0, or -1 if the CPU does not support it
+int RSFS_scan_use_kernel(int kernel){
+    if(kernel==RSFS_KERNEL_AUTO) kernel = best_kernel();
+    if(kernel<RSFS_KERNEL_SCALAR || kernel>RSFS_KERNEL_AVX2 || kernel>best_kernel()){
+        printf("[scan_use_kernel] kernel %d is not supported here.\n", kernel);
+        return -1;
+    }
+    __atomic_store_n(&kernel_in_use, kernel, __ATOMIC_RELAXED);
+    __atomic_store_n(&find_byte, kernel_function(kernel), __ATOMIC_RELEASE);
+    return 0;
+}
+
+//name of the kernel scans use ("auto" before the first scan picks one)
+const char *RSFS_scan_kernel_name(){
+    return kernel_names[__atomic_load_n(&kernel_in_use, __ATOMIC_RELAXED)];
+}
+
+int RSFS_find(int fd, const void *pattern, int len, int start_offset){ return rsfs_find(&rsfs_default, fd, pattern, len, start_offset); }
+int RSFS_scan(int fd, const void *pattern, int len, int start_offset, rsfs_scan_fn fn, void *arg){ return rsfs_scan(&rsfs_default, fd, pattern, len, start_offset, fn, arg); }
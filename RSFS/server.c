@@ -0,0 +1,439 @@
+/*
+    local server: the rsfs_* calls of an instance served over a Unix-domain socket
+    (see the rsfsd_* definitions in def.h for the protocol, and client.c for a client)
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RSFSD_EVENTS 64 //events taken per epoll_wait()
+#define RSFSD_RESPONSES 64 //responses a worker sends at a time
+
+//connected client; owned by at most one worker at a time (epoll hands it out once per arming)
+struct rsfsd_conn{
+    int sock;
+    char *buffer; //shared buffer from RSFSD_HELLO; NULL until then
+    size_t buffer_size;
+    int passed_fd; //descriptor received with the pending RSFSD_HELLO; -1 if none
+
+    char in[sizeof(struct rsfsd_request)+RSFSD_MAX_PATH]; //received bytes not run yet
+    int in_used;
+
+    int *fds; //descriptors the client has open, closed for it when it goes away
+    int num_fds;
+    int max_fds;
+
+    struct rsfsd_conn *next_ready; //ready or parked list
+    struct rsfsd_conn *prev, *next; //list of every client
+};
+
+
+//helper: send all of data on sock, waiting while the socket is full
+static int send_all(int sock, void *data, size_t len){
+    while(len>0){
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if(n<0){
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK) return -1;
+            struct pollfd pfd = {sock, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        data = (char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+//helper: 1 if conn opened fd (a client may only use its own descriptors)
+static int conn_owns(struct rsfsd_conn *conn, int fd){
+    for(int i=0; i<conn->num_fds; i++) if(conn->fds[i]==fd) return 1;
+    return 0;
+}
+
+//helper: remember that conn opened fd; return -1 if there is no room
+static int conn_add_fd(struct rsfsd_conn *conn, int fd){
+    if(conn->num_fds==conn->max_fds){
+        int max_fds = conn->max_fds ? conn->max_fds*2 : 8;
+        int *fds = (int *)realloc(conn->fds, sizeof(int)*max_fds);
+        if(fds==NULL) return -1;
+        conn->fds = fds;
+        conn->max_fds = max_fds;
+    }
+    conn->fds[conn->num_fds++] = fd;
+    return 0;
+}
+
+//helper: forget that conn has fd open
+static void conn_remove_fd(struct rsfsd_conn *conn, int fd){
+    for(int i=0; i<conn->num_fds; i++){
+        if(conn->fds[i]==fd){
+            conn->fds[i] = conn->fds[--conn->num_fds];
+            return;
+        }
+    }
+}
+
+//helper: 1 if [offset, offset+size) lies in the shared buffer of conn
+static int in_buffer(struct rsfsd_conn *conn, unsigned int offset, int size){
+    return conn->buffer && size>=0 && (size_t)offset+size<=conn->buffer_size;
+}
+
+//helper: run one request of conn against fs and return its result;
+//-2 for RSFSD_OPEN means the file is held and the request has to be retried later
+static int rsfsd_execute(rsfs_t *fs, struct rsfsd_conn *conn, struct rsfsd_request *request, char *path){
+    int ret;
+    switch(request->op){
+        case RSFSD_HELLO:
+            if(conn->passed_fd<0 || request->arg<=0) return -1;
+            void *buffer = mmap(NULL, request->arg, PROT_READ | PROT_WRITE, MAP_SHARED, conn->passed_fd, 0);
+            close(conn->passed_fd);
+            conn->passed_fd = -1;
+            if(buffer==MAP_FAILED){
+                printf("[rsfsd] fail to map the buffer of a client.\n");
+                return -1;
+            }
+            if(conn->buffer) munmap(conn->buffer, conn->buffer_size);
+            conn->buffer = (char *)buffer;
+            conn->buffer_size = request->arg;
+            return 0;
+        case RSFSD_CREATE: return rsfs_create(fs, path);
+        case RSFSD_DELETE: return rsfs_delete(fs, path);
+        case RSFSD_MKDIR: return rsfs_mkdir(fs, path);
+        case RSFSD_RMDIR: return rsfs_rmdir(fs, path);
+        case RSFSD_OPEN:
+        case RSFSD_TRY_OPEN:
+            //a blocking open would hold the worker: it is retried instead (see rsfsd_serve())
+            ret = rsfs_try_open(fs, path, request->arg);
+            if(ret>=0 && conn_add_fd(conn, ret)!=0){
+                rsfs_close(fs, ret);
+                ret = -1;
+            }
+            return ret;
+        case RSFSD_READ:
+        case RSFSD_WRITE:
+        case RSFSD_APPEND:
+            if(!conn_owns(conn, request->fd) || !in_buffer(conn, request->offset, request->arg)) return -1;
+            if(request->op==RSFSD_READ) return rsfs_read(fs, request->fd, conn->buffer+request->offset, request->arg);
+            if(request->op==RSFSD_WRITE) return rsfs_write(fs, request->fd, conn->buffer+request->offset, request->arg);
+            return rsfs_append(fs, request->fd, conn->buffer+request->offset, request->arg);
+        case RSFSD_FSEEK:
+            if(!conn_owns(conn, request->fd)) return -1;
+            return rsfs_fseek(fs, request->fd, request->arg);
+        case RSFSD_CUT:
+            if(!conn_owns(conn, request->fd)) return -1;
+            return rsfs_cut(fs, request->fd, request->arg);
+        case RSFSD_CLOSE:
+            if(!conn_owns(conn, request->fd)) return -1;
+            ret = rsfs_close(fs, request->fd);
+            if(ret==0) conn_remove_fd(conn, request->fd);
+            return ret;
+        case RSFSD_GET_STATS:{
+            if(!in_buffer(conn, request->offset, sizeof(struct rsfs_stats))) return -1;
+            struct rsfs_stats stats;
+            rsfs_get_stats(fs, &stats);
+            memcpy(conn->buffer+request->offset, &stats, sizeof(stats));
+            return 0;
+        }
+    }
+    printf("[rsfsd] unknown operation %d.\n", request->op);
+    return -1;
+}
+
+//helper: receive what conn has sent, into the free part of its input buffer;
+//return 1 if the socket may hold more, 0 if it is drained, or -1 if the client is gone
+static int conn_receive(struct rsfsd_conn *conn){
+    if(conn->in_used==(int)sizeof(conn->in)) return 1; //it holds a whole request, which runs first
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {conn->in+conn->in_used, sizeof(conn->in)-conn->in_used};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(conn->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if(n<0) return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR ? 0 : -1;
+    if(n==0) return -1;
+
+    for(struct cmsghdr *c=CMSG_FIRSTHDR(&msg); c; c=CMSG_NXTHDR(&msg, c)){
+        if(c->cmsg_level==SOL_SOCKET && c->cmsg_type==SCM_RIGHTS){
+            if(conn->passed_fd>=0) close(conn->passed_fd);
+            memcpy(&conn->passed_fd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+    conn->in_used += n;
+    return conn->in_used==(int)sizeof(conn->in);
+}
+
+//helper: disconnect conn, closing the files it left open
+static void conn_close(struct rsfsd_server *server, struct rsfsd_conn *conn){
+    pthread_mutex_lock(&server->mutex);
+    if(conn->prev) conn->prev->next = conn->next;
+    else server->conns = conn->next;
+    if(conn->next) conn->next->prev = conn->prev;
+    pthread_mutex_unlock(&server->mutex);
+
+    for(int i=0; i<conn->num_fds; i++) rsfs_close(server->fs, conn->fds[i]);
+    if(conn->buffer) munmap(conn->buffer, conn->buffer_size);
+    if(conn->passed_fd>=0) close(conn->passed_fd);
+    close(conn->sock); //also removes it from the epoll set
+    free(conn->fds);
+    free(conn);
+}
+
+//helper: run the pending requests of conn in order and send their responses;
+//then hand it back to the epoll loop, park it behind an open that would block, or disconnect it
+static void rsfsd_serve(struct rsfsd_server *server, struct rsfsd_conn *conn){
+    struct rsfsd_response out[RSFSD_RESPONSES];
+    int num_out = 0;
+    int parked = 0, gone = 0;
+    char path[RSFSD_MAX_PATH+1];
+
+    while(!parked && !gone){
+        int more = conn_receive(conn);
+        if(more<0) gone = 1;
+
+        int used = 0;
+        while(conn->in_used-used>=(int)sizeof(struct rsfsd_request)){
+            struct rsfsd_request request;
+            memcpy(&request, conn->in+used, sizeof(request));
+            if(request.path_len>RSFSD_MAX_PATH){
+                printf("[rsfsd] a request carries a path of %d bytes.\n", request.path_len);
+                gone = 1;
+                break;
+            }
+            int len = sizeof(request)+request.path_len;
+            if(conn->in_used-used<len) break;
+            memcpy(path, conn->in+used+sizeof(request), request.path_len);
+            path[request.path_len] = '\0';
+
+            int ret = rsfsd_execute(server->fs, conn, &request, path);
+            if(ret==-2 && request.op==RSFSD_OPEN){
+                parked = 1; //the request stays at the head of the buffer
+                break;
+            }
+            out[num_out].id = request.id;
+            out[num_out].result = ret;
+            used += len;
+            if(++num_out==RSFSD_RESPONSES){
+                if(send_all(conn->sock, out, sizeof(out[0])*num_out)!=0) gone = 1;
+                num_out = 0;
+            }
+        }
+        memmove(conn->in, conn->in+used, conn->in_used-used);
+        conn->in_used -= used;
+        if(more==0) break;
+    }
+    if(num_out>0 && send_all(conn->sock, out, sizeof(out[0])*num_out)!=0) gone = 1;
+
+    if(gone){
+        conn_close(server, conn);
+        return;
+    }
+    if(parked){
+        pthread_mutex_lock(&server->mutex);
+        int first = server->parked==NULL;
+        conn->next_ready = server->parked;
+        server->parked = conn;
+        pthread_mutex_unlock(&server->mutex);
+        //the loop may be waiting without a timeout: wake it to set one
+        uint64_t one = 1;
+        if(first && write(server->event_fd, &one, sizeof(one))!=sizeof(one)) printf("[rsfsd] fail to signal the eventfd.\n");
+        return;
+    }
+    struct epoll_event event = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = conn}};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+}
+
+//helper: queue conn for a worker; the caller holds server->mutex
+static void make_ready(struct rsfsd_server *server, struct rsfsd_conn *conn){
+    conn->next_ready = NULL;
+    if(server->ready_tail) server->ready_tail->next_ready = conn;
+    else server->ready_head = conn;
+    server->ready_tail = conn;
+    pthread_cond_signal(&server->ready_cond);
+}
+
+//helper: accept the pending connections and add them to the epoll set
+static void rsfsd_accept(struct rsfsd_server *server){
+    int sock;
+    while((sock=accept(server->listen_fd, NULL, NULL))>=0){
+        struct rsfsd_conn *conn = (struct rsfsd_conn *)calloc(1, sizeof(struct rsfsd_conn));
+        if(conn==NULL){
+            printf("[rsfsd] fail to allocate a connection.\n");
+            close(sock);
+            continue;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+        conn->sock = sock;
+        conn->passed_fd = -1;
+
+        pthread_mutex_lock(&server->mutex);
+        conn->next = server->conns;
+        if(server->conns) server->conns->prev = conn;
+        server->conns = conn;
+        pthread_mutex_unlock(&server->mutex);
+
+        struct epoll_event event = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = conn}};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock, &event);
+    }
+}
+
+//helper: current time in ns
+static unsigned long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+//event loop: accept clients and hand the ones with pending requests to the workers;
+//parked clients are handed out again every RSFSD_RETRY_NS
+static void *rsfsd_loop(void *ptr){
+    struct rsfsd_server *server = (struct rsfsd_server *)ptr;
+    struct epoll_event events[RSFSD_EVENTS];
+    unsigned long last_retry = now_ns();
+
+    while(!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)){
+        pthread_mutex_lock(&server->mutex);
+        int timeout = -1;
+        if(server->parked){
+            unsigned long elapsed = now_ns()-last_retry;
+            timeout = elapsed>=RSFSD_RETRY_NS ? 0 : (RSFSD_RETRY_NS-elapsed+999999)/1000000;
+        }
+        pthread_mutex_unlock(&server->mutex);
+
+        int n = epoll_wait(server->epoll_fd, events, RSFSD_EVENTS, timeout);
+
+        pthread_mutex_lock(&server->mutex);
+        for(int i=0; i<n; i++){
+            if(events[i].data.ptr==NULL){
+                pthread_mutex_unlock(&server->mutex);
+                rsfsd_accept(server);
+                pthread_mutex_lock(&server->mutex);
+            }else if(events[i].data.ptr==server){
+                uint64_t count;
+                if(read(server->event_fd, &count, sizeof(count))!=sizeof(count)) continue;
+            }else{
+                make_ready(server, (struct rsfsd_conn *)events[i].data.ptr);
+            }
+        }
+        if(server->parked && now_ns()-last_retry>=RSFSD_RETRY_NS){
+            struct rsfsd_conn *parked = server->parked;
+            server->parked = NULL;
+            while(parked){
+                struct rsfsd_conn *next = parked->next_ready;
+                make_ready(server, parked);
+                parked = next;
+            }
+            last_retry = now_ns();
+        }
+        pthread_mutex_unlock(&server->mutex);
+    }
+    return NULL;
+}
+
+//worker thread: serve the clients the event loop hands out, one at a time
+static void *rsfsd_worker(void *ptr){
+    struct rsfsd_server *server = (struct rsfsd_server *)ptr;
+
+    while(1){
+        pthread_mutex_lock(&server->mutex);
+        while(server->ready_head==NULL && !server->stop) pthread_cond_wait(&server->ready_cond, &server->mutex);
+        if(server->stop){
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+        struct rsfsd_conn *conn = server->ready_head;
+        server->ready_head = conn->next_ready;
+        if(server->ready_head==NULL) server->ready_tail = NULL;
+        pthread_mutex_unlock(&server->mutex);
+
+        rsfsd_serve(server, conn);
+    }
+    return NULL;
+}
+
+
+//serve the instance fs on a Unix-domain socket at socket_path with num_workers workers:
+//return the server, or NULL on error (e.g., the path is in use)
+struct rsfsd_server *rsfsd_start(rsfs_t *fs, const char *socket_path, int num_workers){
+    if(num_workers<=0) num_workers = RSFSD_DEFAULT_WORKERS;
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path)>=sizeof(addr.sun_path)){
+        printf("[rsfsd] socket path %s is too long.\n", socket_path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct rsfsd_server *server = (struct rsfsd_server *)calloc(1, sizeof(struct rsfsd_server));
+    if(server==NULL){
+        printf("[rsfsd] fail to allocate the server.\n");
+        return NULL;
+    }
+    server->fs = fs;
+    strcpy(server->socket_path, socket_path);
+    server->num_workers = num_workers;
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->workers = (pthread_t *)malloc(sizeof(pthread_t)*num_workers);
+    if(server->listen_fd<0 || server->epoll_fd<0 || server->event_fd<0 || server->workers==NULL
+        || bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr))!=0 || listen(server->listen_fd, 128)!=0){
+        printf("[rsfsd] fail to listen on %s.\n", socket_path);
+        if(server->listen_fd>=0) close(server->listen_fd);
+        if(server->epoll_fd>=0) close(server->epoll_fd);
+        if(server->event_fd>=0) close(server->event_fd);
+        free(server->workers);
+        free(server);
+        return NULL;
+    }
+
+    struct epoll_event event = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+    event.data.ptr = server;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->event_fd, &event);
+
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->ready_cond, NULL);
+    for(int i=0; i<num_workers; i++) pthread_create(&server->workers[i], NULL, rsfsd_worker, server);
+    pthread_create(&server->loop, NULL, rsfsd_loop, server);
+    return server;
+}
+
+//stop server: disconnect every client (closing the files it left open), then free the server
+void rsfsd_stop(struct rsfsd_server *server){
+    __atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if(write(server->event_fd, &one, sizeof(one))!=sizeof(one)) printf("[rsfsd] fail to signal the eventfd.\n");
+    pthread_join(server->loop, NULL);
+
+    pthread_mutex_lock(&server->mutex);
+    pthread_cond_broadcast(&server->ready_cond);
+    pthread_mutex_unlock(&server->mutex);
+    for(int i=0; i<server->num_workers; i++) pthread_join(server->workers[i], NULL);
+
+    while(server->conns) conn_close(server, server->conns);
+    close(server->listen_fd);
+    close(server->epoll_fd);
+    close(server->event_fd);
+    unlink(server->socket_path);
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->ready_cond);
+    free(server->workers);
+    free(server);
+}
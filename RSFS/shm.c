@@ -0,0 +1,207 @@
+/*
+    shared-memory instances: an instance laid out in a POSIX shared-memory segment, so that
+    several processes can attach it and use it with the rsfs_* calls at the same time.
+    The segment starts with struct rsfs (its superblock); everything the instance allocates
+    comes from a bump arena after it, and every link inside it is an offset (see to_ptr()),
+    so each process may map it at a different address
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//helper: size rounded up to whole cache lines
+static size_t round64(size_t size){
+    return (size+63) & ~(size_t)63;
+}
+
+
+//allocate size bytes of cache-aligned memory for fs: from the arena of its segment if fs is shared,
+//otherwise from the heap; return NULL if there is no room
+void *rsfs_alloc(rsfs_t *fs, size_t size){
+    if(fs==NULL || !fs->shared) return aligned_alloc(64, round64(size));
+
+    rsfs_mutex_lock(&fs->arena_mutex);
+    if(fs->arena_used+round64(size)>fs->size){
+        pthread_mutex_unlock(&fs->arena_mutex);
+        printf("[alloc] the shared segment is full.\n");
+        return NULL;
+    }
+    void *ptr = (char *)fs + fs->arena_used;
+    fs->arena_used += round64(size);
+    pthread_mutex_unlock(&fs->arena_mutex);
+    return ptr;
+}
+
+//give back memory from rsfs_alloc(); the arena of a segment is only reclaimed with the segment
+void rsfs_release(rsfs_t *fs, void *ptr){
+    if(fs==NULL || !fs->shared) free(ptr);
+}
+
+//initialize a mutex of fs: process-shared if fs is shared, and robust if asked
+//(robust mutexes can be taken over when their owner dies; they must be unlocked by their owner)
+void rsfs_mutex_init(rsfs_t *fs, pthread_mutex_t *mutex, int robust){
+    if(fs==NULL || !fs->shared){
+        pthread_mutex_init(mutex, NULL);
+        return;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if(robust) pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+//lock mutex; a robust mutex whose owner died is taken over as it is
+//(the state it guards was left by the dead owner and is not repaired)
+int rsfs_mutex_lock(pthread_mutex_t *mutex){
+    int ret = pthread_mutex_lock(mutex);
+    if(ret==EOWNERDEAD){
+        pthread_mutex_consistent(mutex);
+        ret = 0;
+    }
+    return ret;
+}
+
+//try to lock mutex like rsfs_mutex_lock(); return 0 if locked, or EBUSY
+int rsfs_mutex_trylock(pthread_mutex_t *mutex){
+    int ret = pthread_mutex_trylock(mutex);
+    if(ret==EOWNERDEAD){
+        pthread_mutex_consistent(mutex);
+        ret = 0;
+    }
+    return ret;
+}
+
+//1 if process pid still exists
+int rsfs_process_alive(int pid){
+    return kill(pid, 0)==0 || errno!=ESRCH;
+}
+
+
+//create the segment name (size bytes; 0 for RSFS_SHM_SIZE), map it and initialize an instance in it:
+//return the instance, or NULL on failure (e.g., the segment already exists)
+rsfs_t *rsfs_shm_create(const char *name, size_t size){
+    if(size==0) size = RSFS_SHM_SIZE;
+    if(size<round64(sizeof(rsfs_t))){
+        printf("[shm_create] %zu bytes cannot hold an instance.\n", size);
+        return NULL;
+    }
+
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(shm_fd<0){
+        printf("[shm_create] fail to create segment %s.\n", name);
+        return NULL;
+    }
+    if(ftruncate(shm_fd, size)!=0){
+        printf("[shm_create] fail to size segment %s.\n", name);
+        close(shm_fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    rsfs_t *fs = (rsfs_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if(fs==MAP_FAILED){
+        printf("[shm_create] fail to map segment %s.\n", name);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    //the segment is zero-filled; the superblock goes first, then the instance allocates from the arena
+    fs->shared = 1;
+    fs->size = size;
+    fs->arena_used = round64(sizeof(rsfs_t));
+    rsfs_mutex_init(fs, &fs->arena_mutex, 1);
+    epoch_domain_init(&fs->epoch);
+    if(rsfs_init(fs)!=0){
+        munmap(fs, size);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    //attaching processes wait for the magic: everything above is visible before it
+    __atomic_store_n(&fs->magic, RSFS_SHM_MAGIC, __ATOMIC_RELEASE);
+    return fs;
+}
+
+//map the existing segment name and release what processes that died left in it:
+//return the instance, or NULL on failure
+rsfs_t *rsfs_shm_attach(const char *name){
+    int shm_fd = shm_open(name, O_RDWR, 0600);
+    if(shm_fd<0){
+        printf("[shm_attach] segment %s does not exist.\n", name);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(shm_fd, &st)!=0 || (size_t)st.st_size<round64(sizeof(rsfs_t))){
+        printf("[shm_attach] segment %s is not an instance.\n", name);
+        close(shm_fd);
+        return NULL;
+    }
+    rsfs_t *fs = (rsfs_t *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if(fs==MAP_FAILED){
+        printf("[shm_attach] fail to map segment %s.\n", name);
+        return NULL;
+    }
+
+    //the creator may still be initializing it
+    while(__atomic_load_n(&fs->magic, __ATOMIC_ACQUIRE)!=RSFS_SHM_MAGIC) sched_yield();
+    if(fs->size!=(size_t)st.st_size){
+        printf("[shm_attach] segment %s is not an instance.\n", name);
+        munmap(fs, st.st_size);
+        return NULL;
+    }
+
+    rsfs_shm_recover(fs);
+    return fs;
+}
+
+//unmap the instance fs from this process: return 0 if succeed, or -1 on error;
+//descriptors opened by this process must be closed first (or are released by rsfs_shm_recover() after it exits)
+int rsfs_shm_detach(rsfs_t *fs){
+    if(fs==NULL || !fs->shared){
+        printf("[shm_detach] not a shared instance.\n");
+        return -1;
+    }
+
+    //entries this process deleted may still wait for their grace period
+    epoch_barrier(fs);
+    epoch_detach(&fs->epoch);
+    return munmap(fs, fs->size);
+}
+
+//remove the segment name; processes that have it mapped keep using it until they detach
+int rsfs_shm_unlink(const char *name){
+    if(shm_unlink(name)!=0){
+        printf("[shm_unlink] segment %s does not exist.\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+//release the open files, exclusive holds and epoch slots left in fs by processes that died:
+//return the number of resources released
+int rsfs_shm_recover(rsfs_t *fs){
+    int recovered = recover_open_file_entries(fs);
+
+    //a writer's hold goes with its open file entry above; what is left is a delete that died midway.
+    //rw_mutex is not robust (readers release it from any thread), so its pid stands for the owner
+    for(int i=0; i<NUM_INODES; i++){
+        struct inode *inode = &fs->inodes[i];
+        int owner = __atomic_load_n(&inode->rw_owner, __ATOMIC_ACQUIRE);
+        if(owner<=0 || rsfs_process_alive(owner)) continue;
+        if(!__atomic_compare_exchange_n(&inode->rw_owner, &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+        PROF_UNLOCK(&inode->rw_mutex, LOCK_INODE_RW);
+        recovered++;
+    }
+
+    recovered += epoch_recover(&fs->epoch);
+    return recovered;
+}
@@ -0,0 +1,95 @@
+/*
+    slab allocator: fixed-size objects carved out of large slabs and recycled through a free list
+*/
+
+#include "def.h"
+
+//header at the start of each slab; the slabs of a cache are chained so they can be counted
+struct slab{
+    rsfs_off_t next; //offset from the cache
+};
+
+//helper: carve a new slab into objects and put them on the free list; the caller holds cache->mutex.
+//Slabs are whole cache lines, so objects of different caches (and instances) never share one
+static int slab_grow(struct slab_cache *cache){
+    size_t header = (sizeof(struct slab)+15) & ~(size_t)15;
+    struct slab *slab = (struct slab *)rsfs_alloc(to_ptr(cache, cache->fs), header + cache->object_size*cache->objects_per_slab);
+    if(slab==NULL){
+        printf("[slab] fail to allocate a slab.\n");
+        return -1;
+    }
+    slab->next = cache->slabs;
+    cache->slabs = to_off(cache, slab);
+    cache->num_slabs++;
+
+    //objects start zeroed; what they hold when freed is kept until they are handed out again
+    char *object = (char *)slab + header;
+    memset(object, 0, cache->object_size*cache->objects_per_slab);
+    for(int i=0; i<cache->objects_per_slab; i++){
+        *(rsfs_off_t *)object = cache->free_list;
+        cache->free_list = to_off(cache, object);
+        object += cache->object_size;
+    }
+    cache->num_free += cache->objects_per_slab;
+
+    return 0;
+}
+
+
+//initialize a cache of objects of object_size bytes, allocated objects_per_slab at a time
+//from the memory of fs (the heap if fs is NULL)
+void slab_init(rsfs_t *fs, struct slab_cache *cache, size_t object_size, int objects_per_slab){
+    //objects hold the free-list link while free, and stay 16-byte aligned
+    if(object_size<sizeof(rsfs_off_t)) object_size = sizeof(rsfs_off_t);
+    cache->object_size = (object_size+15) & ~(size_t)15;
+    cache->objects_per_slab = objects_per_slab;
+    cache->free_list = 0;
+    cache->slabs = 0;
+    cache->fs = to_off(cache, fs);
+    cache->num_slabs = 0;
+    cache->num_free = 0;
+    rsfs_mutex_init(fs, &cache->mutex, 1);
+}
+
+//allocate an object from the cache; return NULL if no memory is left
+void *slab_alloc(struct slab_cache *cache){
+
+    PROF_LOCK(&cache->mutex, LOCK_SLAB);
+
+    if(cache->free_list==0 && slab_grow(cache)!=0){
+        PROF_UNLOCK(&cache->mutex, LOCK_SLAB);
+        return NULL;
+    }
+    void *object = to_ptr(cache, cache->free_list);
+    cache->free_list = *(rsfs_off_t *)object;
+    cache->num_free--;
+
+    PROF_UNLOCK(&cache->mutex, LOCK_SLAB);
+
+    return object;
+}
+
+//return an object to the cache it was allocated from
+void slab_free(struct slab_cache *cache, void *object){
+
+    PROF_LOCK(&cache->mutex, LOCK_SLAB);
+
+    *(rsfs_off_t *)object = cache->free_list;
+    cache->free_list = to_off(cache, object);
+    cache->num_free++;
+
+    PROF_UNLOCK(&cache->mutex, LOCK_SLAB);
+}
+
+//release every slab of the cache, and with them every object, allocated or not; the cache is empty afterwards
+void slab_destroy(struct slab_cache *cache){
+    while(cache->slabs){
+        struct slab *slab = (struct slab *)to_ptr(cache, cache->slabs);
+        cache->slabs = slab->next;
+        rsfs_release(to_ptr(cache, cache->fs), slab);
+    }
+    cache->free_list = 0;
+    cache->num_slabs = 0;
+    cache->num_free = 0;
+    pthread_mutex_destroy(&cache->mutex);
+}
@@ -0,0 +1,260 @@
+/*
+    point-in-time snapshots of an instance: taking one only bumps the snapshot id, whatever the number and size of files.
+    Each inode records the latest snapshot its content is accounted for in (snap_seen); the first change to a file
+    after a snapshot (a write, an append, a cut or its deletion) preserves its length and block pointers, with its path,
+    for every snapshot taken since, and the blocks get one more reference each, so that writers copy them first
+    (see writable_data_block()). A snapshot is read through descriptors of preserved files, which go through the
+    RSFS_read/RSFS_fseek/RSFS_close calls; files nobody changed are preserved when they are first opened this way.
+    A change that is already in progress when a snapshot is taken may or may not be part of it
+*/
+
+#include "def.h"
+
+
+//helper: the slot of snapshot id; NULL if there is no such snapshot. The caller holds snapshot_mutex
+static struct snapshot *find_snapshot(rsfs_t *fs, int id){
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+        if(id>0 && fs->snapshots[i].id==(unsigned int)id) return &fs->snapshots[i];
+    }
+    return NULL;
+}
+
+//helper: the file of snapshot preserved under path; NULL if it was not preserved. The caller holds snapshot_mutex
+static struct snapshot_file *find_snapshot_file(rsfs_t *fs, struct snapshot *snapshot, const char *path){
+    for(struct snapshot_file *file=to_ptr(fs, snapshot->files); file; file=to_ptr(fs, file->next)){
+        if(strcmp(file->path, path)==0) return file;
+    }
+    return NULL;
+}
+
+//helper: copy file_name to path as dir_entry_path() writes it, without empty components; -1 if it is too long
+static int normalize_path(const char *file_name, char *path){
+    int len = 0;
+    for(const char *p=file_name; *p; p++){
+        if(*p=='/' && (len==0 || path[len-1]=='/')) continue;
+        if(len==SNAPSHOT_PATH_LEN-1) return -1;
+        path[len++] = *p;
+    }
+    if(len>0 && path[len-1]=='/') len--;
+    path[len] = '\0';
+    return len;
+}
+
+//helper: preserve the current content of the file of dir_entry for every snapshot taken since its snap_seen;
+//the caller holds snapshot_mutex, and the file cannot change meanwhile: return 0, or -1 if there is no memory
+static int preserve_file(rsfs_t *fs, struct dir_entry *dir_entry){
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+    unsigned int seen = inode->snap_seen;
+
+    char path[SNAPSHOT_PATH_LEN];
+    if(dir_entry_path(fs, dir_entry, path, sizeof(path))<0){
+        printf("[snapshot] the path of a file is longer than %d bytes.\n", SNAPSHOT_PATH_LEN-1);
+        return -1;
+    }
+
+    //take every copy first, so that a failure leaves no snapshot with the file half preserved
+    struct snapshot_file *files[MAX_SNAPSHOTS] = {NULL};
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+        if(fs->snapshots[i].id<=seen) continue;
+        files[i] = (struct snapshot_file *)slab_alloc(&fs->snapshot_slab);
+        if(files[i]==NULL){
+            printf("[snapshot] fail to allocate a preserved file.\n");
+            for(int j=0; j<i; j++) if(files[j]) slab_free(&fs->snapshot_slab, files[j]);
+            return -1;
+        }
+    }
+
+    //appenders may be installing blocks past the length: only the blocks holding the content are kept
+    int length = __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE);
+    int compressed = __atomic_load_n(&inode->compressed, __ATOMIC_ACQUIRE);
+    int num_blocks = ((compressed ? compressed : length)+BLOCK_SIZE-1)/BLOCK_SIZE;
+
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+        struct snapshot_file *file = files[i];
+        if(file==NULL) continue;
+        file->length = length;
+        file->compressed = compressed;
+        share_data_blocks(fs, inode->block, file->block, num_blocks);
+        for(int j=num_blocks; j<NUM_POINTER; j++) file->block[j] = -1;
+        file->slot = i;
+        strcpy(file->path, path);
+        file->next = fs->snapshots[i].files;
+        fs->snapshots[i].files = to_off(fs, file);
+    }
+
+    __atomic_store_n(&inode->snap_seen, fs->snapshot_id, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+//start fs without snapshots
+void init_snapshots(rsfs_t *fs){
+    fs->snapshot_id = 0;
+    memset(fs->snapshots, 0, sizeof(fs->snapshots));
+    slab_init(fs, &fs->snapshot_slab, sizeof(struct snapshot_file), SNAPSHOT_SLAB_OBJECTS);
+    rsfs_mutex_init(fs, &fs->snapshot_mutex, 1);
+}
+
+//the file of dir_entry, held by the caller, is about to change: preserve its content for the snapshots
+//taken since it last was; return 0, or -1 if it cannot be preserved (the change must not be made)
+int snapshot_preserve(rsfs_t *fs, struct dir_entry *dir_entry){
+    struct inode *inode = &fs->inodes[dir_entry->inode_number];
+
+    //common case: no snapshot was taken since the file was preserved or created
+    if(__atomic_load_n(&inode->snap_seen, __ATOMIC_ACQUIRE)==__atomic_load_n(&fs->snapshot_id, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+
+    PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    int ret = inode->snap_seen==fs->snapshot_id ? 0 : preserve_file(fs, dir_entry);
+    PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    return ret;
+}
+
+//length of the preserved file read through the snapshot descriptor of entry
+int snapshot_length(rsfs_t *fs, struct open_file_entry *entry){
+    return ((struct snapshot_file *)to_ptr(fs, entry->snapshot_file))->length;
+}
+
+//read from the preserved file of entry, from its position, for up to size bytes: return the number of bytes read,
+//or -1 if its compressed data is corrupt. It takes no lock: the blocks it references are never written in place
+int snapshot_read(rsfs_t *fs, struct open_file_entry *entry, void *buf, int size){
+    struct snapshot_file *file = to_ptr(fs, entry->snapshot_file);
+    int position = entry->position;
+    int bytes_read = file->length-position < size ? file->length-position : size;
+    if(bytes_read<=0) return 0;
+
+    if(file->compressed){
+        char plain[NUM_POINTER*BLOCK_SIZE];
+        if(read_compressed(fs, file->block, file->compressed, file->length, plain)<0) return -1;
+        memcpy(buf, plain+position, bytes_read);
+    }else{
+        for(int done=0; done<bytes_read; ){
+            int block = file->block[(position+done)/BLOCK_SIZE];
+            int offset = (position+done)%BLOCK_SIZE;
+            int n = BLOCK_SIZE-offset < bytes_read-done ? BLOCK_SIZE-offset : bytes_read-done;
+            if(block<0){
+                bytes_read = done; //the pool ran dry when the file was written
+                break;
+            }
+            memcpy((char *)buf+done, block_data(fs, block)+offset, n);
+            done += n;
+        }
+    }
+    entry->position = position+bytes_read;
+    return bytes_read;
+}
+
+//the snapshot descriptor of entry is being freed: its snapshot may be dropped once no descriptor is left
+void snapshot_close_file(rsfs_t *fs, struct open_file_entry *entry){
+    struct snapshot_file *file = to_ptr(fs, entry->snapshot_file);
+    PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    fs->snapshots[file->slot].open_files--;
+    PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+}
+
+
+//take a snapshot of fs: nothing is copied, so it takes constant time;
+//return its id (>0), or -1 if MAX_SNAPSHOTS snapshots are kept already
+int rsfs_snapshot_create(rsfs_t *fs){
+    PROF_OP(PROF_SNAPSHOT_CREATE, NULL, -1, 0);
+    PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    struct snapshot *snapshot = NULL;
+    for(int i=0; i<MAX_SNAPSHOTS && snapshot==NULL; i++){
+        if(fs->snapshots[i].id==0) snapshot = &fs->snapshots[i];
+    }
+    if(snapshot==NULL){
+        PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        printf("[snapshot_create] %d snapshots are kept already.\n", MAX_SNAPSHOTS);
+        return -1;
+    }
+    snapshot->open_files = 0;
+    snapshot->files = 0;
+    snapshot->id = fs->snapshot_id+1;
+    //from here on, the first change to any file preserves it first
+    __atomic_store_n(&fs->snapshot_id, snapshot->id, __ATOMIC_RELEASE);
+    int id = snapshot->id;
+    PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    return PROF_ARG(id);
+}
+
+//open file_name as it was when snapshot was taken, read-only (RSFS_read, RSFS_fseek and RSFS_close work on it);
+//return the descriptor, or -1 if the snapshot does not exist or had no such file
+int rsfs_snapshot_open_file(rsfs_t *fs, int snapshot_id, char *file_name){
+    PROF_OP(PROF_SNAPSHOT_OPEN_FILE, file_name, -1, snapshot_id);
+    char path[SNAPSHOT_PATH_LEN];
+    if(normalize_path(file_name, path)<=0){
+        printf("[snapshot_open_file] invalid path %s.\n", file_name);
+        return -1;
+    }
+
+    PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    struct snapshot *snapshot = find_snapshot(fs, snapshot_id);
+    if(snapshot==NULL){
+        PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        printf("[snapshot_open_file] snapshot %d does not exist.\n", snapshot_id);
+        return -1;
+    }
+
+    //a file changed (or deleted) since the snapshot has been preserved; one that has not is preserved now,
+    //unless it was created after the snapshot. Preserving needs snapshot_mutex, which we hold, so neither can race
+    struct snapshot_file *file = find_snapshot_file(fs, snapshot, path);
+    if(file==NULL){
+        epoch_enter(fs);
+        struct dir_entry *dir_entry = search_dir(fs, path);
+        if(dir_entry && dir_entry->inode_number>=0 && !__atomic_load_n(&dir_entry->deleted, __ATOMIC_ACQUIRE)
+                && fs->inodes[dir_entry->inode_number].snap_seen<snapshot->id && preserve_file(fs, dir_entry)==0){
+            file = find_snapshot_file(fs, snapshot, path);
+        }
+        epoch_exit(fs);
+    }
+    if(file==NULL){
+        PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        printf("[snapshot_open_file] file (%s) is not in snapshot %d.\n", file_name, snapshot_id);
+        return -1;
+    }
+    snapshot->open_files++;
+    PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+
+    int fd = allocate_open_file_entry(fs, RSFS_RDONLY, NULL);
+    PROF_FILE(-1, fd, 0);
+    if(fd<0){
+        printf("[snapshot_open_file] no free entry in the open file table.\n");
+        PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        snapshot->open_files--;
+        PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        return -1;
+    }
+    get_open_file_entry(fs, fd)->snapshot_file = to_off(fs, file);
+    return fd;
+}
+
+//release snapshot and the references its files hold on their blocks:
+//return 0, or -1 if it does not exist or a file of it is still open
+int rsfs_snapshot_drop(rsfs_t *fs, int snapshot_id){
+    PROF_OP(PROF_SNAPSHOT_DROP, NULL, -1, snapshot_id);
+    PROF_LOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    struct snapshot *snapshot = find_snapshot(fs, snapshot_id);
+    if(snapshot==NULL || snapshot->open_files>0){
+        PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+        printf("[snapshot_drop] snapshot %d does not exist or has open files.\n", snapshot_id);
+        return -1;
+    }
+    struct snapshot_file *file = to_ptr(fs, snapshot->files);
+    while(file){
+        struct snapshot_file *next = to_ptr(fs, file->next);
+        for(int j=0; j<NUM_POINTER; j++){
+            if(file->block[j]>=0) free_data_block(fs, file->block[j]);
+        }
+        slab_free(&fs->snapshot_slab, file);
+        file = next;
+    }
+    snapshot->files = 0;
+    snapshot->id = 0;
+    PROF_UNLOCK(&fs->snapshot_mutex, LOCK_SNAPSHOT);
+    return 0;
+}
+
+int RSFS_snapshot_create(){ return rsfs_snapshot_create(&rsfs_default); }
+int RSFS_snapshot_open_file(int snapshot, char *file_name){ return rsfs_snapshot_open_file(&rsfs_default, snapshot, file_name); }
+int RSFS_snapshot_drop(int snapshot){ return rsfs_snapshot_drop(&rsfs_default, snapshot); }
@@ -0,0 +1,35 @@
+/*
+    filesystem statistics: counters maintained where things are allocated and freed,
+    so that reading them never scans a table or takes a lock
+*/
+
+#include "def.h"
+
+
+//reset every counter of fs (the file system is empty)
+void init_stats(rsfs_t *fs){
+    memset(&fs->counters, 0, sizeof(fs->counters));
+}
+
+//fill stats with the current counters; each one is read atomically, without any lock
+void rsfs_get_stats(rsfs_t *fs, struct rsfs_stats *stats){
+    stats->total_blocks = NUM_DBLOCKS;
+    stats->used_blocks = __atomic_load_n(&fs->counters.used_blocks.value, __ATOMIC_RELAXED);
+    stats->total_inodes = NUM_INODES;
+    stats->used_inodes = __atomic_load_n(&fs->counters.used_inodes.value, __ATOMIC_RELAXED);
+    stats->open_files = __atomic_load_n(&fs->counters.open_files.value, __ATOMIC_RELAXED);
+    stats->num_files = __atomic_load_n(&fs->counters.num_files.value, __ATOMIC_RELAXED);
+    stats->num_dirs = __atomic_load_n(&fs->counters.num_dirs.value, __ATOMIC_RELAXED);
+    stats->shared_refs = __atomic_load_n(&fs->counters.shared_refs.value, __ATOMIC_RELAXED);
+    stats->dedup_ratio = stats->used_blocks ? (double)(stats->used_blocks+stats->shared_refs)/stats->used_blocks : 1.0;
+    stats->compressed_files = __atomic_load_n(&fs->counters.compressed_files.value, __ATOMIC_RELAXED);
+    stats->compressed_bytes = __atomic_load_n(&fs->counters.compressed_bytes.value, __ATOMIC_RELAXED);
+    stats->compressed_stored = __atomic_load_n(&fs->counters.compressed_stored.value, __ATOMIC_RELAXED);
+    stats->compression_ratio = stats->compressed_stored ? (double)stats->compressed_bytes/stats->compressed_stored : 1.0;
+    stats->defrag_moves = __atomic_load_n(&fs->counters.defrag_moves.value, __ATOMIC_RELAXED);
+}
+
+//fill stats with the counters of the default instance
+void RSFS_get_stats(struct rsfs_stats *stats){
+    rsfs_get_stats(&rsfs_default, stats);
+}
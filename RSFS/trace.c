@@ -0,0 +1,125 @@
+/*
+    event tracing: each thread writes fixed-size binary records into its own ring,
+    overwriting the oldest ones; a dump collects the rings of all threads into one file
+    (trace2json converts it into Chrome trace JSON)
+*/
+
+#include "def.h"
+
+//per-thread ring; rings are never freed, so the list can be walked without a lock
+struct trace_ring{
+    unsigned long head; //number of records ever written (only the owner writes it)
+    int thread;
+    struct trace_ring *next;
+    struct rsfs_trace_record records[TRACE_RING_RECORDS];
+};
+
+int rsfs_tracing; //1 while tracing is on
+
+static struct trace_ring *trace_rings; //list of the rings of all threads that traced
+static int trace_threads; //number of rings, for the thread ids
+static __thread struct trace_ring *my_ring;
+
+
+//helper: get (and register on first use) the ring of the calling thread
+static struct trace_ring *trace_ring(){
+    if(my_ring) return my_ring;
+
+    struct trace_ring *ring = (struct trace_ring *)calloc(1, sizeof(struct trace_ring));
+    if(ring==NULL){
+        printf("[trace] fail to allocate a trace ring.\n");
+        abort();
+    }
+    ring->thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    my_ring = ring;
+    return ring;
+}
+
+
+//append a record to the ring of the calling thread
+void trace_record(int op, unsigned long timestamp, unsigned long duration, unsigned long wait_ns, int inode_number, int fd, int offset, int size){
+    struct trace_ring *ring = trace_ring();
+
+    unsigned long head = ring->head;
+    struct rsfs_trace_record *record = &ring->records[head & (TRACE_RING_RECORDS-1)];
+    record->timestamp = timestamp;
+    record->duration = duration;
+    record->wait_ns = wait_ns;
+    record->thread = ring->thread;
+    record->op = op;
+    record->inode_number = inode_number;
+    record->fd = fd;
+    record->offset = offset;
+    record->size = size;
+
+    //publish the record; a dump only trusts slots below head
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+
+//start recording events
+void RSFS_trace_start(){
+    if(!RSFS_TRACE) printf("[trace] tracing is compiled out (RSFS_TRACE=0).\n");
+    __atomic_store_n(&rsfs_tracing, 1, __ATOMIC_RELEASE);
+}
+
+//stop recording events
+void RSFS_trace_stop(){
+    __atomic_store_n(&rsfs_tracing, 0, __ATOMIC_RELEASE);
+}
+
+//write the records of every ring to the file at path, oldest first within each thread;
+//rings may be written meanwhile: records overwritten during the copy are dropped.
+//return the number of records written, or -1 on error
+int RSFS_trace_dump(char *path){
+
+    FILE *file = fopen(path, "wb");
+    if(file==NULL){
+        printf("[trace] fail to open %s.\n", path);
+        return -1;
+    }
+
+    struct rsfs_trace_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct rsfs_trace_record);
+    header.num_records = 0;
+    fwrite(&header, sizeof(header), 1, file); //rewritten with the count at the end
+
+    struct rsfs_trace_record *copy = (struct rsfs_trace_record *)malloc(sizeof(struct rsfs_trace_record)*TRACE_RING_RECORDS);
+    if(copy==NULL){
+        printf("[trace] fail to allocate the dump buffer.\n");
+        fclose(file);
+        return -1;
+    }
+
+    for(struct trace_ring *ring=__atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring=ring->next){
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head>TRACE_RING_RECORDS ? head-TRACE_RING_RECORDS : 0;
+        for(unsigned long i=first; i<head; i++){
+            copy[i-first] = ring->records[i & (TRACE_RING_RECORDS-1)];
+        }
+
+        //the owner may have lapped the oldest slots while we copied them,
+        //and may be writing record new_head (over record new_head-TRACE_RING_RECORDS) right now
+        unsigned long new_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long valid = new_head+1>TRACE_RING_RECORDS ? new_head+1-TRACE_RING_RECORDS : 0;
+        if(valid<first) valid = first;
+        if(valid<head){
+            fwrite(&copy[valid-first], sizeof(struct rsfs_trace_record), head-valid, file);
+            header.num_records += head-valid;
+        }
+    }
+    free(copy);
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    if(fclose(file)!=0){
+        printf("[trace] fail to write %s.\n", path);
+        return -1;
+    }
+
+    return header.num_records;
+}
@@ -0,0 +1,101 @@
+/*
+    trace decoder: convert a dump written by RSFS_trace_dump() into Chrome trace JSON
+    (load it in chrome://tracing or ui.perfetto.dev)
+
+    usage: trace2json <dump> [<output.json>]
+*/
+
+#include "def.h"
+
+static const char *op_names[TRACE_EVENTS] = {
+    "create", "open", "try_open", "append", "fseek", "read", "write",
+    "cut", "close", "delete", "mkdir", "rmdir", "stat", "opendir",
+    "snapshot_create", "snapshot_open_file", "snapshot_drop",
+    "create_open", "create_many", "open_many", "delete_many", "readdir_plus",
+    "find", "scan", "copy_range", "import_fd", "export_fd",
+    "dir_insert", "dir_delete", "inode_alloc", "inode_free",
+    "block_alloc", "block_free", "fd_alloc", "fd_free",
+    "lock_wait"
+};
+static const char *lock_names[PROF_LOCKS] = {
+    "inode_rw", "inode_read", "dir", "open_file_table", "data_bitmap",
+    "inode_bitmap", "names", "slab", "fs_stat", "snapshot"
+};
+
+
+//print one record as a trace event; timestamps are relative to base, in microseconds
+static void print_event(FILE *out, struct rsfs_trace_record *r, unsigned long base){
+    const char *name = (r->op>=0 && r->op<TRACE_EVENTS) ? op_names[r->op] : "unknown";
+    double ts = (r->timestamp-base)/1000.0;
+
+    if(r->op==TRACE_LOCK_WAIT){
+        const char *lock = (r->size>=0 && r->size<PROF_LOCKS) ? lock_names[r->size] : "unknown";
+        fprintf(out, "{\"name\": \"wait %s\", \"cat\": \"lock\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"lock\": \"%s\", \"inode\": %d, \"fd\": %d}}",
+            lock, ts, r->duration/1000.0, r->thread, lock, r->inode_number, r->fd);
+    }else if(r->op<PROF_OPS){
+        fprintf(out, "{\"name\": \"%s\", \"cat\": \"api\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"inode\": %d, \"fd\": %d, \"offset\": %d, \"size\": %d, \"wait_ns\": %lu}}",
+            name, ts, r->duration/1000.0, r->thread, r->inode_number, r->fd, r->offset, r->size, r->wait_ns);
+    }else{
+        //block events carry the block number in offset
+        const char *offset_name = (r->op==TRACE_BLOCK_ALLOC || r->op==TRACE_BLOCK_FREE) ? "block" : "offset";
+        fprintf(out, "{\"name\": \"%s\", \"cat\": \"internal\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"inode\": %d, \"fd\": %d, \"%s\": %d}}",
+            name, ts, r->thread, r->inode_number, r->fd, offset_name, r->offset);
+    }
+}
+
+
+int main(int argc, char **argv){
+
+    if(argc<2){
+        printf("usage: %s <dump> [<output.json>]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if(in==NULL){
+        printf("[trace2json] fail to open %s.\n", argv[1]);
+        return 1;
+    }
+
+    struct rsfs_trace_header header;
+    if(fread(&header, sizeof(header), 1, in)!=1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))!=0
+        || header.record_size!=sizeof(struct rsfs_trace_record) || header.num_records<0){
+        printf("[trace2json] %s is not a trace dump of this build.\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    struct rsfs_trace_record *records = (struct rsfs_trace_record *)malloc(sizeof(struct rsfs_trace_record)*(header.num_records+1));
+    if(records==NULL || fread(records, sizeof(struct rsfs_trace_record), header.num_records, in)!=(size_t)header.num_records){
+        printf("[trace2json] fail to read the records of %s.\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    fclose(in);
+
+    FILE *out = stdout;
+    if(argc>2 && (out=fopen(argv[2], "w"))==NULL){
+        printf("[trace2json] fail to open %s.\n", argv[2]);
+        return 1;
+    }
+
+    //start the timeline at the first event
+    unsigned long base = 0;
+    for(int i=0; i<header.num_records; i++){
+        if(base==0 || records[i].timestamp<base) base = records[i].timestamp;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for(int i=0; i<header.num_records; i++){
+        print_event(out, &records[i], base);
+        fprintf(out, i+1<header.num_records ? ",\n" : "\n");
+    }
+    fprintf(out, "]}\n");
+
+    if(out!=stdout) fclose(out);
+    free(records);
+    return 0;
+}